@@ -18,6 +18,8 @@
 #endif
 
 #include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <gtk/gtk.h>
 #include <libgnomecanvas/libgnomecanvas.h>
@@ -30,6 +32,8 @@
 #include "xo-file.h"
 #include "xo-paint.h"
 #include "xo-shapes.h"
+#include "xo-print.h"
+#include "xo-pages.h"
 
 GtkWidget *winMain;
 GnomeCanvas *canvas;
@@ -79,7 +83,8 @@ void init_stuff (int argc, char *argv[])
 
   if (argc > 2 || (argc == 2 && argv[1][0] == '-')) {
     printf(_("Invalid command line parameters.\n"
-           "Usage: %s [filename.xoj]\n"), argv[0]);
+           "Usage: %s [filename.xoj]\n"
+           "       %s --export-pdf filename.xoj filename.pdf [pages]\n"), argv[0], argv[0]);
     gtk_exit(0);
   }
    
@@ -326,6 +331,97 @@ void init_stuff (int argc, char *argv[])
   }
 }
 
+/* the pages listed in ranges, e.g. "1-3,5,8-" ; NULL if invalid */
+
+static GList *export_page_list(char *ranges)
+{
+  GList *pages;
+  char *p;
+  int first, last, i;
+
+  pages = NULL;
+  p = ranges;
+  do {
+    if (g_ascii_isdigit(*p)) first = last = strtol(p, &p, 10);
+    else if (*p == '-') { first = 1; last = journal.npages; }
+    else break;
+    if (*p == '-') {
+      p++;
+      last = g_ascii_isdigit(*p) ? strtol(p, &p, 10) : journal.npages;
+    }
+    if (first < 1 || first > last || last > journal.npages) break;
+    for (i = first; i <= last; i++)
+      pages = g_list_prepend(pages, journal_page(i-1));
+    if (*p == 0) return g_list_reverse(pages);
+  } while (*(p++) == ',');
+  g_list_free(pages);
+  return NULL;
+}
+
+/* xournal --export-pdf in.xoj out.pdf [pages]: convert a journal without
+   opening a window (or needing a display), and exit. No canvas items are
+   created; the journal is parsed and handed over to print_to_pdf(). */
+
+int export_pdf(int argc, char *argv[])
+{
+  struct Background *bg_pdf;
+  GList *all_pages;
+  gchar *tmppath, *tmpfn;
+  gboolean maybe_pdf, success;
+  int npages;
+
+  if (argc != 4 && argc != 5) {
+    g_printerr(_("Usage: %s --export-pdf filename.xoj filename.pdf [pages]\n"), argv[0]);
+    return 1;
+  }
+  g_type_init();
+  ui.headless = TRUE;
+
+  ui.default_page.bg = g_new(struct Background, 1);
+  ui.default_page.bg->canvas_item = NULL;
+  tmppath = g_build_filename(g_get_home_dir(), CONFIG_DIR, NULL);
+  ui.mrufile = g_build_filename(tmppath, MRU_FILE, NULL);
+  ui.configfile = g_build_filename(tmppath, CONFIG_FILE, NULL);
+  g_free(tmppath);
+  init_config_default();
+  load_config_from_file(); // for the PDF export settings
+
+  undo = NULL; redo = NULL;
+  journal.pages = NULL;
+  bgpdf.status = STATUS_NOT_INIT;
+
+  if (!read_journal(argv[2], &journal, &bg_pdf, &maybe_pdf)) {
+    g_printerr(_("Error opening file '%s'\n"), argv[2]);
+    return 1;
+  }
+  if (bg_pdf != NULL) {
+    success = open_journal_bgpdf(argv[2], bg_pdf, &tmpfn);
+    if (!success) g_printerr(_("Could not open background '%s'.\n"), tmpfn);
+    g_free(tmpfn);
+    if (!success) return 1;
+  }
+
+  all_pages = journal.pages;
+  npages = journal.npages;
+  if (argc == 5) {
+    journal.pages = export_page_list(argv[4]);
+    if (journal.pages == NULL) {
+      g_printerr(_("Invalid page range '%s'\n"), argv[4]);
+      journal.pages = all_pages;
+      return 1;
+    }
+    journal.npages = g_list_length(journal.pages);
+  }
+
+  success = print_to_pdf(argv[3]);
+  if (!success) g_printerr(_("Error creating file '%s'\n"), argv[3]);
+
+  if (journal.pages != all_pages) g_list_free(journal.pages);
+  journal.pages = all_pages;
+  journal.npages = npages;
+  if (bgpdf.status != STATUS_NOT_INIT) shutdown_bgpdf();
+  return success ? 0 : 1;
+}
 
 int
 main (int argc, char *argv[])
@@ -338,7 +434,10 @@ main (int argc, char *argv[])
   textdomain (GETTEXT_PACKAGE);
 #endif
   
+  if (!g_thread_supported()) g_thread_init(NULL); // for parallel loading and PDF rendering
   gtk_set_locale ();
+  if (argc > 1 && !strcmp(argv[1], "--export-pdf"))
+    return export_pdf(argc, argv); // before gtk_init(), which needs a display
   gtk_init (&argc, &argv);
 
   add_pixmap_directory (PACKAGE_DATA_DIR "/" PACKAGE "/pixmaps");
@@ -0,0 +1,209 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <string.h>
+#include <glib.h>
+
+#include "xo-arena.h"
+
+#define ARENA_BLOCK_SIZE 65536
+#define ARENA_GRAIN 8          // object sizes are rounded up to this
+#define ARENA_MAX_SMALL 2048   // bigger objects get a block of their own
+#define ARENA_NCLASSES (ARENA_MAX_SMALL/ARENA_GRAIN)
+
+#define SIZE_CLASS(size) (((size)>0) ? ((size)+ARENA_GRAIN-1)/ARENA_GRAIN-1 : 0)
+
+typedef struct ArenaBig { // header of a big object, which follows it
+  struct ArenaBig *prev, *next;
+} ArenaBig;
+
+struct Arena {
+  char *block;      // the current block; each block starts with a pointer
+  gsize used;       // to the previous one. Bytes used in the current block
+  gpointer free_lists[ARENA_NCLASSES]; // chained through their first word
+  ArenaBig *big;
+  ArenaStats stats;
+};
+
+struct Arena *arena_new(void)
+{
+  return g_new0(struct Arena, 1);
+}
+
+void arena_destroy(struct Arena *a)
+{
+  char *block;
+  ArenaBig *big;
+
+  if (a == NULL) return;
+  while (a->block != NULL) {
+    block = a->block;
+    a->block = *(char **)block;
+    g_free(block);
+  }
+  while (a->big != NULL) {
+    big = a->big;
+    a->big = big->next;
+    g_free(big);
+  }
+  g_free(a);
+}
+
+// put what is left of the current block on a free list, before replacing it
+
+static void arena_retire_tail(struct Arena *a)
+{
+  gsize rest;
+  int c;
+
+  if (a->block == NULL) return;
+  rest = ARENA_BLOCK_SIZE - a->used;
+  if (rest < ARENA_GRAIN) return;
+  c = MIN(rest/ARENA_GRAIN, ARENA_NCLASSES) - 1;
+  *(gpointer *)(a->block + a->used) = a->free_lists[c];
+  a->free_lists[c] = a->block + a->used;
+  a->used = ARENA_BLOCK_SIZE;
+}
+
+gpointer arena_alloc(struct Arena *a, gsize size)
+{
+  gpointer mem;
+  ArenaBig *big;
+  char *block;
+  int c;
+
+  a->stats.nalloc++;
+  if (size > ARENA_MAX_SMALL) {
+    big = g_malloc(sizeof(ArenaBig) + size);
+    big->prev = NULL;
+    big->next = a->big;
+    if (a->big != NULL) a->big->prev = big;
+    a->big = big;
+    a->stats.nbig++;
+    a->stats.block_bytes += sizeof(ArenaBig) + size;
+    a->stats.live_bytes += size;
+    return big+1;
+  }
+
+  c = SIZE_CLASS(size);
+  size = (c+1)*ARENA_GRAIN;
+  a->stats.live_bytes += size;
+  if (a->free_lists[c] != NULL) {
+    mem = a->free_lists[c];
+    a->free_lists[c] = *(gpointer *)mem;
+    a->stats.nreused++;
+    return mem;
+  }
+  if (a->block == NULL || a->used + size > ARENA_BLOCK_SIZE) {
+    arena_retire_tail(a);
+    block = g_malloc(ARENA_BLOCK_SIZE);
+    *(char **)block = a->block;
+    a->block = block;
+    a->used = MAX(sizeof(char *), ARENA_GRAIN);
+    a->stats.nblocks++;
+    a->stats.block_bytes += ARENA_BLOCK_SIZE;
+  }
+  mem = a->block + a->used;
+  a->used += size;
+  return mem;
+}
+
+gpointer arena_alloc0(struct Arena *a, gsize size)
+{
+  gpointer mem;
+
+  mem = arena_alloc(a, size);
+  memset(mem, 0, size);
+  return mem;
+}
+
+// size must be the size that was passed to arena_alloc()
+
+void arena_free(struct Arena *a, gpointer mem, gsize size)
+{
+  ArenaBig *big;
+  int c;
+
+  if (mem == NULL) return;
+  a->stats.nfree++;
+  if (size > ARENA_MAX_SMALL) {
+    big = (ArenaBig *)mem - 1;
+    if (big->prev != NULL) big->prev->next = big->next;
+    else a->big = big->next;
+    if (big->next != NULL) big->next->prev = big->prev;
+    a->stats.nbig--;
+    a->stats.block_bytes -= sizeof(ArenaBig) + size;
+    a->stats.live_bytes -= size;
+    g_free(big);
+    return;
+  }
+  c = SIZE_CLASS(size);
+  *(gpointer *)mem = a->free_lists[c];
+  a->free_lists[c] = mem;
+  a->stats.live_bytes -= (c+1)*ARENA_GRAIN;
+}
+
+/* move everything src owns into dest, and free src. The blocks of src go
+   behind the current block of dest, which stays current */
+
+void arena_merge(struct Arena *dest, struct Arena *src)
+{
+  char *block;
+  gpointer mem;
+  ArenaBig *big;
+  int c;
+
+  arena_retire_tail(src);
+  if (src->block != NULL) {
+    if (dest->block == NULL) {
+      dest->block = src->block;
+      dest->used = src->used;
+    } else {
+      for (block = src->block; *(char **)block != NULL; block = *(char **)block);
+      *(char **)block = *(char **)dest->block;
+      *(char **)dest->block = src->block;
+    }
+  }
+  if (src->big != NULL) {
+    for (big = src->big; big->next != NULL; big = big->next);
+    big->next = dest->big;
+    if (dest->big != NULL) dest->big->prev = big;
+    dest->big = src->big;
+  }
+  for (c = 0; c < ARENA_NCLASSES; c++) {
+    if (src->free_lists[c] == NULL) continue;
+    for (mem = src->free_lists[c]; *(gpointer *)mem != NULL; mem = *(gpointer *)mem);
+    *(gpointer *)mem = dest->free_lists[c];
+    dest->free_lists[c] = src->free_lists[c];
+  }
+  dest->stats.block_bytes += src->stats.block_bytes;
+  dest->stats.live_bytes += src->stats.live_bytes;
+  dest->stats.nblocks += src->stats.nblocks;
+  dest->stats.nbig += src->stats.nbig;
+  dest->stats.nalloc += src->stats.nalloc;
+  dest->stats.nfree += src->stats.nfree;
+  dest->stats.nreused += src->stats.nreused;
+  g_free(src);
+}
+
+void arena_get_stats(struct Arena *a, struct ArenaStats *stats)
+{
+  if (a == NULL) memset(stats, 0, sizeof(struct ArenaStats));
+  else *stats = a->stats;
+}
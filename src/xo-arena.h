@@ -0,0 +1,44 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* per-journal allocator for items and stroke geometry. Small objects are
+   carved out of large blocks, with one free list per size (the caller
+   passes the size back to arena_free()); big ones get their own block.
+   Everything is released at once by arena_destroy() when the journal is
+   deleted, so delete_journal() doesn't free items one by one. Items on
+   the undo/redo stacks belong to the journal's arena too: the stacks
+   must be cleared before the journal is deleted, as close_journal() does.
+   An arena is not thread-safe: each parser thread has its own, merged
+   into the journal's when the pages are spliced. */
+
+struct Arena;
+
+typedef struct ArenaStats {
+  gsize block_bytes;  // bytes obtained from the system, incl. big objects
+  gsize live_bytes;   // bytes currently handed out
+  gulong nblocks, nbig;
+  gulong nalloc, nfree, nreused; // reused = allocations served by a free list
+} ArenaStats;
+
+struct Arena *arena_new(void);
+void arena_destroy(struct Arena *a);
+void arena_merge(struct Arena *dest, struct Arena *src);
+gpointer arena_alloc(struct Arena *a, gsize size);
+gpointer arena_alloc0(struct Arena *a, gsize size);
+void arena_free(struct Arena *a, gpointer mem, gsize size);
+void arena_get_stats(struct Arena *a, struct ArenaStats *stats);
+
+#define arena_new_item(a) ((struct Item *)arena_alloc((a), sizeof(struct Item)))
+#define arena_free_item(a, item) arena_free((a), (item), sizeof(struct Item))
@@ -0,0 +1,1145 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* xournal-bench: times the hot paths (loading, saving, PDF export, canvas
+   item creation, erasing) on a synthetic journal, and prints one line per
+   benchmark, tab-separated:
+     benchmark  runs  best_s  mean_s  count  bytes
+   where count is the number of items (or pages, numbers, eraser positions)
+   processed in one run, and bytes the size of the output file, if any
+   (for pdf_strokes, the size of the uncompressed content stream).
+   Lines starting with '#' give the allocator counters of the journal, and
+   how much the resident set grows until the first paint, and the results
+   of a few checks of the stroke geometry (lasso selection, eraser, also
+   against the eraser of older versions on the saved journal, pressure
+   strokes in PDF export against the per-segment lines they replaced); the
+   exit status is 1 if any of those fails. Built with
+   "make xournal-bench", run with "make bench" (the lazy canvas is meant
+   to be measured on a big journal, e.g. --pages 500). Canvas items, the
+   eraser and drawing/undoing strokes need a display, and are skipped
+   without one. */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <locale.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <gtk/gtk.h>
+#include <glib/gstdio.h>
+#include <libgnomecanvas/libgnomecanvas.h>
+#include <libart_lgpl/art_svp_vpath.h>
+
+#include "xournal.h"
+#include "xo-interface.h"
+#include "xo-support.h"
+#include "xo-callbacks.h"
+#include "xo-misc.h"
+#include "xo-file.h"
+#include "xo-paint.h"
+#include "xo-selection.h"
+#include "xo-print.h"
+#include "xo-pages.h"
+#include "xo-arena.h"
+#include "xo-path.h"
+
+// the globals normally defined in main.c
+
+GtkWidget *winMain;
+GnomeCanvas *canvas;
+
+struct Journal journal;
+struct BgPdf bgpdf;
+struct UIData ui;
+struct UndoItem *undo, *redo;
+
+double DEFAULT_ZOOM;
+
+#define BENCH_MAX_RUNS 100
+#define BENCH_PAGE_WIDTH 612.
+#define BENCH_PAGE_HEIGHT 792.
+#define BENCH_ERASER_RADIUS 5.
+#define BENCH_DRAW_POINTS 20
+#define CHECK_STROKES 300
+#define CHECK_ERASER_RADIUS 8.
+
+static int n_pages = 50, n_strokes = 200, n_points = 100, n_text = 5, n_images = 1;
+static double pressure_ratio = 0.5;
+static int n_runs = 3, seed = 1, n_draw = 50000;
+
+static GOptionEntry bench_options[] = {
+  { "pages", 0, 0, G_OPTION_ARG_INT, &n_pages, "Number of pages (50)", "N" },
+  { "strokes", 0, 0, G_OPTION_ARG_INT, &n_strokes, "Strokes per page (200)", "N" },
+  { "points", 0, 0, G_OPTION_ARG_INT, &n_points, "Points per stroke (100)", "N" },
+  { "pressure", 0, 0, G_OPTION_ARG_DOUBLE, &pressure_ratio, "Fraction of pressure strokes (0.5)", "F" },
+  { "text", 0, 0, G_OPTION_ARG_INT, &n_text, "Text items per page (5)", "N" },
+  { "images", 0, 0, G_OPTION_ARG_INT, &n_images, "Images per page (1)", "N" },
+  { "draw", 0, 0, G_OPTION_ARG_INT, &n_draw, "Strokes drawn, undone and redone (50000)", "N" },
+  { "runs", 0, 0, G_OPTION_ARG_INT, &n_runs, "Runs of each benchmark (3)", "N" },
+  { "seed", 0, 0, G_OPTION_ARG_INT, &seed, "Random seed (1)", "N" },
+  { NULL }
+};
+
+static gchar *xoj_name, *out_name;
+static int check_failures = 0;
+
+/* the synthetic journal: random walks on lined paper, with a share of
+   pressure strokes, some text and some small distinct images */
+
+static void write_bench_image(FILE *f, int n)
+{
+  GdkPixbuf *pix;
+  gchar *buf, *base64;
+  gsize len;
+  guchar *p;
+  int x, y, stride;
+
+  pix = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, 64, 64);
+  p = gdk_pixbuf_get_pixels(pix);
+  stride = gdk_pixbuf_get_rowstride(pix);
+  for (y = 0; y < 64; y++)
+    for (x = 0; x < 64; x++) {
+      p[y*stride+3*x] = 4*x;
+      p[y*stride+3*x+1] = 4*y;
+      p[y*stride+3*x+2] = n;
+    }
+  gdk_pixbuf_save_to_buffer(pix, &buf, &len, "png", NULL, NULL);
+  g_object_unref(pix);
+  base64 = g_base64_encode((guchar *)buf, len);
+  fputs(base64, f);
+  g_free(base64);
+  g_free(buf);
+}
+
+static gboolean make_journal_file(void)
+{
+  FILE *f;
+  GRand *rand;
+  double x, y, angle, width;
+  gboolean pressure;
+  int fd, pg, i, j;
+
+  fd = g_file_open_tmp("xournal-bench-XXXXXX.xoj", &xoj_name, NULL);
+  if (fd < 0) return FALSE;
+  f = fdopen(fd, "w");
+  if (f == NULL) return FALSE;
+  rand = g_rand_new_with_seed(seed);
+  setlocale(LC_NUMERIC, "C");
+  fputs("<?xml version=\"1.0\" standalone=\"no\"?>\n<xournal version=\"bench\">\n", f);
+  for (pg = 0; pg < n_pages; pg++) {
+    fprintf(f, "<page width=\"%.2f\" height=\"%.2f\">\n", BENCH_PAGE_WIDTH, BENCH_PAGE_HEIGHT);
+    fputs("<background type=\"solid\" color=\"white\" style=\"lined\" />\n<layer>\n", f);
+    for (i = 0; i < n_strokes; i++) {
+      pressure = (g_rand_double(rand) < pressure_ratio);
+      width = pressure ? 1.41 : 0.85 + g_rand_int_range(rand, 0, 3);
+      fprintf(f, "<stroke tool=\"pen\" color=\"%s\" width=\"%.2f",
+              (i%5 == 0) ? "blue" : "black", width);
+      if (pressure)
+        for (j = 0; j < n_points-1; j++)
+          fprintf(f, " %.2f", width*g_rand_double_range(rand, 0.5, 1.5));
+      fputs("\">\n", f);
+      x = g_rand_double_range(rand, 50., BENCH_PAGE_WIDTH-50.);
+      y = g_rand_double_range(rand, 50., BENCH_PAGE_HEIGHT-50.);
+      angle = g_rand_double_range(rand, 0., 2*M_PI);
+      for (j = 0; j < n_points; j++) {
+        fprintf(f, "%.2f %.2f ", x, y);
+        angle += g_rand_double_range(rand, -0.3, 0.3);
+        x += 1.5*cos(angle);
+        y += 1.5*sin(angle);
+      }
+      fputs("\n</stroke>\n", f);
+    }
+    for (i = 0; i < n_text; i++)
+      fprintf(f, "<text font=\"Sans\" size=\"12.00\" x=\"%.2f\" y=\"%.2f\" color=\"black\">"
+              "Lorem ipsum dolor sit amet, %d</text>\n", 72., 72.+20*i, i);
+    for (i = 0; i < n_images; i++) {
+      x = 100. + 80*i;
+      fprintf(f, "<image left=\"%.2f\" top=\"600.00\" right=\"%.2f\" bottom=\"664.00\">", x, x+64);
+      write_bench_image(f, pg*n_images+i);
+      fputs("</image>\n", f);
+    }
+    fputs("</layer>\n</page>\n", f);
+  }
+  fputs("</xournal>\n", f);
+  setlocale(LC_NUMERIC, "");
+  g_rand_free(rand);
+  return (fclose(f) == 0);
+}
+
+static void load_journal(void)
+{
+  struct Background *bg_pdf;
+  gboolean maybe_pdf;
+
+  if (!read_journal(xoj_name, &journal, &bg_pdf, &maybe_pdf)) {
+    g_printerr("xournal-bench: could not read %s\n", xoj_name);
+    exit(1);
+  }
+}
+
+static void close_journal_now(void)
+{
+  if (undo != NULL) clear_undo_stack();
+  if (redo != NULL) clear_redo_stack();
+  delete_journal(&journal);
+  invalidate_page_table();
+}
+
+static long file_size(gchar *filename)
+{
+  struct stat st;
+
+  if (g_stat(filename, &st) != 0) return 0;
+  return (long)st.st_size;
+}
+
+static void report(const char *name, double *times, int count, long bytes)
+{
+  double best, total;
+  int i;
+
+  best = total = times[0];
+  for (i = 1; i < n_runs; i++) {
+    if (times[i] < best) best = times[i];
+    total += times[i];
+  }
+  printf("%s\t%d\t%.6f\t%.6f\t%d\t%ld\n", name, n_runs, best, total/n_runs, count, bytes);
+  fflush(stdout);
+}
+
+// the allocator counters of the journal's arena, as a comment line
+
+static void report_arena(const char *when)
+{
+  struct ArenaStats st;
+
+  arena_get_stats(journal.arena, &st);
+  printf("# arena after %s: %lu blocks, %lu big, %lu bytes reserved, %lu live, "
+         "%lu allocs, %lu frees, %lu reused\n", when, st.nblocks, st.nbig,
+         (gulong)st.block_bytes, (gulong)st.live_bytes, st.nalloc, st.nfree, st.nreused);
+  fflush(stdout);
+}
+
+// the resident set size in kB, or -1 where /proc doesn't tell
+
+static long rss_kb(void)
+{
+  FILE *f;
+  long size, rss;
+
+  f = fopen("/proc/self/statm", "r");
+  if (f == NULL) return -1;
+  if (fscanf(f, "%ld %ld", &size, &rss) != 2) rss = -1;
+  fclose(f);
+  if (rss < 0) return -1;
+  return rss*(sysconf(_SC_PAGESIZE)/1024);
+}
+
+static int count_items(void)
+{
+  GList *pglist, *layerlist;
+  int n = 0;
+
+  for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next)
+    for (layerlist = ((struct Page *)pglist->data)->layers; layerlist!=NULL; layerlist = layerlist->next)
+      n += ((struct Layer *)layerlist->data)->nitems;
+  return n;
+}
+
+/* the stroke data of a dense page (all the strokes of the journal) in
+   a PDF content stream, written by pdf_draw_page() and by the printf
+   code it replaced, which is kept here for comparison */
+
+static void pdf_strokes_printf(struct Page *pg, GString *str)
+{
+  struct Item *item;
+  GList *itemlist;
+  double old_thickness;
+  float *pt;
+  int i;
+
+  old_thickness = 0.0;
+  itemlist = ((struct Layer *)pg->layers->data)->items;
+  for ( ; itemlist!=NULL; itemlist = itemlist->next) {
+    item = (struct Item *)itemlist->data;
+    g_string_append_printf(str, "%.2f %.2f %.2f RG ", RGBA_RGB(item->brush.color_rgba));
+    if (item->brush.thickness != old_thickness)
+      g_string_append_printf(str, "%.2f w ", item->brush.thickness);
+    old_thickness = item->brush.thickness;
+    pt = item->path->coords;
+    if (!item->brush.variable_width) {
+      g_string_append_printf(str, "%.2f %.2f m ", pt[0], pt[1]);
+      for (i=1, pt+=2; i<item->path->num_points; i++, pt+=2)
+        g_string_append_printf(str, "%.2f %.2f l ", pt[0], pt[1]);
+      g_string_append_printf(str,"S\n");
+    } else {
+      for (i=0; i<item->path->num_points-1; i++, pt+=2)
+        g_string_append_printf(str, "%.2f w %.2f %.2f m %.2f %.2f l S\n", 
+           item->path->widths[i], pt[0], pt[1], pt[2], pt[3]);
+      old_thickness = 0.0;
+    }
+  }
+}
+
+static void bench_pdf_strokes(GTimer *timer)
+{
+  double times[BENCH_MAX_RUNS], times_printf[BENCH_MAX_RUNS];
+  struct Page *pg;
+  struct Layer *l;
+  struct Item *item;
+  struct XrefTable xref;
+  GList *pglist, *layerlist, *itemlist, *fonts, *images;
+  GString *str;
+  gboolean use_hiliter;
+  gsize len, len_printf;
+  int run, npoints;
+
+  pg = g_new0(struct Page, 1);
+  l = g_new0(struct Layer, 1);
+  pg->layers = g_list_append(NULL, l);
+  pg->nlayers = 1;
+  npoints = 0;
+  for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next)
+    for (layerlist = ((struct Page *)pglist->data)->layers; layerlist!=NULL; layerlist = layerlist->next)
+      for (itemlist = ((struct Layer *)layerlist->data)->items; itemlist!=NULL; itemlist = itemlist->next) {
+        item = (struct Item *)itemlist->data;
+        if (item->type != ITEM_STROKE) continue;
+        l->items = g_list_prepend(l->items, item);
+        l->nitems++;
+        npoints += item->path->num_points;
+      }
+  l->items = g_list_reverse(l->items);
+  memset(&xref, 0, sizeof(xref));
+  fonts = images = NULL;
+
+  str = g_string_sized_new(1024*1024);
+  len = len_printf = 0;
+  setlocale(LC_NUMERIC, "C");
+  for (run = 0; run < n_runs; run++) {
+    g_string_truncate(str, 0);
+    g_timer_start(timer);
+    pdf_strokes_printf(pg, str);
+    times_printf[run] = g_timer_elapsed(timer, NULL);
+    len_printf = str->len;
+    g_string_truncate(str, 0);
+    g_timer_start(timer);
+    pdf_draw_page(pg, str, &use_hiliter, &xref, &fonts, &images);
+    times[run] = g_timer_elapsed(timer, NULL);
+    len = str->len;
+  }
+  setlocale(LC_NUMERIC, "");
+  report("pdf_strokes_printf", times_printf, npoints, (long)len_printf);
+  report("pdf_strokes", times, npoints, (long)len);
+
+  g_string_free(str, TRUE);
+  g_list_free(l->items);
+  g_free(l);
+  g_list_free(pg->layers);
+  g_free(pg);
+}
+
+static void bench_file(void)
+{
+  double times[BENCH_MAX_RUNS], times_close[BENCH_MAX_RUNS];
+  GTimer *timer;
+  GList *pglist;
+  int run, n;
+  char buf[FIXED2_MAXLEN];
+
+  timer = g_timer_new();
+
+  n = 0;
+  for (run = 0; run < n_runs; run++) {
+    g_timer_start(timer);
+    load_journal();
+    times[run] = g_timer_elapsed(timer, NULL);
+    if (run == 0) { n = count_items(); report_arena("load"); }
+    g_timer_start(timer);
+    close_journal_now();
+    times_close[run] = g_timer_elapsed(timer, NULL);
+  }
+  report("load", times, n, file_size(xoj_name));
+  report("close", times_close, n, 0);
+  load_journal();
+
+  for (run = 0; run < n_runs; run++) {
+    g_timer_start(timer);
+    if (!save_journal(out_name)) g_printerr("xournal-bench: save failed\n");
+    times[run] = g_timer_elapsed(timer, NULL);
+  }
+  report("save", times, n, file_size(out_name));
+
+  // every run starts without the pages kept from the previous export
+  for (run = 0; run < n_runs; run++) {
+    for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next)
+      pdf_page_cache_free((struct Page *)pglist->data);
+    g_timer_start(timer);
+    if (!print_to_pdf(out_name)) g_printerr("xournal-bench: PDF export failed\n");
+    times[run] = g_timer_elapsed(timer, NULL);
+  }
+  report("export_pdf", times, journal.npages, file_size(out_name));
+
+  for (run = 0; run < n_runs; run++) {
+    g_timer_start(timer);
+    if (!print_to_pdf(out_name)) g_printerr("xournal-bench: PDF export failed\n");
+    times[run] = g_timer_elapsed(timer, NULL);
+  }
+  report("export_pdf_unchanged", times, journal.npages, file_size(out_name));
+
+  // the number formatter behind save_journal() and the PDF stroke data
+  for (run = 0; run < n_runs; run++) {
+    g_timer_start(timer);
+    for (n = 0; n < 1000000; n++) fixed2_to_ascii(buf, n*0.37 - 1000.);
+    times[run] = g_timer_elapsed(timer, NULL);
+  }
+  report("format_fixed2", times, 1000000, 0);
+
+  bench_pdf_strokes(timer);
+
+  close_journal_now();
+  g_timer_destroy(timer);
+}
+
+/* checks of the stroke geometry, now that strokes are no longer split
+   into short segments. A failure gets a '#' line */
+
+static void check(gboolean ok, const char *what, int n)
+{
+  if (ok) return;
+  printf("# check failed: %s (%d)\n", what, n);
+  check_failures++;
+}
+
+/* a lasso with a dent: strokes whose ends are inside but which cut
+   through the dent must not be selected */
+
+static void check_lasso(void)
+{
+  static double lasso[] = { 0,0, 300,0, 300,300, 200,300, 200,100, 100,100, 100,300, 0,300 };
+  static double strokes[][4] = { {50,50, 250,50}, {50,200, 50,250}, {250,150, 250,290},
+    {50,200, 250,200}, {50,150, 250,50}, {150,50, 150,200}, {50,200, 350,200} };
+  static gboolean inside[] = { TRUE, TRUE, TRUE, FALSE, FALSE, FALSE, FALSE };
+  ArtVpath vpath[10];
+  ArtSVP *svp;
+  struct Arena *a;
+  struct Item item;
+  int i;
+
+  for (i = 0; i < 9; i++) {
+    vpath[i].code = (i == 0) ? ART_MOVETO : ART_LINETO;
+    vpath[i].x = lasso[2*(i%8)];
+    vpath[i].y = lasso[2*(i%8)+1];
+  }
+  vpath[9].code = ART_END;
+  svp = art_svp_from_vpath(vpath);
+  a = arena_new();
+  item.type = ITEM_STROKE;
+  for (i = 0; i < (int)G_N_ELEMENTS(inside); i++) {
+    item.path = path_new_from_doubles(a, 2, strokes[i], NULL);
+    check(hittest_item(svp, &item) == inside[i], "lasso selection of stroke", i);
+  }
+  arena_destroy(a);
+  art_svp_free(svp);
+  printf("# check lasso: %d strokes\n", (int)G_N_ELEMENTS(inside));
+}
+
+// distance from (x,y) to the segment p[0..1]-p[2..3]
+
+static double segment_distance(double *p, double x, double y)
+{
+  double dx, dy, t;
+
+  dx = p[2]-p[0]; dy = p[3]-p[1];
+  t = (dx == 0. && dy == 0.) ? 0. : ((x-p[0])*dx + (y-p[1])*dy)/(dx*dx+dy*dy);
+  t = CLAMP(t, 0., 1.);
+  return hypot(p[0]+t*dx-x, p[1]+t*dy-y);
+}
+
+/* erase at random places across strokes with segments of all lengths:
+   no remaining segment may come within the eraser radius, and every
+   segment the eraser didn't reach must still be there; then erase a
+   2-point stroke in the middle */
+
+static void check_eraser(GRand *rand)
+{
+  static double line[] = { 100,100, 300,100 }, middle[] = { 200,100 };
+  double *orig, *pos, coords[2*8], seg[4];
+  int norig, npos, i, j, k, np;
+  float *p;
+  GList *list;
+  struct Item *item;
+  gboolean far, found;
+
+  new_journal();
+  orig = g_new(double, 4*8*CHECK_STROKES);
+  norig = 0;
+  for (k = 0; k < CHECK_STROKES; k++) {
+    np = g_rand_int_range(rand, 2, 8);
+    coords[0] = g_rand_double_range(rand, 0., BENCH_PAGE_WIDTH);
+    coords[1] = g_rand_double_range(rand, 0., BENCH_PAGE_HEIGHT);
+    for (i = 1; i < np; i++) { // from 1 to 60 points long
+      coords[2*i] = coords[2*i-2] + g_rand_double_range(rand, -60., 60.);
+      coords[2*i+1] = coords[2*i-1] + g_rand_double_range(rand, -60., 60.);
+    }
+    item = arena_new_item(journal.arena);
+    item->type = ITEM_STROKE;
+    g_memmove(&(item->brush), &(ui.brushes[0][TOOL_PEN]), sizeof(struct Brush));
+    item->brush.variable_width = FALSE;
+    item->path = path_new_from_doubles(journal.arena, np, coords, NULL);
+    update_item_bbox(item);
+    make_canvas_item_one(ui.cur_layer->group, item);
+    layer_append_item(ui.cur_layer, item);
+    for (i = 0, p = item->path->coords; i < np-1; i++, p += 2, norig++)
+      for (j = 0; j < 4; j++) orig[4*norig+j] = p[j];
+  }
+
+  npos = 2*CHECK_STROKES;
+  pos = g_new(double, 2*npos);
+  for (i = 0; i < npos; i++) {
+    pos[2*i] = g_rand_double_range(rand, 0., BENCH_PAGE_WIDTH);
+    pos[2*i+1] = g_rand_double_range(rand, 0., BENCH_PAGE_HEIGHT);
+    do_eraser_at(pos+2*i, CHECK_ERASER_RADIUS, FALSE);
+  }
+  finalize_erasure();
+
+  // the cut ends are at the radius, give or take the float coordinates
+  for (list = ui.cur_layer->items; list != NULL; list = list->next) {
+    item = (struct Item *)list->data;
+    for (i = 0, p = item->path->coords; i < item->path->num_points-1; i++, p += 2) {
+      for (j = 0; j < 4; j++) seg[j] = p[j];
+      for (k = 0; k < npos; k++)
+        check(segment_distance(seg, pos[2*k], pos[2*k+1]) > CHECK_ERASER_RADIUS - 1e-3,
+              "segment left within the eraser radius", k);
+    }
+  }
+  for (k = 0; k < norig; k++) {
+    far = TRUE;
+    for (i = 0; i < npos && far; i++)
+      far = (segment_distance(orig+4*k, pos[2*i], pos[2*i+1]) > CHECK_ERASER_RADIUS);
+    if (!far) continue;
+    found = FALSE;
+    for (list = ui.cur_layer->items; list != NULL && !found; list = list->next) {
+      item = (struct Item *)list->data;
+      for (i = 0, p = item->path->coords; i < item->path->num_points-1 && !found; i++, p += 2)
+        found = (p[0] == orig[4*k] && p[1] == orig[4*k+1] && p[2] == orig[4*k+2] && p[3] == orig[4*k+3]);
+    }
+    check(found, "segment out of the eraser's reach was lost", k);
+  }
+  printf("# check eraser: %d segments, %d positions\n", norig, npos);
+  g_free(orig);
+  g_free(pos);
+  close_journal_now();
+
+  // a 2-point stroke erased in the middle leaves two pieces
+  new_journal();
+  item = arena_new_item(journal.arena);
+  item->type = ITEM_STROKE;
+  g_memmove(&(item->brush), &(ui.brushes[0][TOOL_PEN]), sizeof(struct Brush));
+  item->brush.variable_width = FALSE;
+  item->path = path_new_from_doubles(journal.arena, 2, line, NULL);
+  update_item_bbox(item);
+  make_canvas_item_one(ui.cur_layer->group, item);
+  layer_append_item(ui.cur_layer, item);
+  do_eraser_at(middle, CHECK_ERASER_RADIUS, FALSE);
+  finalize_erasure();
+  check(ui.cur_layer->nitems == 2, "2-point stroke erased in the middle", ui.cur_layer->nitems);
+  for (list = ui.cur_layer->items; list != NULL; list = list->next) {
+    item = (struct Item *)list->data;
+    check(item->path->num_points == 2 && fabs(fabs(item->path->coords[2]-item->path->coords[0])
+          - (100.-CHECK_ERASER_RADIUS)) < 1e-3, "piece of a 2-point stroke", item->path->num_points);
+  }
+  close_journal_now();
+}
+
+/* the eraser of older versions, which removed the points within its
+   radius and the segments around them: the pieces are the runs of two or
+   more points left */
+
+typedef struct ErasedPiece {
+  int first, n; // first = -1 for a piece with a cut end
+  double x0, y0, x1, y1;
+} ErasedPiece;
+
+static void add_path_piece(GArray *pieces, float *coords, int first, int n)
+{
+  ErasedPiece piece;
+
+  piece.first = first;
+  piece.n = n;
+  piece.x0 = coords[2*first]; piece.y0 = coords[2*first+1];
+  piece.x1 = coords[2*(first+n-1)]; piece.y1 = coords[2*(first+n-1)+1];
+  g_array_append_val(pieces, piece);
+}
+
+static void legacy_erase(struct Path *path, double x, double y, double radius, GArray *pieces)
+{
+  float *p;
+  int start, len, i;
+
+  p = path->coords;
+  start = 0;
+  len = path->num_points;
+  for (i = 0; i < len; i++) {
+    if (hypot(p[2*(start+i)]-x, p[2*(start+i)+1]-y) > radius) continue;
+    if (i >= 2) add_path_piece(pieces, p, start, i); // the head
+    while (++i < len && hypot(p[2*(start+i)]-x, p[2*(start+i)+1]-y) <= radius);
+    if (i >= len-1) return; // no tail
+    start += i; len -= i; i = -1; // go on with the tail
+  }
+  add_path_piece(pieces, p, start, len);
+}
+
+// older versions split segments of 10 or more into floor(len/5) parts
+
+static int legacy_subdivide(double *coords, int n, double *sub)
+{
+  int i, k, parts, nsub;
+
+  sub[0] = coords[0]; sub[1] = coords[1];
+  nsub = 1;
+  for (i = 1; i < n; i++) {
+    parts = (int)floor(hypot(coords[2*i]-coords[2*i-2], coords[2*i+1]-coords[2*i-1])/5.);
+    if (parts < 1) parts = 1;
+    for (k = 1; k <= parts; k++, nsub++) {
+      sub[2*nsub] = coords[2*i-2] + k*(coords[2*i]-coords[2*i-2])/parts;
+      sub[2*nsub+1] = coords[2*i-1] + k*(coords[2*i+1]-coords[2*i-1])/parts;
+    }
+  }
+  return nsub;
+}
+
+static void add_erased_piece(double *coords, double *widths, int n, int first, gpointer data)
+{
+  ErasedPiece piece;
+
+  piece.first = first;
+  piece.n = n;
+  piece.x0 = coords[0]; piece.y0 = coords[1];
+  piece.x1 = coords[2*n-2]; piece.y1 = coords[2*n-1];
+  g_array_append_val((GArray *)data, piece);
+}
+
+// what erase_stroke_portions() leaves of the path, as pieces
+
+static void erase_path(struct Arena *a, struct Path *path, double x, double y, double radius,
+                       GArray *pieces)
+{
+  if (!erase_path_hits(a, path, x, y, radius)) // the stroke stays as it is
+    add_path_piece(pieces, path->coords, 0, path->num_points);
+  else erase_path_pieces(a, path, path->widths == NULL, x, y, radius, add_erased_piece, pieces);
+}
+
+// does a segment with both ends outside the disk cross it?
+
+static gboolean crosses_disk(struct Path *path, double x, double y, double radius)
+{
+  double seg[4];
+  float *p;
+  int i;
+
+  for (i = 0, p = path->coords; i < path->num_points-1; i++, p += 2) {
+    seg[0] = p[0]; seg[1] = p[1]; seg[2] = p[2]; seg[3] = p[3];
+    if (hypot(seg[0]-x, seg[1]-y) > radius && hypot(seg[2]-x, seg[3]-y) > radius &&
+        segment_distance(seg, x, y) <= radius) return TRUE;
+  }
+  return FALSE;
+}
+
+/* erase with both erasers near a random point of the path, and compare
+   the pieces, unless a segment crosses the disk (the one case where they
+   differ, see xo-paint.c): then return FALSE */
+
+static gboolean compare_erasers(struct Arena *a, struct Path *path, GRand *rand,
+                                GArray *old, GArray *new)
+{
+  double x, y;
+  gboolean same;
+  int i, k;
+
+  k = g_rand_int_range(rand, 0, path->num_points);
+  x = path->coords[2*k] + g_rand_double_range(rand, -CHECK_ERASER_RADIUS, CHECK_ERASER_RADIUS);
+  y = path->coords[2*k+1] + g_rand_double_range(rand, -CHECK_ERASER_RADIUS, CHECK_ERASER_RADIUS);
+  if (crosses_disk(path, x, y, CHECK_ERASER_RADIUS)) return FALSE;
+  g_array_set_size(old, 0);
+  g_array_set_size(new, 0);
+  legacy_erase(path, x, y, CHECK_ERASER_RADIUS, old);
+  erase_path(a, path, x, y, CHECK_ERASER_RADIUS, new);
+  same = (old->len == new->len);
+  for (i = 0; i < (int)old->len && same; i++)
+    same = (g_array_index(old, ErasedPiece, i).first == g_array_index(new, ErasedPiece, i).first &&
+            g_array_index(old, ErasedPiece, i).n == g_array_index(new, ErasedPiece, i).n);
+  check(same, "eraser pieces differ from those of older versions", k);
+  return TRUE;
+}
+
+/* the eraser without the canvas: a 2-point stroke erased in the middle
+   leaves two pieces, cut at the radius; and we get the same pieces as the
+   eraser of older versions on the strokes they saved: those of the saved
+   journal (segments of 1.5, half of them pressure strokes), and strokes
+   with long segments subdivided as they did */
+
+#define CHECK_SAVED_PAGES 2
+#define CHECK_SAVED_ERASURES 4 // per stroke
+
+static void check_eraser_saved(GRand *rand)
+{
+  static double line[] = { 100,100, 300,100 };
+  double coords[2*8], sub[2*128];
+  struct Arena *a;
+  struct Path *path;
+  GArray *old, *new;
+  GList *pglist, *list;
+  struct Layer *l;
+  struct Item *item;
+  ErasedPiece *pc;
+  int i, k, np, n, ncross;
+
+  old = g_array_new(FALSE, FALSE, sizeof(ErasedPiece));
+  new = g_array_new(FALSE, FALSE, sizeof(ErasedPiece));
+  a = arena_new();
+  path = path_new_from_doubles(a, 2, line, NULL);
+  erase_path(a, path, 200., 100., CHECK_ERASER_RADIUS, new);
+  pc = (ErasedPiece *)new->data;
+  check(new->len == 2 && pc[0].first == -1 && pc[1].first == -1 && pc[0].n == 2 && pc[1].n == 2 &&
+        pc[0].x0 == 100. && fabs(pc[0].x1 - (200.-CHECK_ERASER_RADIUS)) < 1e-6 &&
+        fabs(pc[1].x0 - (200.+CHECK_ERASER_RADIUS)) < 1e-6 && pc[1].x1 == 300.,
+        "2-point stroke erased in the middle", new->len);
+  path_unref(a, path);
+
+  n = ncross = 0;
+  for (k = 0; k < CHECK_STROKES; k++) {
+    np = g_rand_int_range(rand, 2, 8);
+    coords[0] = g_rand_double_range(rand, 0., BENCH_PAGE_WIDTH);
+    coords[1] = g_rand_double_range(rand, 0., BENCH_PAGE_HEIGHT);
+    for (i = 1; i < np; i++) { // segments of up to 85
+      coords[2*i] = coords[2*i-2] + g_rand_double_range(rand, -60., 60.);
+      coords[2*i+1] = coords[2*i-1] + g_rand_double_range(rand, -60., 60.);
+    }
+    path = path_new_from_doubles(a, legacy_subdivide(coords, np, sub), sub, NULL);
+    for (i = 0; i < CHECK_SAVED_ERASURES; i++, n++)
+      if (!compare_erasers(a, path, rand, old, new)) ncross++;
+    path_unref(a, path);
+  }
+  arena_destroy(a);
+
+  load_journal();
+  for (pglist = journal.pages, k = 0; pglist != NULL && k < CHECK_SAVED_PAGES; pglist = pglist->next, k++) {
+    l = (struct Layer *)g_list_last(((struct Page *)pglist->data)->layers)->data;
+    for (list = l->items; list != NULL; list = list->next) {
+      item = (struct Item *)list->data;
+      if (item->type != ITEM_STROKE) continue;
+      for (i = 0; i < CHECK_SAVED_ERASURES; i++, n++)
+        if (!compare_erasers(journal.arena, item->path, rand, old, new)) ncross++;
+    }
+  }
+  close_journal_now();
+  g_array_free(old, TRUE);
+  g_array_free(new, TRUE);
+  printf("# check eraser against older versions: %d erasures, %d not compared "
+         "(a segment crossing the disk)\n", n, ncross);
+}
+
+/* PDF export of pressure strokes: the printf code drew each segment as a
+   line of its own width, pdf_draw_page() draws each run of segments whose
+   widths are within pdf_width_tolerance as one line of their middle width.
+   Both outputs for a stroke with smoothly varying pressure are rasterized
+   at 300 dpi, each pixel's coverage taken from 8x8 samples without
+   antialiasing (so that overlapping segments don't add up at their
+   edges). The edges move by at most a quarter of the tolerance, which at
+   the default 0.1 is a tenth of a pixel, up to two rows of samples: no
+   pixel may be off by more than 3/8 */
+
+#define CHECK_PDF_DPI 300.
+#define CHECK_PDF_SAMPLES 8
+#define CHECK_PDF_MAX_DIFF 96 // of 255
+#define CHECK_PDF_POINTS 120
+
+// draw the "w", "m", "l" and "S" of a content stream, and count the S
+
+static int draw_pdf_strokes(cairo_t *cr, const gchar *stream)
+{
+  gchar **tokens, **t;
+  double num[2];
+  int nlines;
+
+  num[0] = num[1] = 0.;
+  nlines = 0;
+  tokens = g_strsplit_set(stream, " \n", -1);
+  for (t = tokens; *t != NULL; t++) {
+    if (**t == '\0') continue;
+    if (g_ascii_isdigit(**t) || **t == '-' || **t == '.') {
+      num[0] = num[1];
+      num[1] = g_ascii_strtod(*t, NULL);
+    }
+    else if (!strcmp(*t, "w")) cairo_set_line_width(cr, num[1]);
+    else if (!strcmp(*t, "m")) cairo_move_to(cr, num[0], num[1]);
+    else if (!strcmp(*t, "l")) cairo_line_to(cr, num[0], num[1]);
+    else if (!strcmp(*t, "S")) { cairo_stroke(cr); nlines++; }
+  }
+  g_strfreev(tokens);
+  return nlines;
+}
+
+// the samples of the area box (in points), 0 or 255
+
+static cairo_surface_t *rasterize_pdf_strokes(const gchar *stream, struct BBox *box,
+                                              int width, int height, int *nlines)
+{
+  cairo_surface_t *surface;
+  cairo_t *cr;
+  double scale;
+
+  scale = CHECK_PDF_SAMPLES*CHECK_PDF_DPI/72.;
+  surface = cairo_image_surface_create(CAIRO_FORMAT_A8, width, height);
+  cr = cairo_create(surface);
+  cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+  cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND); // as set by "1 J 1 j"
+  cairo_set_line_join(cr, CAIRO_LINE_JOIN_ROUND);
+  cairo_scale(cr, scale, scale);
+  cairo_translate(cr, -box->left, -box->top);
+  *nlines = draw_pdf_strokes(cr, stream);
+  cairo_destroy(cr);
+  cairo_surface_flush(surface);
+  return surface;
+}
+
+static void check_pdf_widths(GRand *rand)
+{
+  double coords[2*CHECK_PDF_POINTS], widths[CHECK_PDF_POINTS], angle, scale;
+  struct Arena *a;
+  struct Page *pg;
+  struct Layer *l;
+  struct Item *item;
+  struct XrefTable xref;
+  struct BBox box;
+  GList *fonts, *images;
+  GString *old, *new;
+  gboolean use_hiliter;
+  cairo_surface_t *s_old, *s_new;
+  unsigned char *p_old, *p_new;
+  int i, x, y, sx, sy, width, height, stride, c_old, c_new, diff, maxdiff, ndiff, ncovered;
+  int nold, nnew;
+
+  coords[0] = coords[1] = 0.;
+  angle = g_rand_double_range(rand, 0., 2*M_PI);
+  for (i = 0; i < CHECK_PDF_POINTS; i++) {
+    if (i > 0) {
+      angle += g_rand_double_range(rand, -0.3, 0.3);
+      coords[2*i] = coords[2*i-2] + 1.5*cos(angle);
+      coords[2*i+1] = coords[2*i-1] + 1.5*sin(angle);
+    }
+    widths[i] = 1.41*(1. + 0.4*sin(i/12.)) + g_rand_double_range(rand, -0.01, 0.01);
+  }
+  a = arena_new();
+  item = g_new0(struct Item, 1);
+  item->type = ITEM_STROKE;
+  g_memmove(&(item->brush), &(ui.brushes[0][TOOL_PEN]), sizeof(struct Brush));
+  item->brush.variable_width = TRUE;
+  item->brush.color_rgba = 0x000000ff;
+  item->path = path_new_from_doubles(a, CHECK_PDF_POINTS, coords, widths);
+  update_item_bbox(item);
+  pg = g_new0(struct Page, 1);
+  l = g_new0(struct Layer, 1);
+  pg->layers = g_list_append(NULL, l);
+  pg->nlayers = 1;
+  l->items = g_list_append(NULL, item);
+  l->nitems = 1;
+  memset(&xref, 0, sizeof(xref));
+  fonts = images = NULL;
+
+  old = g_string_new(NULL);
+  new = g_string_new(NULL);
+  setlocale(LC_NUMERIC, "C");
+  pdf_strokes_printf(pg, old);
+  pdf_draw_page(pg, new, &use_hiliter, &xref, &fonts, &images);
+  setlocale(LC_NUMERIC, "");
+
+  box.left = item->bbox.left - 2.; box.right = item->bbox.right + 2.;
+  box.top = item->bbox.top - 2.; box.bottom = item->bbox.bottom + 2.;
+  scale = CHECK_PDF_DPI/72.;
+  width = CHECK_PDF_SAMPLES*(int)ceil((box.right-box.left)*scale);
+  height = CHECK_PDF_SAMPLES*(int)ceil((box.bottom-box.top)*scale);
+  s_old = rasterize_pdf_strokes(old->str, &box, width, height, &nold);
+  s_new = rasterize_pdf_strokes(new->str, &box, width, height, &nnew);
+  p_old = cairo_image_surface_get_data(s_old);
+  p_new = cairo_image_surface_get_data(s_new);
+  stride = cairo_image_surface_get_stride(s_old);
+  maxdiff = ndiff = ncovered = 0;
+  for (y = 0; y < height; y += CHECK_PDF_SAMPLES)
+    for (x = 0; x < width; x += CHECK_PDF_SAMPLES) {
+      c_old = c_new = 0;
+      for (sy = y; sy < y + CHECK_PDF_SAMPLES; sy++)
+        for (sx = x; sx < x + CHECK_PDF_SAMPLES; sx++) {
+          if (p_old[sy*stride+sx] != 0) c_old++;
+          if (p_new[sy*stride+sx] != 0) c_new++;
+        }
+      diff = ABS(c_old-c_new)*255/(CHECK_PDF_SAMPLES*CHECK_PDF_SAMPLES);
+      if (diff > maxdiff) maxdiff = diff;
+      if (diff > 0) ndiff++;
+      if (c_old > 0) ncovered++;
+    }
+  check(maxdiff <= CHECK_PDF_MAX_DIFF, "pressure stroke in PDF differs from per-segment lines", maxdiff);
+  printf("# check pdf widths: tolerance %.2f, %d lines instead of %d, "
+         "pixels at %.0f dpi at most %d/255 off, %d of %d differ\n", ui.pdf_width_tolerance,
+         nnew, nold, CHECK_PDF_DPI, maxdiff, ndiff, ncovered);
+
+  cairo_surface_destroy(s_old);
+  cairo_surface_destroy(s_new);
+  g_string_free(old, TRUE);
+  g_string_free(new, TRUE);
+  g_list_free(l->items);
+  g_free(l);
+  g_list_free(pg->layers);
+  g_free(pg);
+  g_free(item);
+  arena_destroy(a);
+}
+
+/* a stroke as the pen would leave it: ui.cur_item and ui.cur_path
+   filled in, then finalize_stroke() */
+
+static void draw_stroke(GRand *rand)
+{
+  double x, y, angle, *pt;
+  int i;
+
+  ui.cur_item_type = ITEM_STROKE;
+  ui.cur_item = arena_new_item(journal.arena);
+  ui.cur_item->type = ITEM_STROKE;
+  g_memmove(&(ui.cur_item->brush), ui.cur_brush, sizeof(struct Brush));
+  ui.cur_item->brush.variable_width = FALSE;
+  ui.cur_item->path = NULL;
+  ui.cur_item->canvas_item = gnome_canvas_item_new(
+      ui.cur_layer->group, gnome_canvas_group_get_type(), NULL);
+  realloc_cur_path(BENCH_DRAW_POINTS);
+  x = g_rand_double_range(rand, 50., BENCH_PAGE_WIDTH-50.);
+  y = g_rand_double_range(rand, 50., BENCH_PAGE_HEIGHT-50.);
+  angle = g_rand_double_range(rand, 0., 2*M_PI);
+  for (i = 0, pt = ui.cur_path.coords; i < BENCH_DRAW_POINTS; i++, pt += 2) {
+    pt[0] = x; pt[1] = y;
+    angle += g_rand_double_range(rand, -0.3, 0.3);
+    x += 1.5*cos(angle);
+    y += 1.5*sin(angle);
+  }
+  ui.cur_path.num_points = BENCH_DRAW_POINTS;
+  finalize_stroke();
+}
+
+static void bench_canvas(void)
+{
+  double times[BENCH_MAX_RUNS], times_undo[BENCH_MAX_RUNS], times_redo[BENCH_MAX_RUNS], pos[2];
+  GTimer *timer;
+  GRand *rand;
+  GList *pglist;
+  struct Page *pg;
+  int run, n, lazy;
+  long rss;
+
+  timer = g_timer_new();
+  ui.zoom = DEFAULT_ZOOM;
+  ui.cur_item_type = ITEM_NONE;
+  ui.lazy_canvas = FALSE;
+  canvas = GNOME_CANVAS(gnome_canvas_new_aa());
+  g_object_ref_sink(canvas);
+  gnome_canvas_set_pixels_per_unit(canvas, ui.zoom);
+
+  rand = g_rand_new_with_seed(seed);
+  check_eraser(rand);
+  g_rand_free(rand);
+
+  for (run = 0; run < n_runs; run++) {
+    load_journal();
+    g_timer_start(timer);
+    make_canvas_items();
+    times[run] = g_timer_elapsed(timer, NULL);
+    n = count_items();
+    close_journal_now();
+  }
+  report("canvas_items", times, n, 0);
+
+  // sweep the eraser along seven horizontal lines on each page
+  for (run = 0; run < n_runs; run++) {
+    load_journal();
+    make_canvas_items();
+    n = 0;
+    g_timer_start(timer);
+    for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next) {
+      ui.cur_page = pg = (struct Page *)pglist->data;
+      ui.cur_layer = (struct Layer *)g_list_last(pg->layers)->data;
+      for (pos[1] = pg->height/8; pos[1] < pg->height-1.; pos[1] += pg->height/8)
+        for (pos[0] = 0.; pos[0] < pg->width; pos[0] += BENCH_ERASER_RADIUS, n++)
+          do_eraser_at(pos, BENCH_ERASER_RADIUS, FALSE);
+      finalize_erasure();
+    }
+    times[run] = g_timer_elapsed(timer, NULL);
+    if (run == 0) report_arena("eraser");
+    close_journal_now();
+  }
+  report("eraser", times, n, 0);
+
+  /* opening a journal until the first paint: loading it, then creating
+     the canvas items of every page, or in lazy mode of the first page
+     only (the one in view). The lazy mode goes first, so that the growth
+     of the resident set isn't hidden by memory the other mode freed */
+  for (lazy = 1; lazy >= 0; lazy--) {
+    ui.lazy_canvas = lazy;
+    for (run = 0; run < n_runs; run++) {
+      rss = rss_kb();
+      g_timer_start(timer);
+      load_journal();
+      make_canvas_items();
+      if (lazy) map_page_items((struct Page *)journal.pages->data);
+      times[run] = g_timer_elapsed(timer, NULL);
+      if (run == 0 && rss >= 0)
+        printf("# resident set growth at first paint%s: %ld kB\n",
+               lazy ? " (lazy)" : "", rss_kb() - rss);
+      close_journal_now();
+    }
+    report(lazy ? "first_paint_lazy" : "first_paint", times, n_pages, 0);
+  }
+
+  /* lazy mode: erase across every page, unmap them all, then undo and
+     redo the erasures, which map the pages they concern again */
+  ui.lazy_canvas = TRUE;
+  for (run = 0; run < n_runs; run++) {
+    load_journal();
+    make_canvas_items();
+    for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next) {
+      ui.cur_page = pg = (struct Page *)pglist->data;
+      ui.cur_layer = (struct Layer *)g_list_last(pg->layers)->data;
+      map_page_items(pg);
+      pos[1] = pg->height/2;
+      for (pos[0] = 0.; pos[0] < pg->width; pos[0] += BENCH_ERASER_RADIUS)
+        do_eraser_at(pos, BENCH_ERASER_RADIUS, FALSE);
+      finalize_erasure();
+    }
+    ui.cur_page = NULL;
+    for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next)
+      unmap_page_items((struct Page *)pglist->data);
+    g_timer_start(timer);
+    for (n = 0; n < n_pages; n++) on_editUndo_activate(NULL, NULL);
+    times_undo[run] = g_timer_elapsed(timer, NULL);
+    for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next)
+      unmap_page_items((struct Page *)pglist->data);
+    g_timer_start(timer);
+    for (n = 0; n < n_pages; n++) on_editRedo_activate(NULL, NULL);
+    times_redo[run] = g_timer_elapsed(timer, NULL);
+    close_journal_now();
+  }
+  report("undo_lazy", times_undo, n_pages, 0);
+  report("redo_lazy", times_redo, n_pages, 0);
+  ui.lazy_canvas = FALSE;
+
+  // draw strokes one by one on an empty page, then undo and redo them all
+  if (n_draw > 0) {
+    ui.cur_brush = &(ui.brushes[0][TOOL_PEN]);
+    for (run = 0; run < n_runs; run++) {
+      new_journal();
+      rand = g_rand_new_with_seed(seed);
+      g_timer_start(timer);
+      for (n = 0; n < n_draw; n++) draw_stroke(rand);
+      times[run] = g_timer_elapsed(timer, NULL);
+      g_rand_free(rand);
+      g_timer_start(timer);
+      for (n = 0; n < n_draw; n++) on_editUndo_activate(NULL, NULL);
+      times_undo[run] = g_timer_elapsed(timer, NULL);
+      g_timer_start(timer);
+      for (n = 0; n < n_draw; n++) on_editRedo_activate(NULL, NULL);
+      times_redo[run] = g_timer_elapsed(timer, NULL);
+      close_journal_now();
+    }
+    report("draw", times, n_draw, 0);
+    report("undo", times_undo, n_draw, 0);
+    report("redo", times_redo, n_draw, 0);
+  }
+
+  g_object_unref(canvas);
+  canvas = NULL;
+  g_timer_destroy(timer);
+}
+
+int main(int argc, char *argv[])
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  gboolean have_display;
+  gchar *path, *dir;
+  GRand *rand;
+  int fd;
+
+  if (!g_thread_supported()) g_thread_init(NULL);
+  have_display = gtk_init_check(&argc, &argv);
+  if (!have_display) g_type_init();
+
+  context = g_option_context_new("- time xournal on a synthetic journal");
+  g_option_context_add_main_entries(context, bench_options, NULL);
+  if (!g_option_context_parse(context, &argc, &argv, &error)) {
+    g_printerr("xournal-bench: %s\n", error->message);
+    return 1;
+  }
+  g_option_context_free(context);
+  if (n_runs < 1 || n_runs > BENCH_MAX_RUNS || n_pages < 1 ||
+      n_strokes < 0 || n_points < 2 || n_text < 0 || n_images < 0 || n_draw < 0) {
+    g_printerr("xournal-bench: invalid parameters\n");
+    return 1;
+  }
+
+  // the default settings, not the user's config file
+  ui.headless = !have_display;
+  ui.default_page.bg = g_new(struct Background, 1);
+  init_config_default();
+  ui.default_page.bg->canvas_item = NULL;
+  ui.hiliter_alpha_mask = 0xffffff00 + (guint)(255*ui.hiliter_opacity);
+  undo = NULL; redo = NULL;
+  journal.pages = NULL;
+  bgpdf.status = STATUS_NOT_INIT;
+  if (have_display) {
+    add_pixmap_directory(PACKAGE_DATA_DIR "/" PACKAGE "/pixmaps");
+    dir = g_path_get_dirname(argv[0]);
+    path = g_build_filename(dir, "..", "pixmaps", NULL);
+    add_pixmap_directory(path);
+    g_free(path);
+    g_free(dir);
+    winMain = create_winMain(); // never shown, but the undo code updates its menus
+  }
+
+  if (!make_journal_file()) {
+    g_printerr("xournal-bench: could not write the test journal\n");
+    return 1;
+  }
+  fd = g_file_open_tmp("xournal-bench-XXXXXX.out", &out_name, NULL);
+  if (fd >= 0) close(fd);
+
+  printf("# xournal-bench pages=%d strokes=%d points=%d pressure=%.2f text=%d images=%d seed=%d\n",
+         n_pages, n_strokes, n_points, pressure_ratio, n_text, n_images, seed);
+  printf("benchmark\truns\tbest_s\tmean_s\tcount\tbytes\n");
+  check_lasso();
+  rand = g_rand_new_with_seed(seed);
+  check_eraser_saved(rand);
+  check_pdf_widths(rand);
+  g_rand_free(rand);
+  bench_file();
+  if (have_display) bench_canvas();
+  else printf("# check eraser, canvas_items, eraser, first_paint, undo_lazy, draw, undo, redo: skipped (no display)\n");
+
+  g_unlink(xoj_name);
+  g_unlink(out_name);
+  return (check_failures > 0) ? 1 : 0;
+}
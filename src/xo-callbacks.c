@@ -36,6 +36,7 @@
 #include "xo-selection.h"
 #include "xo-print.h"
 #include "xo-shapes.h"
+#include "xo-pages.h"
 
 void
 on_fileNew_activate                    (GtkMenuItem     *menuitem,
@@ -469,36 +470,37 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
   if (undo == NULL) return; // nothing to undo!
   reset_selection(); // safer
   reset_recognizer(); // safer
+  map_undo_pages(undo); // lazy canvas: make sure the items have canvas items
+  undo->marked = FALSE; // its pages are about to change again
+  mark_undo_pages(undo);
   if (undo->type == ITEM_STROKE || undo->type == ITEM_TEXT || undo->type == ITEM_IMAGE) {
     // we're keeping the stroke info, but deleting the canvas item
     gtk_object_destroy(GTK_OBJECT(undo->item->canvas_item));
     undo->item->canvas_item = NULL;
     // we also remove the object from its layer!
-    undo->layer->items = g_list_remove(undo->layer->items, undo->item);
-    undo->layer->nitems--;
+    layer_remove_item(undo->layer, undo->item);
   }
   else if (undo->type == ITEM_ERASURE || undo->type == ITEM_RECOGNIZER) {
-    for (list = undo->erasurelist; list!=NULL; list = list->next) {
+    /* the erasures are in depth order: go from the top down, so that the
+       item each one goes back under is already in place */
+    for (list = g_list_last(undo->erasurelist); list!=NULL; list = list->prev) {
       erasure = (struct UndoErasureData *)list->data;
       // delete all the created items
       for (itemlist = erasure->replacement_items; itemlist!=NULL; itemlist = itemlist->next) {
         it = (struct Item *)itemlist->data;
         gtk_object_destroy(GTK_OBJECT(it->canvas_item));
         it->canvas_item = NULL;
-        undo->layer->items = g_list_remove(undo->layer->items, it);
-        undo->layer->nitems--;
+        layer_remove_item(undo->layer, it);
       }
       // recreate the deleted one
       make_canvas_item_one(undo->layer->group, erasure->item);
       
-      undo->layer->items = g_list_insert(undo->layer->items, erasure->item,
-                                                             erasure->npos);
-      if (erasure->npos == 0)
+      layer_insert_item_before(undo->layer, erasure->item, erasure->next);
+      if (erasure->item->link->prev == NULL)
         lower_canvas_item_to(undo->layer->group, erasure->item->canvas_item, NULL);
       else
         lower_canvas_item_to(undo->layer->group, erasure->item->canvas_item,
-          ((struct Item *)g_list_nth_data(undo->layer->items, erasure->npos-1))->canvas_item);
-      undo->layer->nitems++;
+          ((struct Item *)erasure->item->link->prev->data)->canvas_item);
     }
   }
   else if (undo->type == ITEM_NEW_BG_ONE || undo->type == ITEM_NEW_BG_RESIZE
@@ -519,9 +521,10 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
       undo->val_x = tmp_x;
       undo->val_y = tmp_y;
       make_page_clipbox(undo->page);
+      page_resized(journal_page_index(undo->page));
     }
     update_canvas_bg(undo->page);
-    do_switch_page(g_list_index(journal.pages, undo->page), TRUE, TRUE);
+    do_switch_page(journal_page_index(undo->page), TRUE, TRUE);
   }
   else if (undo->type == ITEM_NEW_DEFAULT_BG) {
     tmp_bg = ui.default_page.bg;
@@ -540,8 +543,7 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
       // also destroys the background and layer's canvas items
     undo->page->group = NULL;
     undo->page->bg->canvas_item = NULL;
-    journal.pages = g_list_remove(journal.pages, undo->page);
-    journal.npages--;
+    journal_remove_page(undo->page);
     if (ui.cur_page == undo->page) ui.cur_page = NULL;
         // so do_switch_page() won't try to remap the layers of the defunct page
     if (ui.pageno >= undo->val) ui.pageno--;
@@ -549,8 +551,7 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
     do_switch_page(ui.pageno, TRUE, TRUE);
   }
   else if (undo->type == ITEM_DELETE_PAGE) {
-    journal.pages = g_list_insert(journal.pages, undo->page, undo->val);
-    journal.npages++;
+    journal_insert_page(undo->page, undo->val);
     make_canvas_items(); // re-create the canvas items
     do_switch_page(undo->val, TRUE, TRUE);
   }
@@ -576,8 +577,7 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
       it = (struct Item *)itemlist->data;
       gtk_object_destroy(GTK_OBJECT(it->canvas_item));
       it->canvas_item = NULL;
-      undo->layer->items = g_list_remove(undo->layer->items, it);
-      undo->layer->nitems--;
+      layer_remove_item(undo->layer, it);
     }
   }
   else if (undo->type == ITEM_NEW_LAYER) {
@@ -669,7 +669,7 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
                                         gpointer         user_data)
 {
   struct UndoItem *u;
-  GList *list, *itemlist, *target;
+  GList *list, *itemlist;
   struct UndoErasureData *erasure;
   struct Item *it;
   struct Brush tmp_brush;
@@ -683,30 +683,29 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
   if (redo == NULL) return; // nothing to redo!
   reset_selection(); // safer
   reset_recognizer(); // safer
+  map_undo_pages(redo);
+  redo->marked = FALSE;
+  mark_undo_pages(redo);
   if (redo->type == ITEM_STROKE || redo->type == ITEM_TEXT || redo->type == ITEM_IMAGE) {
     // re-create the canvas_item
     make_canvas_item_one(redo->layer->group, redo->item);
     // reinsert the item on its layer
-    redo->layer->items = g_list_append(redo->layer->items, redo->item);
-    redo->layer->nitems++;
+    layer_append_item(redo->layer, redo->item);
   }
   else if (redo->type == ITEM_ERASURE || redo->type == ITEM_RECOGNIZER) {
     for (list = redo->erasurelist; list!=NULL; list = list->next) {
       erasure = (struct UndoErasureData *)list->data;
-      target = g_list_find(redo->layer->items, erasure->item);
       // re-create all the created items
       for (itemlist = erasure->replacement_items; itemlist!=NULL; itemlist = itemlist->next) {
         it = (struct Item *)itemlist->data;
         make_canvas_item_one(redo->layer->group, it);
-        redo->layer->items = g_list_insert_before(redo->layer->items, target, it);
-        redo->layer->nitems++;
+        layer_insert_item_before(redo->layer, it, erasure->item);
         lower_canvas_item_to(redo->layer->group, it->canvas_item, erasure->item->canvas_item);
       }
       // re-delete the deleted one
       gtk_object_destroy(GTK_OBJECT(erasure->item->canvas_item));
       erasure->item->canvas_item = NULL;
-      redo->layer->items = g_list_delete_link(redo->layer->items, target);
-      redo->layer->nitems--;
+      layer_remove_item(redo->layer, erasure->item);
     }
   }
   else if (redo->type == ITEM_NEW_BG_ONE || redo->type == ITEM_NEW_BG_RESIZE
@@ -727,9 +726,10 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
       redo->val_x = tmp_x;
       redo->val_y = tmp_y;
       make_page_clipbox(redo->page);
+      page_resized(journal_page_index(redo->page));
     }
     update_canvas_bg(redo->page);
-    do_switch_page(g_list_index(journal.pages, redo->page), TRUE, TRUE);
+    do_switch_page(journal_page_index(redo->page), TRUE, TRUE);
   }
   else if (redo->type == ITEM_NEW_DEFAULT_BG) {
     tmp_bg = ui.default_page.bg;
@@ -753,8 +753,7 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
     l->group = (GnomeCanvasGroup *) gnome_canvas_item_new(
       redo->page->group, gnome_canvas_group_get_type(), NULL);
     
-    journal.pages = g_list_insert(journal.pages, redo->page, redo->val);
-    journal.npages++;
+    journal_insert_page(redo->page, redo->val);
     do_switch_page(redo->val, TRUE, TRUE);
   }
   else if (redo->type == ITEM_DELETE_PAGE) {
@@ -768,8 +767,7 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
         ((struct Item *)itemlist->data)->canvas_item = NULL;
       l->group = NULL;
     }
-    journal.pages = g_list_remove(journal.pages, redo->page);
-    journal.npages--;
+    journal_remove_page(redo->page);
     if (ui.pageno > redo->val || ui.pageno == journal.npages) ui.pageno--;
     ui.cur_page = NULL;
       // so do_switch_page() won't try to remap the layers of the defunct page
@@ -795,8 +793,7 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
     for (itemlist = redo->itemlist; itemlist != NULL; itemlist = itemlist->next) {
       it = (struct Item *)itemlist->data;
       make_canvas_item_one(redo->layer->group, it);
-      redo->layer->items = g_list_append(redo->layer->items, it);
-      redo->layer->nitems++;
+      layer_append_item(redo->layer, it);
     }
   }
   else if (redo->type == ITEM_NEW_LAYER) {
@@ -1089,8 +1086,7 @@ on_journalNewPageBefore_activate       (GtkMenuItem     *menuitem,
   end_text();
   reset_selection();
   pg = new_page(ui.cur_page);
-  journal.pages = g_list_insert(journal.pages, pg, ui.pageno);
-  journal.npages++;
+  journal_insert_page(pg, ui.pageno);
   do_switch_page(ui.pageno, TRUE, TRUE);
   
   prepare_new_undo();
@@ -1109,8 +1105,7 @@ on_journalNewPageAfter_activate        (GtkMenuItem     *menuitem,
   end_text();
   reset_selection();
   pg = new_page(ui.cur_page);
-  journal.pages = g_list_insert(journal.pages, pg, ui.pageno+1);
-  journal.npages++;
+  journal_insert_page(pg, ui.pageno+1);
   do_switch_page(ui.pageno+1, TRUE, TRUE);
 
   prepare_new_undo();
@@ -1129,8 +1124,7 @@ on_journalNewPageEnd_activate          (GtkMenuItem     *menuitem,
   end_text();
   reset_selection();
   pg = new_page((struct Page *)g_list_last(journal.pages)->data);
-  journal.pages = g_list_append(journal.pages, pg);
-  journal.npages++;
+  journal_insert_page(pg, journal.npages);
   do_switch_page(journal.npages-1, TRUE, TRUE);
 
   prepare_new_undo();
@@ -1167,8 +1161,7 @@ on_journalDeletePage_activate          (GtkMenuItem     *menuitem,
     l->group = NULL;
   }
   
-  journal.pages = g_list_remove(journal.pages, ui.cur_page);
-  journal.npages--;
+  journal_remove_page(ui.cur_page);
   if (ui.pageno == journal.npages) ui.pageno--;
   ui.cur_page = NULL;
      // so do_switch_page() won't try to remap the layers of the defunct page
@@ -1185,8 +1178,9 @@ on_journalNewLayer_activate            (GtkMenuItem     *menuitem,
   end_text();
   reset_selection();
   l = g_new(struct Layer, 1);
-  l->items = NULL;
+  l->items = l->items_tail = NULL;
   l->nitems = 0;
+  l->index = NULL;
   l->group = (GnomeCanvasGroup *) gnome_canvas_item_new(
     ui.cur_page->group, gnome_canvas_group_get_type(), NULL);
   lower_canvas_item_to(ui.cur_page->group, GNOME_CANVAS_ITEM(l->group),
@@ -1237,8 +1231,9 @@ on_journalDeleteLayer_activate         (GtkMenuItem     *menuitem,
   } 
   else { // special case: can't remove the last layer
     ui.cur_layer = g_new(struct Layer, 1);
-    ui.cur_layer->items = NULL;
+    ui.cur_layer->items = ui.cur_layer->items_tail = NULL;
     ui.cur_layer->nitems = 0;
+    ui.cur_layer->index = NULL;
     ui.cur_layer->group = (GnomeCanvasGroup *) gnome_canvas_item_new(
       ui.cur_page->group, gnome_canvas_group_get_type(), NULL);
     ui.cur_page->layers = g_list_append(NULL, ui.cur_layer);
@@ -1326,6 +1321,8 @@ on_journalPaperSize_activate           (GtkMenuItem     *menuitem,
     update_canvas_bg(pg);
     if (!ui.bg_apply_all_pages) break;
   }
+  if (ui.bg_apply_all_pages) invalidate_page_table();
+  else page_resized(ui.pageno);
   do_switch_page(ui.pageno, TRUE, TRUE);
 }
 
@@ -1538,13 +1535,12 @@ on_journalLoadBackground_activate      (GtkMenuItem     *menuitem,
       pg = new_page_with_bg(bg, 
               gdk_pixbuf_get_width(bg->pixbuf)/bg->pixbuf_scale,
               gdk_pixbuf_get_height(bg->pixbuf)/bg->pixbuf_scale);
-      journal.pages = g_list_append(journal.pages, pg);
-      journal.npages++;
+      journal_insert_page(pg, journal.npages);
       undo->val = pageno;
       undo->page = pg;
     } else
     {
-      pg = g_list_nth_data(journal.pages, pageno);
+      pg = journal_page(pageno);
       undo->type = ITEM_NEW_BG_RESIZE;
       undo->page = pg;
       undo->bg = pg->bg;
@@ -1556,6 +1552,7 @@ on_journalLoadBackground_activate      (GtkMenuItem     *menuitem,
       pg->width = gdk_pixbuf_get_width(bg->pixbuf)/bg->pixbuf_scale;
       pg->height = gdk_pixbuf_get_height(bg->pixbuf)/bg->pixbuf_scale;
       make_page_clipbox(pg);
+      page_resized(pageno);
       update_canvas_bg(pg);
     }
   }
@@ -1606,6 +1603,7 @@ on_journalScreenshot_activate          (GtkMenuItem     *menuitem,
   ui.cur_page->height = gdk_pixbuf_get_height(bg->pixbuf)/bg->pixbuf_scale;
 
   make_page_clipbox(ui.cur_page);
+  page_resized(ui.pageno);
   update_canvas_bg(ui.cur_page);
 
   if (ui.zoom != DEFAULT_ZOOM) {
@@ -2672,7 +2670,9 @@ on_canvas_expose_event                 (GtkWidget       *widget,
                                         GdkEventExpose  *event,
                                         gpointer         user_data)
 {
-  if (ui.view_continuous && ui.progressive_bg) rescale_bg_pixmaps();
+  if (ui.view_continuous && (ui.progressive_bg || ui.pdf_cache_size > 0))
+    rescale_visible_bg_pixmaps();
+  else bgpdf_update_tiles(); // PDF bg tiles follow the scrolling
   return FALSE;
 }
 
@@ -2937,33 +2937,33 @@ void
 on_vscroll_changed                     (GtkAdjustment   *adjustment,
                                         gpointer         user_data)
 {
-  gboolean need_update;
   double viewport_top, viewport_bottom;
   struct Page *tmppage;
+  int pageno;
   
   if (!ui.view_continuous) return;
   
-  if (ui.progressive_bg) rescale_bg_pixmaps();
-  need_update = FALSE;
+  if (ui.progressive_bg || ui.pdf_cache_size > 0) rescale_visible_bg_pixmaps();
   viewport_top = adjustment->value / ui.zoom;
   viewport_bottom = (adjustment->value + adjustment->page_size) / ui.zoom;
+  pageno = ui.pageno;
   tmppage = ui.cur_page;
-  while (viewport_top > tmppage->voffset + tmppage->height) {
-    if (ui.pageno == journal.npages-1) break;
-    need_update = TRUE;
-    ui.pageno++;
-    tmppage = g_list_nth_data(journal.pages, ui.pageno);
-  }
-  while (viewport_bottom < tmppage->voffset) {
-    if (ui.pageno == 0) break;
-    need_update = TRUE;
-    ui.pageno--;
-    tmppage = g_list_nth_data(journal.pages, ui.pageno);
-  }
-  if (need_update) {
+  if (viewport_top > tmppage->voffset + tmppage->height) {
+    // the first page reaching down into the viewport
+    pageno = page_at_voffset(viewport_top);
+    tmppage = journal_page(pageno);
+    if (viewport_top > tmppage->voffset + tmppage->height && pageno < journal.npages-1)
+      tmppage = journal_page(++pageno);
+  }
+  if (viewport_bottom < tmppage->voffset) {
+    // the last page starting above the bottom of the viewport
+    pageno = page_at_voffset(viewport_bottom);
+  }
+  if (pageno != ui.pageno) {
     end_text();
-    do_switch_page(ui.pageno, FALSE, FALSE);
+    do_switch_page(pageno, FALSE, FALSE);
   }
+  else update_lazy_pages();
   return;
 }
 
@@ -3046,6 +3046,8 @@ on_journalDefaultBackground_activate   (GtkMenuItem     *menuitem,
     update_canvas_bg(pg);
     if (!ui.bg_apply_all_pages) break;
   }
+  if (ui.bg_apply_all_pages) invalidate_page_table();
+  else page_resized(ui.pageno);
   do_switch_page(ui.pageno, TRUE, TRUE);
 }
 
@@ -0,0 +1,281 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <math.h>
+#include <string.h>
+#include <gtk/gtk.h>
+#include <libgnomecanvas/libgnomecanvas.h>
+#include <libart_lgpl/art_vpath.h>
+#include <libart_lgpl/art_svp_vpath.h>
+#include <libart_lgpl/art_svp_intersect.h>
+
+#include "xo-canvas.h"
+
+/* A variable-width stroke used to be a group of one GnomeCanvasLine per
+   segment. Here the whole stroke is a single item: the outline is the
+   union of the round-capped segments, computed as one SVP and rendered
+   in one pass. Only the antialiased canvas is supported (no draw method),
+   which is the only kind xournal creates. */
+
+#define STROKE_FLATNESS 0.25 // max. deviation from true round caps, in pixels
+#define STROKE_MAX_ARC_STEPS 64
+
+enum {
+  PROP_0,
+  PROP_FILL_COLOR_RGBA
+};
+
+G_DEFINE_TYPE(XoCanvasStroke, xo_canvas_stroke, GNOME_TYPE_CANVAS_ITEM)
+
+static void xo_canvas_stroke_init(XoCanvasStroke *stroke)
+{
+  stroke->num_points = 0;
+  stroke->coords = NULL;
+  stroke->widths = NULL;
+  stroke->rgba = 0x000000ff;
+  stroke->svp = NULL;
+}
+
+static void xo_canvas_stroke_destroy(GtkObject *object)
+{
+  XoCanvasStroke *stroke = XO_CANVAS_STROKE(object);
+
+  if (stroke->svp != NULL) { art_svp_free(stroke->svp); stroke->svp = NULL; }
+  g_free(stroke->coords);
+  stroke->coords = stroke->widths = NULL;
+  stroke->num_points = 0;
+  if (GTK_OBJECT_CLASS(xo_canvas_stroke_parent_class)->destroy)
+    GTK_OBJECT_CLASS(xo_canvas_stroke_parent_class)->destroy(object);
+}
+
+static void xo_canvas_stroke_set_property(GObject *object, guint prop_id,
+          const GValue *value, GParamSpec *pspec)
+{
+  XoCanvasStroke *stroke = XO_CANVAS_STROKE(object);
+  GnomeCanvasItem *item = GNOME_CANVAS_ITEM(object);
+
+  switch (prop_id) {
+    case PROP_FILL_COLOR_RGBA:
+      stroke->rgba = g_value_get_uint(value);
+      if (stroke->svp != NULL)
+        gnome_canvas_request_redraw(item->canvas, item->x1, item->y1, item->x2, item->y2);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+      break;
+  }
+}
+
+static void xo_canvas_stroke_get_property(GObject *object, guint prop_id,
+          GValue *value, GParamSpec *pspec)
+{
+  XoCanvasStroke *stroke = XO_CANVAS_STROKE(object);
+
+  switch (prop_id) {
+    case PROP_FILL_COLOR_RGBA:
+      g_value_set_uint(value, stroke->rgba);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+      break;
+  }
+}
+
+/* the outline as a vector path in canvas coordinates: one closed convex
+   polygon (two half-circles joined by straight edges) per segment, all
+   with the same orientation, so that the nonzero winding rule makes
+   their union */
+
+static ArtVpath *stroke_outline(XoCanvasStroke *stroke, double *affine)
+{
+  ArtVpath *vpath, *vp;
+  double expansion, maxw, r, step, ux, uy, len;
+  double x0, y0, x1, y1, *pt;
+  double c[STROKE_MAX_ARC_STEPS+1], s[STROKE_MAX_ARC_STEPS+1];
+  int i, k, n;
+
+  expansion = art_affine_expansion(affine);
+  maxw = 0.;
+  for (i = 0; i < stroke->num_points-1; i++)
+    if (stroke->widths[i] > maxw) maxw = stroke->widths[i];
+  r = maxw*expansion/2;
+  if (r > STROKE_FLATNESS) {
+    step = 2*acos(1. - STROKE_FLATNESS/r);
+    n = (int)ceil(M_PI/step);
+  } else n = 1;
+  if (n < 1) n = 1;
+  if (n > STROKE_MAX_ARC_STEPS) n = STROKE_MAX_ARC_STEPS;
+  for (k = 0; k <= n; k++) {
+    c[k] = cos(M_PI/2 - M_PI*k/n);
+    s[k] = sin(M_PI/2 - M_PI*k/n);
+  }
+
+  vpath = g_new(ArtVpath, (stroke->num_points-1)*(2*n+3) + 1);
+  vp = vpath;
+  for (i = 0, pt = stroke->coords; i < stroke->num_points-1; i++, pt += 2) {
+    x0 = affine[0]*pt[0] + affine[2]*pt[1] + affine[4];
+    y0 = affine[1]*pt[0] + affine[3]*pt[1] + affine[5];
+    x1 = affine[0]*pt[2] + affine[2]*pt[3] + affine[4];
+    y1 = affine[1]*pt[2] + affine[3]*pt[3] + affine[5];
+    r = stroke->widths[i]*expansion/2;
+    len = hypot(x1-x0, y1-y0);
+    if (len > 1e-9) { ux = (x1-x0)/len; uy = (y1-y0)/len; }
+    else { ux = 1.; uy = 0.; }
+    // cap around (x1,y1) from +normal to -normal, then around (x0,y0) back
+    for (k = 0; k <= n; k++, vp++) {
+      vp->code = (k == 0) ? ART_MOVETO : ART_LINETO;
+      vp->x = x1 + r*(c[k]*ux - s[k]*uy);
+      vp->y = y1 + r*(c[k]*uy + s[k]*ux);
+    }
+    for (k = 0; k <= n; k++, vp++) {
+      vp->code = ART_LINETO;
+      vp->x = x0 - r*(c[k]*ux - s[k]*uy);
+      vp->y = y0 - r*(c[k]*uy + s[k]*ux);
+    }
+    vp->code = ART_LINETO;
+    vp->x = (vp-2*n-2)->x;
+    vp->y = (vp-2*n-2)->y;
+    vp++;
+  }
+  vp->code = ART_END;
+  vp->x = vp->y = 0.;
+  return vpath;
+}
+
+static void xo_canvas_stroke_update(GnomeCanvasItem *item, double *affine,
+          ArtSVP *clip_path, int flags)
+{
+  XoCanvasStroke *stroke = XO_CANVAS_STROKE(item);
+  ArtVpath *vpath;
+  ArtSVP *svp;
+  ArtSvpWriter *swr;
+
+  if (GNOME_CANVAS_ITEM_CLASS(xo_canvas_stroke_parent_class)->update)
+    GNOME_CANVAS_ITEM_CLASS(xo_canvas_stroke_parent_class)->update(item, affine, clip_path, flags);
+
+  gnome_canvas_item_reset_bounds(item);
+  if (stroke->num_points < 2) {
+    gnome_canvas_item_update_svp(item, &stroke->svp, NULL);
+    return;
+  }
+  vpath = stroke_outline(stroke, affine);
+  svp = art_svp_from_vpath(vpath);
+  g_free(vpath);
+  swr = art_svp_writer_rewind_new(ART_WIND_RULE_NONZERO);
+  art_svp_intersector(svp, swr);
+  art_svp_free(svp);
+  svp = art_svp_writer_rewind_reap(swr);
+  gnome_canvas_item_update_svp_clip(item, &stroke->svp, svp, clip_path);
+}
+
+static void xo_canvas_stroke_render(GnomeCanvasItem *item, GnomeCanvasBuf *buf)
+{
+  XoCanvasStroke *stroke = XO_CANVAS_STROKE(item);
+
+  if (stroke->svp != NULL)
+    gnome_canvas_render_svp(buf, stroke->svp, stroke->rgba);
+}
+
+static double xo_canvas_stroke_point(GnomeCanvasItem *item, double x, double y,
+          int cx, int cy, GnomeCanvasItem **actual_item)
+{
+  XoCanvasStroke *stroke = XO_CANVAS_STROKE(item);
+  double best, dist, dx, dy, len2, t, *pt;
+  int i;
+
+  *actual_item = item;
+  best = 1e10;
+  for (i = 0, pt = stroke->coords; i < stroke->num_points-1; i++, pt += 2) {
+    dx = pt[2]-pt[0]; dy = pt[3]-pt[1];
+    len2 = dx*dx + dy*dy;
+    t = (len2 > 0.) ? ((x-pt[0])*dx + (y-pt[1])*dy)/len2 : 0.;
+    if (t < 0.) t = 0.;
+    if (t > 1.) t = 1.;
+    dist = hypot(x - pt[0] - t*dx, y - pt[1] - t*dy) - stroke->widths[i]/2;
+    if (dist < best) best = dist;
+    if (best <= 0.) return 0.;
+  }
+  return best;
+}
+
+static void xo_canvas_stroke_bounds(GnomeCanvasItem *item,
+          double *x1, double *y1, double *x2, double *y2)
+{
+  XoCanvasStroke *stroke = XO_CANVAS_STROKE(item);
+  double maxw, *pt;
+  int i;
+
+  if (stroke->num_points == 0) { *x1 = *y1 = *x2 = *y2 = 0.; return; }
+  *x1 = *x2 = stroke->coords[0];
+  *y1 = *y2 = stroke->coords[1];
+  maxw = 0.;
+  for (i = 0, pt = stroke->coords; i < stroke->num_points; i++, pt += 2) {
+    if (pt[0] < *x1) *x1 = pt[0];
+    if (pt[0] > *x2) *x2 = pt[0];
+    if (pt[1] < *y1) *y1 = pt[1];
+    if (pt[1] > *y2) *y2 = pt[1];
+    if (i < stroke->num_points-1 && stroke->widths[i] > maxw) maxw = stroke->widths[i];
+  }
+  *x1 -= maxw/2; *y1 -= maxw/2;
+  *x2 += maxw/2; *y2 += maxw/2;
+}
+
+static void xo_canvas_stroke_class_init(XoCanvasStrokeClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+  GtkObjectClass *object_class = GTK_OBJECT_CLASS(klass);
+  GnomeCanvasItemClass *item_class = GNOME_CANVAS_ITEM_CLASS(klass);
+
+  gobject_class->set_property = xo_canvas_stroke_set_property;
+  gobject_class->get_property = xo_canvas_stroke_get_property;
+  g_object_class_install_property(gobject_class, PROP_FILL_COLOR_RGBA,
+      g_param_spec_uint("fill-color-rgba", NULL, NULL, 0, G_MAXUINT, 0,
+                        G_PARAM_READWRITE));
+
+  object_class->destroy = xo_canvas_stroke_destroy;
+
+  item_class->update = xo_canvas_stroke_update;
+  item_class->render = xo_canvas_stroke_render;
+  item_class->point = xo_canvas_stroke_point;
+  item_class->bounds = xo_canvas_stroke_bounds;
+}
+
+/* the stroke keeps its own copy of the path and widths, as doubles: the
+   canvas item may be moved by an affine (e.g. while dragging a selection)
+   independently of the journal data */
+
+GnomeCanvasItem *xo_canvas_stroke_new(GnomeCanvasGroup *group,
+      int num_points, const float *coords, const float *widths, guint rgba)
+{
+  GnomeCanvasItem *item;
+  XoCanvasStroke *stroke;
+  int i, n;
+
+  item = gnome_canvas_item_new(group, XO_TYPE_CANVAS_STROKE,
+           "fill-color-rgba", rgba, NULL);
+  stroke = XO_CANVAS_STROKE(item);
+  n = num_points;
+  stroke->coords = g_new(double, 3*n-1);
+  for (i = 0; i < 2*n; i++) stroke->coords[i] = coords[i];
+  stroke->widths = stroke->coords + 2*n;
+  for (i = 0; i < n-1; i++) stroke->widths[i] = widths[i];
+  stroke->num_points = n;
+  gnome_canvas_item_request_update(item);
+  return item;
+}
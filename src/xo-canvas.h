@@ -0,0 +1,38 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* a variable-width stroke, drawn as a single canvas item.
+   properties: "fill-color-rgba" (guint) */
+
+#define XO_TYPE_CANVAS_STROKE (xo_canvas_stroke_get_type())
+#define XO_CANVAS_STROKE(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj), XO_TYPE_CANVAS_STROKE, XoCanvasStroke))
+#define XO_IS_CANVAS_STROKE(obj) (G_TYPE_CHECK_INSTANCE_TYPE((obj), XO_TYPE_CANVAS_STROKE))
+
+typedef struct XoCanvasStroke {
+  GnomeCanvasItem item;
+  int num_points;
+  double *coords;  // 2*num_points, followed by num_points-1 widths
+  double *widths;
+  guint rgba;
+  ArtSVP *svp;     // outline in canvas pixel coordinates
+} XoCanvasStroke;
+
+typedef struct XoCanvasStrokeClass {
+  GnomeCanvasItemClass parent_class;
+} XoCanvasStrokeClass;
+
+GType xo_canvas_stroke_get_type(void);
+GnomeCanvasItem *xo_canvas_stroke_new(GnomeCanvasGroup *group,
+      int num_points, const float *coords, const float *widths, guint rgba);
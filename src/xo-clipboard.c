@@ -27,6 +27,8 @@
 #include "xo-misc.h"
 #include "xo-paint.h"
 #include "xo-image.h"
+#include "xo-path.h"
+#include "xo-arena.h"
 
 // the various formats in which we might present clipboard data
 #define TARGET_XOURNAL 1
@@ -78,8 +80,9 @@ void callback_clipboard_clear(GtkClipboard *clipboard, gpointer user_data)
 void selection_to_clip(void)
 {
   struct XojSelectionData *sel;
-  int bufsz, nitems, val;
+  int bufsz, nitems, val, i;
   char *p;
+  double *pf;
   GList *list;
   struct Item *item;
   GtkTargetList *targetlist;
@@ -144,10 +147,12 @@ void selection_to_clip(void)
     if (item->type == ITEM_STROKE) {
       g_memmove(p, &item->brush, sizeof(struct Brush)); p+= sizeof(struct Brush);
       g_memmove(p, &item->path->num_points, sizeof(int)); p+= sizeof(int);
-      g_memmove(p, item->path->coords, 2*item->path->num_points*sizeof(double));
+      pf = (double *)p;
+      path_get_coords(item->path, pf);
       p+= 2*item->path->num_points*sizeof(double);
       if (item->brush.variable_width) {
-        g_memmove(p, item->widths, (item->path->num_points-1)*sizeof(double));
+        pf = (double *)p;
+        for (i=0; i<item->path->num_points-1; i++) pf[i] = item->path->widths[i];
         p+= (item->path->num_points-1)*sizeof(double);
       }
     }
@@ -241,15 +246,13 @@ void clipboard_paste_from_xournal(GtkSelectionData *sel_data)
   make_dashed(ui.selection->canvas_item);
 
   while (nitems-- > 0) {
-    item = g_new(struct Item, 1);
+    item = arena_new_item(journal.arena);
     ui.selection->items = g_list_append(ui.selection->items, item);
-    ui.cur_layer->items = g_list_append(ui.cur_layer->items, item);
-    ui.cur_layer->nitems++;
     g_memmove(&item->type, p, sizeof(int)); p+= sizeof(int);
     if (item->type == ITEM_STROKE) {
       g_memmove(&item->brush, p, sizeof(struct Brush)); p+= sizeof(struct Brush);
       g_memmove(&npts, p, sizeof(int)); p+= sizeof(int);
-      item->path = gnome_canvas_points_new(npts);
+      item->path = path_new(journal.arena, npts, item->brush.variable_width);
       pf = (double *)p;
       for (i=0; i<npts; i++) {
         item->path->coords[2*i] = pf[2*i] + hoffset;
@@ -257,10 +260,10 @@ void clipboard_paste_from_xournal(GtkSelectionData *sel_data)
       }
       p+= 2*item->path->num_points*sizeof(double);
       if (item->brush.variable_width) {
-        item->widths = g_memdup(p, (item->path->num_points-1)*sizeof(double));
+        pf = (double *)p;
+        for (i=0; i<npts-1; i++) item->path->widths[i] = pf[i];
         p+= (item->path->num_points-1)*sizeof(double);
       }
-      else item->widths = NULL;
       update_item_bbox(item);
       make_canvas_item_one(ui.cur_layer->group, item);
     }
@@ -298,6 +301,7 @@ void clipboard_paste_from_xournal(GtkSelectionData *sel_data)
       }
       make_canvas_item_one(ui.cur_layer->group, item);
     }
+    layer_append_item(ui.cur_layer, item); // now that its bbox is known
   }
 
   prepare_new_undo();
@@ -329,10 +333,9 @@ void clipboard_paste_text(gchar *text)
   ui.selection->layer = ui.cur_layer;
   ui.selection->items = NULL;
 
-  item = g_new(struct Item, 1);
+  item = arena_new_item(journal.arena);
   ui.selection->items = g_list_append(ui.selection->items, item);
-  ui.cur_layer->items = g_list_append(ui.cur_layer->items, item);
-  ui.cur_layer->nitems++;
+  layer_append_item(ui.cur_layer, item);
   item->type = ITEM_TEXT;
   g_memmove(&(item->brush), &(ui.brushes[ui.cur_mapping][TOOL_PEN]), sizeof(struct Brush));
   item->text = text; // text was newly allocated, we keep it
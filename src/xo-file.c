@@ -18,6 +18,7 @@
 #endif
 
 #include <signal.h>
+#include <unistd.h>
 #include <memory.h>
 #include <string.h>
 #include <stdio.h>
@@ -44,6 +45,10 @@
 #include "xo-file.h"
 #include "xo-paint.h"
 #include "xo-image.h"
+#include "xo-print.h"
+#include "xo-pages.h"
+#include "xo-path.h"
+#include "xo-arena.h"
 
 const char *tool_names[NUM_TOOLS] = {"pen", "eraser", "highlighter", "text", "selectregion", "selectrect", "vertspace", "hand", "image"};
 const char *color_names[COLOR_MAX] = {"black", "blue", "red", "green",
@@ -60,8 +65,10 @@ int PDFTOPPM_PRINTING_DPI, GS_BITMAP_DPI;
 
 void new_journal(void)
 {
+  journal.arena = arena_new();
   journal.npages = 1;
   journal.pages = g_list_append(NULL, new_page(&ui.default_page));
+  invalidate_page_table();
   journal.last_attach_no = 0;
   ui.pageno = 0;
   ui.layerno = 0;
@@ -128,6 +135,123 @@ GdkPixbuf *read_pixbuf(const gchar *base64_str, gsize base64_strlen)
   return pixbuf;
 }
 
+/* format a number the way printf("%.2f") would, without going through
+   the printf machinery; returns the number of characters written.
+   buf must have room for at least FIXED2_MAXLEN bytes. Values that are
+   too large or too close to a rounding tie are handed to g_snprintf(),
+   so the output is always identical to "%.2f" in the C locale, except
+   for huge values (and nan, inf), whose "%.2f" might not fit in buf:
+   those are written with "%g" instead. */
+
+int fixed2_to_ascii(char *buf, double x)
+{
+  double r, frac;
+  guint64 n;
+  char digits[24];
+  int nd, len;
+
+  if (!(fabs(x) < 1e7)) { // also catches nan and inf
+    if (fabs(x) < 1e20) return g_snprintf(buf, FIXED2_MAXLEN, "%.2f", x);
+    return g_snprintf(buf, FIXED2_MAXLEN, "%g", x);
+  }
+  r = fabs(x)*100.;
+  frac = r - floor(r);
+  if (fabs(frac-0.5) < 1e-6)
+    return g_snprintf(buf, FIXED2_MAXLEN, "%.2f", x);
+  n = (guint64)(r+0.5);
+
+  len = 0;
+  if (signbit(x)) buf[len++] = '-';
+  nd = 0;
+  do { digits[nd++] = '0' + n%10; n /= 10; } while (n>0 || nd<3);
+  while (nd>2) buf[len++] = digits[--nd];
+  buf[len++] = '.';
+  buf[len++] = digits[1];
+  buf[len++] = digits[0];
+  buf[len] = 0;
+  return len;
+}
+
+/* output buffer for save_journal(): stroke data is accumulated here
+   and handed to zlib in large blocks rather than one number at a time */
+
+#define XOJ_WRITEBUF_SIZE 65536
+
+struct XojWriter {
+  gzFile f;
+  char buf[XOJ_WRITEBUF_SIZE];
+  int len;
+  gboolean error;
+};
+
+static void xojw_flush(struct XojWriter *w)
+{
+  if (w->len == 0) return;
+  if (gzwrite(w->f, w->buf, w->len) != w->len) w->error = TRUE;
+  w->len = 0;
+}
+
+static void xojw_reserve(struct XojWriter *w, int n)
+{
+  if (w->len + n > XOJ_WRITEBUF_SIZE) xojw_flush(w);
+}
+
+static void xojw_puts(struct XojWriter *w, const char *s)
+{
+  int n = strlen(s);
+
+  if (n > XOJ_WRITEBUF_SIZE/2) {
+    xojw_flush(w);
+    if (gzwrite(w->f, s, n) != n) w->error = TRUE;
+    return;
+  }
+  xojw_reserve(w, n);
+  memcpy(w->buf + w->len, s, n);
+  w->len += n;
+}
+
+static void xojw_putc(struct XojWriter *w, char c)
+{
+  xojw_reserve(w, 1);
+  w->buf[w->len++] = c;
+}
+
+static void xojw_double(struct XojWriter *w, double x)
+{
+  xojw_reserve(w, FIXED2_MAXLEN);
+  w->len += fixed2_to_ascii(w->buf + w->len, x);
+}
+
+static void xojw_stroke(struct XojWriter *w, struct Item *item)
+{
+  char tmp[16];
+  float *pt;
+  int i;
+
+  xojw_puts(w, "<stroke tool=\"");
+  xojw_puts(w, tool_names[item->brush.tool_type]);
+  xojw_puts(w, "\" color=\"");
+  if (item->brush.color_no >= 0)
+    xojw_puts(w, color_names[item->brush.color_no]);
+  else {
+    g_snprintf(tmp, 16, "#%08x", item->brush.color_rgba);
+    xojw_puts(w, tmp);
+  }
+  xojw_puts(w, "\" width=\"");
+  xojw_double(w, item->brush.thickness);
+  if (item->brush.variable_width)
+    for (i=0;i<item->path->num_points-1;i++) {
+      xojw_putc(w, ' ');
+      xojw_double(w, item->path->widths[i]);
+    }
+  xojw_puts(w, "\">\n");
+  for (i=0, pt=item->path->coords; i<2*item->path->num_points; i++, pt++) {
+    xojw_double(w, *pt);
+    xojw_putc(w, ' ');
+  }
+  xojw_puts(w, "\n</stroke>\n");
+}
+
 // saves the journal to a file: returns true on success, false on error
 
 gboolean save_journal(const char *filename)
@@ -138,20 +262,26 @@ gboolean save_journal(const char *filename)
   struct Item *item;
   int i, is_clone;
   char *tmpfn, *tmpstr;
-  gboolean success;
+  gboolean success, bg_written;
   FILE *tmpf;
   GList *pagelist, *layerlist, *itemlist, *list;
   GtkWidget *dialog;
+  struct XojWriter *w;
   
   f = gzopen(filename, "wb");
   if (f==NULL) return FALSE;
   chk_attach_names();
+  w = g_new(struct XojWriter, 1);
+  w->f = f;
+  w->len = 0;
+  w->error = FALSE;
 
   setlocale(LC_NUMERIC, "C");
   
   gzprintf(f, "<?xml version=\"1.0\" standalone=\"no\"?>\n"
      "<xournal version=\"" VERSION "\">\n"
      "<title>Xournal document - see http://math.mit.edu/~auroux/software/xournal/</title>\n");
+  success = TRUE;
   for (pagelist = journal.pages; pagelist!=NULL; pagelist = pagelist->next) {
     pg = (struct Page *)pagelist->data;
     gzprintf(f, "<page width=\"%.2f\" height=\"%.2f\">\n", pg->width, pg->height);
@@ -200,15 +330,15 @@ gboolean save_journal(const char *filename)
       if (!is_clone) {
         if (pg->bg->file_domain == DOMAIN_ATTACH) {
           tmpfn = g_strdup_printf("%s.%s", filename, pg->bg->filename->s);
-          success = FALSE;
+          bg_written = FALSE;
           if (bgpdf.status != STATUS_NOT_INIT && bgpdf.file_contents != NULL)
           {
             tmpf = fopen(tmpfn, "wb");
             if (tmpf != NULL && fwrite(bgpdf.file_contents, 1, bgpdf.file_length, tmpf) == bgpdf.file_length)
-              success = TRUE;
+              bg_written = TRUE;
             fclose(tmpf);
           }
-          if (!success) {
+          if (!bg_written) {
             dialog = gtk_message_dialog_new(GTK_WINDOW(winMain), GTK_DIALOG_MODAL,
               GTK_MESSAGE_ERROR, GTK_BUTTONS_OK, 
               _("Could not write background '%s'. Continuing anyway."), tmpfn);
@@ -231,21 +361,10 @@ gboolean save_journal(const char *filename)
       for (itemlist = layer->items; itemlist!=NULL; itemlist = itemlist->next) {
         item = (struct Item *)itemlist->data;
         if (item->type == ITEM_STROKE) {
-          gzprintf(f, "<stroke tool=\"%s\" color=\"", 
-                          tool_names[item->brush.tool_type]);
-          if (item->brush.color_no >= 0)
-            gzputs(f, color_names[item->brush.color_no]);
-          else
-            gzprintf(f, "#%08x", item->brush.color_rgba);
-          gzprintf(f, "\" width=\"%.2f", item->brush.thickness);
-          if (item->brush.variable_width)
-            for (i=0;i<item->path->num_points-1;i++)
-              gzprintf(f, " %.2f", item->widths[i]);
-          gzprintf(f, "\">\n");
-          for (i=0;i<2*item->path->num_points;i++)
-            gzprintf(f, "%.2f ", item->path->coords[i]);
-          gzprintf(f, "\n</stroke>\n");
+          xojw_stroke(w, item);
+          continue;
         }
+        xojw_flush(w); // the other item types write to f directly
         if (item->type == ITEM_TEXT) {
           tmpstr = g_markup_escape_text(item->font_name, -1);
           gzprintf(f, "<text font=\"%s\" size=\"%.2f\" x=\"%.2f\" y=\"%.2f\" color=\"",
@@ -268,15 +387,18 @@ gboolean save_journal(const char *filename)
           gzprintf(f, "</image>\n");
         }
       }
+      xojw_flush(w);
       gzprintf(f, "</layer>\n");
     }
     gzprintf(f, "</page>\n");
   }
   gzprintf(f, "</xournal>\n");
-  gzclose(f);
+  success = success && !w->error;
+  g_free(w);
+  if (gzclose(f) != Z_OK) success = FALSE; // the last of the deflated data
   setlocale(LC_NUMERIC, "");
 
-  return TRUE;
+  return success;
 }
 
 // closes a journal: returns true on success, false on abort
@@ -293,6 +415,7 @@ gboolean close_journal(void)
 
   shutdown_bgpdf();
   delete_journal(&journal);
+  invalidate_page_table();
   
   return TRUE;
   /* note: various members of ui and journal are now in invalid states,
@@ -302,78 +425,258 @@ gboolean close_journal(void)
 // sanitize a string containing floats, in case it may have , instead of .
 // also replace Windows-produced 1.#J by inf
 
-void cleanup_numeric(char *s)
+void cleanup_numeric_len(char *s, gsize len)
 {
-  while (*s!=0) { 
+  while (len>0 && *s!=0) { 
     if (*s==',') *s='.'; 
-    if (*s=='1' && s[1]=='.' && s[2]=='#' && s[3]=='J') 
+    if (len>=4 && *s=='1' && s[1]=='.' && s[2]=='#' && s[3]=='J') 
       { *s='i'; s[1]='n'; s[2]='f'; s[3]=' '; }
-    s++; 
+    s++; len--;
   }
 }
 
+void cleanup_numeric(char *s)
+{
+  cleanup_numeric_len(s, strlen(s));
+}
+
 // the XML parser functions for open_journal()
 
-struct Journal tmpJournal;
-struct Page *tmpPage;
-struct Layer *tmpLayer;
-struct Item *tmpItem;
-char *tmpFilename;
-struct Background *tmpBg_pdf;
+/* the parser state. open_journal() may run several parsers at once (one
+   per page, in worker threads), so everything the callbacks touch lives
+   here rather than in globals. A worker parses a single <page> and only
+   records the <background> attributes; those are interpreted later on
+   the main thread, since they can refer to earlier pages, load files
+   and pop up dialogs. */
+
+struct XojParseState {
+  struct Journal journal;
+  struct Page *page;
+  struct Layer *layer;
+  struct Item *item;
+  char *filename;
+  struct Background *bg_pdf;
+  double *coords, *widths; // scratch space for stroke data
+  int coords_alloc, widths_alloc;
+  int num_points; // expected number of points of a variable-width stroke
+  gboolean defer_bg;
+  gchar **bg_names, **bg_values; // saved <background> attributes
+};
+
+static void xoj_parse_state_init(struct XojParseState *st, char *filename)
+{
+  memset(st, 0, sizeof(struct XojParseState));
+  st->filename = filename;
+  st->journal.arena = arena_new();
+}
+
+static void xoj_parse_state_clear(struct XojParseState *st)
+{
+  g_free(st->coords);
+  g_free(st->widths);
+  g_strfreev(st->bg_names);
+  g_strfreev(st->bg_values);
+  st->coords = st->widths = NULL;
+  st->bg_names = st->bg_values = NULL;
+}
+
+static void xoj_realloc_coords(struct XojParseState *st, int n)
+{
+  if (n <= st->coords_alloc) return;
+  st->coords_alloc = n+100;
+  st->coords = g_realloc(st->coords, 2*(n+100)*sizeof(double));
+}
+
+static void xoj_realloc_widths(struct XojParseState *st, int n)
+{
+  if (n <= st->widths_alloc) return;
+  st->widths_alloc = n+100;
+  st->widths = g_realloc(st->widths, (n+100)*sizeof(double));
+}
 
 GError *xoj_invalid(void)
 {
   return g_error_new(G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT, _("Invalid file contents"));
 }
 
+// the <background> element, for the page st->page
+
+void xoj_parse_background(struct XojParseState *st, const gchar **attribute_names,
+   const gchar **attribute_values, GError **error)
+{
+  int has_attr, i;
+  char *ptr;
+  struct Background *tmpbg;
+  char *tmpbg_filename;
+  GtkWidget *dialog;
+
+  has_attr = 0;
+  while (*attribute_names!=NULL) {
+    if (!strcmp(*attribute_names, "type")) {
+      if (has_attr) *error = xoj_invalid();
+      for (i=0; i<3; i++)
+        if (!strcmp(*attribute_values, bgtype_names[i]))
+          st->page->bg->type = i;
+      if (st->page->bg->type < 0) *error = xoj_invalid();
+      has_attr |= 1;
+      if (st->page->bg->type == BG_PDF) {
+        if (st->bg_pdf == NULL) st->bg_pdf = st->page->bg;
+        else {
+          has_attr |= 24;
+          st->page->bg->filename = refstring_ref(st->bg_pdf->filename);
+          st->page->bg->file_domain = st->bg_pdf->file_domain;
+        }
+      }
+    }
+    else if (!strcmp(*attribute_names, "color")) {
+      if (st->page->bg->type != BG_SOLID) *error = xoj_invalid();
+      if (has_attr & 2) *error = xoj_invalid();
+      st->page->bg->color_no = COLOR_OTHER;
+      for (i=0; i<COLOR_MAX; i++)
+        if (!strcmp(*attribute_values, bgcolor_names[i])) {
+          st->page->bg->color_no = i;
+          st->page->bg->color_rgba = predef_bgcolors_rgba[i];
+        }
+      // there's also the case of hex (#rrggbbaa) colors
+      if (st->page->bg->color_no == COLOR_OTHER && **attribute_values == '#') {
+        st->page->bg->color_rgba = strtoul(*attribute_values + 1, &ptr, 16);
+        if (*ptr!=0) *error = xoj_invalid();
+      }
+      has_attr |= 2;
+    }
+    else if (!strcmp(*attribute_names, "style")) {
+      if (st->page->bg->type != BG_SOLID) *error = xoj_invalid();
+      if (has_attr & 4) *error = xoj_invalid();
+      st->page->bg->ruling = -1;
+      for (i=0; i<4; i++)
+        if (!strcmp(*attribute_values, bgstyle_names[i]))
+          st->page->bg->ruling = i;
+      if (st->page->bg->ruling < 0) *error = xoj_invalid();
+      has_attr |= 4;
+    }
+    else if (!strcmp(*attribute_names, "domain")) {
+      if (st->page->bg->type <= BG_SOLID || (has_attr & 8))
+        { *error = xoj_invalid(); return; }
+      st->page->bg->file_domain = -1;
+      for (i=0; i<3; i++)
+        if (!strcmp(*attribute_values, file_domain_names[i]))
+          st->page->bg->file_domain = i;
+      if (st->page->bg->file_domain < 0)
+        { *error = xoj_invalid(); return; }
+      has_attr |= 8;
+    }
+    else if (!strcmp(*attribute_names, "filename")) {
+      if (st->page->bg->type <= BG_SOLID || (has_attr != 9)) 
+        { *error = xoj_invalid(); return; }
+      if (st->page->bg->file_domain == DOMAIN_CLONE) {
+        // filename is a page number
+        i = strtol(*attribute_values, &ptr, 10);
+        if (ptr == *attribute_values || i < 0 || i > st->journal.npages-2)
+          { *error = xoj_invalid(); return; }
+        tmpbg = ((struct Page *)g_list_nth_data(st->journal.pages, i))->bg;
+        if (tmpbg->type != st->page->bg->type)
+          { *error = xoj_invalid(); return; }
+        st->page->bg->filename = refstring_ref(tmpbg->filename);
+        st->page->bg->pixbuf = tmpbg->pixbuf;
+        if (tmpbg->pixbuf!=NULL) g_object_ref(tmpbg->pixbuf);
+        st->page->bg->file_domain = tmpbg->file_domain;
+      }
+      else {
+        st->page->bg->filename = new_refstring(*attribute_values);
+        if (st->page->bg->type == BG_PIXMAP) {
+          if (st->page->bg->file_domain == DOMAIN_ATTACH) {
+            tmpbg_filename = g_strdup_printf("%s.%s", st->filename, *attribute_values);
+            if (sscanf(*attribute_values, "bg_%d.png", &i) == 1)
+              if (i > st->journal.last_attach_no) 
+                st->journal.last_attach_no = i;
+          }
+          else tmpbg_filename = g_strdup(*attribute_values);
+          st->page->bg->pixbuf = gdk_pixbuf_new_from_file(tmpbg_filename, NULL);
+          if (st->page->bg->pixbuf == NULL) {
+            if (ui.headless)
+              g_printerr(_("Could not open background '%s'. Setting background to white.\n"),
+                tmpbg_filename);
+            else {
+              dialog = gtk_message_dialog_new(GTK_WINDOW(winMain), GTK_DIALOG_MODAL,
+                GTK_MESSAGE_WARNING, GTK_BUTTONS_OK, 
+                _("Could not open background '%s'. Setting background to white."),
+                tmpbg_filename);
+              gtk_dialog_run(GTK_DIALOG(dialog));
+              gtk_widget_destroy(dialog);
+            }
+            st->page->bg->pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, 1, 1);
+            gdk_pixbuf_fill(st->page->bg->pixbuf, 0xffffffff); // solid white
+          }
+          g_free(tmpbg_filename);
+        }
+      }
+      has_attr |= 16;
+    }
+    else if (!strcmp(*attribute_names, "pageno")) {
+      if (st->page->bg->type != BG_PDF || (has_attr & 32))
+        { *error = xoj_invalid(); return; }
+      st->page->bg->file_page_seq = strtol(*attribute_values, &ptr, 10);
+      if (ptr == *attribute_values) *error = xoj_invalid();
+      has_attr |= 32;
+    }
+    else *error = xoj_invalid();
+    attribute_names++;
+    attribute_values++;
+  }
+  if (st->page->bg->type < 0) *error = xoj_invalid();
+  if (st->page->bg->type == BG_SOLID && has_attr != 7) *error = xoj_invalid();
+  if (st->page->bg->type == BG_PIXMAP && has_attr != 25) *error = xoj_invalid();
+  if (st->page->bg->type == BG_PDF && has_attr != 57) *error = xoj_invalid();
+}
+
 void xoj_parser_start_element(GMarkupParseContext *context,
    const gchar *element_name, const gchar **attribute_names, 
    const gchar **attribute_values, gpointer user_data, GError **error)
 {
+  struct XojParseState *st = (struct XojParseState *)user_data;
   int has_attr, i;
   char *ptr, *tmpptr;
-  struct Background *tmpbg;
-  char *tmpbg_filename;
   gdouble val;
-  GtkWidget *dialog;
   
   if (!strcmp(element_name, "title") || !strcmp(element_name, "xournal")) {
-    if (tmpPage != NULL) {
+    if (st->page != NULL) {
       *error = xoj_invalid();
       return;
     }
     // nothing special to do
   }
   else if (!strcmp(element_name, "page")) { // start of a page
-    if (tmpPage != NULL) {
+    if (st->page != NULL) {
       *error = xoj_invalid();
       return;
     }
-    tmpPage = (struct Page *)g_malloc(sizeof(struct Page));
-    tmpPage->layers = NULL;
-    tmpPage->nlayers = 0;
-    tmpPage->group = NULL;
-    tmpPage->bg = g_new(struct Background, 1);
-    tmpPage->bg->type = -1;
-    tmpPage->bg->canvas_item = NULL;
-    tmpPage->bg->pixbuf = NULL;
-    tmpPage->bg->filename = NULL;
-    tmpJournal.pages = g_list_append(tmpJournal.pages, tmpPage);
-    tmpJournal.npages++;
+    st->page = (struct Page *)g_malloc(sizeof(struct Page));
+    st->page->layers = NULL;
+    st->page->nlayers = 0;
+    st->page->group = NULL;
+    st->page->items_unmapped = FALSE;
+    st->page->pdf_cache = NULL;
+    st->page->bg = g_new(struct Background, 1);
+    st->page->bg->type = -1;
+    st->page->bg->canvas_item = NULL;
+    st->page->bg->pixbuf = NULL;
+    st->page->bg->filename = NULL;
+    st->journal.pages = g_list_append(st->journal.pages, st->page);
+    st->journal.npages++;
     // scan for height and width attributes
     has_attr = 0;
     while (*attribute_names!=NULL) {
       if (!strcmp(*attribute_names, "width")) {
         if (has_attr & 1) *error = xoj_invalid();
         cleanup_numeric((gchar *)*attribute_values);
-        tmpPage->width = g_ascii_strtod(*attribute_values, &ptr);
+        st->page->width = g_ascii_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 1;
       }
       else if (!strcmp(*attribute_names, "height")) {
         if (has_attr & 2) *error = xoj_invalid();
         cleanup_numeric((gchar *)*attribute_values);
-        tmpPage->height = g_ascii_strtod(*attribute_values, &ptr);
+        st->page->height = g_ascii_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 2;
       }
@@ -384,194 +687,83 @@ void xoj_parser_start_element(GMarkupParseContext *context,
     if (has_attr!=3) *error = xoj_invalid();
   }
   else if (!strcmp(element_name, "background")) {
-    if (tmpPage == NULL || tmpLayer !=NULL || tmpPage->bg->type >= 0) {
+    if (st->page == NULL || st->layer !=NULL || st->page->bg->type >= 0 ||
+        st->bg_names != NULL) {
       *error = xoj_invalid();
       return;
     }
-    has_attr = 0;
-    while (*attribute_names!=NULL) {
-      if (!strcmp(*attribute_names, "type")) {
-        if (has_attr) *error = xoj_invalid();
-        for (i=0; i<3; i++)
-          if (!strcmp(*attribute_values, bgtype_names[i]))
-            tmpPage->bg->type = i;
-        if (tmpPage->bg->type < 0) *error = xoj_invalid();
-        has_attr |= 1;
-        if (tmpPage->bg->type == BG_PDF) {
-          if (tmpBg_pdf == NULL) tmpBg_pdf = tmpPage->bg;
-          else {
-            has_attr |= 24;
-            tmpPage->bg->filename = refstring_ref(tmpBg_pdf->filename);
-            tmpPage->bg->file_domain = tmpBg_pdf->file_domain;
-          }
-        }
-      }
-      else if (!strcmp(*attribute_names, "color")) {
-        if (tmpPage->bg->type != BG_SOLID) *error = xoj_invalid();
-        if (has_attr & 2) *error = xoj_invalid();
-        tmpPage->bg->color_no = COLOR_OTHER;
-        for (i=0; i<COLOR_MAX; i++)
-          if (!strcmp(*attribute_values, bgcolor_names[i])) {
-            tmpPage->bg->color_no = i;
-            tmpPage->bg->color_rgba = predef_bgcolors_rgba[i];
-          }
-        // there's also the case of hex (#rrggbbaa) colors
-        if (tmpPage->bg->color_no == COLOR_OTHER && **attribute_values == '#') {
-          tmpPage->bg->color_rgba = strtoul(*attribute_values + 1, &ptr, 16);
-          if (*ptr!=0) *error = xoj_invalid();
-        }
-        has_attr |= 2;
-      }
-      else if (!strcmp(*attribute_names, "style")) {
-        if (tmpPage->bg->type != BG_SOLID) *error = xoj_invalid();
-        if (has_attr & 4) *error = xoj_invalid();
-        tmpPage->bg->ruling = -1;
-        for (i=0; i<4; i++)
-          if (!strcmp(*attribute_values, bgstyle_names[i]))
-            tmpPage->bg->ruling = i;
-        if (tmpPage->bg->ruling < 0) *error = xoj_invalid();
-        has_attr |= 4;
-      }
-      else if (!strcmp(*attribute_names, "domain")) {
-        if (tmpPage->bg->type <= BG_SOLID || (has_attr & 8))
-          { *error = xoj_invalid(); return; }
-        tmpPage->bg->file_domain = -1;
-        for (i=0; i<3; i++)
-          if (!strcmp(*attribute_values, file_domain_names[i]))
-            tmpPage->bg->file_domain = i;
-        if (tmpPage->bg->file_domain < 0)
-          { *error = xoj_invalid(); return; }
-        has_attr |= 8;
-      }
-      else if (!strcmp(*attribute_names, "filename")) {
-        if (tmpPage->bg->type <= BG_SOLID || (has_attr != 9)) 
-          { *error = xoj_invalid(); return; }
-        if (tmpPage->bg->file_domain == DOMAIN_CLONE) {
-          // filename is a page number
-          i = strtol(*attribute_values, &ptr, 10);
-          if (ptr == *attribute_values || i < 0 || i > tmpJournal.npages-2)
-            { *error = xoj_invalid(); return; }
-          tmpbg = ((struct Page *)g_list_nth_data(tmpJournal.pages, i))->bg;
-          if (tmpbg->type != tmpPage->bg->type)
-            { *error = xoj_invalid(); return; }
-          tmpPage->bg->filename = refstring_ref(tmpbg->filename);
-          tmpPage->bg->pixbuf = tmpbg->pixbuf;
-          if (tmpbg->pixbuf!=NULL) g_object_ref(tmpbg->pixbuf);
-          tmpPage->bg->file_domain = tmpbg->file_domain;
-        }
-        else {
-          tmpPage->bg->filename = new_refstring(*attribute_values);
-          if (tmpPage->bg->type == BG_PIXMAP) {
-            if (tmpPage->bg->file_domain == DOMAIN_ATTACH) {
-              tmpbg_filename = g_strdup_printf("%s.%s", tmpFilename, *attribute_values);
-              if (sscanf(*attribute_values, "bg_%d.png", &i) == 1)
-                if (i > tmpJournal.last_attach_no) 
-                  tmpJournal.last_attach_no = i;
-            }
-            else tmpbg_filename = g_strdup(*attribute_values);
-            tmpPage->bg->pixbuf = gdk_pixbuf_new_from_file(tmpbg_filename, NULL);
-            if (tmpPage->bg->pixbuf == NULL) {
-              dialog = gtk_message_dialog_new(GTK_WINDOW(winMain), GTK_DIALOG_MODAL,
-                GTK_MESSAGE_WARNING, GTK_BUTTONS_OK, 
-                _("Could not open background '%s'. Setting background to white."),
-                tmpbg_filename);
-              gtk_dialog_run(GTK_DIALOG(dialog));
-              gtk_widget_destroy(dialog);
-              tmpPage->bg->pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, 1, 1);
-              gdk_pixbuf_fill(tmpPage->bg->pixbuf, 0xffffffff); // solid white
-            }
-            g_free(tmpbg_filename);
-          }
-        }
-        has_attr |= 16;
-      }
-      else if (!strcmp(*attribute_names, "pageno")) {
-        if (tmpPage->bg->type != BG_PDF || (has_attr & 32))
-          { *error = xoj_invalid(); return; }
-        tmpPage->bg->file_page_seq = strtol(*attribute_values, &ptr, 10);
-        if (ptr == *attribute_values) *error = xoj_invalid();
-        has_attr |= 32;
-      }
-      else *error = xoj_invalid();
-      attribute_names++;
-      attribute_values++;
+    if (st->defer_bg) {
+      st->bg_names = g_strdupv((gchar **)attribute_names);
+      st->bg_values = g_strdupv((gchar **)attribute_values);
     }
-    if (tmpPage->bg->type < 0) *error = xoj_invalid();
-    if (tmpPage->bg->type == BG_SOLID && has_attr != 7) *error = xoj_invalid();
-    if (tmpPage->bg->type == BG_PIXMAP && has_attr != 25) *error = xoj_invalid();
-    if (tmpPage->bg->type == BG_PDF && has_attr != 57) *error = xoj_invalid();
+    else xoj_parse_background(st, attribute_names, attribute_values, error);
   }
   else if (!strcmp(element_name, "layer")) { // start of a layer
-    if (tmpPage == NULL || tmpLayer != NULL) {
+    if (st->page == NULL || st->layer != NULL) {
       *error = xoj_invalid();
       return;
     }
-    tmpLayer = (struct Layer *)g_malloc(sizeof(struct Layer));
-    tmpLayer->items = NULL;
-    tmpLayer->nitems = 0;
-    tmpLayer->group = NULL;
-    tmpPage->layers = g_list_append(tmpPage->layers, tmpLayer);
-    tmpPage->nlayers++;
+    st->layer = (struct Layer *)g_malloc(sizeof(struct Layer));
+    st->layer->items = st->layer->items_tail = NULL;
+    st->layer->nitems = 0;
+    st->layer->group = NULL;
+    st->layer->index = NULL;
+    st->page->layers = g_list_append(st->page->layers, st->layer);
+    st->page->nlayers++;
   }
   else if (!strcmp(element_name, "stroke")) { // start of a stroke
-    if (tmpLayer == NULL || tmpItem != NULL) {
+    if (st->layer == NULL || st->item != NULL) {
       *error = xoj_invalid();
       return;
     }
-    tmpItem = (struct Item *)g_malloc(sizeof(struct Item));
-    tmpItem->type = ITEM_STROKE;
-    tmpItem->path = NULL;
-    tmpItem->canvas_item = NULL;
-    tmpItem->widths = NULL;
-    tmpLayer->items = g_list_append(tmpLayer->items, tmpItem);
-    tmpLayer->nitems++;
+    st->item = arena_new_item(st->journal.arena);
+    st->item->type = ITEM_STROKE;
+    st->item->path = NULL;
+    st->item->canvas_item = NULL;
+    layer_append_item(st->layer, st->item);
     // scan for tool, color, and width attributes
     has_attr = 0;
     while (*attribute_names!=NULL) {
       if (!strcmp(*attribute_names, "width")) {
         if (has_attr & 1) *error = xoj_invalid();
         cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->brush.thickness = g_ascii_strtod(*attribute_values, &ptr);
+        st->item->brush.thickness = g_ascii_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         i = 0;
         while (*ptr!=0) {
-          realloc_cur_widths(i+1);
-          ui.cur_widths[i] = g_ascii_strtod(ptr, &tmpptr);
+          xoj_realloc_widths(st, i+1);
+          st->widths[i] = g_ascii_strtod(ptr, &tmpptr);
           if (tmpptr == ptr) break;
           ptr = tmpptr;
           i++;
         }
-        tmpItem->brush.variable_width = (i>0);
-        if (i>0) {
-          tmpItem->brush.variable_width = TRUE;
-          tmpItem->widths = (gdouble *) g_memdup(ui.cur_widths, i*sizeof(gdouble));
-          ui.cur_path.num_points =  i+1;
-        }
+        st->item->brush.variable_width = (i>0);
+        if (i>0) st->num_points = i+1; // the widths stay in st->widths for now
         has_attr |= 1;
       }
       else if (!strcmp(*attribute_names, "color")) {
         if (has_attr & 2) *error = xoj_invalid();
-        tmpItem->brush.color_no = COLOR_OTHER;
+        st->item->brush.color_no = COLOR_OTHER;
         for (i=0; i<COLOR_MAX; i++)
           if (!strcmp(*attribute_values, color_names[i])) {
-            tmpItem->brush.color_no = i;
-            tmpItem->brush.color_rgba = predef_colors_rgba[i];
+            st->item->brush.color_no = i;
+            st->item->brush.color_rgba = predef_colors_rgba[i];
           }
         // there's also the case of hex (#rrggbbaa) colors
-        if (tmpItem->brush.color_no == COLOR_OTHER && **attribute_values == '#') {
-          tmpItem->brush.color_rgba = strtoul(*attribute_values + 1, &ptr, 16);
+        if (st->item->brush.color_no == COLOR_OTHER && **attribute_values == '#') {
+          st->item->brush.color_rgba = strtoul(*attribute_values + 1, &ptr, 16);
           if (*ptr!=0) *error = xoj_invalid();
         }
         has_attr |= 2;
       }
       else if (!strcmp(*attribute_names, "tool")) {
         if (has_attr & 4) *error = xoj_invalid();
-        tmpItem->brush.tool_type = -1;
+        st->item->brush.tool_type = -1;
         for (i=0; i<NUM_STROKE_TOOLS; i++)
           if (!strcmp(*attribute_values, tool_names[i])) {
-            tmpItem->brush.tool_type = i;
+            st->item->brush.tool_type = i;
           }
-        if (tmpItem->brush.tool_type == -1) *error = xoj_invalid();
+        if (st->item->brush.tool_type == -1) *error = xoj_invalid();
         has_attr |= 4;
       }
       else *error = xoj_invalid();
@@ -580,65 +772,64 @@ void xoj_parser_start_element(GMarkupParseContext *context,
     }
     if (has_attr!=7) *error = xoj_invalid();
     // finish filling the brush info
-    tmpItem->brush.thickness_no = 0;  // who cares ?
-    tmpItem->brush.tool_options = 0;  // who cares ?
-    tmpItem->brush.ruler = FALSE;
-    tmpItem->brush.recognizer = FALSE;
-    if (tmpItem->brush.tool_type == TOOL_HIGHLIGHTER) {
-      if (tmpItem->brush.color_no >= 0)
-        tmpItem->brush.color_rgba &= ui.hiliter_alpha_mask;
+    st->item->brush.thickness_no = 0;  // who cares ?
+    st->item->brush.tool_options = 0;  // who cares ?
+    st->item->brush.ruler = FALSE;
+    st->item->brush.recognizer = FALSE;
+    if (st->item->brush.tool_type == TOOL_HIGHLIGHTER) {
+      if (st->item->brush.color_no >= 0)
+        st->item->brush.color_rgba &= ui.hiliter_alpha_mask;
     }
   }
   else if (!strcmp(element_name, "text")) { // start of a text item
-    if (tmpLayer == NULL || tmpItem != NULL) {
+    if (st->layer == NULL || st->item != NULL) {
       *error = xoj_invalid();
       return;
     }
-    tmpItem = (struct Item *)g_malloc0(sizeof(struct Item));
-    tmpItem->type = ITEM_TEXT;
-    tmpItem->canvas_item = NULL;
-    tmpLayer->items = g_list_append(tmpLayer->items, tmpItem);
-    tmpLayer->nitems++;
+    st->item = (struct Item *)arena_alloc0(st->journal.arena, sizeof(struct Item));
+    st->item->type = ITEM_TEXT;
+    st->item->canvas_item = NULL;
+    layer_append_item(st->layer, st->item);
     // scan for font, size, x, y, and color attributes
     has_attr = 0;
     while (*attribute_names!=NULL) {
       if (!strcmp(*attribute_names, "font")) {
         if (has_attr & 1) *error = xoj_invalid();
-        tmpItem->font_name = g_strdup(*attribute_values);
+        st->item->font_name = g_strdup(*attribute_values);
         has_attr |= 1;
       }
       else if (!strcmp(*attribute_names, "size")) {
         if (has_attr & 2) *error = xoj_invalid();
         cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->font_size = g_ascii_strtod(*attribute_values, &ptr);
+        st->item->font_size = g_ascii_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 2;
       }
       else if (!strcmp(*attribute_names, "x")) {
         if (has_attr & 4) *error = xoj_invalid();
         cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->bbox.left = g_ascii_strtod(*attribute_values, &ptr);
+        st->item->bbox.left = g_ascii_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 4;
       }
       else if (!strcmp(*attribute_names, "y")) {
         if (has_attr & 8) *error = xoj_invalid();
         cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->bbox.top = g_ascii_strtod(*attribute_values, &ptr);
+        st->item->bbox.top = g_ascii_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 8;
       }
       else if (!strcmp(*attribute_names, "color")) {
         if (has_attr & 16) *error = xoj_invalid();
-        tmpItem->brush.color_no = COLOR_OTHER;
+        st->item->brush.color_no = COLOR_OTHER;
         for (i=0; i<COLOR_MAX; i++)
           if (!strcmp(*attribute_values, color_names[i])) {
-            tmpItem->brush.color_no = i;
-            tmpItem->brush.color_rgba = predef_colors_rgba[i];
+            st->item->brush.color_no = i;
+            st->item->brush.color_rgba = predef_colors_rgba[i];
           }
         // there's also the case of hex (#rrggbbaa) colors
-        if (tmpItem->brush.color_no == COLOR_OTHER && **attribute_values == '#') {
-          tmpItem->brush.color_rgba = strtoul(*attribute_values + 1, &ptr, 16);
+        if (st->item->brush.color_no == COLOR_OTHER && **attribute_values == '#') {
+          st->item->brush.color_rgba = strtoul(*attribute_values + 1, &ptr, 16);
           if (*ptr!=0) *error = xoj_invalid();
         }
         has_attr |= 16;
@@ -650,46 +841,45 @@ void xoj_parser_start_element(GMarkupParseContext *context,
     if (has_attr!=31) *error = xoj_invalid();
   }
   else if (!strcmp(element_name, "image")) { // start of a image item
-    if (tmpLayer == NULL || tmpItem != NULL) {
+    if (st->layer == NULL || st->item != NULL) {
       *error = xoj_invalid();
       return;
     }
-    tmpItem = (struct Item *)g_malloc0(sizeof(struct Item));
-    tmpItem->type = ITEM_IMAGE;
-    tmpItem->canvas_item = NULL;
-    tmpItem->image=NULL;
-    tmpItem->image_png = NULL;
-    tmpItem->image_png_len = 0;
-    tmpLayer->items = g_list_append(tmpLayer->items, tmpItem);
-    tmpLayer->nitems++;
+    st->item = (struct Item *)arena_alloc0(st->journal.arena, sizeof(struct Item));
+    st->item->type = ITEM_IMAGE;
+    st->item->canvas_item = NULL;
+    st->item->image=NULL;
+    st->item->image_png = NULL;
+    st->item->image_png_len = 0;
+    layer_append_item(st->layer, st->item);
     // scan for x, y
     has_attr = 0;
     while (*attribute_names!=NULL) {
       if (!strcmp(*attribute_names, "left")) {
         if (has_attr & 1) *error = xoj_invalid();
         cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->bbox.left = g_ascii_strtod(*attribute_values, &ptr);
+        st->item->bbox.left = g_ascii_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 1;
       }
       else if (!strcmp(*attribute_names, "top")) {
         if (has_attr & 2) *error = xoj_invalid();
         cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->bbox.top = g_ascii_strtod(*attribute_values, &ptr);
+        st->item->bbox.top = g_ascii_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 2;
       }
       else if (!strcmp(*attribute_names, "right")) {
         if (has_attr & 4) *error = xoj_invalid();
         cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->bbox.right = g_ascii_strtod(*attribute_values, &ptr);
+        st->item->bbox.right = g_ascii_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 4;
       }
       else if (!strcmp(*attribute_names, "bottom")) {
         if (has_attr & 8) *error = xoj_invalid();
         cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->bbox.bottom = g_ascii_strtod(*attribute_values, &ptr);
+        st->item->bbox.bottom = g_ascii_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 8;
       }
@@ -704,82 +894,145 @@ void xoj_parser_start_element(GMarkupParseContext *context,
 void xoj_parser_end_element(GMarkupParseContext *context,
    const gchar *element_name, gpointer user_data, GError **error)
 {
+  struct XojParseState *st = (struct XojParseState *)user_data;
+
   if (!strcmp(element_name, "page")) {
-    if (tmpPage == NULL || tmpLayer != NULL) {
+    if (st->page == NULL || st->layer != NULL) {
       *error = xoj_invalid();
       return;
     }
-    if (tmpPage->nlayers == 0 || tmpPage->bg->type < 0) *error = xoj_invalid();
-    tmpPage = NULL;
+    if (st->page->nlayers == 0 || (st->page->bg->type < 0 && st->bg_names == NULL))
+      *error = xoj_invalid();
+    st->page = NULL;
   }
   if (!strcmp(element_name, "layer")) {
-    if (tmpLayer == NULL || tmpItem != NULL) {
+    if (st->layer == NULL || st->item != NULL) {
       *error = xoj_invalid();
       return;
     }
-    tmpLayer = NULL;
+    st->layer = NULL;
   }
   if (!strcmp(element_name, "stroke")) {
-    if (tmpItem == NULL) {
+    if (st->item == NULL) {
       *error = xoj_invalid();
       return;
     }
-    update_item_bbox(tmpItem);
-    tmpItem = NULL;
+    update_item_bbox(st->item);
+    st->item = NULL;
   }
   if (!strcmp(element_name, "text")) {
-    if (tmpItem == NULL) {
+    if (st->item == NULL) {
       *error = xoj_invalid();
       return;
     }
-    tmpItem = NULL;
+    st->item = NULL;
   }
   if (!strcmp(element_name, "image")) {
-    if (tmpItem == NULL) {
+    if (st->item == NULL) {
       *error = xoj_invalid();
       return;
     }
-    tmpItem = NULL;
+    st->item = NULL;
   }
 }
 
+/* parse the coordinates of a <stroke> into st->coords, returning
+   the number of values read. Numbers of the form [-]ddd.dd, as written by
+   save_journal(), are converted directly: with at most 15 digits the
+   mantissa and the power of ten are exact, so the single division is
+   correctly rounded and matches g_ascii_strtod(). Anything else (exponents,
+   commas, Windows' 1.#J, ...) goes through cleanup_numeric() and
+   g_ascii_strtod() as before. */
+
+static const double pow10_tab[23] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6,
+  1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18,
+  1e19, 1e20, 1e21, 1e22 };
+
+static gboolean parse_simple_decimal(const char *s, const char *end, 
+                                     double *val, const char **endptr)
+{
+  gboolean neg;
+  guint64 m;
+  int ndigits, nfrac;
+
+  neg = FALSE;
+  if (s<end && (*s=='-' || *s=='+')) { neg = (*s=='-'); s++; }
+  m = 0; ndigits = 0; nfrac = 0;
+  while (s<end && *s>='0' && *s<='9') { m = 10*m + (*s-'0'); s++; ndigits++; }
+  if (s<end && *s=='.') {
+    s++;
+    while (s<end && *s>='0' && *s<='9') 
+      { m = 10*m + (*s-'0'); s++; ndigits++; nfrac++; }
+  }
+  if (ndigits == 0 || ndigits > 15) return FALSE;
+  if (s<end && *s!=0 && !g_ascii_isspace(*s)) return FALSE;
+  *val = (double)m / pow10_tab[nfrac];
+  if (neg) *val = -*val;
+  *endptr = s;
+  return TRUE;
+}
+
+int parse_stroke_coords(struct XojParseState *st, gchar *text, gsize text_len)
+{
+  const gchar *p, *end, *ptr;
+  gboolean cleaned;
+  double *coords;
+  int n, count;
+  
+  // pre-size the array from the number of whitespace-separated tokens
+  end = text + text_len;
+  count = 0;
+  for (p = text; p<end; p++)
+    if (!g_ascii_isspace(*p) && (p==text || g_ascii_isspace(p[-1]))) count++;
+  xoj_realloc_coords(st, count/2 + 1);
+
+  cleaned = FALSE;
+  n = 0;
+  p = text;
+  while (p<end) {
+    while (p<end && g_ascii_isspace(*p)) p++;
+    if (p==end || *p==0) break;
+    if (n >= 2*st->coords_alloc) xoj_realloc_coords(st, n/2 + 1);
+    coords = st->coords + n;
+    if (!parse_simple_decimal(p, end, coords, &ptr)) {
+      if (!cleaned) { cleanup_numeric_len((gchar *)p, end-p); cleaned = TRUE; }
+      *coords = g_ascii_strtod(p, (char **)(&ptr));
+      if (ptr == p) break;
+    }
+    if (!finite_sized(*coords)) {
+      if (n>=2) *coords = coords[-2];
+      else *coords = 0;
+    }
+    p = ptr;
+    n++;
+  }
+  return n;
+}
+
 void xoj_parser_text(GMarkupParseContext *context,
    const gchar *text, gsize text_len, gpointer user_data, GError **error)
 {
-  const gchar *element_name, *ptr;
+  struct XojParseState *st = (struct XojParseState *)user_data;
+  const gchar *element_name;
   int n;
   
   element_name = g_markup_parse_context_get_element(context);
   if (element_name == NULL) return;
   if (!strcmp(element_name, "stroke")) {
-    cleanup_numeric((gchar *)text);
-    ptr = text;
-    n = 0;
-    while (text_len > 0) {
-      realloc_cur_path(n/2 + 1);
-      ui.cur_path.coords[n] = g_ascii_strtod(text, (char **)(&ptr));
-      if (ptr == text) break;
-      text_len -= (ptr - text);
-      text = ptr;
-      if (!finite_sized(ui.cur_path.coords[n])) {
-        if (n>=2) ui.cur_path.coords[n] = ui.cur_path.coords[n-2];
-        else ui.cur_path.coords[n] = 0;
-      }
-      n++;
-    }
+    n = parse_stroke_coords(st, (gchar *)text, text_len);
     if (n<4 || n&1 || 
-        (tmpItem->brush.variable_width && (n!=2*ui.cur_path.num_points))) 
+        (st->item->brush.variable_width && (n!=2*st->num_points))) 
       { *error = xoj_invalid(); return; } // wrong number of points
-    tmpItem->path = gnome_canvas_points_new(n/2);
-    g_memmove(tmpItem->path->coords, ui.cur_path.coords, n*sizeof(double));
+    st->item->path = path_new_from_doubles(st->journal.arena, n/2, st->coords,
+        st->item->brush.variable_width ? st->widths : NULL);
   }
   if (!strcmp(element_name, "text")) {
-    tmpItem->text = g_malloc(text_len+1);
-    g_memmove(tmpItem->text, text, text_len);
-    tmpItem->text[text_len]=0;
+    st->item->text = g_malloc(text_len+1);
+    g_memmove(st->item->text, text, text_len);
+    st->item->text[text_len]=0;
   }
   if (!strcmp(element_name, "image")) {
-    tmpItem->image = read_pixbuf(text, text_len);
+    st->item->image = read_pixbuf(text, text_len);
   }
 }
 
@@ -824,31 +1077,215 @@ gboolean user_wants_second_chance(char **filename)
   return TRUE;    
 }
 
-gboolean open_journal(char *filename)
+static const GMarkupParser xoj_parser = { xoj_parser_start_element, 
+                                          xoj_parser_end_element, 
+                                          xoj_parser_text, NULL, NULL};
+
+// parse a whole (uncompressed) journal, or a fragment of one
+
+static gboolean xoj_parse_buffer(struct XojParseState *st, gchar *buf, gsize len)
 {
-  const GMarkupParser parser = { xoj_parser_start_element, 
-                                 xoj_parser_end_element, 
-                                 xoj_parser_text, NULL, NULL};
   GMarkupParseContext *context;
   GError *error;
-  GtkWidget *dialog;
   gboolean valid;
-  gzFile f;
-  char buffer[1000];
-  int len;
-  gchar *tmpfn, *tmpfn2, *p, *q;
-  gboolean maybe_pdf;
+
+  context = g_markup_parse_context_new(&xoj_parser, 0, st, NULL);
+  error = NULL;
+  valid = g_markup_parse_context_parse(context, buf, len, &error);
+  if (valid) valid = g_markup_parse_context_end_parse(context, &error);
+  g_markup_parse_context_free(context);
+  if (error != NULL) g_error_free(error);
+  return valid;
+}
+
+/* parallel loading: the file is cut at each <page> tag and the pages are
+   parsed by a pool of threads, then spliced back in order. Only pages and
+   their contents are built by the workers; backgrounds are interpreted on
+   the main thread, and canvas items are created later as usual. */
+
+#define XOJ_PARALLEL_MIN_PAGES 8
+
+struct XojPageChunk {
+  gchar *start;
+  gsize len;
+  struct XojParseState st;
+  gboolean valid;
+};
+
+int xoj_num_threads(void)
+{
+  long n = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if (n < 1) n = 1;
+  if (n > 32) n = 32;
+  return (int)n;
+}
+
+/* Before 0.24, poppler keeps unprotected global state even across separate
+   documents: then only one thread at a time may render. Creating and
+   destroying documents is always serialized. */
+
+#ifdef POPPLER_CHECK_VERSION
+#if POPPLER_CHECK_VERSION(0,24,0)
+#define XOJ_POPPLER_THREADSAFE
+#endif
+#endif
+
+static GStaticRecMutex xoj_poppler_mutex = G_STATIC_REC_MUTEX_INIT;
+
+void xoj_poppler_lock(gboolean rendering)
+{
+#ifdef XOJ_POPPLER_THREADSAFE
+  if (rendering) return;
+#endif
+  g_static_rec_mutex_lock(&xoj_poppler_mutex);
+}
+
+void xoj_poppler_unlock(gboolean rendering)
+{
+#ifdef XOJ_POPPLER_THREADSAFE
+  if (rendering) return;
+#endif
+  g_static_rec_mutex_unlock(&xoj_poppler_mutex);
+}
+
+static void xoj_parse_chunk(gpointer data, gpointer user_data)
+{
+  struct XojPageChunk *chunk = (struct XojPageChunk *)data;
+
+  xoj_parse_state_init(&chunk->st, (char *)user_data);
+  chunk->st.defer_bg = TRUE;
+  chunk->valid = xoj_parse_buffer(&chunk->st, chunk->start, chunk->len)
+                 && chunk->st.journal.npages == 1;
+}
+
+/* find where the pages start; returns FALSE if the file is too small to
+   bother, or doesn't look like something we can safely cut into pieces
+   (comments and CDATA sections could hide a "<page" string) */
+
+static gboolean xoj_split_pages(gchar *buf, gsize len, GArray *offsets, gsize *epilog)
+{
+  gchar *p, *end;
+  gsize off;
+
+  if (g_strstr_len(buf, len, "<!") != NULL) return FALSE;
+  p = buf;
+  while ((p = g_strstr_len(p, len-(p-buf), "<page")) != NULL) {
+    if (p[5]==' ' || p[5]=='\t' || p[5]=='\n' || p[5]=='\r' || p[5]=='>') {
+      off = p-buf;
+      g_array_append_val(offsets, off);
+    }
+    p += 5;
+  }
+  if (offsets->len < XOJ_PARALLEL_MIN_PAGES) return FALSE;
+  end = g_strrstr_len(buf, len, "</xournal>");
+  if (end == NULL) return FALSE;
+  *epilog = end-buf;
+  return (*epilog > g_array_index(offsets, gsize, offsets->len-1));
+}
+
+static gboolean xoj_parse_parallel(struct XojParseState *st, gchar *buf, gsize len)
+{
+  GArray *offsets;
+  struct XojPageChunk *chunks;
+  GThreadPool *pool;
+  GMarkupParseContext *context;
+  gsize epilog;
+  int i, n, nthreads;
+  gboolean valid;
+  GError *error;
+
+  nthreads = xoj_num_threads();
+  if (nthreads < 2 || !g_thread_supported()) return FALSE;
+  offsets = g_array_new(FALSE, FALSE, sizeof(gsize));
+  if (!xoj_split_pages(buf, len, offsets, &epilog)) {
+    g_array_free(offsets, TRUE);
+    return FALSE;
+  }
+  n = offsets->len;
+  chunks = g_new0(struct XojPageChunk, n);
+  for (i=0; i<n; i++) {
+    chunks[i].start = buf + g_array_index(offsets, gsize, i);
+    chunks[i].len = ((i<n-1) ? g_array_index(offsets, gsize, i+1) : epilog)
+                    - g_array_index(offsets, gsize, i);
+  }
   
-  tmpfn = g_strdup_printf("%s.xoj", filename);
-  if (ui.autoload_pdf_xoj && g_file_test(tmpfn, G_FILE_TEST_EXISTS) &&
-      (g_str_has_suffix(filename, ".pdf") || g_str_has_suffix(filename, ".PDF")))
-  {
-    valid = open_journal(tmpfn);
-    g_free(tmpfn);
-    return valid;
+  pool = g_thread_pool_new(xoj_parse_chunk, st->filename, nthreads, TRUE, NULL);
+  if (pool == NULL) valid = FALSE;
+  else {
+    for (i=0; i<n; i++) g_thread_pool_push(pool, chunks+i, NULL);
+    g_thread_pool_free(pool, FALSE, TRUE); // waits for the workers
+    valid = TRUE;
+    for (i=0; i<n; i++) if (!chunks[i].valid) valid = FALSE;
   }
-  g_free(tmpfn);
 
+  // the surrounding <xournal> and <title> elements
+  if (valid) {
+    context = g_markup_parse_context_new(&xoj_parser, 0, st, NULL);
+    error = NULL;
+    valid = g_markup_parse_context_parse(context, buf, 
+                   g_array_index(offsets, gsize, 0), &error);
+    if (valid) valid = g_markup_parse_context_parse(context, buf+epilog, len-epilog, &error);
+    if (valid) valid = g_markup_parse_context_end_parse(context, &error);
+    g_markup_parse_context_free(context);
+    if (error != NULL) g_error_free(error);
+    if (st->journal.npages != 0) valid = FALSE;
+  }
+
+  if (!valid) { // let the serial parser have the final word
+    for (i=0; i<n; i++) {
+      delete_journal(&chunks[i].st.journal);
+      xoj_parse_state_clear(&chunks[i].st);
+    }
+    g_free(chunks);
+    g_array_free(offsets, TRUE);
+    delete_journal(&st->journal);
+    xoj_parse_state_init(st, st->filename);
+    return FALSE;
+  }
+
+  // splice the pages in order, and set up their backgrounds
+  error = NULL;
+  for (i=0; i<n; i++) {
+    st->page = (struct Page *)chunks[i].st.journal.pages->data;
+    st->journal.pages = g_list_concat(st->journal.pages, chunks[i].st.journal.pages);
+    st->journal.npages++;
+    chunks[i].st.journal.pages = NULL;
+    arena_merge(st->journal.arena, chunks[i].st.journal.arena);
+    chunks[i].st.journal.arena = NULL;
+    if (error == NULL && chunks[i].st.bg_names != NULL)
+      xoj_parse_background(st, (const gchar **)chunks[i].st.bg_names, 
+                           (const gchar **)chunks[i].st.bg_values, &error);
+    xoj_parse_state_clear(&chunks[i].st);
+  }
+  st->page = NULL;
+  if (error != NULL) {
+    g_error_free(error);
+    st->journal.npages = 0; // reject the file
+  }
+  g_free(chunks);
+  g_array_free(offsets, TRUE);
+  return TRUE;
+}
+
+/* read and parse a journal file into j, without creating any canvas
+   items; *bg_pdf is the background of its first PDF page, if any.
+   On failure, *maybe_pdf says whether the file looked like a PDF */
+
+gboolean read_journal(char *filename, struct Journal *j,
+                      struct Background **bg_pdf, gboolean *maybe_pdf)
+{
+  struct XojParseState st;
+  gboolean valid;
+  gzFile f;
+  gchar *buf;
+  gsize len, alloc;
+  int nread;
+
+  *maybe_pdf = FALSE;
+  *bg_pdf = NULL;
   f = gzopen(filename, "rb");
   if (f==NULL) return FALSE;
   if (filename[0]=='/') {
@@ -856,35 +1293,88 @@ gboolean open_journal(char *filename)
     ui.default_path = g_path_get_dirname(filename);
   }
   
-  context = g_markup_parse_context_new(&parser, 0, NULL, NULL);
+  // decompress the whole file at once
+  alloc = 65536;
+  buf = g_malloc(alloc);
+  len = 0;
   valid = TRUE;
-  tmpJournal.npages = 0;
-  tmpJournal.pages = NULL;
-  tmpJournal.last_attach_no = 0;
-  tmpPage = NULL;
-  tmpLayer = NULL;
-  tmpItem = NULL;
-  tmpFilename = filename;
-  error = NULL;
-  tmpBg_pdf = NULL;
-  maybe_pdf = TRUE;
-
-  while (valid && !gzeof(f)) {
-    len = gzread(f, buffer, 1000);
-    if (len<0) valid = FALSE;
-    if (maybe_pdf && len>=4 && !strncmp(buffer, "%PDF", 4))
-      { valid = FALSE; break; } // most likely pdf
-    else maybe_pdf = FALSE;
-    if (len<=0) break;
-    valid = g_markup_parse_context_parse(context, buffer, len, &error);
+  while ((nread = gzread(f, buf+len, MIN(alloc-len-1, 1<<24))) > 0) {
+    len += nread;
+    if (alloc-len-1 < 65536) { alloc *= 2; buf = g_realloc(buf, alloc); }
   }
+  if (nread < 0) valid = FALSE;
+  buf[len] = 0;
   gzclose(f);
-  if (valid) valid = g_markup_parse_context_end_parse(context, &error);
-  if (tmpJournal.npages == 0) valid = FALSE;
-  g_markup_parse_context_free(context);
+  *maybe_pdf = (valid && len>=4 && !strncmp(buf, "%PDF", 4)); // most likely pdf
+  if (*maybe_pdf) valid = FALSE;
+
+  xoj_parse_state_init(&st, filename);
+  if (valid && !xoj_parse_parallel(&st, buf, len))
+    valid = xoj_parse_buffer(&st, buf, len);
+  if (st.journal.npages == 0) valid = FALSE;
+  xoj_parse_state_clear(&st);
+  g_free(buf);
   
   if (!valid) {
-    delete_journal(&tmpJournal);
+    delete_journal(&st.journal);
+    return FALSE;
+  }
+  g_memmove(j, &st.journal, sizeof(struct Journal));
+  *bg_pdf = st.bg_pdf;
+  return TRUE;
+}
+
+/* start the PDF loader for the background of a journal just read by
+   read_journal(). If the file isn't where the journal says, try in the
+   journal's directory. *tmpfn is the name that was tried first. */
+
+gboolean open_journal_bgpdf(char *filename, struct Background *bg_pdf, char **tmpfn)
+{
+  gboolean valid;
+  gchar *tmpfn2, *p, *q;
+
+  if (bg_pdf->file_domain == DOMAIN_ATTACH)
+    *tmpfn = g_strdup_printf("%s.%s", filename, bg_pdf->filename->s);
+  else
+    *tmpfn = g_strdup(bg_pdf->filename->s);
+  valid = init_bgpdf(*tmpfn, FALSE, bg_pdf->file_domain);
+  // if file name is invalid: first try in xoj file's directory
+  if (!valid && bg_pdf->file_domain != DOMAIN_ATTACH) {
+    p = g_path_get_dirname(filename);
+    q = g_path_get_basename(*tmpfn);
+    tmpfn2 = g_strdup_printf("%s/%s", p, q);
+    g_free(p); g_free(q);
+    valid = init_bgpdf(tmpfn2, FALSE, bg_pdf->file_domain);
+    if (valid) {  // change the file name...
+      if (!ui.headless) printf("substituting %s -> %s\n", *tmpfn, tmpfn2);
+      g_free(bg_pdf->filename->s);
+      bg_pdf->filename->s = tmpfn2;
+    }
+    else g_free(tmpfn2);
+  }
+  return valid;
+}
+
+gboolean open_journal(char *filename)
+{
+  struct Journal newj;
+  struct Background *bg_pdf;
+  GtkWidget *dialog;
+  gboolean valid;
+  gchar *tmpfn;
+  gboolean maybe_pdf;
+  
+  tmpfn = g_strdup_printf("%s.xoj", filename);
+  if (ui.autoload_pdf_xoj && g_file_test(tmpfn, G_FILE_TEST_EXISTS) &&
+      (g_str_has_suffix(filename, ".pdf") || g_str_has_suffix(filename, ".PDF")))
+  {
+    valid = open_journal(tmpfn);
+    g_free(tmpfn);
+    return valid;
+  }
+  g_free(tmpfn);
+
+  if (!read_journal(filename, &newj, &bg_pdf, &maybe_pdf)) {
     if (!maybe_pdf) return FALSE;
     // essentially same as on_fileNewBackground from here on
     ui.saved = TRUE;
@@ -899,42 +1389,24 @@ gboolean open_journal(char *filename)
   
   ui.saved = TRUE; // force close_journal() to do its job
   close_journal();
-  g_memmove(&journal, &tmpJournal, sizeof(struct Journal));
+  g_memmove(&journal, &newj, sizeof(struct Journal));
   
   // if we need to initialize a fresh pdf loader
-  if (tmpBg_pdf!=NULL) { 
+  if (bg_pdf!=NULL) { 
     while (bgpdf.status != STATUS_NOT_INIT) gtk_main_iteration();
-    if (tmpBg_pdf->file_domain == DOMAIN_ATTACH)
-      tmpfn = g_strdup_printf("%s.%s", filename, tmpBg_pdf->filename->s);
-    else
-      tmpfn = g_strdup(tmpBg_pdf->filename->s);
-    valid = init_bgpdf(tmpfn, FALSE, tmpBg_pdf->file_domain);
-    // if file name is invalid: first try in xoj file's directory
-    if (!valid && tmpBg_pdf->file_domain != DOMAIN_ATTACH) {
-      p = g_path_get_dirname(filename);
-      q = g_path_get_basename(tmpfn);
-      tmpfn2 = g_strdup_printf("%s/%s", p, q);
-      g_free(p); g_free(q);
-      valid = init_bgpdf(tmpfn2, FALSE, tmpBg_pdf->file_domain);
-      if (valid) {  // change the file name...
-        printf("substituting %s -> %s\n", tmpfn, tmpfn2);
-        g_free(tmpBg_pdf->filename->s);
-        tmpBg_pdf->filename->s = tmpfn2;
-      }
-      else g_free(tmpfn2);
-    }
+    valid = open_journal_bgpdf(filename, bg_pdf, &tmpfn);
     // if file name is invalid: next prompt user
-    if (!valid && tmpBg_pdf->file_domain != DOMAIN_ATTACH)
+    if (!valid && bg_pdf->file_domain != DOMAIN_ATTACH)
       if (user_wants_second_chance(&tmpfn)) {
-        valid = init_bgpdf(tmpfn, FALSE, tmpBg_pdf->file_domain);
+        valid = init_bgpdf(tmpfn, FALSE, bg_pdf->file_domain);
         if (valid) { // change the file name...
-          g_free(tmpBg_pdf->filename->s);
-          tmpBg_pdf->filename->s = g_strdup(tmpfn);
+          g_free(bg_pdf->filename->s);
+          bg_pdf->filename->s = g_strdup(tmpfn);
         }
       }
     if (valid) {
       refstring_unref(bgpdf.filename);
-      bgpdf.filename = refstring_ref(tmpBg_pdf->filename);
+      bgpdf.filename = refstring_ref(bg_pdf->filename);
     } else {
       dialog = gtk_message_dialog_new(GTK_WINDOW(winMain), GTK_DIALOG_MODAL,
         GTK_MESSAGE_ERROR, GTK_BUTTONS_OK, _("Could not open background '%s'."),
@@ -1101,6 +1573,327 @@ struct Background *attempt_screenshot_bg(void)
 
 /************** pdf annotation ***************/
 
+/* PDF pages are rendered by a pool of worker threads, each using its own
+   PopplerDocument (a document can't be shared) opened from the in-memory
+   copy of the file. The main thread keeps the queue of pending requests,
+   hands the most urgent ones (closest to the viewport) to the workers,
+   and installs the results. */
+
+#define BGPDF_MAX_THREADS 4
+
+struct BgPdfRenderer {
+  gint refcount;
+  gchar *data;        // owns the file contents once bgpdf is shut down
+  gsize length;
+  gboolean owns_data;
+  GAsyncQueue *documents; // idle PopplerDocuments, reused by the workers
+};
+
+typedef struct BgPdfJob {
+  struct BgPdfRenderer *renderer;
+  int pageno;
+  double dpi;
+  int tx, ty; // a tile, or the whole page if tx < 0
+  volatile gint cancelled;
+  gboolean failed;
+  GdkPixbuf *pixbuf;
+  int pixel_width, pixel_height;
+} BgPdfJob;
+
+typedef struct BgPdfTileView {
+  int pageno;
+  double dpi;
+  int i0, j0, i1, j1; // the range of tiles wanted on screen
+} BgPdfTileView;
+
+static GThreadPool *bgpdf_pool = NULL;
+static int bgpdf_nthreads = 0;
+static guint bgpdf_tile_serial = 0;
+
+static void bgpdf_renderer_unref(struct BgPdfRenderer *r)
+{
+  PopplerDocument *doc;
+  
+  if (!g_atomic_int_dec_and_test(&r->refcount)) return;
+  xoj_poppler_lock(FALSE);
+  while ((doc = (PopplerDocument *)g_async_queue_try_pop(r->documents)) != NULL)
+    g_object_unref(doc);
+  xoj_poppler_unlock(FALSE);
+  g_async_queue_unref(r->documents);
+  if (r->owns_data) g_free(r->data);
+  g_free(r);
+}
+
+/* the page of a job, and the part of it to render. The document is
+   borrowed from the renderer's queue, and must be given back. */
+
+static PopplerPage *bgpdf_job_page(BgPdfJob *job, PopplerDocument **doc,
+                                   int *x, int *y, int *w, int *h)
+{
+  struct BgPdfRenderer *r = job->renderer;
+  PopplerPage *pdfpage;
+  gdouble width, height;
+
+  *doc = (PopplerDocument *)g_async_queue_try_pop(r->documents);
+  if (*doc == NULL) {
+    xoj_poppler_lock(FALSE);
+    *doc = poppler_document_new_from_data(r->data, r->length, NULL, NULL);
+    xoj_poppler_unlock(FALSE);
+  }
+  pdfpage = (*doc != NULL) ? poppler_document_get_page(*doc, job->pageno-1) : NULL;
+  if (pdfpage == NULL) return NULL;
+  poppler_page_get_size(pdfpage, &width, &height);
+  job->pixel_width = (int) (job->dpi * width/72);
+  job->pixel_height = (int) (job->dpi * height/72);
+  *x = *y = 0;
+  *w = job->pixel_width;
+  *h = job->pixel_height;
+  if (job->tx >= 0) { // just one tile of the page
+    *x = job->tx * PDF_TILE_SIZE;
+    *y = job->ty * PDF_TILE_SIZE;
+    *w = MIN(PDF_TILE_SIZE, *w - *x);
+    *h = MIN(PDF_TILE_SIZE, *h - *y);
+  }
+  return pdfpage;
+}
+
+/* runs in a worker thread: no GTK/GDK calls here! */
+
+static void bgpdf_render_job(gpointer data, gpointer user_data)
+{
+  BgPdfJob *job = (BgPdfJob *)data;
+  PopplerDocument *doc;
+  PopplerPage *pdfpage;
+  int x, y, w, h;
+
+  job->pixbuf = NULL;
+  job->failed = FALSE;
+  if (!g_atomic_int_get(&job->cancelled)) {
+    xoj_poppler_lock(TRUE);
+    pdfpage = bgpdf_job_page(job, &doc, &x, &y, &w, &h);
+    if (pdfpage) {
+      // through a cairo image surface: GDK pixmaps are off limits here
+      if (w > 0 && h > 0) {
+        job->pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, w, h);
+        wrapper_poppler_page_render_to_pixbuf(
+                pdfpage, x, y, w, h, job->dpi/72, 0, job->pixbuf);
+      }
+      g_object_unref(pdfpage);
+    }
+    else job->failed = TRUE;
+    xoj_poppler_unlock(TRUE);
+    if (doc != NULL) g_async_queue_push(job->renderer->documents, doc);
+  }
+  g_idle_add(bgpdf_job_done, job);
+}
+
+/* with ui.poppler_force_cairo, jobs are rendered in the main thread
+   instead, as before: poppler -> cairo -> pixmap -> pixbuf */
+
+static gboolean bgpdf_render_job_pixmap(gpointer data)
+{
+  BgPdfJob *job = (BgPdfJob *)data;
+  PopplerDocument *doc;
+  PopplerPage *pdfpage;
+  GdkPixmap *pixmap;
+  cairo_t *cr;
+  int x, y, w, h;
+
+  job->pixbuf = NULL;
+  job->failed = FALSE;
+  if (!g_atomic_int_get(&job->cancelled)) {
+    xoj_poppler_lock(TRUE);
+    pdfpage = bgpdf_job_page(job, &doc, &x, &y, &w, &h);
+    if (pdfpage) {
+      if (w > 0 && h > 0) {
+        set_cursor_busy(TRUE);
+        pixmap = gdk_pixmap_new(GTK_WIDGET(canvas)->window, w, h, -1);
+        cr = gdk_cairo_create(pixmap);
+        cairo_set_source_rgb(cr, 1., 1., 1.);
+        cairo_paint(cr);
+        cairo_translate(cr, -x, -y);
+        cairo_scale(cr, job->dpi/72, job->dpi/72);
+        poppler_page_render(pdfpage, cr);
+        cairo_destroy(cr);
+        job->pixbuf = gdk_pixbuf_get_from_drawable(NULL, GDK_DRAWABLE(pixmap),
+          NULL, 0, 0, 0, 0, w, h);
+        g_object_unref(pixmap);
+        set_cursor_busy(FALSE);
+      }
+      g_object_unref(pdfpage);
+    }
+    else job->failed = TRUE;
+    xoj_poppler_unlock(TRUE);
+    if (doc != NULL) g_async_queue_push(job->renderer->documents, doc);
+  }
+  return bgpdf_job_done(job);
+}
+
+/* At high zoom, the page is only rendered at a lower resolution, as a
+   backdrop for tiles of PDF_TILE_SIZE pixels covering the visible area.
+   The tiles are kept in bgpdf.tiles, and shown as canvas items in the
+   background's group, above the backdrop. */
+
+gboolean bgpdf_page_is_tiled(struct Page *pg, double *zoom)
+{
+  *zoom = MIN(ui.zoom, MAX_SAFE_RENDER_DPI/72.0);
+  return (pg->width*(*zoom) * pg->height*(*zoom) > PDF_TILE_THRESHOLD);
+}
+
+// the tiles needed to cover the visible part of a page (plus a margin of one tile)
+
+static gboolean bgpdf_tile_range(struct Page *pg, BgPdfTileView *v)
+{
+  gint sx, sy;
+  double x0, y0, x1, y1, zoom, t;
+
+  if (pg->bg->type != BG_PDF || !bgpdf_page_is_tiled(pg, &zoom)) return FALSE;
+  if (!is_visible(pg)) return FALSE;
+  gnome_canvas_get_scroll_offsets(canvas, &sx, &sy);
+  gnome_canvas_window_to_world(canvas, (double)sx, (double)sy, &x0, &y0);
+  gnome_canvas_window_to_world(canvas, (double)(sx + GTK_WIDGET(canvas)->allocation.width),
+      (double)(sy + GTK_WIDGET(canvas)->allocation.height), &x1, &y1);
+  v->pageno = pg->bg->file_page_seq;
+  v->dpi = 72*zoom;
+  t = PDF_TILE_SIZE*72/v->dpi; // tile size in points
+  v->i0 = MAX(0, (int)floor((x0 - pg->hoffset)/t) - 1);
+  v->j0 = MAX(0, (int)floor((y0 - pg->voffset)/t) - 1);
+  v->i1 = MIN((int)ceil(pg->width/t) - 1, (int)floor((x1 - pg->hoffset)/t) + 1);
+  v->j1 = MIN((int)ceil(pg->height/t) - 1, (int)floor((y1 - pg->voffset)/t) + 1);
+  return (v->i0 <= v->i1 && v->j0 <= v->j1);
+}
+
+static GArray *bgpdf_tile_views(void)
+{
+  GArray *views;
+  BgPdfTileView v;
+  GList *list;
+
+  views = g_array_new(FALSE, FALSE, sizeof(BgPdfTileView));
+  for (list = journal.pages; list!=NULL; list = list->next)
+    if (bgpdf_tile_range((struct Page *)list->data, &v))
+      g_array_append_val(views, v);
+  return views;
+}
+
+static gboolean bgpdf_tile_in_view(GArray *views, int pageno, double dpi, int tx, int ty)
+{
+  BgPdfTileView *v;
+  int k;
+
+  for (k = 0; k < views->len; k++) {
+    v = &g_array_index(views, BgPdfTileView, k);
+    if (v->pageno == pageno && v->dpi == dpi &&
+        tx >= v->i0 && tx <= v->i1 && ty >= v->j0 && ty <= v->j1) return TRUE;
+  }
+  return FALSE;
+}
+
+static guint bgpdf_tile_hash(gconstpointer key)
+{
+  const BgPdfTile *t = (const BgPdfTile *)key;
+  return ((guint)t->pageno*65599 + (guint)t->tx)*65599 + (guint)t->ty;
+}
+
+static gboolean bgpdf_tile_equal(gconstpointer a, gconstpointer b)
+{
+  const BgPdfTile *t1 = (const BgPdfTile *)a, *t2 = (const BgPdfTile *)b;
+  return (t1->pageno == t2->pageno && t1->tx == t2->tx && t1->ty == t2->ty
+          && t1->dpi == t2->dpi);
+}
+
+static BgPdfTile *bgpdf_find_tile(int pageno, double dpi, int tx, int ty)
+{
+  BgPdfTile key;
+
+  if (bgpdf.tiles == NULL) return NULL;
+  key.pageno = pageno; key.dpi = dpi;
+  key.tx = tx; key.ty = ty;
+  return (BgPdfTile *)g_hash_table_lookup(bgpdf.tiles, &key);
+}
+
+/* distance from the viewport to the nearest page using each PDF page,
+   in points (continuous mode) or in pages (one page mode) */
+
+static double *bgpdf_page_distances(int maxpage)
+{
+  GtkAdjustment *v_adj;
+  double ytop, ybot, d, *dist;
+  GList *list;
+  struct Page *pg;
+  int i, seq;
+
+  dist = g_new(double, maxpage+1);
+  for (i=0; i<=maxpage; i++) dist[i] = G_MAXDOUBLE;
+  v_adj = gtk_layout_get_vadjustment(GTK_LAYOUT(canvas));
+  ytop = v_adj->value/ui.zoom;
+  ybot = (v_adj->value + v_adj->page_size)/ui.zoom;
+  for (i=0, list = journal.pages; list!=NULL; i++, list = list->next) {
+    pg = (struct Page *)list->data;
+    if (pg->bg->type != BG_PDF) continue;
+    seq = pg->bg->file_page_seq;
+    if (seq < 0 || seq > maxpage) continue;
+    if (!ui.view_continuous) d = ABS(i - ui.pageno);
+    else if (pg->voffset + pg->height < ytop) d = ytop - (pg->voffset + pg->height);
+    else if (pg->voffset > ybot) d = pg->voffset - ybot;
+    else d = 0.;
+    if (d < dist[seq]) dist[seq] = d;
+  }
+  return dist;
+}
+
+/* hand the most urgent requests to idle workers */
+
+static void bgpdf_dispatch(void)
+{
+  struct BgPdfRequest *req, *best;
+  GList *list;
+  BgPdfJob *job;
+  GArray *views;
+  double *dist;
+  int maxpage;
+
+  if (bgpdf.status == STATUS_NOT_INIT || bgpdf.requests == NULL) return;
+  if (bgpdf_pool == NULL) {
+    bgpdf_nthreads = MAX(1, MIN(xoj_num_threads(), BGPDF_MAX_THREADS));
+    bgpdf_pool = g_thread_pool_new(bgpdf_render_job, NULL, bgpdf_nthreads, FALSE, NULL);
+    if (bgpdf_pool == NULL) return;
+  }
+  if (g_list_length(bgpdf.jobs) >= bgpdf_nthreads) return;
+
+  maxpage = 0;
+  for (list = bgpdf.requests; list!=NULL; list = list->next)
+    maxpage = MAX(maxpage, ((struct BgPdfRequest *)list->data)->pageno);
+  dist = bgpdf_page_distances(maxpage);
+  views = bgpdf_tile_views();
+
+  while (bgpdf.requests != NULL && g_list_length(bgpdf.jobs) < bgpdf_nthreads) {
+    best = NULL;
+    for (list = bgpdf.requests; list!=NULL; list = list->next) {
+      req = (struct BgPdfRequest *)list->data;
+      if (best == NULL || dist[req->pageno] < dist[best->pageno]) best = req;
+    }
+    // tiles that were scrolled out of view before their turn came
+    if (best->tx >= 0 && !bgpdf_tile_in_view(views, best->pageno, best->dpi, best->tx, best->ty))
+      { cancel_bgpdf_request(best); continue; }
+    job = g_new(BgPdfJob, 1);
+    job->renderer = bgpdf.renderer;
+    g_atomic_int_inc(&job->renderer->refcount);
+    job->pageno = best->pageno;
+    job->dpi = best->dpi;
+    job->tx = best->tx;
+    job->ty = best->ty;
+    job->cancelled = 0;
+    job->pixbuf = NULL;
+    cancel_bgpdf_request(best);
+    bgpdf.jobs = g_list_append(bgpdf.jobs, job);
+    if (ui.poppler_force_cairo) g_idle_add(bgpdf_render_job_pixmap, job);
+    else g_thread_pool_push(bgpdf_pool, job, NULL);
+  }
+  g_array_free(views, TRUE);
+  g_free(dist);
+}
+
 /* cancel a request */
 
 void cancel_bgpdf_request(struct BgPdfRequest *req)
@@ -1114,89 +1907,305 @@ void cancel_bgpdf_request(struct BgPdfRequest *req)
   g_free(req);
 }
 
-/* process a bg PDF request from the queue, and recurse */
+/* Rendered pages are kept in bgpdf.pages within a memory budget
+   (ui.pdf_cache_size). When over budget, the least recently used pages
+   that aren't on screen are replaced by a low-resolution placeholder,
+   so that they never show up blank; they get re-rendered when they
+   come back into view. Tiles are evicted the same way, except those
+   covering the visible area. */
 
-gboolean bgpdf_scheduler_callback(gpointer data)
+static gsize pixbuf_bytes(GdkPixbuf *pix)
 {
-  struct BgPdfRequest *req;
-  struct BgPdfPage *bgpg;
-  GdkPixbuf *pixbuf;
-  GtkWidget *dialog;
-  PopplerPage *pdfpage;
-  gdouble height, width;
-  int scaled_height, scaled_width;
-  GdkPixmap *pixmap;
-  cairo_t *cr;
+  if (pix == NULL) return 0;
+  return (gsize)gdk_pixbuf_get_rowstride(pix) * gdk_pixbuf_get_height(pix);
+}
 
-  // if all requests have been cancelled, remove ourselves from main loop
-  if (bgpdf.requests == NULL) { bgpdf.pid = 0; return FALSE; }
-  if (bgpdf.status == STATUS_NOT_INIT)
-    { printf("DEBUG: BGPDF not initialized??\n"); bgpdf.pid = 0; return FALSE; }
+static void bgpdf_cache_forget(struct BgPdfPage *bgpg)
+{
+  if (bgpg->pixbuf == NULL) return;
+  if (bgpg->placeholder) bgpdf.placeholder_bytes -= pixbuf_bytes(bgpg->pixbuf);
+  else bgpdf.cache_bytes -= pixbuf_bytes(bgpg->pixbuf);
+  g_object_unref(bgpg->pixbuf);
+  bgpg->pixbuf = NULL;
+}
 
-  req = (struct BgPdfRequest *)bgpdf.requests->data;
+static void bgpdf_cache_store(struct BgPdfPage *bgpg, GdkPixbuf *pix, double dpi, gboolean placeholder)
+{
+  bgpdf_cache_forget(bgpg);
+  bgpg->pixbuf = pix;
+  bgpg->dpi = dpi;
+  bgpg->pixel_width = gdk_pixbuf_get_width(pix);
+  bgpg->pixel_height = gdk_pixbuf_get_height(pix);
+  bgpg->placeholder = placeholder;
+  if (placeholder) bgpdf.placeholder_bytes += pixbuf_bytes(pix);
+  else {
+    bgpdf.cache_bytes += pixbuf_bytes(pix);
+    bgpg->last_use = ++bgpdf.cache_clock;
+  }
+}
 
-  // use poppler to generate the page
-  pixbuf = NULL;
-  pdfpage = poppler_document_get_page(bgpdf.document, req->pageno-1);
-  if (pdfpage) {
-//    printf("DEBUG: Processing request for page %d at %f dpi\n", req->pageno, req->dpi);
-    set_cursor_busy(TRUE);
-    poppler_page_get_size(pdfpage, &width, &height);
-    scaled_width = (int) (req->dpi * width/72);
-    scaled_height = (int) (req->dpi * height/72);
-
-    if (ui.poppler_force_cairo) { // poppler -> cairo -> pixmap -> pixbuf
-      pixmap = gdk_pixmap_new(GTK_WIDGET(canvas)->window, scaled_width, scaled_height, -1);
-      cr = gdk_cairo_create(pixmap);
-      cairo_set_source_rgb(cr, 1., 1., 1.);
-      cairo_paint(cr);
-      cairo_scale(cr, scaled_width/width, scaled_height/height);
-      poppler_page_render(pdfpage, cr);
-      cairo_destroy(cr);
-      pixbuf = gdk_pixbuf_get_from_drawable(NULL, GDK_DRAWABLE(pixmap),
-        NULL, 0, 0, 0, 0, scaled_width, scaled_height);
-      g_object_unref(pixmap);
-    }
-    else { // directly poppler -> pixbuf: faster, but bitmap font bug
-      pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB,
-                 FALSE, 8, scaled_width, scaled_height);
-      wrapper_poppler_page_render_to_pixbuf(
-                pdfpage, 0, 0, scaled_width, scaled_height,
-                req->dpi/72, 0, pixbuf);
+static void bgpdf_tile_free(gpointer data)
+{
+  BgPdfTile *tile = (BgPdfTile *)data;
+
+  bgpdf.cache_bytes -= pixbuf_bytes(tile->pixbuf);
+  g_object_unref(tile->pixbuf);
+  g_free(tile);
+}
+
+static BgPdfTile *bgpdf_store_tile(int pageno, double dpi, int tx, int ty, GdkPixbuf *pix)
+{
+  BgPdfTile *tile;
+
+  if (bgpdf.tiles == NULL)
+    bgpdf.tiles = g_hash_table_new_full(bgpdf_tile_hash, bgpdf_tile_equal, bgpdf_tile_free, NULL);
+  tile = g_new(BgPdfTile, 1);
+  tile->pageno = pageno; tile->dpi = dpi;
+  tile->tx = tx; tile->ty = ty;
+  if (++bgpdf_tile_serial == 0) bgpdf_tile_serial++;
+  tile->id = bgpdf_tile_serial;
+  tile->pixbuf = pix;
+  tile->last_use = ++bgpdf.cache_clock;
+  bgpdf.cache_bytes += pixbuf_bytes(pix);
+  g_hash_table_replace(bgpdf.tiles, tile, tile);
+  return tile;
+}
+
+// remove the canvas items showing a tile, and forget it
+
+static void bgpdf_drop_tile(BgPdfTile *tile)
+{
+  GList *list, *itemlist, *next;
+  struct Page *pg;
+
+  for (list = journal.pages; list!=NULL; list = list->next) {
+    pg = (struct Page *)list->data;
+    if (pg->bg->type != BG_PDF || pg->bg->file_page_seq != tile->pageno) continue;
+    if (pg->bg->canvas_item == NULL) continue;
+    for (itemlist = GNOME_CANVAS_GROUP(pg->bg->canvas_item)->item_list;
+         itemlist != NULL; itemlist = next) {
+      next = itemlist->next;
+      if (GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(itemlist->data), "tile-id")) == tile->id)
+        gtk_object_destroy(GTK_OBJECT(itemlist->data));
     }
-    g_object_unref(pdfpage);
-    set_cursor_busy(FALSE);
   }
+  g_hash_table_remove(bgpdf.tiles, tile);
+}
 
-  // process the generated pixbuf...
-  if (pixbuf != NULL) { // success
-    while (req->pageno > bgpdf.npages) {
-      bgpg = g_new(struct BgPdfPage, 1);
-      bgpg->pixbuf = NULL;
-      bgpdf.pages = g_list_append(bgpdf.pages, bgpg);
-      bgpdf.npages++;
+static void find_lru_tile(gpointer key, gpointer value, gpointer user_data)
+{
+  BgPdfTile *tile = (BgPdfTile *)value, **victim = (BgPdfTile **)user_data;
+
+  if (tile->last_use == G_MAXUINT) return; // in view
+  if (*victim == NULL || tile->last_use < (*victim)->last_use) *victim = tile;
+}
+
+static void mark_tile_in_view(gpointer key, gpointer value, gpointer user_data)
+{
+  BgPdfTile *tile = (BgPdfTile *)value;
+
+  if (bgpdf_tile_in_view((GArray *)user_data, tile->pageno, tile->dpi, tile->tx, tile->ty))
+    tile->last_use = G_MAXUINT;
+}
+
+static void unmark_tile_in_view(gpointer key, gpointer value, gpointer user_data)
+{
+  BgPdfTile *tile = (BgPdfTile *)value;
+
+  if (tile->last_use == G_MAXUINT) tile->last_use = bgpdf.cache_clock;
+}
+
+static void bgpdf_cache_evict(int keep_pageno)
+{
+  BgPdfTile *tile;
+  GArray *views;
+  struct BgPdfPage *bgpg, *victim;
+  gboolean *onscreen;
+  GList *list;
+  struct Page *pg;
+  GdkPixbuf *pix;
+  int i, seq, victim_no, w, h;
+
+  if (ui.pdf_cache_size <= 0) return;
+  if (bgpdf.cache_bytes <= (gsize)ui.pdf_cache_size*1024*1024) return;
+  
+  onscreen = g_new0(gboolean, bgpdf.npages+1);
+  for (list = journal.pages; list!=NULL; list = list->next) {
+    pg = (struct Page *)list->data;
+    if (pg->bg->type != BG_PDF) continue;
+    seq = pg->bg->file_page_seq;
+    if (seq >= 1 && seq <= bgpdf.npages && is_visible(pg)) onscreen[seq] = TRUE;
+  }
+  // tiles covering the visible area are marked as such while we work
+  views = bgpdf_tile_views();
+  if (bgpdf.tiles != NULL) g_hash_table_foreach(bgpdf.tiles, mark_tile_in_view, views);
+
+  while (bgpdf.cache_bytes > (gsize)ui.pdf_cache_size*1024*1024) {
+    victim = NULL; victim_no = 0;
+    for (i=1, list = bgpdf.pages; list!=NULL; i++, list = list->next) {
+      bgpg = (struct BgPdfPage *)list->data;
+      if (bgpg->pixbuf == NULL || bgpg->placeholder || bgpg->dpi <= PDF_PLACEHOLDER_DPI) continue;
+      if (i == keep_pageno || onscreen[i]) continue;
+      if (victim == NULL || bgpg->last_use < victim->last_use) { victim = bgpg; victim_no = i; }
     }
-    bgpg = g_list_nth_data(bgpdf.pages, req->pageno-1);
-    if (bgpg->pixbuf!=NULL) g_object_unref(bgpg->pixbuf);
-    bgpg->pixbuf = pixbuf;
-    bgpg->dpi = req->dpi;
-    bgpg->pixel_height = scaled_height;
-    bgpg->pixel_width = scaled_width;
-    bgpdf_update_bg(req->pageno, bgpg); // update all pages that have this bg
-  } else { // failure
-    if (!bgpdf.has_failed) {
-      dialog = gtk_message_dialog_new(GTK_WINDOW(winMain), GTK_DIALOG_MODAL,
-        GTK_MESSAGE_ERROR, GTK_BUTTONS_OK, _("Unable to render one or more PDF pages."));
-      gtk_dialog_run(GTK_DIALOG(dialog));
-      gtk_widget_destroy(dialog);
+    tile = NULL;
+    if (bgpdf.tiles != NULL) g_hash_table_foreach(bgpdf.tiles, find_lru_tile, &tile);
+    if (tile != NULL && (victim == NULL || tile->last_use < victim->last_use)) {
+      bgpdf_drop_tile(tile);
+      bgpdf.cache_evictions++;
+      continue;
+    }
+    if (victim == NULL) break; // everything left is in use
+    w = MAX(1, (int)(victim->pixel_width * PDF_PLACEHOLDER_DPI / victim->dpi));
+    h = MAX(1, (int)(victim->pixel_height * PDF_PLACEHOLDER_DPI / victim->dpi));
+    pix = gdk_pixbuf_scale_simple(victim->pixbuf, w, h, GDK_INTERP_BILINEAR);
+    if (pix != NULL) bgpdf_cache_store(victim, pix, PDF_PLACEHOLDER_DPI, TRUE);
+    else bgpdf_cache_forget(victim);
+    bgpdf.cache_evictions++;
+    bgpdf_update_bg(victim_no, victim);
+    // have the page re-rendered when it comes back into view
+    for (list = journal.pages; list!=NULL; list = list->next) {
+      pg = (struct Page *)list->data;
+      if (pg->bg->type == BG_PDF && pg->bg->file_page_seq == victim_no)
+        pg->bg->pixbuf_scale = 0;
     }
-    bgpdf.has_failed = TRUE;
   }
+  if (bgpdf.tiles != NULL) g_hash_table_foreach(bgpdf.tiles, unmark_tile_in_view, NULL);
+  g_array_free(views, TRUE);
+  g_free(onscreen);
+}
+
+/* show the rendered tiles that cover the visible part of the page,
+   and request the missing ones if asked to */
+
+static void add_bgpdf_tile_request(int pageno, double dpi, int tx, int ty);
+
+void bgpdf_show_tiles(struct Page *pg, gboolean request)
+{
+  GnomeCanvasGroup *group;
+  GnomeCanvasItem *item;
+  GList *list, *next;
+  BgPdfTileView v;
+  BgPdfTile *tile;
+  guint id, *wanted;
+  gboolean in_view, *shown;
+  int i, j, k, n;
 
-  bgpdf.requests = g_list_delete_link(bgpdf.requests, bgpdf.requests);
-  if (bgpdf.requests != NULL) return TRUE; // remain in the idle loop
+  if (bgpdf.status == STATUS_NOT_INIT) return;
+  if (pg->bg->type != BG_PDF || pg->bg->canvas_item == NULL) return;
+  group = GNOME_CANVAS_GROUP(pg->bg->canvas_item);
+  in_view = bgpdf_tile_range(pg, &v);
+  n = in_view ? (v.i1-v.i0+1)*(v.j1-v.j0+1) : 0;
+  wanted = g_new0(guint, MAX(n, 1));
+  shown = g_new0(gboolean, MAX(n, 1));
+  for (k = 0; k < n; k++) {
+    tile = bgpdf_find_tile(v.pageno, v.dpi, v.i0 + k%(v.i1-v.i0+1), v.j0 + k/(v.i1-v.i0+1));
+    if (tile != NULL) { wanted[k] = tile->id; tile->last_use = ++bgpdf.cache_clock; }
+  }
+
+  // drop the tiles we no longer need (other zoom, scrolled away)
+  for (list = group->item_list; list != NULL; list = next) {
+    next = list->next;
+    id = GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(list->data), "tile-id"));
+    if (id == 0) continue; // the backdrop
+    for (k = 0; k < n; k++) if (wanted[k] == id) break;
+    if (k < n) shown[k] = TRUE;
+    else gtk_object_destroy(GTK_OBJECT(list->data));
+  }
+
+  for (k = 0; k < n; k++) {
+    i = v.i0 + k%(v.i1-v.i0+1);
+    j = v.j0 + k/(v.i1-v.i0+1);
+    if (wanted[k] == 0) {
+      if (request) add_bgpdf_tile_request(v.pageno, v.dpi, i, j);
+      continue;
+    }
+    if (shown[k]) continue;
+    tile = bgpdf_find_tile(v.pageno, v.dpi, i, j);
+    bgpdf.cache_hits++;
+    item = gnome_canvas_item_new(group, gnome_canvas_pixbuf_get_type(),
+        "pixbuf", tile->pixbuf,
+        "x", i*PDF_TILE_SIZE*72/v.dpi, "y", j*PDF_TILE_SIZE*72/v.dpi,
+        "width", gdk_pixbuf_get_width(tile->pixbuf)*72/v.dpi,
+        "height", gdk_pixbuf_get_height(tile->pixbuf)*72/v.dpi,
+        "width-set", TRUE, "height-set", TRUE, NULL);
+    g_object_set_data(G_OBJECT(item), "tile-id", GUINT_TO_POINTER(tile->id));
+  }
+  g_free(wanted);
+  g_free(shown);
+}
+
+// bring the tiles of all pages up to date (e.g. after scrolling)
+
+void bgpdf_update_tiles(void)
+{
+  GList *list;
+
+  if (bgpdf.status == STATUS_NOT_INIT) return;
+  for (list = journal.pages; list!=NULL; list = list->next)
+    bgpdf_show_tiles((struct Page *)list->data, TRUE);
+}
+
+/* dispatch the queued requests once they've all been made */
+
+gboolean bgpdf_scheduler_callback(gpointer data)
+{
   bgpdf.pid = 0;
-  return FALSE; // we're done
+  bgpdf_dispatch();
+  return FALSE;
+}
+
+/* a worker is done with a job: install the result (in the main thread) */
+
+gboolean bgpdf_job_done(gpointer data)
+{
+  BgPdfJob *job = (BgPdfJob *)data;
+  struct BgPdfPage *bgpg;
+  GtkWidget *dialog;
+  GList *list;
+  struct Page *pg;
+  gboolean current;
+
+  current = (bgpdf.status != STATUS_NOT_INIT && job->renderer == bgpdf.renderer);
+  if (current) bgpdf.jobs = g_list_remove(bgpdf.jobs, job);
+  
+  if (current && !g_atomic_int_get(&job->cancelled)) {
+    if (job->pixbuf != NULL && job->tx >= 0) { // a tile: show it wherever it's wanted
+      bgpdf_store_tile(job->pageno, job->dpi, job->tx, job->ty, job->pixbuf);
+      job->pixbuf = NULL;
+      for (list = journal.pages; list!=NULL; list = list->next) {
+        pg = (struct Page *)list->data;
+        if (pg->bg->type == BG_PDF && pg->bg->file_page_seq == job->pageno)
+          bgpdf_show_tiles(pg, FALSE);
+      }
+      bgpdf_cache_evict(0);
+    } else if (job->pixbuf != NULL) { // success
+      while (job->pageno > bgpdf.npages) {
+        bgpg = g_new0(struct BgPdfPage, 1);
+        bgpdf.pages = g_list_append(bgpdf.pages, bgpg);
+        bgpdf.npages++;
+      }
+      bgpg = g_list_nth_data(bgpdf.pages, job->pageno-1);
+      bgpdf_cache_store(bgpg, job->pixbuf, job->dpi, FALSE);
+      job->pixbuf = NULL;
+      bgpdf_update_bg(job->pageno, bgpg); // update all pages that have this bg
+      bgpdf_cache_evict(job->pageno);
+    } else if (job->failed) {
+      if (!bgpdf.has_failed) {
+        dialog = gtk_message_dialog_new(GTK_WINDOW(winMain), GTK_DIALOG_MODAL,
+          GTK_MESSAGE_ERROR, GTK_BUTTONS_OK, _("Unable to render one or more PDF pages."));
+        gtk_dialog_run(GTK_DIALOG(dialog));
+        gtk_widget_destroy(dialog);
+      }
+      bgpdf.has_failed = TRUE;
+    }
+  }
+
+  if (job->pixbuf != NULL) g_object_unref(job->pixbuf);
+  bgpdf_renderer_unref(job->renderer);
+  g_free(job);
+  if (current) bgpdf_dispatch();
+  return FALSE;
 }
 
 /* make a request */
@@ -1204,26 +2213,80 @@ gboolean bgpdf_scheduler_callback(gpointer data)
 gboolean add_bgpdf_request(int pageno, double zoom)
 {
   struct BgPdfRequest *req, *cmp_req;
+  struct BgPdfPage *bgpg;
+  BgPdfJob *job;
   GList *list;
 
   if (bgpdf.status == STATUS_NOT_INIT)
     return FALSE; // don't accept requests
+
+  // cancel any request this may supersede, including those being processed
+  for (list = bgpdf.requests; list != NULL; ) {
+    cmp_req = (struct BgPdfRequest *)list->data;
+    list = list->next;
+    if (cmp_req->pageno == pageno && cmp_req->tx < 0) cancel_bgpdf_request(cmp_req);
+  }
+  for (list = bgpdf.jobs; list != NULL; list = list->next) {
+    job = (BgPdfJob *)list->data;
+    if (job->pageno == pageno && job->tx < 0) g_atomic_int_set(&job->cancelled, 1);
+  }
+
+  // already rendered at this resolution?
+  if (pageno <= bgpdf.npages) {
+    bgpg = (struct BgPdfPage *)g_list_nth_data(bgpdf.pages, pageno-1);
+    if (bgpg->pixbuf != NULL && !bgpg->placeholder && bgpg->dpi == 72*zoom) {
+      bgpdf.cache_hits++;
+      bgpg->last_use = ++bgpdf.cache_clock;
+      bgpdf_update_bg(pageno, bgpg);
+      return TRUE;
+    }
+  }
+  bgpdf.cache_misses++;
+
   req = g_new(struct BgPdfRequest, 1);
   req->pageno = pageno;
   req->dpi = 72*zoom;
+  req->tx = req->ty = -1;
 //  printf("DEBUG: Enqueuing request for page %d at %f dpi\n", pageno, req->dpi);
 
-  // cancel any request this may supersede
+  // make the request; it gets dispatched once the caller is done queueing
+  bgpdf.requests = g_list_append(bgpdf.requests, req);
+  if (!bgpdf.pid) bgpdf.pid = g_idle_add(bgpdf_scheduler_callback, NULL);
+  return TRUE;
+}
+
+static void add_bgpdf_tile_request(int pageno, double dpi, int tx, int ty)
+{
+  struct BgPdfRequest *req;
+  BgPdfJob *job;
+  GList *list;
+  gboolean pending = FALSE;
+
+  // tiles requested at another zoom are no longer needed
   for (list = bgpdf.requests; list != NULL; ) {
-    cmp_req = (struct BgPdfRequest *)list->data;
+    req = (struct BgPdfRequest *)list->data;
     list = list->next;
-    if (cmp_req->pageno == pageno) cancel_bgpdf_request(cmp_req);
+    if (req->pageno != pageno || req->tx < 0) continue;
+    if (req->dpi != dpi) cancel_bgpdf_request(req);
+    else if (req->tx == tx && req->ty == ty) pending = TRUE;
+  }
+  for (list = bgpdf.jobs; list != NULL; list = list->next) {
+    job = (BgPdfJob *)list->data;
+    if (job->pageno != pageno || job->tx < 0) continue;
+    if (job->dpi != dpi) g_atomic_int_set(&job->cancelled, 1);
+    else if (job->tx == tx && job->ty == ty && !g_atomic_int_get(&job->cancelled))
+      pending = TRUE;
   }
+  if (pending) return;
 
-  // make the request
+  bgpdf.cache_misses++;
+  req = g_new(struct BgPdfRequest, 1);
+  req->pageno = pageno;
+  req->dpi = dpi;
+  req->tx = tx;
+  req->ty = ty;
   bgpdf.requests = g_list_append(bgpdf.requests, req);
   if (!bgpdf.pid) bgpdf.pid = g_idle_add(bgpdf_scheduler_callback, NULL);
-  return TRUE;
 }
 
 /* shutdown the PDF reader */
@@ -1235,6 +2298,7 @@ void shutdown_bgpdf(void)
   struct BgPdfRequest *req;
 
   if (bgpdf.status == STATUS_NOT_INIT) return;
+  pdf_forget_source(); // PDF export: the parsed file is about to go away
   
   // cancel all requests and free data structures
   refstring_unref(bgpdf.filename);
@@ -1249,13 +2313,28 @@ void shutdown_bgpdf(void)
     g_free(req);
   }
   g_list_free(bgpdf.requests);
-
-  if (bgpdf.file_contents!=NULL) {
-    g_free(bgpdf.file_contents); 
-    bgpdf.file_contents = NULL;
+  bgpdf.requests = NULL;
+  if (bgpdf.tiles != NULL) g_hash_table_destroy(bgpdf.tiles);
+  bgpdf.tiles = NULL;
+  if (bgpdf.pid) { g_source_remove(bgpdf.pid); bgpdf.pid = 0; }
+
+  // jobs still in the workers get discarded when they come back
+  for (list = bgpdf.jobs; list != NULL; list = list->next)
+    g_atomic_int_set(&((BgPdfJob *)list->data)->cancelled, 1);
+  g_list_free(bgpdf.jobs);
+  bgpdf.jobs = NULL;
+
+  if (bgpdf.renderer != NULL) { // the renderer frees the file contents
+    bgpdf.renderer->owns_data = TRUE;
+    bgpdf_renderer_unref(bgpdf.renderer);
+    bgpdf.renderer = NULL;
   }
+  else if (bgpdf.file_contents!=NULL) g_free(bgpdf.file_contents);
+  bgpdf.file_contents = NULL;
   if (bgpdf.document!=NULL) {
+    xoj_poppler_lock(FALSE);
     g_object_unref(bgpdf.document);
+    xoj_poppler_unlock(FALSE);
     bgpdf.document = NULL;
   }
 
@@ -1272,7 +2351,6 @@ gboolean init_bgpdf(char *pdfname, gboolean create_pages, int file_domain)
   struct Page *pg;
   PopplerPage *pdfpage;
   gdouble width, height;
-  gchar *uri;
   
   if (bgpdf.status != STATUS_NOT_INIT) return FALSE;
   
@@ -1289,20 +2367,29 @@ gboolean init_bgpdf(char *pdfname, gboolean create_pages, int file_domain)
   bgpdf.npages = 0;
   bgpdf.pages = NULL;
   bgpdf.requests = NULL;
+  bgpdf.tiles = NULL;
   bgpdf.pid = 0;
   bgpdf.has_failed = FALSE;
+  bgpdf.cache_bytes = bgpdf.placeholder_bytes = 0;
+  bgpdf.cache_clock = 0;
+  bgpdf.cache_hits = bgpdf.cache_misses = bgpdf.cache_evictions = 0;
+
+  bgpdf.jobs = NULL;
+  bgpdf.renderer = NULL;
 
-/* poppler_document_new_from_data() starts at 0.6.1, but we want to
-   be compatible with poppler 0.5.4 = latest in CentOS as of sept 2009 */
-  uri = g_filename_to_uri(pdfname, NULL, NULL);
-  if (!uri) uri = g_strdup_printf("file://%s", pdfname);
-  bgpdf.document = poppler_document_new_from_file(uri, NULL, NULL);
-  g_free(uri);
-/*    with poppler 0.6.1 or later, can replace the above 4 lines by:
+  xoj_poppler_lock(FALSE);
   bgpdf.document = poppler_document_new_from_data(bgpdf.file_contents, 
                           bgpdf.file_length, NULL, NULL);
-*/
+  xoj_poppler_unlock(FALSE);
   if (bgpdf.document == NULL) { shutdown_bgpdf(); return FALSE; }
+
+  // the workers share the file contents (read-only) with us
+  bgpdf.renderer = g_new(struct BgPdfRenderer, 1);
+  bgpdf.renderer->refcount = 1;
+  bgpdf.renderer->data = bgpdf.file_contents;
+  bgpdf.renderer->length = bgpdf.file_length;
+  bgpdf.renderer->owns_data = FALSE;
+  bgpdf.renderer->documents = g_async_queue_new();
   
   if (pdfname[0]=='/' && ui.filename == NULL) {
     if (ui.default_path!=NULL) g_free(ui.default_path);
@@ -1321,7 +2408,7 @@ gboolean init_bgpdf(char *pdfname, gboolean create_pages, int file_domain)
       bg->canvas_item = NULL;
       pg = NULL;
     } else {
-      pg = (struct Page *)g_list_nth_data(journal.pages, i-1);
+      pg = journal_page(i-1);
       bg = pg->bg;
     }
     bg->type = BG_PDF;
@@ -1334,12 +2421,12 @@ gboolean init_bgpdf(char *pdfname, gboolean create_pages, int file_domain)
     g_object_unref(pdfpage);
     if (pg == NULL) {
       pg = new_page_with_bg(bg, width, height);
-      journal.pages = g_list_append(journal.pages, pg);
-      journal.npages++;
+      journal_insert_page(pg, journal.npages);
     } else {
       pg->width = width; 
       pg->height = height;
       make_page_clipbox(pg);
+      page_resized(i-1);
       update_canvas_bg(pg);
     }
   }
@@ -1506,6 +2593,10 @@ void init_config_default(void)
   ui.button_switch_mapping = FALSE;
   ui.autoload_pdf_xoj = FALSE;
   ui.poppler_force_cairo = FALSE;
+  ui.lazy_canvas = FALSE;
+  ui.lazy_canvas_margin = 1000.;
+  ui.pdf_cache_size = 256;
+  ui.pdf_width_tolerance = 0.1; // edges off by a tenth of a pixel at 300 dpi, see xournal-bench
   
   // the default UI vertical order
   ui.vertical_order[0][0] = 1; 
@@ -1687,6 +2778,18 @@ void save_config_to_file(void)
   update_keyval("general", "poppler_force_cairo",
     _(" force PDF rendering through cairo (slower but nicer) (true/false)"),
     g_strdup(ui.poppler_force_cairo?"true":"false"));
+  update_keyval("general", "lazy_canvas",
+    _(" only create canvas items for pages near the visible area; saves memory on large journals (true/false)"),
+    g_strdup(ui.lazy_canvas?"true":"false"));
+  update_keyval("general", "lazy_canvas_margin",
+    _(" with lazy_canvas, distance beyond the visible area (in points) within which pages are kept ready"),
+    g_strdup_printf("%.0f", ui.lazy_canvas_margin));
+  update_keyval("general", "pdf_cache_size",
+    _(" memory budget for rendered PDF backgrounds, in MB (0 = unlimited)"),
+    g_strdup_printf("%d", ui.pdf_cache_size));
+  update_keyval("general", "pdf_width_tolerance",
+    _(" in PDF export, pressure-sensitive strokes are drawn as one line wherever their width varies by at most this much, in points (0 = exact widths)"),
+    g_strdup_printf("%.2f", ui.pdf_width_tolerance));
 
   update_keyval("paper", "width",
     _(" the default page width, in points (1/72 in)"),
@@ -2058,6 +3161,10 @@ void load_config_from_file(void)
   parse_keyval_float("general", "highlighter_opacity", &ui.hiliter_opacity, 0., 1.);
   parse_keyval_boolean("general", "autosave_prefs", &ui.auto_save_prefs);
   parse_keyval_boolean("general", "poppler_force_cairo", &ui.poppler_force_cairo);
+  parse_keyval_boolean("general", "lazy_canvas", &ui.lazy_canvas);
+  parse_keyval_float("general", "lazy_canvas_margin", &ui.lazy_canvas_margin, 0., 100000.);
+  parse_keyval_int("general", "pdf_cache_size", &ui.pdf_cache_size, 0, 100000);
+  parse_keyval_float("general", "pdf_width_tolerance", &ui.pdf_width_tolerance, 0., 10.);
   
   parse_keyval_float("paper", "width", &ui.default_page.width, 1., 5000.);
   parse_keyval_float("paper", "height", &ui.default_page.height, 1., 5000.);
@@ -24,10 +24,20 @@ extern int GS_BITMAP_DPI, PDFTOPPM_PRINTING_DPI;
 
 #define TMPDIR_TEMPLATE "/tmp/xournalpdf.XXXXXX"
 
+#define FIXED2_MAXLEN 32
+
+int fixed2_to_ascii(char *buf, double x);
+
 void new_journal(void);
 gboolean save_journal(const char *filename);
 gboolean close_journal(void);
 gboolean open_journal(char *filename);
+gboolean read_journal(char *filename, struct Journal *j,
+                      struct Background **bg_pdf, gboolean *maybe_pdf);
+gboolean open_journal_bgpdf(char *filename, struct Background *bg_pdf, char **tmpfn);
+int xoj_num_threads(void);
+void xoj_poppler_lock(gboolean rendering);
+void xoj_poppler_unlock(gboolean rendering);
 
 struct Background *attempt_load_pix_bg(char *filename, gboolean attach);
 GList *attempt_load_gv_bg(char *filename);
@@ -36,11 +46,15 @@ struct Background *attempt_screenshot_bg(void);
 void cancel_bgpdf_request(struct BgPdfRequest *req);
 gboolean add_bgpdf_request(int pageno, double zoom);
 gboolean bgpdf_scheduler_callback(gpointer data);
+gboolean bgpdf_job_done(gpointer data);
 void shutdown_bgpdf(void);
 gboolean init_bgpdf(char *pdfname, gboolean create_pages, int file_domain);
 
 void bgpdf_create_page_with_bg(int pageno, struct BgPdfPage *bgpg);
 void bgpdf_update_bg(int pageno, struct BgPdfPage *bgpg);
+gboolean bgpdf_page_is_tiled(struct Page *pg, double *zoom);
+void bgpdf_show_tiles(struct Page *pg, gboolean request);
+void bgpdf_update_tiles(void);
 
 void init_mru(void);
 void update_mru_menu(void);
@@ -23,7 +23,9 @@
 
 #include "xournal.h"
 #include "xo-support.h"
+#include "xo-misc.h"
 #include "xo-image.h"
+#include "xo-arena.h"
 
 // create pixbuf from buffer, or return NULL on failure
 GdkPixbuf *pixbuf_from_buffer(const gchar *buf, gsize buflen)
@@ -45,7 +47,7 @@ void create_image_from_pixbuf(GdkPixbuf *pixbuf, double *pt)
   double scale;
   struct Item *item;
 
-  item = g_new(struct Item, 1);
+  item = arena_new_item(journal.arena);
   item->type = ITEM_IMAGE;
   item->canvas_item = NULL;
   item->bbox.left = pt[0];
@@ -63,8 +65,7 @@ void create_image_from_pixbuf(GdkPixbuf *pixbuf, double *pt)
 
   item->bbox.right = item->bbox.left + scale * gdk_pixbuf_get_width(item->image);
   item->bbox.bottom = item->bbox.top + scale * gdk_pixbuf_get_height(item->image);
-  ui.cur_layer->items = g_list_append(ui.cur_layer->items, item);
-  ui.cur_layer->nitems++;
+  layer_append_item(ui.cur_layer, item);
   
   make_canvas_item_one(ui.cur_layer->group, item);
 
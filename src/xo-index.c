@@ -0,0 +1,337 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <math.h>
+#include <stdlib.h>
+#include <gtk/gtk.h>
+#include <libgnomecanvas/libgnomecanvas.h>
+
+#include "xournal.h"
+#include "xo-misc.h"
+#include "xo-index.h"
+
+#define INDEX_MIN_ITEMS 32    // below this, a plain scan is just as good
+#define INDEX_MIN_CELL 16.    // cell size bounds, in points
+#define INDEX_MAX_CELL 256.
+#define INDEX_MAX_DIM 256     // max. number of cells in each direction
+#define INDEX_MAX_SPAN 16     // items covering more cells go to the "big" list
+
+typedef struct IndexCell {
+  struct Item **items;   // in no particular order
+  int n, alloc;
+} IndexCell;
+
+typedef struct LayerIndex {
+  int nbuilt;            // the number of items when the grid was laid out
+  double x0, y0, cell;   // grid origin and cell size
+  int nx, ny;
+  IndexCell *cells;      // nx*ny of them
+  IndexCell big;         // items spanning many cells
+} LayerIndex;
+
+/* where an item is filed: the cells it was put in (from its bbox at the
+   time), and its stacking order, since the cells don't keep it. Entries
+   of all the layers are in one table, so that an item whose bbox changed
+   can be refiled without knowing its layer */
+
+typedef struct IndexEntry {
+  LayerIndex *idx;
+  int i0, j0, i1, j1;    // i0 < 0 if it's on the big list
+  double depth;          // increasing from the bottom of the layer up
+} IndexEntry;
+
+static GHashTable *index_entries = NULL; // struct Item * -> IndexEntry *
+
+static void cell_add(IndexCell *c, struct Item *item)
+{
+  if (c->n == c->alloc) {
+    c->alloc = MAX(2*c->alloc, 4);
+    c->items = g_renew(struct Item *, c->items, c->alloc);
+  }
+  c->items[c->n++] = item;
+}
+
+static void cell_remove(IndexCell *c, struct Item *item)
+{
+  int k;
+
+  for (k = 0; k < c->n; k++)
+    if (c->items[k] == item) { c->items[k] = c->items[--c->n]; return; }
+}
+
+static void cell_range(LayerIndex *idx, struct BBox *b, int *i0, int *j0, int *i1, int *j1)
+{
+  double v;
+
+  v = floor((b->left - idx->x0)/idx->cell);  *i0 = (v < 0) ? 0 : (v >= idx->nx) ? idx->nx-1 : (int)v;
+  v = floor((b->right - idx->x0)/idx->cell); *i1 = (v < 0) ? 0 : (v >= idx->nx) ? idx->nx-1 : (int)v;
+  v = floor((b->top - idx->y0)/idx->cell);   *j0 = (v < 0) ? 0 : (v >= idx->ny) ? idx->ny-1 : (int)v;
+  v = floor((b->bottom - idx->y0)/idx->cell); *j1 = (v < 0) ? 0 : (v >= idx->ny) ? idx->ny-1 : (int)v;
+}
+
+static gboolean index_is_big(LayerIndex *idx, struct BBox *b, int *i0, int *j0, int *i1, int *j1)
+{
+  if (!finite_sized(b->left) || !finite_sized(b->right) ||
+      !finite_sized(b->top) || !finite_sized(b->bottom)) return TRUE;
+  cell_range(idx, b, i0, j0, i1, j1);
+  return ((*i1-*i0+1)*(*j1-*j0+1) > INDEX_MAX_SPAN);
+}
+
+// file the item according to its current bbox
+
+static void index_file(LayerIndex *idx, struct Item *item, IndexEntry *e)
+{
+  int i, j;
+
+  e->idx = idx;
+  if (index_is_big(idx, &item->bbox, &e->i0, &e->j0, &e->i1, &e->j1)) {
+    e->i0 = -1;
+    cell_add(&idx->big, item);
+    return;
+  }
+  for (j = e->j0; j <= e->j1; j++)
+    for (i = e->i0; i <= e->i1; i++)
+      cell_add(&idx->cells[j*idx->nx+i], item);
+}
+
+static void index_unfile(struct Item *item, IndexEntry *e)
+{
+  LayerIndex *idx = e->idx;
+  int i, j;
+
+  if (e->i0 < 0) { cell_remove(&idx->big, item); return; }
+  for (j = e->j0; j <= e->j1; j++)
+    for (i = e->i0; i <= e->i1; i++)
+      cell_remove(&idx->cells[j*idx->nx+i], item);
+}
+
+static IndexEntry *index_entry(struct Item *item)
+{
+  if (index_entries == NULL) return NULL;
+  return (IndexEntry *)g_hash_table_lookup(index_entries, item);
+}
+
+static void renumber_depths(struct Layer *l)
+{
+  GList *list;
+  IndexEntry *e;
+  int k;
+
+  for (k = 0, list = l->items; list != NULL; k++, list = list->next) {
+    e = index_entry((struct Item *)list->data);
+    if (e != NULL) e->depth = k;
+  }
+}
+
+/* a depth between those of the item's neighbors in the layer; when two
+   neighbors get too close for that, the whole layer is renumbered */
+
+static void set_depth(struct Layer *l, struct Item *item, IndexEntry *e)
+{
+  IndexEntry *prev, *next;
+
+  prev = (item->link->prev != NULL) ? index_entry((struct Item *)item->link->prev->data) : NULL;
+  next = (item->link->next != NULL) ? index_entry((struct Item *)item->link->next->data) : NULL;
+  if (prev == NULL && next == NULL) e->depth = 0.;
+  else if (next == NULL) e->depth = prev->depth + 1.;
+  else if (prev == NULL) e->depth = next->depth - 1.;
+  else {
+    e->depth = (prev->depth + next->depth)/2;
+    if (!(prev->depth < e->depth && e->depth < next->depth)) renumber_depths(l);
+  }
+}
+
+void free_layer_index(struct Layer *l)
+{
+  LayerIndex *idx = l->index;
+  int c, k;
+
+  if (idx == NULL) return;
+  // the layer's items may be gone already: find the entries from the cells
+  for (c = 0; c < idx->nx*idx->ny; c++) {
+    for (k = 0; k < idx->cells[c].n; k++)
+      g_hash_table_remove(index_entries, idx->cells[c].items[k]);
+    g_free(idx->cells[c].items);
+  }
+  for (k = 0; k < idx->big.n; k++)
+    g_hash_table_remove(index_entries, idx->big.items[k]);
+  g_free(idx->big.items);
+  g_free(idx->cells);
+  g_free(idx);
+  l->index = NULL;
+}
+
+static void build_layer_index(struct Layer *l)
+{
+  LayerIndex *idx;
+  IndexEntry *e;
+  GList *list;
+  struct Item *item;
+  struct BBox ext;
+  int n, k;
+
+  free_layer_index(l);
+  if (index_entries == NULL)
+    index_entries = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+  idx = g_new0(LayerIndex, 1);
+  l->index = idx;
+  idx->nbuilt = n = l->nitems;
+  for (k = 0, list = l->items; list != NULL; k++, list = list->next) {
+    item = (struct Item *)list->data;
+    if (k == 0) ext = item->bbox;
+    else {
+      if (item->bbox.left < ext.left) ext.left = item->bbox.left;
+      if (item->bbox.right > ext.right) ext.right = item->bbox.right;
+      if (item->bbox.top < ext.top) ext.top = item->bbox.top;
+      if (item->bbox.bottom > ext.bottom) ext.bottom = item->bbox.bottom;
+    }
+  }
+  if (n == 0 || !finite_sized(ext.left) || !finite_sized(ext.right) ||
+      !finite_sized(ext.top) || !finite_sized(ext.bottom)) {
+    ext.left = ext.right = ext.top = ext.bottom = 0.;
+  }
+
+  // aim for about one item per cell
+  idx->cell = sqrt(MAX((ext.right-ext.left)*(ext.bottom-ext.top), 1.)/MAX(n, 1));
+  if (idx->cell < INDEX_MIN_CELL) idx->cell = INDEX_MIN_CELL;
+  if (idx->cell > INDEX_MAX_CELL) idx->cell = INDEX_MAX_CELL;
+  if ((ext.right-ext.left)/idx->cell > INDEX_MAX_DIM-1)
+    idx->cell = (ext.right-ext.left)/(INDEX_MAX_DIM-1);
+  if ((ext.bottom-ext.top)/idx->cell > INDEX_MAX_DIM-1)
+    idx->cell = (ext.bottom-ext.top)/(INDEX_MAX_DIM-1);
+  idx->x0 = ext.left;
+  idx->y0 = ext.top;
+  idx->nx = (int)((ext.right-ext.left)/idx->cell) + 1;
+  idx->ny = (int)((ext.bottom-ext.top)/idx->cell) + 1;
+  idx->cells = g_new0(IndexCell, idx->nx*idx->ny);
+
+  for (k = 0, list = l->items; list != NULL; k++, list = list->next) {
+    item = (struct Item *)list->data;
+    e = g_new(IndexEntry, 1);
+    e->depth = k;
+    index_file(idx, item, e);
+    g_hash_table_insert(index_entries, item, e);
+  }
+}
+
+/* keeping the index up to date, one item at a time: these are called by
+   layer_insert_item_before(), layer_remove_item(), and whenever the bbox
+   of an item changes (update_item_bbox(), moving and resizing). Layers
+   that have no index yet are left alone */
+
+void layer_index_add_item(struct Layer *l, struct Item *item)
+{
+  IndexEntry *e;
+
+  if (l->index == NULL) return;
+  e = g_new(IndexEntry, 1);
+  index_file(l->index, item, e);
+  g_hash_table_insert(index_entries, item, e);
+  set_depth(l, item, e);
+}
+
+void layer_index_remove_item(struct Layer *l, struct Item *item)
+{
+  IndexEntry *e;
+
+  if (l->index == NULL || (e = index_entry(item)) == NULL) return;
+  index_unfile(item, e);
+  g_hash_table_remove(index_entries, item);
+}
+
+void layer_index_update_item(struct Item *item)
+{
+  IndexEntry *e;
+
+  if ((e = index_entry(item)) == NULL) return;
+  index_unfile(item, e);
+  index_file(e->idx, item, e);
+}
+
+typedef struct IndexHit {
+  double depth;
+  struct Item *item;
+} IndexHit;
+
+static int compare_hits(const void *a, const void *b)
+{
+  double da = ((const IndexHit *)a)->depth, db = ((const IndexHit *)b)->depth;
+  return (da < db) ? -1 : (da > db) ? 1 : 0;
+}
+
+/* the items of the layer whose bbox meets the given box (in the sense of
+   have_intersect), in stacking order; free the list with g_list_free() */
+
+GList *layer_items_in_bbox(struct Layer *l, struct BBox *box)
+{
+  LayerIndex *idx;
+  IndexCell *cell;
+  GList *list, *result;
+  struct Item *item;
+  struct BBox *b;
+  IndexHit *found;
+  int i, j, i0, j0, i1, j1, k, ki, kj, nfound;
+
+  if (l->nitems < INDEX_MIN_ITEMS) {
+    result = NULL;
+    for (list = l->items; list != NULL; list = list->next) {
+      item = (struct Item *)list->data;
+      if (have_intersect(&item->bbox, box)) result = g_list_prepend(result, item);
+    }
+    return g_list_reverse(result);
+  }
+
+  // lay the grid out again once the layer has grown well past it
+  if (l->index == NULL || l->nitems > 2*l->index->nbuilt + INDEX_MIN_ITEMS)
+    build_layer_index(l);
+  idx = l->index;
+
+  found = g_new(IndexHit, l->nitems);
+  nfound = 0;
+  cell_range(idx, box, &i0, &j0, &i1, &j1);
+  for (j = j0; j <= j1; j++)
+    for (i = i0; i <= i1; i++) {
+      cell = &idx->cells[j*idx->nx+i];
+      for (k = 0; k < cell->n; k++) {
+        b = &cell->items[k]->bbox;
+        if (!have_intersect(b, box)) continue;
+        /* an item spanning several cells is reported only from the cell
+           containing the top-left corner of its intersection with the box */
+        ki = (int)floor((MAX(b->left, box->left) - idx->x0)/idx->cell);
+        kj = (int)floor((MAX(b->top, box->top) - idx->y0)/idx->cell);
+        if (ki < i0) ki = i0;
+        if (kj < j0) kj = j0;
+        if (ki > i1) ki = i1;
+        if (kj > j1) kj = j1;
+        if (ki == i && kj == j) found[nfound++].item = cell->items[k];
+      }
+    }
+  for (k = 0; k < idx->big.n; k++)
+    if (have_intersect(&idx->big.items[k]->bbox, box))
+      found[nfound++].item = idx->big.items[k];
+
+  for (k = 0; k < nfound; k++)
+    found[k].depth = index_entry(found[k].item)->depth;
+  qsort(found, nfound, sizeof(IndexHit), compare_hits);
+  result = NULL;
+  for (k = nfound-1; k >= 0; k--)
+    result = g_list_prepend(result, found[k].item);
+  g_free(found);
+  return result;
+}
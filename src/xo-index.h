@@ -0,0 +1,26 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* spatial index (uniform grid over the item bboxes) for a layer.
+   It is built on the first query, then kept up to date one item at a
+   time: layer_insert_item_before() and layer_remove_item() add and remove
+   items, and whatever changes an item's bbox on a layer must then call
+   layer_index_update_item() (update_item_bbox() does). */
+
+void free_layer_index(struct Layer *l);
+void layer_index_add_item(struct Layer *l, struct Item *item);
+void layer_index_remove_item(struct Layer *l, struct Item *item);
+void layer_index_update_item(struct Item *item);
+GList *layer_items_in_bbox(struct Layer *l, struct BBox *box);
@@ -18,6 +18,7 @@
 #endif
 
 #include <math.h>
+#include <stdio.h>
 #include <string.h>
 #include <gtk/gtk.h>
 #include <libgnomecanvas/libgnomecanvas.h>
@@ -32,6 +33,12 @@
 #include "xo-paint.h"
 #include "xo-shapes.h"
 #include "xo-image.h"
+#include "xo-canvas.h"
+#include "xo-index.h"
+#include "xo-print.h"
+#include "xo-pages.h"
+#include "xo-path.h"
+#include "xo-arena.h"
 
 // some global constants
 
@@ -58,10 +65,13 @@ struct Page *new_page(struct Page *template)
   struct Page *pg = (struct Page *) g_memdup(template, sizeof(struct Page));
   struct Layer *l = g_new(struct Layer, 1);
   
-  l->items = NULL;
+  l->items = l->items_tail = NULL;
   l->nitems = 0;
+  l->index = NULL;
   pg->layers = g_list_append(NULL, l);
   pg->nlayers = 1;
+  pg->items_unmapped = FALSE;
+  pg->pdf_cache = NULL;
   pg->bg = (struct Background *)g_memdup(template->bg, sizeof(struct Background));
   pg->bg->canvas_item = NULL;
   if (pg->bg->type == BG_PIXMAP || pg->bg->type == BG_PDF) {
@@ -87,10 +97,13 @@ struct Page *new_page_with_bg(struct Background *bg, double width, double height
   struct Page *pg = g_new(struct Page, 1);
   struct Layer *l = g_new(struct Layer, 1);
   
-  l->items = NULL;
+  l->items = l->items_tail = NULL;
   l->nitems = 0;
+  l->index = NULL;
   pg->layers = g_list_append(NULL, l);
   pg->nlayers = 1;
+  pg->items_unmapped = FALSE;
+  pg->pdf_cache = NULL;
   pg->bg = bg;
   pg->bg->canvas_item = NULL;
   pg->height = height;
@@ -117,7 +130,7 @@ void set_current_page(gdouble *pt)
     if (ui.pageno == 0) break;
     page_change = TRUE;
     ui.pageno--;
-    tmppage = g_list_nth_data(journal.pages, ui.pageno);
+    tmppage = journal_page(ui.pageno);
     pt[1] += tmppage->height + VIEW_CONTINUOUS_SKIP;
   }
   while (ui.view_continuous && (pt[1] > tmppage->height + VIEW_CONTINUOUS_SKIP)) {
@@ -125,7 +138,7 @@ void set_current_page(gdouble *pt)
     pt[1] -= tmppage->height + VIEW_CONTINUOUS_SKIP;
     page_change = TRUE;
     ui.pageno++;
-    tmppage = g_list_nth_data(journal.pages, ui.pageno);
+    tmppage = journal_page(ui.pageno);
   }
   if (page_change) do_switch_page(ui.pageno, FALSE, FALSE);
 }
@@ -149,10 +162,10 @@ void realloc_cur_widths(int n)
 void prepare_new_undo(void)
 {
   struct UndoItem *u;
+  mark_undo_pages(undo); // the previous record is complete
   // add a new UndoItem on the stack  
-  u = (struct UndoItem *)g_malloc(sizeof(struct UndoItem));
+  u = g_new0(struct UndoItem, 1); // the fields its type doesn't use stay NULL
   u->next = undo;
-  u->multiop = 0;
   undo = u;
   ui.saved = FALSE;
   clear_redo_stack();
@@ -172,29 +185,27 @@ void clear_redo_stack(void)
   
   while (redo!=NULL) {
     if (redo->type == ITEM_STROKE) {
-      gnome_canvas_points_free(redo->item->path);
-      if (redo->item->brush.variable_width) g_free(redo->item->widths);
-      g_free(redo->item);
+      path_unref(journal.arena, redo->item->path);
+      arena_free_item(journal.arena, redo->item);
       /* the strokes are unmapped, so there are no associated canvas items */
     }
     else if (redo->type == ITEM_TEXT) {
       g_free(redo->item->text);
       g_free(redo->item->font_name);
-      g_free(redo->item);
+      arena_free_item(journal.arena, redo->item);
     }
     else if (redo->type == ITEM_IMAGE) {
       g_object_unref(redo->item->image);
       g_free(redo->item->image_png);
-      g_free(redo->item);
+      arena_free_item(journal.arena, redo->item);
     }
     else if (redo->type == ITEM_ERASURE || redo->type == ITEM_RECOGNIZER) {
       for (list = redo->erasurelist; list!=NULL; list=list->next) {
         erasure = (struct UndoErasureData *)list->data;
         for (repl = erasure->replacement_items; repl!=NULL; repl=repl->next) {
           it = (struct Item *)repl->data;
-          gnome_canvas_points_free(it->path);
-          if (it->brush.variable_width) g_free(it->widths);
-          g_free(it);
+          path_unref(journal.arena, it->path);
+          arena_free_item(journal.arena, it);
         }
         g_list_free(erasure->replacement_items);
         g_free(erasure);
@@ -222,11 +233,8 @@ void clear_redo_stack(void)
     else if (redo->type == ITEM_PASTE) {
       for (list = redo->itemlist; list!=NULL; list=list->next) {
         it = (struct Item *)list->data;
-        if (it->type == ITEM_STROKE) {
-          gnome_canvas_points_free(it->path);
-          if (it->brush.variable_width) g_free(it->widths);
-        }
-        g_free(it);
+        if (it->type == ITEM_STROKE) path_unref(journal.arena, it->path);
+        arena_free_item(journal.arena, it);
       }
       g_list_free(redo->itemlist);
     }
@@ -257,17 +265,15 @@ void clear_undo_stack(void)
     if (undo->type == ITEM_ERASURE || undo->type == ITEM_RECOGNIZER) {
       for (list = undo->erasurelist; list!=NULL; list=list->next) {
         erasure = (struct UndoErasureData *)list->data;
-        if (erasure->item->type == ITEM_STROKE) {
-          gnome_canvas_points_free(erasure->item->path);
-          if (erasure->item->brush.variable_width) g_free(erasure->item->widths);
-        }
+        if (erasure->item->type == ITEM_STROKE)
+          path_unref(journal.arena, erasure->item->path);
         if (erasure->item->type == ITEM_TEXT)
           { g_free(erasure->item->text); g_free(erasure->item->font_name); }
         if (erasure->item->type == ITEM_IMAGE) {
           g_object_unref(erasure->item->image);
           g_free(erasure->item->image_png);
         }
-        g_free(erasure->item);
+        arena_free_item(journal.arena, erasure->item);
         g_list_free(erasure->replacement_items);
         g_free(erasure);
       }
@@ -312,22 +318,20 @@ void clear_undo_stack(void)
 
 // free data structures 
 
-void delete_journal(struct Journal *j)
-{
-  while (j->pages!=NULL) {
-    delete_page((struct Page *)j->pages->data);
-    j->pages = g_list_delete_link(j->pages, j->pages);
-  }
-}
+/* the items of a page or layer live in an arena (normally journal.arena);
+   when the whole arena is about to be destroyed, a is NULL and only what
+   the items own outside of it (text, images) is freed */
 
-void delete_page(struct Page *pg)
+static void free_layer(struct Layer *l, struct Arena *a);
+
+static void free_page(struct Page *pg, struct Arena *a)
 {
   struct Layer *l;
   
   while (pg->layers!=NULL) {
     l = (struct Layer *)pg->layers->data;
     l->group = NULL;
-    delete_layer(l);
+    free_layer(l, a);
     pg->layers = g_list_delete_link(pg->layers, pg->layers);
   }
   if (pg->group!=NULL) gtk_object_destroy(GTK_OBJECT(pg->group));
@@ -337,17 +341,18 @@ void delete_page(struct Page *pg)
     if (pg->bg->filename != NULL) refstring_unref(pg->bg->filename);
   }
   g_free(pg->bg);
+  pdf_page_cache_free(pg);
   g_free(pg);
 }
 
-void delete_layer(struct Layer *l)
+static void free_layer(struct Layer *l, struct Arena *a)
 {
   struct Item *item;
   
   while (l->items!=NULL) {
     item = (struct Item *)l->items->data;
-    if (item->type == ITEM_STROKE && item->path != NULL) 
-      gnome_canvas_points_free(item->path);
+    if (item->type == ITEM_STROKE && a != NULL) 
+      path_unref(a, item->path);
     if (item->type == ITEM_TEXT) {
       g_free(item->font_name); g_free(item->text);
     }
@@ -356,13 +361,77 @@ void delete_layer(struct Layer *l)
       g_free(item->image_png);
     }
     // don't need to delete the canvas_item, as it's part of the group destroyed below
-    g_free(item);
+    if (a != NULL) arena_free_item(a, item);
     l->items = g_list_delete_link(l->items, l->items);
   }
   if (l->group!= NULL) gtk_object_destroy(GTK_OBJECT(l->group));
+  free_layer_index(l);
   g_free(l);
 }
 
+// the journal's items go with its arena, in one go
+
+void delete_journal(struct Journal *j)
+{
+  while (j->pages!=NULL) {
+    free_page((struct Page *)j->pages->data, NULL);
+    j->pages = g_list_delete_link(j->pages, j->pages);
+  }
+  arena_destroy(j->arena);
+  j->arena = NULL;
+}
+
+// a page or layer of the current journal (e.g. from the undo stack)
+
+void delete_page(struct Page *pg)
+{
+  free_page(pg, journal.arena);
+}
+
+void delete_layer(struct Layer *l)
+{
+  free_layer(l, journal.arena);
+}
+
+/* the items of a layer are a doubly linked list, and each item on a layer
+   knows its link (item->link), so that adding, removing and restacking an
+   item never walks the list. These keep items, items_tail and nitems in
+   sync; next == NULL means on top of the layer */
+
+void layer_append_item(struct Layer *l, struct Item *item)
+{
+  layer_insert_item_before(l, item, NULL);
+}
+
+void layer_insert_item_before(struct Layer *l, struct Item *item, struct Item *next)
+{
+  GList *link, *after;
+
+  if (next != NULL && next->link == NULL) next = NULL; // not on a layer: stack on top
+  link = g_list_alloc();
+  link->data = item;
+  after = (next != NULL) ? next->link : NULL;
+  link->next = after;
+  link->prev = (after != NULL) ? after->prev : l->items_tail;
+  if (link->prev != NULL) link->prev->next = link;
+  else l->items = link;
+  if (after != NULL) after->prev = link;
+  else l->items_tail = link;
+  item->link = link;
+  l->nitems++;
+  layer_index_add_item(l, item);
+}
+
+void layer_remove_item(struct Layer *l, struct Item *item)
+{
+  if (item->link == NULL) return;
+  layer_index_remove_item(l, item);
+  if (item->link == l->items_tail) l->items_tail = item->link->prev;
+  l->items = g_list_delete_link(l->items, item->link);
+  item->link = NULL;
+  l->nitems--;
+}
+
 // referenced strings
 
 struct Refstring *new_refstring(const char *s)
@@ -524,7 +593,8 @@ double get_pressure_multiplier(GdkEvent *event)
 void update_item_bbox(struct Item *item)
 {
   int i;
-  gdouble *p, h, w;
+  float *p;
+  gdouble h, w;
   
   if (item->type == ITEM_STROKE) {
     item->bbox.left = item->bbox.right = item->path->coords[0];
@@ -543,6 +613,7 @@ void update_item_bbox(struct Item *item)
     item->bbox.right = item->bbox.left + w;
     item->bbox.bottom = item->bbox.top + h;
   }
+  layer_index_update_item(item);
 }
 
 void make_page_clipbox(struct Page *pg)
@@ -562,30 +633,21 @@ void make_page_clipbox(struct Page *pg)
 void make_canvas_item_one(GnomeCanvasGroup *group, struct Item *item)
 {
   PangoFontDescription *font_desc;
-  GnomeCanvasPoints points;
-  int j;
+  GnomeCanvasPoints *pts;
 
   if (item->type == ITEM_STROKE) {
-    if (!item->brush.variable_width)
+    if (!item->brush.variable_width) {
+      pts = path_to_canvas_points(item->path);
       item->canvas_item = gnome_canvas_item_new(group,
-            gnome_canvas_line_get_type(), "points", item->path,   
+            gnome_canvas_line_get_type(), "points", pts,   
             "cap-style", GDK_CAP_ROUND, "join-style", GDK_JOIN_ROUND,
             "fill-color-rgba", item->brush.color_rgba,  
             "width-units", item->brush.thickness, NULL);
-    else {
-      item->canvas_item = gnome_canvas_item_new(group,
-            gnome_canvas_group_get_type(), NULL);
-      points.num_points = 2;
-      points.ref_count = 1;
-      for (j = 0; j < item->path->num_points-1; j++) {
-        points.coords = item->path->coords+2*j;
-        gnome_canvas_item_new((GnomeCanvasGroup *) item->canvas_item,
-              gnome_canvas_line_get_type(), "points", &points, 
-              "cap-style", GDK_CAP_ROUND, "join-style", GDK_JOIN_ROUND, 
-              "fill-color-rgba", item->brush.color_rgba,
-              "width-units", item->widths[j], NULL);
-      }
+      gnome_canvas_points_free(pts);
     }
+    else
+      item->canvas_item = xo_canvas_stroke_new(group, item->path->num_points,
+            item->path->coords, item->path->widths, item->brush.color_rgba);
   }
   if (item->type == ITEM_TEXT) {
     font_desc = pango_font_description_from_string(item->font_name);
@@ -623,6 +685,8 @@ void make_canvas_items(void)
       pg->group = (GnomeCanvasGroup *) gnome_canvas_item_new(
          gnome_canvas_root(canvas), gnome_canvas_clipgroup_get_type(), NULL);
       make_page_clipbox(pg);
+      // in lazy mode, the contents are mapped by update_lazy_pages()
+      if (ui.lazy_canvas) pg->items_unmapped = TRUE;
     }
     if (pg->bg->canvas_item == NULL) update_canvas_bg(pg);
     for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next) {
@@ -630,6 +694,7 @@ void make_canvas_items(void)
       if (l->group == NULL)
         l->group = (GnomeCanvasGroup *) gnome_canvas_item_new(
            pg->group, gnome_canvas_group_get_type(), NULL);
+      if (pg->items_unmapped) continue;
       for (itemlist = l->items; itemlist!=NULL; itemlist = itemlist->next) {
         item = (struct Item *)itemlist->data;
         if (item->canvas_item == NULL)
@@ -715,23 +780,28 @@ void update_canvas_bg(struct Page *pg)
 
   if (pg->bg->type == BG_PDF)
   {
+    // a group: the whole page, then the tiles at high zoom (see bgpdf_show_tiles)
+    pg->bg->canvas_item = gnome_canvas_item_new(pg->group,
+                               gnome_canvas_group_get_type(), NULL);
+    group = GNOME_CANVAS_GROUP(pg->bg->canvas_item);
+    lower_canvas_item_to(pg->group, pg->bg->canvas_item, NULL);
     if (pg->bg->pixbuf == NULL) return;
     is_well_scaled = (fabs(pg->bg->pixel_width - pg->width*ui.zoom) < 2.
                    && fabs(pg->bg->pixel_height - pg->height*ui.zoom) < 2.);
     if (is_well_scaled)
-      pg->bg->canvas_item = gnome_canvas_item_new(pg->group, 
+      gnome_canvas_item_new(group, 
           gnome_canvas_pixbuf_get_type(), 
           "pixbuf", pg->bg->pixbuf,
           "width-in-pixels", TRUE, "height-in-pixels", TRUE, 
           NULL);
     else
-      pg->bg->canvas_item = gnome_canvas_item_new(pg->group, 
+      gnome_canvas_item_new(group, 
           gnome_canvas_pixbuf_get_type(), 
           "pixbuf", pg->bg->pixbuf,
           "width", pg->width, "height", pg->height, 
           "width-set", TRUE, "height-set", TRUE, 
           NULL);
-    lower_canvas_item_to(pg->group, pg->bg->canvas_item, NULL);
+    bgpdf_show_tiles(pg, FALSE);
   }
 }
 
@@ -747,47 +817,275 @@ gboolean is_visible(struct Page *pg)
   return (MAX(ytop, pg->voffset) < MIN(ybot, pg->voffset+pg->height));
 }
 
-void rescale_bg_pixmaps(void)
+/* lazy canvas: only the pages near the viewport get canvas items for
+   their contents; the others just have their group and background */
+
+void map_page_items(struct Page *pg)
+{
+  GList *layerlist, *itemlist;
+  struct Layer *l;
+  struct Item *item;
+
+  if (pg->group == NULL) return;
+  for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next) {
+    l = (struct Layer *)layerlist->data;
+    if (l->group == NULL) continue;
+    for (itemlist = l->items; itemlist!=NULL; itemlist = itemlist->next) {
+      item = (struct Item *)itemlist->data;
+      if (item->canvas_item == NULL)
+        make_canvas_item_one(l->group, item);
+    }
+  }
+  pg->items_unmapped = FALSE;
+}
+
+void unmap_page_items(struct Page *pg)
+{
+  GList *layerlist, *itemlist;
+  struct Layer *l;
+  struct Item *item;
+
+  // don't pull the rug from under the current page, selection, or operation
+  if (pg == ui.cur_page || ui.cur_item_type != ITEM_NONE) return;
+  if (ui.selection != NULL && g_list_find(pg->layers, ui.selection->layer) != NULL) return;
+  
+  for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next) {
+    l = (struct Layer *)layerlist->data;
+    for (itemlist = l->items; itemlist!=NULL; itemlist = itemlist->next) {
+      item = (struct Item *)itemlist->data;
+      if (item->canvas_item != NULL) {
+        gtk_object_destroy(GTK_OBJECT(item->canvas_item));
+        item->canvas_item = NULL;
+      }
+    }
+  }
+  pg->items_unmapped = TRUE;
+}
+
+void update_lazy_pages(void)
 {
+  GtkAdjustment *v_adj;
+  double ytop, ybot, margin;
+  gboolean near, far;
   GList *pglist;
   struct Page *pg;
+  
+  if (!ui.lazy_canvas) return;
+  v_adj = gtk_layout_get_vadjustment(GTK_LAYOUT(canvas));
+  ytop = v_adj->value/ui.zoom;
+  ybot = (v_adj->value + v_adj->page_size) / ui.zoom;
+  margin = ui.lazy_canvas_margin;
+
+  for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next) {
+    pg = (struct Page *)pglist->data;
+    if (pg == ui.cur_page) near = TRUE;
+    else if (!ui.view_continuous) near = FALSE;
+    else near = (MAX(ytop-margin, pg->voffset) < MIN(ybot+margin, pg->voffset+pg->height));
+    // map within one margin, unmap beyond two, so scrolling back and forth doesn't thrash
+    if (ui.view_continuous)
+      far = !(MAX(ytop-2*margin, pg->voffset) < MIN(ybot+2*margin, pg->voffset+pg->height));
+    else far = !near;
+    if (near && pg->items_unmapped) map_page_items(pg);
+    else if (far && !near && !pg->items_unmapped) unmap_page_items(pg);
+  }
+}
+
+/* what an undo record concerns, found from its type the way the undo and
+   redo handlers find it: its page, its layer(s), or else one of its items,
+   whose page has to be looked up. A selection's items all live in the same
+   layer, so one of them is enough. An erasure's items are found through its
+   layer, where undoing puts them back. Only the fields that the record's
+   type sets are read */
+
+static void undo_record_target(struct UndoItem *u, struct Page **pg,
+                               struct Layer **l1, struct Layer **l2, struct Item **item)
+{
+  *pg = NULL; *l1 = *l2 = NULL; *item = NULL;
+  if (u->type == ITEM_STROKE || u->type == ITEM_TEXT || u->type == ITEM_TEXT_EDIT ||
+      u->type == ITEM_IMAGE || u->type == ITEM_PASTE || u->type == ITEM_ERASURE ||
+      u->type == ITEM_RECOGNIZER)
+    *l1 = u->layer;
+  else if (u->type == ITEM_MOVESEL) {
+    *l1 = u->layer;
+    *l2 = u->layer2;
+  }
+  else if (u->type == ITEM_NEW_BG_ONE || u->type == ITEM_NEW_BG_RESIZE ||
+           u->type == ITEM_PAPER_RESIZE || u->type == ITEM_NEW_PAGE ||
+           u->type == ITEM_DELETE_PAGE || u->type == ITEM_NEW_LAYER ||
+           u->type == ITEM_DELETE_LAYER)
+    *pg = u->page;
+  else if (u->type == ITEM_REPAINTSEL || u->type == ITEM_RESIZESEL) {
+    if (u->itemlist != NULL) *item = (struct Item *)u->itemlist->data;
+  }
+  else if (u->type == ITEM_TEXT_ATTRIB)
+    *item = u->item;
+  // ITEM_NEW_DEFAULT_BG concerns no page
+}
+
+static gboolean undo_touches_page(struct UndoItem *u, struct Page *pg)
+{
+  GList *layerlist, *itemlist;
+  struct Page *target_pg;
+  struct Layer *l, *l1, *l2;
+  struct Item *target;
+
+  undo_record_target(u, &target_pg, &l1, &l2, &target);
+  if (target_pg != NULL) return (pg == target_pg);
+  for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next) {
+    l = (struct Layer *)layerlist->data;
+    if (l1 != NULL && (l == l1 || l == l2)) return TRUE;
+    if (target != NULL)
+      for (itemlist = l->items; itemlist!=NULL; itemlist = itemlist->next)
+        if (itemlist->data == target) return TRUE;
+  }
+  return FALSE;
+}
+
+// map whichever unmapped page holds the items that an undo/redo will touch
+
+void map_undo_pages(struct UndoItem *u)
+{
+  GList *pglist;
+  struct Page *pg;
+  
+  if (!ui.lazy_canvas || u == NULL) return;
+  if (u->type == ITEM_NEW_BG_ONE || u->type == ITEM_NEW_BG_RESIZE ||
+      u->type == ITEM_PAPER_RESIZE || u->type == ITEM_NEW_DEFAULT_BG ||
+      u->type == ITEM_NEW_PAGE || u->type == ITEM_DELETE_PAGE) return;
+
+  for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next) {
+    pg = (struct Page *)pglist->data;
+    if (pg->items_unmapped && undo_touches_page(u, pg)) map_page_items(pg);
+  }
+}
+
+/* every change to the journal goes through the undo stack, so the pages
+   saved by the last PDF export (pg->pdf_cache) are dropped when an undo
+   record concerning them is completed, undone or redone. A record is only
+   marked once until it is undone or redone, so that a later export isn't
+   thrown away by the next change. */
+
+void page_changed(struct Page *pg)
+{
+  pdf_page_cache_free(pg);
+}
+
+void mark_undo_pages(struct UndoItem *u)
+{
+  GList *pglist;
+  struct Page *pg;
+
+  if (u == NULL || u->marked || u->type == ITEM_NEW_DEFAULT_BG) return;
+  u->marked = TRUE; // until it is undone or redone
+  for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next) {
+    pg = (struct Page *)pglist->data;
+    if (pg->pdf_cache != NULL && undo_touches_page(u, pg)) page_changed(pg);
+  }
+}
+
+static void rescale_bg_page(struct Page *pg, gboolean visible)
+{
+  GList *bgitems;
   GdkPixbuf *pix;
   gboolean is_well_scaled;
   gdouble zoom_to_request;
+
+  if (pg->bg->type == BG_PIXMAP && pg->bg->canvas_item!=NULL) {
+    g_object_get(G_OBJECT(pg->bg->canvas_item), "pixbuf", &pix, NULL);
+    if (pix!=pg->bg->pixbuf)
+      gnome_canvas_item_set(pg->bg->canvas_item, "pixbuf", pg->bg->pixbuf, NULL);
+    pg->bg->pixbuf_scale = 0;
+  }
+  if (pg->bg->type == BG_PDF) { 
+    // make pixmap scale to correct size if current one is wrong
+    is_well_scaled = (fabs(pg->bg->pixel_width - pg->width*ui.zoom) < 2.
+                   && fabs(pg->bg->pixel_height - pg->height*ui.zoom) < 2.);
+    bgitems = (pg->bg->canvas_item != NULL) ?
+                GNOME_CANVAS_GROUP(pg->bg->canvas_item)->item_list : NULL;
+    if (bgitems != NULL && !is_well_scaled &&
+        g_object_get_data(G_OBJECT(bgitems->data), "tile-id") == NULL) {
+      g_object_get(bgitems->data, "width-in-pixels", &is_well_scaled, NULL);
+      if (is_well_scaled)
+        gnome_canvas_item_set(GNOME_CANVAS_ITEM(bgitems->data),
+          "width", pg->width, "height", pg->height, 
+          "width-in-pixels", FALSE, "height-in-pixels", FALSE, 
+          "width-set", TRUE, "height-set", TRUE, 
+          NULL);
+    }
+    // with a bounded cache, offscreen pages would just get evicted again
+    if (ui.pdf_cache_size > 0 && !ui.progressive_bg && !visible) return;
+    // request an asynchronous update to a better pixmap if needed
+    if (bgpdf_page_is_tiled(pg, &zoom_to_request)) {
+      // the visible part in tiles, the whole page only as a backdrop
+      bgpdf_show_tiles(pg, TRUE);
+      zoom_to_request = sqrt(PDF_TILE_THRESHOLD/(pg->width*pg->height));
+    }
+    if (pg->bg->pixbuf_scale == zoom_to_request) return;
+    if (add_bgpdf_request(pg->bg->file_page_seq, zoom_to_request))
+      pg->bg->pixbuf_scale = zoom_to_request;
+  }
+}
+
+/* the pages seen by the last pass of rescale_visible_bg_pixmaps(),
+   forgotten whenever all the pages are looked at again */
+
+static GPtrArray *visible_bg_pages = NULL;
+static guint visible_bg_pid = 0;
+
+void rescale_bg_pixmaps(void)
+{
+  GList *pglist;
+  struct Page *pg;
   
+  if (visible_bg_pages != NULL) g_ptr_array_set_size(visible_bg_pages, 0);
   for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next) {
     pg = (struct Page *)pglist->data;
     // in progressive mode we scale only visible pages
     if (ui.progressive_bg && !is_visible(pg)) continue;
-
-    if (pg->bg->type == BG_PIXMAP && pg->bg->canvas_item!=NULL) {
-      g_object_get(G_OBJECT(pg->bg->canvas_item), "pixbuf", &pix, NULL);
-      if (pix!=pg->bg->pixbuf)
-        gnome_canvas_item_set(pg->bg->canvas_item, "pixbuf", pg->bg->pixbuf, NULL);
-      pg->bg->pixbuf_scale = 0;
-    }
-    if (pg->bg->type == BG_PDF) { 
-      // make pixmap scale to correct size if current one is wrong
-      is_well_scaled = (fabs(pg->bg->pixel_width - pg->width*ui.zoom) < 2.
-                     && fabs(pg->bg->pixel_height - pg->height*ui.zoom) < 2.);
-      if (pg->bg->canvas_item != NULL && !is_well_scaled) {
-        g_object_get(pg->bg->canvas_item, "width-in-pixels", &is_well_scaled, NULL);
-        if (is_well_scaled)
-          gnome_canvas_item_set(pg->bg->canvas_item,
-            "width", pg->width, "height", pg->height, 
-            "width-in-pixels", FALSE, "height-in-pixels", FALSE, 
-            "width-set", TRUE, "height-set", TRUE, 
-            NULL);
-      }
-      // request an asynchronous update to a better pixmap if needed
-      zoom_to_request = MIN(ui.zoom, MAX_SAFE_RENDER_DPI/72.0);
-      if (pg->bg->pixbuf_scale == zoom_to_request) continue;
-      if (add_bgpdf_request(pg->bg->file_page_seq, zoom_to_request))
-        pg->bg->pixbuf_scale = zoom_to_request;
-    }
+    rescale_bg_page(pg, is_visible(pg));
   }
 }
 
+static gboolean visible_bg_callback(gpointer data)
+{
+  GtkAdjustment *v_adj;
+  GPtrArray *seen;
+  GList *pglist;
+  struct Page *pg;
+  double ytop, ybot;
+  gboolean known;
+  int k;
+
+  visible_bg_pid = 0;
+  v_adj = gtk_layout_get_vadjustment(GTK_LAYOUT(canvas));
+  ytop = v_adj->value/ui.zoom;
+  ybot = (v_adj->value + v_adj->page_size)/ui.zoom;
+  seen = g_ptr_array_new();
+  for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next) {
+    pg = (struct Page *)pglist->data;
+    if (!ui.view_continuous) { if (pg != ui.cur_page) continue; }
+    else if (MAX(ytop, pg->voffset) >= MIN(ybot, pg->voffset+pg->height)) continue;
+    g_ptr_array_add(seen, pg);
+    known = FALSE;
+    if (visible_bg_pages != NULL)
+      for (k = 0; k < visible_bg_pages->len && !known; k++)
+        known = (g_ptr_array_index(visible_bg_pages, k) == pg);
+    if (!known) rescale_bg_page(pg, TRUE);
+    else if (pg->bg->type == BG_PDF) bgpdf_show_tiles(pg, TRUE); // tiles follow the scrolling
+  }
+  if (visible_bg_pages != NULL) g_ptr_array_free(visible_bg_pages, TRUE);
+  visible_bg_pages = seen;
+  return FALSE;
+}
+
+/* after scrolling or switching pages: only the pages that came into view
+   since the last pass need looking at, once per burst of events */
+
+void rescale_visible_bg_pixmaps(void)
+{
+  if (visible_bg_pid == 0) visible_bg_pid = g_idle_add(visible_bg_callback, NULL);
+}
+
 gboolean have_intersect(struct BBox *a, struct BBox *b)
 {
   return (MAX(a->top, b->top) <= MIN(a->bottom, b->bottom)) &&
@@ -1318,11 +1616,11 @@ void do_switch_page(int pg, gboolean rescroll, gboolean refresh_all)
         gnome_canvas_item_show(GNOME_CANVAS_ITEM(layer->group));
     }
   
-  ui.cur_page = g_list_nth_data(journal.pages, ui.pageno);
+  ui.cur_page = journal_page(ui.pageno);
   ui.layerno = ui.cur_page->nlayers-1;
   ui.cur_layer = (struct Layer *)(g_list_last(ui.cur_page->layers)->data);
   update_page_stuff();
-  if (ui.progressive_bg) rescale_bg_pixmaps();
+  if (ui.progressive_bg || ui.pdf_cache_size > 0) rescale_visible_bg_pixmaps();
  
   if (rescroll) { // scroll and force a refresh
 /* -- this seems to cause some display bugs ??
@@ -1339,6 +1637,19 @@ void do_switch_page(int pg, gboolean rescroll, gboolean refresh_all)
   }
 }
 
+/* setting a group's position makes the canvas update all of its items,
+   even if it hasn't moved: only do it for the pages that did move */
+
+static void move_page_group(struct Page *pg)
+{
+  double x, y;
+
+  g_object_get(pg->group, "x", &x, "y", &y, NULL);
+  if (x != pg->hoffset || y != pg->voffset)
+    gnome_canvas_item_set(GNOME_CANVAS_ITEM(pg->group), 
+        "x", pg->hoffset, "y", pg->voffset, NULL);
+}
+
 void update_page_stuff(void)
 {
   gchar tmp[10];
@@ -1351,28 +1662,24 @@ void update_page_stuff(void)
 
   // move the page groups to their rightful locations or hide them
   if (ui.view_continuous) {
-    vertpos = 0.; 
     maxwidth = 0.;
     for (i=0, pglist = journal.pages; pglist!=NULL; i++, pglist = pglist->next) {
       pg = (struct Page *)pglist->data;
+      pg->hoffset = 0.; pg->voffset = page_voffset(i);
       if (pg->group!=NULL) {
-        pg->hoffset = 0.; pg->voffset = vertpos;
-        gnome_canvas_item_set(GNOME_CANVAS_ITEM(pg->group), 
-            "x", pg->hoffset, "y", pg->voffset, NULL);
+        move_page_group(pg);
         gnome_canvas_item_show(GNOME_CANVAS_ITEM(pg->group));
       }
-      vertpos += pg->height + VIEW_CONTINUOUS_SKIP;
       if (pg->width > maxwidth) maxwidth = pg->width;
     }
-    vertpos -= VIEW_CONTINUOUS_SKIP;
+    vertpos = page_voffset(journal.npages) - VIEW_CONTINUOUS_SKIP;
     gnome_canvas_set_scroll_region(canvas, 0, 0, maxwidth, vertpos);
   } else {
     for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next) {
       pg = (struct Page *)pglist->data;
       if (pg == ui.cur_page && pg->group!=NULL) {
         pg->hoffset = 0.; pg->voffset = 0.;
-        gnome_canvas_item_set(GNOME_CANVAS_ITEM(pg->group), 
-            "x", pg->hoffset, "y", pg->voffset, NULL);
+        move_page_group(pg);
         gnome_canvas_item_show(GNOME_CANVAS_ITEM(pg->group));
       } else {
         if (pg->group!=NULL) gnome_canvas_item_hide(GNOME_CANVAS_ITEM(pg->group));
@@ -1380,6 +1687,7 @@ void update_page_stuff(void)
     }
     gnome_canvas_set_scroll_region(canvas, 0, 0, ui.cur_page->width, ui.cur_page->height);
   }
+  update_lazy_pages();
 
   // update the page / layer info at bottom of screen
 
@@ -1833,40 +2141,39 @@ void move_journal_items_by(GList *itemlist, double dx, double dy,
   GnomeCanvasItem *refitem;
   GList *link;
   int i;
-  double *pt;
+  float *pt;
   
   while (itemlist!=NULL) {
     item = (struct Item *)itemlist->data;
-    if (item->type == ITEM_STROKE)
+    if (item->type == ITEM_STROKE) {
+      path_make_writable(journal.arena, &item->path);
       for (pt=item->path->coords, i=0; i<item->path->num_points; i++, pt+=2)
         { pt[0] += dx; pt[1] += dy; }
+    }
     if (item->type == ITEM_STROKE || item->type == ITEM_TEXT || 
         item->type == ITEM_TEMP_TEXT || item->type == ITEM_IMAGE) {
       item->bbox.left += dx;
       item->bbox.right += dx;
       item->bbox.top += dy;
       item->bbox.bottom += dy;
+      layer_index_update_item(item);
     }
     if (l1 != l2) {
-      // find out where to insert
+      // find out where to insert: just above the item given by depths
+      layer_remove_item(l1, item);
       if (depths != NULL) {
         if (depths->data == NULL) link = l2->items;
         else {
-          link = g_list_find(l2->items, depths->data);
+          link = ((struct Item *)depths->data)->link;
           if (link != NULL) link = link->next;
         }
       } else link = NULL;
-      l2->items = g_list_insert_before(l2->items, link, item);
-      l2->nitems++;
-      l1->items = g_list_remove(l1->items, item);
-      l1->nitems--;
+      layer_insert_item_before(l2, item, (link != NULL) ? (struct Item *)link->data : NULL);
     }
     if (depths != NULL) { // also raise/lower the canvas items
       if (item->canvas_item!=NULL) {
-        if (depths->data == NULL) link = NULL;
-        else link = g_list_find(l2->items, depths->data);
-        if (link != NULL) refitem = ((struct Item *)(link->data))->canvas_item;
-        else refitem = NULL;
+        if (depths->data == NULL) refitem = NULL;
+        else refitem = ((struct Item *)depths->data)->canvas_item;
         lower_canvas_item_to(l2->group, item->canvas_item, refitem);
       }
       depths = depths->next;
@@ -1881,7 +2188,7 @@ void resize_journal_items_by(GList *itemlist, double scaling_x, double scaling_y
   struct Item *item;
   GList *list;
   double mean_scaling, temp;
-  double *pt, *wid;
+  float *pt, *wid;
   GnomeCanvasGroup *group;
   int i; 
   
@@ -1893,12 +2200,13 @@ void resize_journal_items_by(GList *itemlist, double scaling_x, double scaling_y
     item = (struct Item *)list->data;
     if (item->type == ITEM_STROKE) {
       item->brush.thickness = item->brush.thickness * mean_scaling;
+      path_make_writable(journal.arena, &item->path);
       for (i=0, pt=item->path->coords; i<item->path->num_points; i++, pt+=2) {
         pt[0] = pt[0]*scaling_x + offset_x;
         pt[1] = pt[1]*scaling_y + offset_y;
       }
       if (item->brush.variable_width)
-        for (i=0, wid=item->widths; i<item->path->num_points-1; i++, wid++)
+        for (i=0, wid=item->path->widths; i<item->path->num_points-1; i++, wid++)
           *wid = *wid * mean_scaling;
 
       item->bbox.left = item->bbox.left*scaling_x + offset_x;
@@ -1940,6 +2248,7 @@ void resize_journal_items_by(GList *itemlist, double scaling_x, double scaling_y
         item->bbox.bottom = temp;
       }
     }
+    layer_index_update_item(item);
     // redraw the item
     if (item->canvas_item!=NULL) {
       group = (GnomeCanvasGroup *) item->canvas_item->parent;
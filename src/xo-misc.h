@@ -26,6 +26,9 @@ void prepare_new_undo(void);
 void delete_journal(struct Journal *j);
 void delete_page(struct Page *pg);
 void delete_layer(struct Layer *l);
+void layer_append_item(struct Layer *l, struct Item *item);
+void layer_insert_item_before(struct Layer *l, struct Item *item, struct Item *next);
+void layer_remove_item(struct Layer *l, struct Item *item);
 
 // referenced strings
 
@@ -46,7 +49,14 @@ void make_canvas_items(void);
 void make_canvas_item_one(GnomeCanvasGroup *group, struct Item *item);
 void update_canvas_bg(struct Page *pg);
 gboolean is_visible(struct Page *pg);
+void map_page_items(struct Page *pg);
+void unmap_page_items(struct Page *pg);
+void update_lazy_pages(void);
+void map_undo_pages(struct UndoItem *u);
+void page_changed(struct Page *pg);
+void mark_undo_pages(struct UndoItem *u);
 void rescale_bg_pixmaps(void);
+void rescale_visible_bg_pixmaps(void);
 
 gboolean have_intersect(struct BBox *a, struct BBox *b);
 void lower_canvas_item_to(GnomeCanvasGroup *g, GnomeCanvasItem *item, GnomeCanvasItem *after);
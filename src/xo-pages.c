@@ -0,0 +1,178 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <string.h>
+#include <gtk/gtk.h>
+#include <libgnomecanvas/libgnomecanvas.h>
+
+#include "xournal.h"
+#include "xo-pages.h"
+
+static struct {
+  GList *head;          // journal.pages and journal.npages when last built,
+  int n;                // so that a replaced journal is noticed
+  int alloc;
+  struct Page **pages;
+  double *heights;      // the page heights plus VIEW_CONTINUOUS_SKIP
+  double *tree;         // 1-based Fenwick tree over the heights
+} ptab = { NULL, -1, 0, NULL, NULL, NULL };
+
+void invalidate_page_table(void)
+{
+  ptab.head = NULL;
+  ptab.n = -1;
+}
+
+static void grow_page_table(int n)
+{
+  if (n <= ptab.alloc) return;
+  ptab.alloc = MAX(n, 2*ptab.alloc);
+  ptab.pages = g_renew(struct Page *, ptab.pages, ptab.alloc);
+  ptab.heights = g_renew(double, ptab.heights, ptab.alloc);
+  ptab.tree = g_renew(double, ptab.tree, ptab.alloc+1);
+}
+
+// linear-time construction: each node passes its sum on to its parent
+
+static void build_tree(void)
+{
+  int i, j;
+
+  for (i = 1; i <= ptab.n; i++) ptab.tree[i] = ptab.heights[i-1];
+  for (i = 1; i <= ptab.n; i++) {
+    j = i + (i & -i);
+    if (j <= ptab.n) ptab.tree[j] += ptab.tree[i];
+  }
+}
+
+static void sync_page_table(void)
+{
+  GList *list;
+  struct Page *pg;
+  int i;
+
+  if (ptab.head == journal.pages && ptab.n == journal.npages) return;
+  grow_page_table(journal.npages);
+  for (i = 0, list = journal.pages; list != NULL && i < journal.npages; i++, list = list->next) {
+    pg = (struct Page *)list->data;
+    ptab.pages[i] = pg;
+    ptab.heights[i] = pg->height + VIEW_CONTINUOUS_SKIP;
+  }
+  ptab.n = i;
+  build_tree();
+  ptab.head = journal.pages;
+}
+
+/* the insertion and removal shift the arrays (a memmove of a few pointers
+   and doubles per page) and rebuild the tree in linear time; that is
+   negligible next to moving the canvas groups of the following pages */
+
+void journal_insert_page(struct Page *pg, int pageno)
+{
+  sync_page_table();
+  if (pageno < 0 || pageno > journal.npages) pageno = journal.npages;
+  journal.pages = g_list_insert(journal.pages, pg, pageno);
+  journal.npages++;
+  grow_page_table(journal.npages);
+  g_memmove(ptab.pages+pageno+1, ptab.pages+pageno, (ptab.n-pageno)*sizeof(struct Page *));
+  g_memmove(ptab.heights+pageno+1, ptab.heights+pageno, (ptab.n-pageno)*sizeof(double));
+  ptab.pages[pageno] = pg;
+  ptab.heights[pageno] = pg->height + VIEW_CONTINUOUS_SKIP;
+  ptab.n++;
+  build_tree();
+  ptab.head = journal.pages;
+}
+
+void journal_remove_page(struct Page *pg)
+{
+  int pageno;
+
+  pageno = journal_page_index(pg);
+  if (pageno < 0) return;
+  journal.pages = g_list_remove(journal.pages, pg);
+  journal.npages--;
+  g_memmove(ptab.pages+pageno, ptab.pages+pageno+1, (ptab.n-pageno-1)*sizeof(struct Page *));
+  g_memmove(ptab.heights+pageno, ptab.heights+pageno+1, (ptab.n-pageno-1)*sizeof(double));
+  ptab.n--;
+  build_tree();
+  ptab.head = journal.pages;
+}
+
+void page_resized(int pageno)
+{
+  double delta;
+  int i;
+
+  sync_page_table();
+  if (pageno < 0 || pageno >= ptab.n) return;
+  delta = ptab.pages[pageno]->height + VIEW_CONTINUOUS_SKIP - ptab.heights[pageno];
+  ptab.heights[pageno] += delta;
+  for (i = pageno+1; i <= ptab.n; i += (i & -i))
+    ptab.tree[i] += delta;
+}
+
+struct Page *journal_page(int pageno)
+{
+  sync_page_table();
+  if (pageno < 0 || pageno >= ptab.n) return NULL;
+  return ptab.pages[pageno];
+}
+
+int journal_page_index(struct Page *pg)
+{
+  int i;
+
+  sync_page_table();
+  for (i = 0; i < ptab.n; i++)
+    if (ptab.pages[i] == pg) return i;
+  return -1;
+}
+
+// the continuous-mode offset of the top of the page
+
+double page_voffset(int pageno)
+{
+  double sum;
+  int i;
+
+  sync_page_table();
+  if (pageno > ptab.n) pageno = ptab.n;
+  sum = 0.;
+  for (i = pageno; i > 0; i -= (i & -i))
+    sum += ptab.tree[i];
+  return sum;
+}
+
+// the last page whose top is at or above y (the first page if none)
+
+int page_at_voffset(double y)
+{
+  int pos, step;
+
+  sync_page_table();
+  if (ptab.n == 0) return 0;
+  for (step = 1; 2*step <= ptab.n; step *= 2);
+  for (pos = 0; step > 0; step /= 2)
+    if (pos+step <= ptab.n && ptab.tree[pos+step] <= y) {
+      pos += step;
+      y -= ptab.tree[pos];
+    }
+  // pos pages lie entirely above y
+  return (pos < ptab.n) ? pos : ptab.n-1;
+}
@@ -0,0 +1,31 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* random-access table of journal.pages: the pages in an array, and a
+   Fenwick tree over their heights (plus VIEW_CONTINUOUS_SKIP) giving the
+   continuous-mode vertical offsets. Pages are added and removed through
+   journal_insert_page() and journal_remove_page(), and page_resized() is
+   called when a page's height changes. Wholesale changes (new or closed
+   journal, resizing all pages) call invalidate_page_table(): the table
+   is then rebuilt on the next query. */
+
+void invalidate_page_table(void);
+void journal_insert_page(struct Page *pg, int pageno);
+void journal_remove_page(struct Page *pg);
+void page_resized(int pageno);
+struct Page *journal_page(int pageno);
+int journal_page_index(struct Page *pg);
+double page_voffset(int pageno);
+int page_at_voffset(double y);
@@ -28,6 +28,9 @@
 #include "xo-support.h"
 #include "xo-misc.h"
 #include "xo-paint.h"
+#include "xo-index.h"
+#include "xo-path.h"
+#include "xo-arena.h"
 
 /************** drawing nice cursors *********/
 
@@ -194,41 +197,15 @@ void update_cursor_for_resize(double *pt)
 
 /************** painting strokes *************/
 
-#define SUBDIVIDE_MAXDIST 5.0
-
-void subdivide_cur_path(null)
-{
-  int n, pieces, k;
-  double *p;
-  double x0, y0, x1, y1;
-
-  for (n=0, p=ui.cur_path.coords; n<ui.cur_path.num_points-1; n++, p+=2) {
-    pieces = (int)floor(hypot(p[2]-p[0], p[3]-p[1])/SUBDIVIDE_MAXDIST);
-    if (pieces>1) {
-      x0 = p[0]; y0 = p[1];
-      x1 = p[2]; y1 = p[3];
-      realloc_cur_path(ui.cur_path.num_points+pieces-1);
-      g_memmove(ui.cur_path.coords+2*(n+pieces), ui.cur_path.coords+2*(n+1),
-                    2*(ui.cur_path.num_points-n-1)*sizeof(double));
-      p = ui.cur_path.coords+2*n;
-      ui.cur_path.num_points += pieces-1;
-      n += (pieces-1);
-      for (k=1; k<pieces; k++) {
-        p+=2;
-        p[0] = x0 + k*(x1-x0)/pieces;
-        p[1] = y0 + k*(y1-y0)/pieces;
-      } 
-    }
-  }
-}
+#define SUBDIVIDE_MAXDIST 5.0 // see the eraser tool
 
 void create_new_stroke(GdkEvent *event)
 {
   ui.cur_item_type = ITEM_STROKE;
-  ui.cur_item = g_new(struct Item, 1);
+  ui.cur_item = arena_new_item(journal.arena);
   ui.cur_item->type = ITEM_STROKE;
   g_memmove(&(ui.cur_item->brush), ui.cur_brush, sizeof(struct Brush));
-  ui.cur_item->path = &ui.cur_path;
+  ui.cur_item->path = NULL; // the points are in ui.cur_path until finalize_stroke()
   realloc_cur_path(2);
   ui.cur_path.num_points = 1;
   get_pointer_coords(event, ui.cur_path.coords);
@@ -301,25 +278,15 @@ void finalize_stroke(void)
     ui.cur_item->brush.variable_width = FALSE;
   }
   
-  if (!ui.cur_item->brush.variable_width)
-    subdivide_cur_path(); // split the segment so eraser will work
-
-  ui.cur_item->path = gnome_canvas_points_new(ui.cur_path.num_points);
-  g_memmove(ui.cur_item->path->coords, ui.cur_path.coords, 
-      2*ui.cur_path.num_points*sizeof(double));
-  if (ui.cur_item->brush.variable_width)
-    ui.cur_item->widths = (gdouble *)g_memdup(ui.cur_widths, 
-                            (ui.cur_path.num_points-1)*sizeof(gdouble));
-  else ui.cur_item->widths = NULL;
+  ui.cur_item->path = path_new_from_doubles(journal.arena, ui.cur_path.num_points, ui.cur_path.coords,
+      ui.cur_item->brush.variable_width ? ui.cur_widths : NULL);
   update_item_bbox(ui.cur_item);
   ui.cur_path.num_points = 0;
 
-  if (!ui.cur_item->brush.variable_width) {
-    // destroy the entire group of temporary line segments
-    gtk_object_destroy(GTK_OBJECT(ui.cur_item->canvas_item));
-    // make a new line item to replace it
-    make_canvas_item_one(ui.cur_layer->group, ui.cur_item);
-  }
+  // destroy the entire group of temporary line segments
+  gtk_object_destroy(GTK_OBJECT(ui.cur_item->canvas_item));
+  // make a new line (or variable-width stroke) item to replace it
+  make_canvas_item_one(ui.cur_layer->group, ui.cur_item);
 
   // add undo information
   prepare_new_undo();
@@ -328,122 +295,232 @@ void finalize_stroke(void)
   undo->layer = ui.cur_layer;
 
   // store the item on top of the layer stack
-  ui.cur_layer->items = g_list_append(ui.cur_layer->items, ui.cur_item);
-  ui.cur_layer->nitems++;
+  layer_append_item(ui.cur_layer, ui.cur_item);
   ui.cur_item = NULL;
   ui.cur_item_type = ITEM_NONE;
 }
 
 /************** eraser tool *************/
 
-void erase_stroke_portions(struct Item *item, double x, double y, double radius,
-                   gboolean whole_strokes, struct UndoErasureData *erasure)
+/* the part of the segment p[0..1]-p[2..3], parametrized by t in [0,1],
+   within distance radius of (x,y) */
+
+static gboolean segment_hits_disk(double *p, double x, double y, double radius,
+                                  double *t0, double *t1)
 {
-  int i;
-  double *pt;
-  struct Item *newhead, *newtail;
-  gboolean need_recalc = FALSE;
-
-  for (i=0, pt=item->path->coords; i<item->path->num_points; i++, pt+=2) {
-    if (hypot(pt[0]-x, pt[1]-y) <= radius) { // found an intersection
-      // FIXME: need to test if line SEGMENT hits the circle
-      // hide the canvas item, and create erasure data if needed
-      if (erasure == NULL) {
-        item->type = ITEM_TEMP_STROKE;
-        gnome_canvas_item_hide(item->canvas_item);  
-            /*  we'll use this hidden item as an insertion point later */
-        erasure = (struct UndoErasureData *)g_malloc(sizeof(struct UndoErasureData));
-        item->erasure = erasure;
-        erasure->item = item;
-        erasure->npos = g_list_index(ui.cur_layer->items, item);
-        erasure->nrepl = 0;
-        erasure->replacement_items = NULL;
-      }
-      // split the stroke
-      newhead = newtail = NULL;
-      if (!whole_strokes) {
-        if (i>=2) {
-          newhead = (struct Item *)g_malloc(sizeof(struct Item));
-          newhead->type = ITEM_STROKE;
-          g_memmove(&newhead->brush, &item->brush, sizeof(struct Brush));
-          newhead->path = gnome_canvas_points_new(i);
-          g_memmove(newhead->path->coords, item->path->coords, 2*i*sizeof(double));
-          if (newhead->brush.variable_width)
-            newhead->widths = (gdouble *)g_memdup(item->widths, (i-1)*sizeof(gdouble));
-          else newhead->widths = NULL;
-        }
-        while (++i < item->path->num_points) {
-          pt+=2;
-          if (hypot(pt[0]-x, pt[1]-y) > radius) break;
-        }
-        if (i<item->path->num_points-1) {
-          newtail = (struct Item *)g_malloc(sizeof(struct Item));
-          newtail->type = ITEM_STROKE;
-          g_memmove(&newtail->brush, &item->brush, sizeof(struct Brush));
-          newtail->path = gnome_canvas_points_new(item->path->num_points-i);
-          g_memmove(newtail->path->coords, item->path->coords+2*i, 
-                           2*(item->path->num_points-i)*sizeof(double));
-          if (newtail->brush.variable_width)
-            newtail->widths = (gdouble *)g_memdup(item->widths+i, 
-              (item->path->num_points-i-1)*sizeof(gdouble));
-          else newtail->widths = NULL;
-          newtail->canvas_item = NULL;
-        }
-      }
-      if (item->type == ITEM_STROKE) { 
-        // it's inside an erasure list - we destroy it
-        gnome_canvas_points_free(item->path);
-        if (item->brush.variable_width) g_free(item->widths);
-        if (item->canvas_item != NULL) 
-          gtk_object_destroy(GTK_OBJECT(item->canvas_item));
-        erasure->nrepl--;
-        erasure->replacement_items = g_list_remove(erasure->replacement_items, item);
-        g_free(item);
-      }
-      // add the new head
-      if (newhead != NULL) {
-        update_item_bbox(newhead);
-        make_canvas_item_one(ui.cur_layer->group, newhead);
-        lower_canvas_item_to(ui.cur_layer->group,
-                  newhead->canvas_item, erasure->item->canvas_item);
-        erasure->replacement_items = g_list_prepend(erasure->replacement_items, newhead);
-        erasure->nrepl++;
-        // prepending ensures it won't get processed twice
-      }
-      // recurse into the new tail
-      need_recalc = (newtail!=NULL);
-      if (newtail == NULL) break;
-      item = newtail;
-      erasure->replacement_items = g_list_prepend(erasure->replacement_items, newtail);
-      erasure->nrepl++;
-      i=0; pt=item->path->coords;
+  double dx, dy, fx, fy, a, b, c, disc;
+  
+  dx = p[2]-p[0]; dy = p[3]-p[1];
+  fx = p[0]-x; fy = p[1]-y;
+  a = dx*dx+dy*dy;
+  b = fx*dx+fy*dy;
+  c = fx*fx+fy*fy-radius*radius;
+  if (a == 0.) { *t0 = 0.; *t1 = 1.; return (c <= 0.); }
+  disc = b*b-a*c;
+  if (disc < 0.) return FALSE;
+  *t0 = (-b-sqrt(disc))/a;
+  *t1 = (-b+sqrt(disc))/a;
+  if (*t1 < 0. || *t0 > 1.) return FALSE;
+  if (*t0 < 0.) *t0 = 0.;
+  if (*t1 > 1.) *t1 = 1.;
+  return TRUE;
+}
+
+/* older versions split constant-width strokes into segments shorter than
+   2*SUBDIVIDE_MAXDIST, and the eraser removed the points within its radius.
+   On the strokes they saved, we give the same pieces, except where a segment
+   crosses the disk with both ends outside it: it used to survive, it goes
+   now. Only longer segments, which they never left, are cut at the edge of
+   the disk (and only in constant-width strokes, pressure strokes were never
+   split). The segments are tested in chunks of PATH_CHUNK, and a chunk
+   whose bounding box the disk misses is skipped */
+
+#define ERASER_CUT_MINLEN (2*SUBDIVIDE_MAXDIST)
+
+static gboolean chunk_misses_disk(struct BBox *box, double x, double y, double radius)
+{
+  return (x < box->left - radius || x > box->right + radius ||
+          y < box->top - radius || y > box->bottom + radius);
+}
+
+// does the eraser disk at (x,y) meet the path?
+
+gboolean erase_path_hits(struct Arena *a, struct Path *path, double x, double y, double radius)
+{
+  struct BBox *boxes;
+  double pt[4], t0, t1;
+  float *p;
+  int i, nseg;
+
+  if (path->num_points == 1)
+    return (hypot(path->coords[0]-x, path->coords[1]-y) <= radius);
+  boxes = path_get_chunk_boxes(a, path);
+  nseg = path->num_points-1;
+  for (i = 0; i < nseg; i++) {
+    if (i % PATH_CHUNK == 0 && chunk_misses_disk(boxes + i/PATH_CHUNK, x, y, radius)) {
+      i += PATH_CHUNK-1;
+      continue;
+    }
+    p = path->coords + 2*i;
+    pt[0] = p[0]; pt[1] = p[1]; pt[2] = p[2]; pt[3] = p[3];
+    if (segment_hits_disk(pt, x, y, radius, &t0, &t1)) return TRUE;
+  }
+  return FALSE;
+}
+
+/* the pieces of the path left by the eraser disk at (x,y), i.e. the runs
+   of segments that miss it: func gets the coordinates, the widths (if the
+   path has any), the number of points, and the index in the path of the
+   first point, or -1 if the piece has a cut end. With cut_long, segments
+   at least ERASER_CUT_MINLEN long are cut at the edge of the disk rather
+   than removed */
+
+void erase_path_pieces(struct Arena *a, struct Path *path, gboolean cut_long,
+                       double x, double y, double radius, ErasePieceFunc func, gpointer data)
+{
+  struct BBox *boxes;
+  double pt[4], t0, t1, *coords, *widths;
+  float *p;
+  int i, n, np, first;
+  gboolean miss, cut;
+
+  n = path->num_points;
+  if (n < 2) return;
+  boxes = path_get_chunk_boxes(a, path);
+  coords = g_new(double, 2*n+4);
+  widths = g_new(double, n+1);
+  np = 0;
+  first = -1;
+  miss = FALSE;
+  for (i=0, p=path->coords; i<n-1; i++, p+=2) {
+    if (i % PATH_CHUNK == 0) miss = chunk_misses_disk(boxes + i/PATH_CHUNK, x, y, radius);
+    pt[0] = p[0]; pt[1] = p[1]; pt[2] = p[2]; pt[3] = p[3];
+    if (miss || !segment_hits_disk(pt, x, y, radius, &t0, &t1)) {
+      if (np == 0) { coords[0] = pt[0]; coords[1] = pt[1]; np = 1; first = i; }
+      coords[2*np] = pt[2]; coords[2*np+1] = pt[3];
+      if (path->widths != NULL) widths[np-1] = path->widths[i];
+      np++;
+      continue;
+    }
+    cut = (cut_long && hypot(pt[2]-pt[0], pt[3]-pt[1]) >= ERASER_CUT_MINLEN);
+    if (cut && t0 > 0.) { // keep the part before the eraser
+      if (np == 0) { coords[0] = pt[0]; coords[1] = pt[1]; np = 1; }
+      coords[2*np] = pt[0] + t0*(pt[2]-pt[0]);
+      coords[2*np+1] = pt[1] + t0*(pt[3]-pt[1]);
+      if (path->widths != NULL) widths[np-1] = path->widths[i];
+      np++;
+      first = -1;
+    }
+    if (np >= 2) func(coords, widths, np, first, data);
+    np = 0;
+    if (cut && t1 < 1.) { // restart after the eraser, with the rest of the segment
+      coords[0] = pt[0] + t1*(pt[2]-pt[0]);
+      coords[1] = pt[1] + t1*(pt[3]-pt[1]);
+      coords[2] = pt[2]; coords[3] = pt[3];
+      if (path->widths != NULL) widths[0] = path->widths[i];
+      np = 2;
+      first = -1;
     }
   }
-  // add the tail if needed
-  if (!need_recalc) return;
-  update_item_bbox(item);
-  make_canvas_item_one(ui.cur_layer->group, item);
-  lower_canvas_item_to(ui.cur_layer->group, item->canvas_item, 
-                                      erasure->item->canvas_item);
+  if (np >= 2) func(coords, widths, np, first, data);
+  g_free(coords);
+  g_free(widths);
+}
+
+/* a piece made of the points first..first+n-1 of the stroke (first = -1
+   if it has a cut end) shares the stroke's data, unless it is so small
+   that keeping the whole data alive for it would waste memory (measured
+   against the original stroke, which a piece of a piece still holds) */
+
+#define ERASURE_SHARE_FRACTION 4
+
+struct ErasureTarget {
+  struct Item *item;
+  struct UndoErasureData *erasure;
+};
+
+static void add_erasure_piece(double *coords, double *widths, int n, int first, gpointer data)
+{
+  struct ErasureTarget *target = (struct ErasureTarget *)data;
+  struct Item *item, *piece;
+  int total;
+  
+  item = target->item;
+  piece = arena_new_item(journal.arena);
+  piece->type = ITEM_STROKE;
+  g_memmove(&piece->brush, &item->brush, sizeof(struct Brush));
+  total = (item->path->parent != NULL) ? item->path->parent->num_points : item->path->num_points;
+  if (first >= 0 && ERASURE_SHARE_FRACTION*n >= total)
+    piece->path = path_new_piece(journal.arena, item->path, first, n);
+  else
+    piece->path = path_new_from_doubles(journal.arena, n, coords,
+        piece->brush.variable_width ? widths : NULL);
+  update_item_bbox(piece);
+  make_canvas_item_one(ui.cur_layer->group, piece);
+  lower_canvas_item_to(ui.cur_layer->group, piece->canvas_item, target->erasure->item->canvas_item);
+  // prepending ensures it won't get processed twice
+  target->erasure->replacement_items = g_list_prepend(target->erasure->replacement_items, piece);
+  target->erasure->nrepl++;
 }
 
+// erase the parts of the stroke that pass within the eraser radius
+
+void erase_stroke_portions(struct Item *item, double x, double y, double radius,
+                   gboolean whole_strokes, struct UndoErasureData *erasure)
+{
+  struct ErasureTarget target;
+
+  if (!erase_path_hits(journal.arena, item->path, x, y, radius)) return;
+
+  // hide the canvas item, and create erasure data if needed
+  if (erasure == NULL) {
+    item->type = ITEM_TEMP_STROKE;
+    if (item->canvas_item != NULL)
+      gnome_canvas_item_hide(item->canvas_item);  
+        /*  we'll use this hidden item as an insertion point later */
+    erasure = (struct UndoErasureData *)g_malloc(sizeof(struct UndoErasureData));
+    item->erasure = erasure;
+    erasure->item = item;
+    erasure->next = NULL; // filled in by finalize_erasure()
+    erasure->nrepl = 0;
+    erasure->replacement_items = NULL;
+  }
+
+  if (!whole_strokes) {
+    target.item = item;
+    target.erasure = erasure;
+    erase_path_pieces(journal.arena, item->path, !item->brush.variable_width,
+                      x, y, radius, add_erasure_piece, &target);
+  }
+
+  if (item->type == ITEM_STROKE) { 
+    // it's inside an erasure list - we destroy it
+    path_unref(journal.arena, item->path);
+    if (item->canvas_item != NULL) 
+      gtk_object_destroy(GTK_OBJECT(item->canvas_item));
+    erasure->nrepl--;
+    erasure->replacement_items = g_list_remove(erasure->replacement_items, item);
+    arena_free_item(journal.arena, item);
+  }
+}
 
-void do_eraser(GdkEvent *event, double radius, gboolean whole_strokes)
+void do_eraser_at(double *pos, double radius, gboolean whole_strokes)
 {
   struct Item *item, *repl;
-  GList *itemlist, *repllist;
-  double pos[2];
+  GList *itemlist, *list, *repllist;
   struct BBox eraserbox;
   
-  get_pointer_coords(event, pos);
   eraserbox.left = pos[0]-radius;
   eraserbox.right = pos[0]+radius;
   eraserbox.top = pos[1]-radius;
   eraserbox.bottom = pos[1]+radius;
-  for (itemlist = ui.cur_layer->items; itemlist!=NULL; itemlist = itemlist->next) {
-    item = (struct Item *)itemlist->data;
+  /* the layer's item list doesn't change until finalize_erasure(), and
+     a partly erased stroke keeps its original bbox, which contains those
+     of its replacement items */
+  itemlist = layer_items_in_bbox(ui.cur_layer, &eraserbox);
+  for (list = itemlist; list!=NULL; list = list->next) {
+    item = (struct Item *)list->data;
     if (item->type == ITEM_STROKE) {
-      if (!have_intersect(&(item->bbox), &eraserbox)) continue;
       erase_stroke_portions(item, pos[0], pos[1], radius, whole_strokes, NULL);
     } else if (item->type == ITEM_TEMP_STROKE) {
       repllist = item->erasure->replacement_items;
@@ -456,6 +533,7 @@ void do_eraser(GdkEvent *event, double radius, gboolean whole_strokes)
       }
     }
   }
+  g_list_free(itemlist);
 }
 
 void finalize_erasure(void)
@@ -474,27 +552,27 @@ void finalize_erasure(void)
     itemlist = itemlist->next;
     if (item->type != ITEM_TEMP_STROKE) continue;
     item->type = ITEM_STROKE;
-    ui.cur_layer->items = g_list_remove(ui.cur_layer->items, item);
+    // the items above haven't been touched yet: the next one is the original neighbor
+    item->erasure->next = (itemlist != NULL) ? (struct Item *)itemlist->data : NULL;
+    // add the new strokes into the current layer, where the item was
+    for (partlist = item->erasure->replacement_items; partlist!=NULL; partlist = partlist->next)
+      layer_insert_item_before(ui.cur_layer, (struct Item *)partlist->data, item);
+    layer_remove_item(ui.cur_layer, item);
     // the item has an invisible canvas item, which used to act as anchor
     if (item->canvas_item!=NULL) {
       gtk_object_destroy(GTK_OBJECT(item->canvas_item));
       item->canvas_item = NULL;
     }
-    undo->erasurelist = g_list_append(undo->erasurelist, item->erasure);
-    // add the new strokes into the current layer
-    for (partlist = item->erasure->replacement_items; partlist!=NULL; partlist = partlist->next)
-      ui.cur_layer->items = g_list_insert_before(
-                      ui.cur_layer->items, itemlist, partlist->data);
-    ui.cur_layer->nitems += item->erasure->nrepl-1;
+    undo->erasurelist = g_list_prepend(undo->erasurelist, item->erasure);
   }
+  undo->erasurelist = g_list_reverse(undo->erasurelist);
     
   ui.cur_item = NULL;
   ui.cur_item_type = ITEM_NONE;
   
   /* NOTE: the list of erasures goes in the depth order of the layer;
-     this guarantees that, upon undo, the erasure->npos fields give the
-     correct position where each item should be reinserted as the list
-     is traversed in the forward direction */
+     upon undo it is traversed backwards, so that each item's erasure->next
+     is back on the layer by the time the item is reinserted under it */
 }
 
 
@@ -555,7 +633,7 @@ void start_text(GdkEvent *event, struct Item *item)
   ui.cur_item_type = ITEM_TEXT;
 
   if (item==NULL) {
-    item = g_new(struct Item, 1);
+    item = arena_new_item(journal.arena);
     item->text = NULL;
     item->canvas_item = NULL;
     item->bbox.left = pt[0];
@@ -565,8 +643,7 @@ void start_text(GdkEvent *event, struct Item *item)
     item->font_name = g_strdup(ui.font_name);
     item->font_size = ui.font_size;
     g_memmove(&(item->brush), ui.cur_brush, sizeof(struct Brush));
-    ui.cur_layer->items = g_list_append(ui.cur_layer->items, item);
-    ui.cur_layer->nitems++;
+    layer_append_item(ui.cur_layer, item);
   }
   
   item->type = ITEM_TEMP_TEXT;
@@ -639,13 +716,13 @@ void end_text(void)
       undo->layer = ui.cur_layer;
       erasure = (struct UndoErasureData *)g_malloc(sizeof(struct UndoErasureData));
       erasure->item = ui.cur_item;
-      erasure->npos = g_list_index(ui.cur_layer->items, ui.cur_item);
+      erasure->next = (ui.cur_item->link->next != NULL) ?
+                         (struct Item *)ui.cur_item->link->next->data : NULL;
       erasure->nrepl = 0;
       erasure->replacement_items = NULL;
       undo->erasurelist = g_list_append(NULL, erasure);
     }
-    ui.cur_layer->items = g_list_remove(ui.cur_layer->items, ui.cur_item);
-    ui.cur_layer->nitems--;
+    layer_remove_item(ui.cur_layer, ui.cur_item);
     ui.cur_item = NULL;
     return;
   }
@@ -703,33 +780,39 @@ void rescale_text_items(void)
 
 struct Item *click_is_in_text(struct Layer *layer, double x, double y)
 {
-  GList *itemlist;
+  GList *itemlist, *list;
   struct Item *item, *val;
+  struct BBox box;
   
   val = NULL;
-  for (itemlist = layer->items; itemlist!=NULL; itemlist = itemlist->next) {
-    item = (struct Item *)itemlist->data;
+  box.left = box.right = x;
+  box.top = box.bottom = y;
+  itemlist = layer_items_in_bbox(layer, &box);
+  for (list = itemlist; list!=NULL; list = list->next) {
+    item = (struct Item *)list->data;
     if (item->type != ITEM_TEXT) continue;
-    if (x<item->bbox.left || x>item->bbox.right) continue;
-    if (y<item->bbox.top || y>item->bbox.bottom) continue;
     val = item;
   }
+  g_list_free(itemlist);
   return val;
 }
 
 struct Item *click_is_in_text_or_image(struct Layer *layer, double x, double y)
 {
-  GList *itemlist;
+  GList *itemlist, *list;
   struct Item *item, *val;
+  struct BBox box;
   
   val = NULL;
-  for (itemlist = layer->items; itemlist!=NULL; itemlist = itemlist->next) {
-    item = (struct Item *)itemlist->data;
+  box.left = box.right = x;
+  box.top = box.bottom = y;
+  itemlist = layer_items_in_bbox(layer, &box);
+  for (list = itemlist; list!=NULL; list = list->next) {
+    item = (struct Item *)list->data;
     if (item->type != ITEM_TEXT && item->type != ITEM_IMAGE) continue;
-    if (x<item->bbox.left || x>item->bbox.right) continue;
-    if (y<item->bbox.top || y>item->bbox.bottom) continue;
     val = item;
   }
+  g_list_free(itemlist);
   return val;
 }
 
@@ -23,8 +23,18 @@ void continue_stroke(GdkEvent *event);
 void finalize_stroke(void);
 
 void do_eraser(GdkEvent *event, double radius, gboolean whole_strokes);
+void do_eraser_at(double *pos, double radius, gboolean whole_strokes);
 void finalize_erasure(void);
 
+/* the eraser's geometry, without the canvas (see xo-paint.c); func gets
+   each piece left of a path */
+
+typedef void (*ErasePieceFunc)(double *coords, double *widths, int n, int first, gpointer data);
+
+gboolean erase_path_hits(struct Arena *a, struct Path *path, double x, double y, double radius);
+void erase_path_pieces(struct Arena *a, struct Path *path, gboolean cut_long,
+                       double x, double y, double radius, ErasePieceFunc func, gpointer data);
+
 void do_hand(GdkEvent *event);
 
 /* text functions */
@@ -0,0 +1,179 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <gtk/gtk.h>
+#include <libgnomecanvas/libgnomecanvas.h>
+
+#include "xournal.h"
+#include "xo-path.h"
+#include "xo-arena.h"
+
+// the size of a path's block, header included (a piece has only the header)
+
+static gsize path_size(struct Path *path)
+{
+  int nfloats;
+
+  if (path->parent != NULL) return sizeof(struct Path);
+  nfloats = 2*path->num_points;
+  if (path->widths != NULL && path->num_points > 1) nfloats += path->num_points-1;
+  return sizeof(struct Path) + nfloats*sizeof(float);
+}
+
+/* a new path with room for num_points points (and num_points-1 widths if
+   variable_width), with a refcount of 1; the contents are left uninitialized */
+
+struct Path *path_new(struct Arena *a, int num_points, gboolean variable_width)
+{
+  struct Path *path;
+  int nfloats;
+
+  nfloats = 2*num_points;
+  if (variable_width && num_points > 1) nfloats += num_points-1;
+  path = arena_alloc(a, sizeof(struct Path) + nfloats*sizeof(float));
+  path->num_points = num_points;
+  path->ref_count = 1;
+  path->coords = (float *)(path+1);
+  path->widths = variable_width ? path->coords + 2*num_points : NULL;
+  path->parent = NULL;
+  path->chunk_boxes = NULL;
+  return path;
+}
+
+// widths may be NULL for a constant-width stroke
+
+struct Path *path_new_from_doubles(struct Arena *a, int num_points,
+                                   const double *coords, const double *widths)
+{
+  struct Path *path;
+  int i;
+
+  path = path_new(a, num_points, widths != NULL);
+  for (i = 0; i < 2*num_points; i++)
+    path->coords[i] = (float)coords[i];
+  if (widths != NULL)
+    for (i = 0; i < num_points-1; i++)
+      path->widths[i] = (float)widths[i];
+  return path;
+}
+
+/* the points first..first+num_points-1 of path, sharing its data: only
+   a header is allocated, and the block holding the data is kept alive */
+
+struct Path *path_new_piece(struct Arena *a, struct Path *path, int first, int num_points)
+{
+  struct Path *piece;
+
+  piece = arena_alloc(a, sizeof(struct Path));
+  piece->num_points = num_points;
+  piece->ref_count = 1;
+  piece->coords = path->coords + 2*first;
+  piece->widths = (path->widths != NULL) ? path->widths + first : NULL;
+  piece->parent = path_ref((path->parent != NULL) ? path->parent : path);
+  piece->chunk_boxes = NULL;
+  return piece;
+}
+
+struct Path *path_ref(struct Path *path)
+{
+  path->ref_count++;
+  return path;
+}
+
+void path_unref(struct Arena *a, struct Path *path)
+{
+  if (path == NULL || --path->ref_count > 0) return;
+  if (path->parent != NULL) path_unref(a, path->parent);
+  if (path->chunk_boxes != NULL)
+    arena_free(a, path->chunk_boxes, path_num_chunks(path)*sizeof(struct BBox));
+  arena_free(a, path, path_size(path));
+}
+
+/* copy on write: make *path a path of its own, which no one else sees,
+   before its points or widths get modified */
+
+void path_make_writable(struct Arena *a, struct Path **path)
+{
+  struct Path *copy;
+  int n;
+
+  if ((*path)->ref_count == 1 && (*path)->parent == NULL) {
+    if ((*path)->chunk_boxes != NULL) // they won't fit the new points
+      arena_free(a, (*path)->chunk_boxes, path_num_chunks(*path)*sizeof(struct BBox));
+    (*path)->chunk_boxes = NULL;
+    return;
+  }
+  n = (*path)->num_points;
+  copy = path_new(a, n, (*path)->widths != NULL);
+  g_memmove(copy->coords, (*path)->coords, 2*n*sizeof(float));
+  if (copy->widths != NULL)
+    g_memmove(copy->widths, (*path)->widths, (n-1)*sizeof(float));
+  path_unref(a, *path);
+  *path = copy;
+}
+
+// coords must have room for 2*path->num_points doubles
+
+void path_get_coords(struct Path *path, double *coords)
+{
+  int i;
+
+  for (i = 0; i < 2*path->num_points; i++)
+    coords[i] = path->coords[i];
+}
+
+// for a GnomeCanvasLine "points" property; free with gnome_canvas_points_free()
+
+GnomeCanvasPoints *path_to_canvas_points(struct Path *path)
+{
+  GnomeCanvasPoints *pts;
+
+  pts = gnome_canvas_points_new(path->num_points);
+  path_get_coords(path, pts->coords);
+  return pts;
+}
+
+/* the bounding boxes of the points of segments 0..PATH_CHUNK-1, then
+   PATH_CHUNK..2*PATH_CHUNK-1, etc.: computed the first time they are
+   asked for, and kept (in the arena) until the path is changed or freed.
+   NULL for a single point */
+
+struct BBox *path_get_chunk_boxes(struct Arena *a, struct Path *path)
+{
+  struct BBox *box;
+  float *p;
+  int i, k, nseg;
+
+  if (path->chunk_boxes != NULL || path->num_points < 2) return path->chunk_boxes;
+  path->chunk_boxes = arena_alloc(a, path_num_chunks(path)*sizeof(struct BBox));
+  nseg = path->num_points-1;
+  for (k = 0, box = path->chunk_boxes; k < nseg; k += PATH_CHUNK, box++) {
+    p = path->coords + 2*k;
+    box->left = box->right = p[0];
+    box->top = box->bottom = p[1];
+    for (i = 1; i <= PATH_CHUNK && k+i <= nseg; i++) {
+      p += 2;
+      if (p[0] < box->left) box->left = p[0];
+      if (p[0] > box->right) box->right = p[0];
+      if (p[1] < box->top) box->top = p[1];
+      if (p[1] > box->bottom) box->bottom = p[1];
+    }
+  }
+  return path->chunk_boxes;
+}
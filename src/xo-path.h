@@ -0,0 +1,35 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* stroke geometry (struct Path, see xournal.h): allocation in a journal's
+   arena, sharing, and conversion to and from the double arrays used while
+   drawing and by GnomeCanvas. An item holds one reference to its path */
+
+struct Path *path_new(struct Arena *a, int num_points, gboolean variable_width);
+struct Path *path_new_from_doubles(struct Arena *a, int num_points,
+                                   const double *coords, const double *widths);
+struct Path *path_new_piece(struct Arena *a, struct Path *path, int first, int num_points);
+struct Path *path_ref(struct Path *path);
+void path_unref(struct Arena *a, struct Path *path);
+void path_make_writable(struct Arena *a, struct Path **path);
+void path_get_coords(struct Path *path, double *coords);
+GnomeCanvasPoints *path_to_canvas_points(struct Path *path);
+
+// a stroke's segments, in runs of PATH_CHUNK, for the eraser's hit tests
+
+#define PATH_CHUNK 16
+#define path_num_chunks(path) (((path)->num_points+PATH_CHUNK-2)/PATH_CHUNK)
+
+struct BBox *path_get_chunk_boxes(struct Arena *a, struct Path *path);
@@ -42,6 +42,7 @@
 #include "xo-paint.h"
 #include "xo-print.h"
 #include "xo-file.h"
+#include "xo-pages.h"
 
 #define RGBA_RED(rgba) (((rgba>>24)&0xff)/255.0)
 #define RGBA_GREEN(rgba) (((rgba>>16)&0xff)/255.0)
@@ -334,38 +335,343 @@ struct PdfObj *get_dict_entry(struct PdfObj *dict, char *name)
   return NULL;
 }
 
-struct PdfObj *get_pdfobj(GString *pdfbuf, struct XrefTable *xref, struct PdfObj *obj)
+// decompress a /FlateDecode stream (lenient about truncated data)
+
+static GString *do_inflate(char *in, int len)
 {
-  char *p, *eof;
-  int offs, n;
+  GString *out;
+  z_stream zs;
+  int ret;
 
-  if (obj==NULL) return NULL;
-  if (obj->type!=PDFTYPE_REF) return dup_pdfobj(obj);
-  if (obj->intval>xref->last) return NULL;
-  offs = xref->data[obj->intval];
-  if (offs<=0 || offs >= pdfbuf->len) return NULL;
+  zs.zalloc = Z_NULL;
+  zs.zfree = Z_NULL;
+  zs.opaque = Z_NULL;
+  zs.next_in = (Bytef *)in;
+  zs.avail_in = len;
+  if (inflateInit(&zs) != Z_OK) return NULL;
+  out = g_string_sized_new(4*len+1024);
+  g_string_set_size(out, 4*len+1024);
+  while (1) {
+    zs.next_out = (Bytef *)out->str + zs.total_out;
+    zs.avail_out = out->len - zs.total_out;
+    ret = inflate(&zs, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) break;
+    if (ret != Z_OK && ret != Z_BUF_ERROR) break;
+    if (zs.avail_out == 0) g_string_set_size(out, 2*out->len);
+    else break; // input exhausted
+  }
+  g_string_truncate(out, zs.total_out);
+  inflateEnd(&zs);
+  if (zs.total_out == 0 && ret != Z_STREAM_END) {
+    g_string_free(out, TRUE);
+    return NULL;
+  }
+  return out;
+}
+
+// undo the PNG predictors (/Predictor >= 10) of a decoded stream
+
+static GString *pdf_png_unpredict(GString *in, int colors, int bpc, int columns)
+{
+  GString *out;
+  guchar *src, *cur, *prev;
+  int bpp, rowlen, i, a, b, c, p, pa, pb, pc;
+
+  bpp = MAX(1, (colors*bpc+7)/8);
+  rowlen = (columns*colors*bpc+7)/8;
+  if (rowlen <= 0) return NULL;
+  out = g_string_sized_new(in->len);
+  prev = g_malloc0(rowlen);
+  for (src = (guchar *)in->str; src+rowlen+1 <= (guchar *)in->str+in->len; src += rowlen+1) {
+    g_string_append_len(out, (char *)src+1, rowlen);
+    cur = (guchar *)out->str + out->len - rowlen;
+    for (i=0; i<rowlen; i++) {
+      a = (i>=bpp) ? cur[i-bpp] : 0;
+      b = prev[i];
+      c = (i>=bpp) ? prev[i-bpp] : 0;
+      switch (src[0]) {
+        case 1: cur[i] += a; break;
+        case 2: cur[i] += b; break;
+        case 3: cur[i] += (a+b)/2; break;
+        case 4:
+          p = a+b-c; pa = ABS(p-a); pb = ABS(p-b); pc = ABS(p-c);
+          cur[i] += (pa<=pb && pa<=pc) ? a : (pb<=pc) ? b : c;
+          break;
+      }
+    }
+    g_memmove(prev, cur, rowlen);
+  }
+  g_free(prev);
+  return out;
+}
+
+// the decoded data of the stream whose dictionary ends at p
+
+static GString *pdf_stream_data(GString *pdfbuf, struct XrefTable *xref,
+                                struct PdfObj *dict, char *p)
+{
+  char *eof, *q;
+  struct PdfObj *obj, *parms;
+  GString *raw, *data;
+  int len, predictor;
 
-  p = pdfbuf->str + offs;
   eof = pdfbuf->str + pdfbuf->len;
-  n = strtol(p, &p, 10);
-  if (n!=obj->intval) return NULL;
   skipspace(&p, eof);
-  n = strtol(p, &p, 10);
-  skipspace(&p, eof);
-  if (strncmp(p, "obj", 3)) return NULL;
-  p+=3;
+  if (eof-p < 6 || strncmp(p, "stream", 6)) return NULL;
+  p+=6;
+  if (p!=eof && *p=='\r') p++;
+  if (p!=eof && *p=='\n') p++;
+  obj = get_pdfobj(pdfbuf, xref, get_dict_entry(dict, "/Length"));
+  len = (obj!=NULL && obj->type == PDFTYPE_INT) ? obj->intval : -1;
+  free_pdfobj(obj);
+  if (len>=0 && len <= eof-p) {
+    q = p+len;
+    skipspace(&q, eof);
+    if (eof-q < 9 || strncmp(q, "endstream", 9)) len = -1;
+  }
+  else len = -1;
+  if (len<0) { // bad /Length: look for the end of the stream instead
+    for (q = p; eof-q >= 9 && strncmp(q, "endstream", 9); q++);
+    if (eof-q < 9) return NULL;
+    len = q-p;
+  }
+
+  obj = get_dict_entry(dict, "/Filter");
+  if (obj!=NULL && obj->type == PDFTYPE_ARRAY && obj->num == 1) obj = obj->elts[0];
+  if (obj==NULL) return g_string_new_len(p, len);
+  if (obj->type != PDFTYPE_NAME || strcmp(obj->str, "/FlateDecode")) return NULL;
+  data = do_inflate(p, len);
+  if (data==NULL) return NULL;
+
+  parms = get_dict_entry(dict, "/DecodeParms");
+  if (parms!=NULL && parms->type == PDFTYPE_ARRAY && parms->num == 1) parms = parms->elts[0];
+  obj = get_dict_entry(parms, "/Predictor");
+  predictor = (obj!=NULL && obj->type == PDFTYPE_INT) ? obj->intval : 1;
+  if (predictor >= 10) {
+    raw = data;
+    obj = get_dict_entry(parms, "/Colors");
+    len = (obj!=NULL && obj->type == PDFTYPE_INT) ? obj->intval : 1;
+    obj = get_dict_entry(parms, "/BitsPerComponent");
+    predictor = (obj!=NULL && obj->type == PDFTYPE_INT) ? obj->intval : 8;
+    obj = get_dict_entry(parms, "/Columns");
+    data = pdf_png_unpredict(raw, len, predictor,
+             (obj!=NULL && obj->type == PDFTYPE_INT) ? obj->intval : 1);
+    g_string_free(raw, TRUE);
+  }
+  else if (predictor != 1) { g_string_free(data, TRUE); return NULL; }
+  return data;
+}
+
+// the dictionary of object number num at offset offs; p is set to its end
+
+static struct PdfObj *parse_indirect_obj(GString *pdfbuf, int offs, int num, char **p)
+{
+  char *eof;
+  int n;
+
+  if (offs<=0 || offs >= pdfbuf->len) return NULL;
+  *p = pdfbuf->str + offs;
+  eof = pdfbuf->str + pdfbuf->len;
+  n = strtol(*p, p, 10);
+  if (n!=num && num>=0) return NULL;
+  skipspace(p, eof);
+  n = strtol(*p, p, 10);
+  skipspace(p, eof);
+  if (eof-*p < 3 || strncmp(*p, "obj", 3)) return NULL;
+  *p+=3;
+  return parse_pdf_object(p, eof);
+}
+
+/* an object stream, decoded once: the objects it contains are
+   at data->str + first + offsets[i] */
+
+struct PdfObjStm {
+  GString *data;
+  int first;
+  int n;
+  int *offsets;
+};
+
+static void free_pdfobjstm(struct PdfObjStm *stm)
+{
+  g_string_free(stm->data, TRUE);
+  g_free(stm->offsets);
+  g_free(stm);
+}
+
+static struct PdfObjStm *get_pdfobjstm(GString *pdfbuf, struct XrefTable *xref, int num)
+{
+  struct PdfObjStm *stm;
+  struct PdfObj *dict, *obj;
+  char *p, *eof;
+  int i;
+
+  stm = g_hash_table_lookup(xref->objstms, GINT_TO_POINTER(num));
+  if (stm!=NULL) return stm;
+  if (num<=0 || num>xref->last) return NULL;
+  dict = parse_indirect_obj(pdfbuf, xref->data[num], num, &p);
+  if (dict==NULL) return NULL;
+  stm = g_new0(struct PdfObjStm, 1);
+  obj = get_dict_entry(dict, "/N");
+  if (obj!=NULL && obj->type == PDFTYPE_INT) stm->n = obj->intval;
+  obj = get_dict_entry(dict, "/First");
+  if (obj!=NULL && obj->type == PDFTYPE_INT) stm->first = obj->intval;
+  stm->data = pdf_stream_data(pdfbuf, xref, dict, p);
+  free_pdfobj(dict);
+  if (stm->data==NULL || stm->n<=0 || stm->first<=0 || stm->first>stm->data->len) {
+    if (stm->data!=NULL) g_string_free(stm->data, TRUE);
+    g_free(stm);
+    return NULL;
+  }
+  stm->offsets = g_new0(int, stm->n);
+  p = stm->data->str;
+  eof = stm->data->str + stm->first;
+  for (i=0; i<stm->n && p<eof; i++) {
+    skipspace(&p, eof);
+    strtol(p, &p, 10); // object number
+    skipspace(&p, eof);
+    stm->offsets[i] = strtol(p, &p, 10);
+  }
+  g_hash_table_insert(xref->objstms, GINT_TO_POINTER(num), stm);
+  return stm;
+}
+
+static struct PdfObj *load_pdfobj(GString *pdfbuf, struct XrefTable *xref, int num)
+{
+  struct PdfObjStm *stm;
+  char *p, *eof;
+  int offs;
+
+  offs = xref->data[num];
+  if (offs>=0) return parse_indirect_obj(pdfbuf, offs, num, &p);
+  // a compressed object
+  if (xref->objstms==NULL) return NULL;
+  stm = get_pdfobjstm(pdfbuf, xref, -offs);
+  if (stm==NULL || xref->index[num]<0 || xref->index[num]>=stm->n) return NULL;
+  offs = stm->first + stm->offsets[xref->index[num]];
+  if (offs<0 || offs>=stm->data->len) return NULL;
+  p = stm->data->str + offs;
+  eof = stm->data->str + stm->data->len;
   return parse_pdf_object(&p, eof);
 }
 
+/* a malformed file can make object lookups (a /Length in an object
+   stream whose /Length is in it...), xref sections (a /Prev cycle) and
+   the page tree (a /Kids cycle) nest without end: past PDF_MAX_DEPTH
+   levels, they fail and the file is marked as broken */
+
+#define PDF_MAX_DEPTH 256
+
+static gboolean pdf_enter(struct XrefTable *xref)
+{
+  if (xref->broken) return FALSE; // don't go on trying every branch
+  if (xref->depth >= PDF_MAX_DEPTH) { xref->broken = TRUE; return FALSE; }
+  xref->depth++;
+  return TRUE;
+}
+
+// dereference obj; the objects of the source file are parsed only once
+
+struct PdfObj *get_pdfobj(GString *pdfbuf, struct XrefTable *xref, struct PdfObj *obj)
+{
+  struct PdfObj *cached;
+
+  if (obj==NULL) return NULL;
+  if (obj->type!=PDFTYPE_REF) return dup_pdfobj(obj);
+  if (obj->intval<=0 || obj->intval>xref->last) return NULL;
+  if (xref->objects!=NULL) {
+    cached = g_hash_table_lookup(xref->objects, GINT_TO_POINTER(obj->intval));
+    if (cached!=NULL) return dup_pdfobj(cached);
+  }
+  if (!pdf_enter(xref)) return NULL;
+  cached = load_pdfobj(pdfbuf, xref, obj->intval);
+  xref->depth--;
+  if (cached==NULL || xref->objects==NULL) return cached;
+  g_hash_table_insert(xref->objects, GINT_TO_POINTER(obj->intval), cached);
+  return dup_pdfobj(cached);
+}
+
+// read a cross-reference stream (PDF 1.5), and return its dictionary
+
+struct PdfObj *parse_xref_table(GString *pdfbuf, struct XrefTable *xref, int offs);
+
+static struct PdfObj *parse_xref_stream(GString *pdfbuf, struct XrefTable *xref, int offs)
+{
+  struct PdfObj *dict, *obj, *index;
+  GString *data;
+  char *p;
+  guchar *entry;
+  int w[3], start, len, i, j, k, n, size;
+  unsigned int field[3];
+
+  dict = parse_indirect_obj(pdfbuf, offs, -1, &p);
+  obj = get_dict_entry(dict, "/Type");
+  if (obj==NULL || obj->type != PDFTYPE_NAME || strcmp(obj->str, "/XRef"))
+    { free_pdfobj(dict); return NULL; }
+  obj = get_dict_entry(dict, "/W");
+  if (obj==NULL || obj->type != PDFTYPE_ARRAY || obj->num != 3)
+    { free_pdfobj(dict); return NULL; }
+  for (i=0; i<3; i++) {
+    if (obj->elts[i]->type != PDFTYPE_INT || obj->elts[i]->intval<0 ||
+        obj->elts[i]->intval>4) { free_pdfobj(dict); return NULL; }
+    w[i] = obj->elts[i]->intval;
+  }
+  obj = get_dict_entry(dict, "/Size");
+  if (obj==NULL || obj->type != PDFTYPE_INT) { free_pdfobj(dict); return NULL; }
+  size = obj->intval;
+  if (size<=0 || size>pdfbuf->len) { free_pdfobj(dict); return NULL; }
+  if (size-1>xref->last) make_xref(xref, size-1, 0);
+  obj = get_dict_entry(dict, "/Prev");
+  if (obj!=NULL && obj->type == PDFTYPE_INT && obj->intval>0 && obj->intval!=offs) {
+    // recurse into older xref section
+    obj = parse_xref_table(pdfbuf, xref, obj->intval);
+    free_pdfobj(obj);
+  }
+  data = pdf_stream_data(pdfbuf, xref, dict, p);
+  if (data==NULL) { free_pdfobj(dict); return NULL; }
+
+  index = get_dict_entry(dict, "/Index");
+  if (index!=NULL && index->type != PDFTYPE_ARRAY) index = NULL;
+  entry = (guchar *)data->str;
+  for (k=0; index==NULL ? k==0 : k+1<index->num; k+=2) {
+    if (index==NULL) { start = 0; len = size; }
+    else {
+      if (index->elts[k]->type != PDFTYPE_INT || index->elts[k+1]->type != PDFTYPE_INT) break;
+      start = index->elts[k]->intval;
+      len = index->elts[k+1]->intval;
+    }
+    if (start<0 || len<=0 || start>pdfbuf->len) continue;
+    // no more entries than there is data for
+    len = MIN(len, (data->len - (entry-(guchar *)data->str))/MAX(1, w[0]+w[1]+w[2]));
+    if (len<=0) break;
+    if (start+len-1 > xref->last) make_xref(xref, start+len-1, 0);
+    for (n=start; n<start+len; n++) {
+      if (entry+w[0]+w[1]+w[2] > (guchar *)data->str+data->len) break;
+      for (i=0; i<3; i++) {
+        field[i] = (i==0 && w[0]==0) ? 1 : 0;
+        for (j=0; j<w[i]; j++) field[i] = (field[i]<<8) + *(entry++);
+      }
+      if (field[0]==1 && field[1]<pdfbuf->len)
+        { xref->data[n] = field[1]; xref->index[n] = 0; }
+      if (field[0]==2 && field[1]>0 && field[1]<=G_MAXINT && field[2]<=G_MAXINT)
+        { xref->data[n] = -(int)field[1]; xref->index[n] = field[2]; }
+    }
+  }
+  g_string_free(data, TRUE);
+  return dict;
+}
+
 // read the xref table of a PDF file in memory, and return the trailerdict
 
-struct PdfObj *parse_xref_table(GString *pdfbuf, struct XrefTable *xref, int offs)
+static struct PdfObj *read_xref_section(GString *pdfbuf, struct XrefTable *xref, int offs)
 {
   char *p, *eof;
   struct PdfObj *trailerdict, *obj;
   int start, len, i;
   
-  if (strncmp(pdfbuf->str+offs, "xref", 4)) return NULL;
+  if (offs<=0 || offs>=pdfbuf->len) return NULL;
+  if (strncmp(pdfbuf->str+offs, "xref", 4))
+    return parse_xref_stream(pdfbuf, xref, offs);
   p = strstr(pdfbuf->str+offs, "trailer");
   eof = pdfbuf->str + pdfbuf->len;
   if (p==NULL) return NULL;
@@ -388,15 +694,32 @@ struct PdfObj *parse_xref_table(GString *pdfbuf, struct XrefTable *xref, int off
     skipspace(&p, eof);
     len = strtol(p, &p, 10);
     skipspace(&p, eof);
-    if (len <= 0 || 20*len > eof-p) break;
+    if (len <= 0 || len > (eof-p)/20) break;
     if (start+len-1 > xref->last) make_xref(xref, start+len-1, 0);
     for (i=start; i<start+len; i++) {
-      xref->data[i] = strtol(p, NULL, 10);
+      xref->data[i] = (p[17]=='n') ? strtol(p, NULL, 10) : 0;
+      xref->index[i] = 0;
       p+=20;
     }
     skipspace(&p, eof);
   }
   if (*p!='t') { free_pdfobj(trailerdict); return NULL; }
+  // hybrid file: the compressed objects are in a separate xref stream
+  obj = get_dict_entry(trailerdict, "/XRefStm");
+  if (obj!=NULL && obj->type == PDFTYPE_INT && obj->intval!=offs) {
+    obj = parse_xref_stream(pdfbuf, xref, obj->intval);
+    free_pdfobj(obj);
+  }
+  return trailerdict;
+}
+
+struct PdfObj *parse_xref_table(GString *pdfbuf, struct XrefTable *xref, int offs)
+{
+  struct PdfObj *trailerdict;
+
+  if (!pdf_enter(xref)) return NULL;
+  trailerdict = read_xref_section(pdfbuf, xref, offs);
+  xref->depth--;
   return trailerdict;
 }
 
@@ -460,12 +783,13 @@ int pdf_getpageinfo(GString *pdfbuf, struct XrefTable *xref,
     if (obj!=NULL && obj->type == PDFTYPE_ARRAY) {
       for (i=0; i<obj->num; i++) {
         kid = get_pdfobj(pdfbuf, xref, obj->elts[i]);
-        if (kid!=NULL) {
+        if (kid!=NULL && pdf_enter(xref)) {
           j = pdf_getpageinfo(pdfbuf, xref, kid, nmax, pages);
+          xref->depth--;
           nmax -= j;
           pages += j;
-          free_pdfobj(kid);
         }
+        free_pdfobj(kid);
       }
     }
     free_pdfobj(obj);
@@ -479,11 +803,17 @@ int pdf_getpageinfo(GString *pdfbuf, struct XrefTable *xref,
 gboolean pdf_parse_info(GString *pdfbuf, struct PdfInfo *pdfinfo, struct XrefTable *xref)
 {
   char *p;
-  int offs;
+  int offs, i;
   struct PdfObj *obj, *pages;
 
   xref->n_alloc = xref->last = 0;
-  xref->data = NULL;
+  xref->data = xref->index = NULL;
+  xref->depth = 0;
+  xref->broken = FALSE;
+  xref->objects = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                    NULL, (GDestroyNotify)free_pdfobj);
+  xref->objstms = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                    NULL, (GDestroyNotify)free_pdfobjstm);
   p = pdfbuf->str + pdfbuf->len-1;
   
   while (*p!='s' && p!=pdfbuf->str) p--;
@@ -496,6 +826,7 @@ gboolean pdf_parse_info(GString *pdfbuf, struct PdfInfo *pdfinfo, struct XrefTab
   
   pdfinfo->trailerdict = parse_xref_table(pdfbuf, xref, offs);
   if (pdfinfo->trailerdict == NULL) return FALSE; // fail
+  if (xref->broken) { free_pdfobj(pdfinfo->trailerdict); return FALSE; }
   
   obj = get_pdfobj(pdfbuf, xref,
      get_dict_entry(pdfinfo->trailerdict, "/Root"));
@@ -515,6 +846,17 @@ gboolean pdf_parse_info(GString *pdfbuf, struct PdfInfo *pdfinfo, struct XrefTab
   pdfinfo->pages = g_malloc0(pdfinfo->npages*sizeof(struct PdfPageDesc));
   pdf_getpageinfo(pdfbuf, xref, pages, pdfinfo->npages, pdfinfo->pages);
   free_pdfobj(pages);
+  if (xref->broken) { // give up on annotating it
+    for (i=0; i<pdfinfo->npages; i++) {
+      free_pdfobj(pdfinfo->pages[i].resources);
+      free_pdfobj(pdfinfo->pages[i].mediabox);
+      free_pdfobj(pdfinfo->pages[i].contents);
+    }
+    g_free(pdfinfo->pages);
+    pdfinfo->pages = NULL;
+    free_pdfobj(pdfinfo->trailerdict);
+    return FALSE;
+  }
   
   return TRUE;
 }
@@ -523,14 +865,51 @@ gboolean pdf_parse_info(GString *pdfbuf, struct PdfInfo *pdfinfo, struct XrefTab
 
 void make_xref(struct XrefTable *xref, int nobj, int offset)
 {
+  int n;
+
   if (xref->n_alloc <= nobj) {
+    n = xref->n_alloc;
     xref->n_alloc = nobj + 10;
     xref->data = g_realloc(xref->data, xref->n_alloc*sizeof(int));
+    xref->index = g_realloc(xref->index, xref->n_alloc*sizeof(int));
+    memset(xref->data+n, 0, (xref->n_alloc-n)*sizeof(int));
+    memset(xref->index+n, 0, (xref->n_alloc-n)*sizeof(int));
   }
   if (xref->last < nobj) xref->last = nobj;
   xref->data[nobj] = offset;
 }
 
+// output to the PDF file: objects are appended to a buffer, which is
+// written out whenever it gets large; big chunks of data bypass it
+
+#define PDFOUT_CHUNK 65536
+
+static int pdfout_tell(struct PdfOutput *out)
+{
+  return out->offset + out->buf->len;
+}
+
+static void pdfout_flush(struct PdfOutput *out)
+{
+  if (out->buf->len > 0 && !out->error &&
+      fwrite(out->buf->str, 1, out->buf->len, out->f) < out->buf->len)
+    out->error = TRUE;
+  out->offset += out->buf->len;
+  g_string_truncate(out->buf, 0);
+}
+
+static void pdfout_write(struct PdfOutput *out, const char *data, gsize len)
+{
+  if (out->buf->len + len <= PDFOUT_CHUNK) {
+    g_string_append_len(out->buf, data, len);
+    return;
+  }
+  pdfout_flush(out);
+  if (len > 0 && !out->error && fwrite(data, 1, len, out->f) < len)
+    out->error = TRUE;
+  out->offset += len;
+}
+
 // a wrapper for deflate
 
 GString *do_deflate(char *in, int len)
@@ -724,44 +1103,85 @@ void pdf_draw_solid_background(struct Page *pg, GString *str)
       RULING_LEFTMARGIN, RULING_LEFTMARGIN, pg->height);
 }
 
-int pdf_draw_bitmap_background(struct Page *pg, GString *str, 
-                                struct XrefTable *xref, GString *pdfbuf)
+static gboolean pdf_pixbuf_is_rgb8(GdkPixbuf *pix)
+{
+  return (gdk_pixbuf_get_bits_per_sample(pix) == 8 &&
+          gdk_pixbuf_get_colorspace(pix) == GDK_COLORSPACE_RGB &&
+          (gdk_pixbuf_get_n_channels(pix) == 3 || gdk_pixbuf_get_n_channels(pix) == 4));
+}
+
+/* a checksum of the pixels of an image, to recognize copies of it */
+
+static gchar *pdf_pixbuf_digest(GdkPixbuf *pix)
+{
+  GChecksum *checksum;
+  gchar *digest;
+  guchar *p;
+  int y, header[4];
+
+  header[0] = gdk_pixbuf_get_width(pix);
+  header[1] = gdk_pixbuf_get_height(pix);
+  header[2] = gdk_pixbuf_get_n_channels(pix);
+  header[3] = gdk_pixbuf_get_has_alpha(pix);
+  checksum = g_checksum_new(G_CHECKSUM_SHA1);
+  g_checksum_update(checksum, (guchar *)header, sizeof(header));
+  p = gdk_pixbuf_get_pixels(pix);
+  for (y=0; y<header[1]; y++, p += gdk_pixbuf_get_rowstride(pix))
+    g_checksum_update(checksum, p, header[0]*header[2]);
+  digest = g_strdup(g_checksum_get_string(checksum));
+  g_checksum_free(checksum);
+  return digest;
+}
+
+/* a page's bitmap background, as deflated RGB samples (NULL on failure).
+   This is called from the export worker threads: PDF backgrounds are
+   rendered with PopplerDocuments taken from (and returned to) the queue */
+
+GString *pdf_bitmap_background(struct Page *pg, GAsyncQueue *documents,
+                               int *pixwidth, int *pixheight)
 {
-  BgPdfPage *pgpdf;
   GdkPixbuf *pix;
   GString *zpix;
+  PopplerDocument *doc;
   PopplerPage *pdfpage;
   char *buf, *p1, *p2;
   int height, width, stride, x, y, chan;
   double pgheight, pgwidth;
   
   if (pg->bg->type == BG_PDF) {
-    if (!bgpdf.document) return -1;
-    pdfpage = poppler_document_get_page(bgpdf.document, pg->bg->file_page_seq-1);
-    if (!pdfpage) return -1;
-    poppler_page_get_size(pdfpage, &pgwidth, &pgheight);
-    width = (int) (PDFTOPPM_PRINTING_DPI * pgwidth/72.0);
-    height = (int) (PDFTOPPM_PRINTING_DPI * pgheight/72.0);
-    pix = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, width, height);
-    wrapper_poppler_page_render_to_pixbuf(
-       pdfpage, 0, 0, width, height, PDFTOPPM_PRINTING_DPI/72.0, 0, pix);
-    g_object_unref(pdfpage);
+    if (bgpdf.status == STATUS_NOT_INIT || bgpdf.file_contents == NULL) return NULL;
+    // serialized with the background renderers when poppler needs it
+    xoj_poppler_lock(TRUE);
+    doc = (PopplerDocument *)g_async_queue_try_pop(documents);
+    if (doc == NULL) {
+      xoj_poppler_lock(FALSE);
+      doc = poppler_document_new_from_data(bgpdf.file_contents, bgpdf.file_length, NULL, NULL);
+      xoj_poppler_unlock(FALSE);
+    }
+    pdfpage = (doc != NULL) ? poppler_document_get_page(doc, pg->bg->file_page_seq-1) : NULL;
+    pix = NULL;
+    if (pdfpage) {
+      poppler_page_get_size(pdfpage, &pgwidth, &pgheight);
+      width = (int) (PDFTOPPM_PRINTING_DPI * pgwidth/72.0);
+      height = (int) (PDFTOPPM_PRINTING_DPI * pgheight/72.0);
+      pix = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+      wrapper_poppler_page_render_to_pixbuf(
+         pdfpage, 0, 0, width, height, PDFTOPPM_PRINTING_DPI/72.0, 0, pix);
+      g_object_unref(pdfpage);
+    }
+    xoj_poppler_unlock(TRUE);
+    if (doc != NULL) g_async_queue_push(documents, doc);
+    if (pix == NULL) return NULL;
   }
   else pix = g_object_ref(pg->bg->pixbuf);
   
-  if (gdk_pixbuf_get_bits_per_sample(pix) != 8 ||
-      gdk_pixbuf_get_colorspace(pix) != GDK_COLORSPACE_RGB)
-    { g_object_unref(pix); return -1; }
+  if (!pdf_pixbuf_is_rgb8(pix)) { g_object_unref(pix); return NULL; }
                     
   width = gdk_pixbuf_get_width(pix);
   height = gdk_pixbuf_get_height(pix);
   stride = gdk_pixbuf_get_rowstride(pix);
   chan = gdk_pixbuf_get_n_channels(pix);
-  if (chan!=3 && chan!=4) { g_object_unref(pix); return -1; }
 
-  g_string_append_printf(str, "q %.2f 0 0 %.2f 0 %.2f cm /ImBg Do Q ",
-    pg->width, -pg->height, pg->height);
-  
   p2 = buf = (char *)g_malloc(3*width*height);
   for (y=0; y<height; y++) {
     p1 = (char *)gdk_pixbuf_get_pixels(pix)+stride*y;
@@ -773,21 +1193,26 @@ int pdf_draw_bitmap_background(struct Page *pg, GString *str,
   zpix = do_deflate(buf, 3*width*height);
   g_free(buf);
   g_object_unref(pix);
+  *pixwidth = width;
+  *pixheight = height;
+  return zpix;
+}
 
-  make_xref(xref, xref->last+1, pdfbuf->len);
-  g_string_append_printf(pdfbuf, 
+int pdf_write_bitmap_background(GString *zpix, int width, int height,
+                                struct XrefTable *xref, struct PdfOutput *out)
+{
+  make_xref(xref, xref->last+1, pdfout_tell(out));
+  g_string_append_printf(out->buf, 
     "%d 0 obj\n<< /Length %zu /Filter /FlateDecode /Type /Xobject "
     "/Subtype /Image /Width %d /Height %d /ColorSpace /DeviceRGB "
     "/BitsPerComponent 8 >> stream\n",
     xref->last, zpix->len, width, height);
-  g_string_append_len(pdfbuf, zpix->str, zpix->len);
-  g_string_free(zpix, TRUE);
-  g_string_append(pdfbuf, "endstream\nendobj\n");
- 
+  pdfout_write(out, zpix->str, zpix->len);
+  g_string_append(out->buf, "endstream\nendobj\n");
   return xref->last;
 }
 
-gboolean pdf_draw_image(PdfImage *image, struct XrefTable *xref, GString *pdfbuf)
+gboolean pdf_draw_image(PdfImage *image, struct XrefTable *xref, struct PdfOutput *out)
 {
   char *buf, *p1, *p2;
   int height, width, stride, x, y, chan;
@@ -817,22 +1242,22 @@ gboolean pdf_draw_image(PdfImage *image, struct XrefTable *xref, GString *pdfbuf
   zpix = do_deflate(buf, 3*width*height);
   g_free(buf);
 
-  xref->data[image->n_obj] = pdfbuf->len;
-  g_string_append_printf(pdfbuf, 
+  xref->data[image->n_obj] = pdfout_tell(out);
+  g_string_append_printf(out->buf, 
     "%d 0 obj\n<< /Length %d /Filter /FlateDecode /Type /Xobject "
     "/Subtype /Image /Width %d /Height %d /ColorSpace /DeviceRGB "
     "/BitsPerComponent 8 ",
     image->n_obj, zpix->len, width, height);
   if (image->has_alpha) {
-    g_string_append_printf(pdfbuf, 
+    g_string_append_printf(out->buf, 
       "/SMask %d 0 R ",
       image->n_obj_smask);
   }
-  g_string_append_printf(pdfbuf, " >> stream\n");
+  g_string_append_printf(out->buf, " >> stream\n");
 
-  g_string_append_len(pdfbuf, zpix->str, zpix->len);
+  pdfout_write(out, zpix->str, zpix->len);
   g_string_free(zpix, TRUE);
-  g_string_append(pdfbuf, "endstream\nendobj\n");
+  g_string_append(out->buf, "endstream\nendobj\n");
 
   if (image->has_alpha) {
     p2 = buf = (char *)g_malloc(width*height);
@@ -846,16 +1271,16 @@ gboolean pdf_draw_image(PdfImage *image, struct XrefTable *xref, GString *pdfbuf
     zpix = do_deflate(buf, width*height);
     g_free(buf);
     
-    xref->data[image->n_obj_smask] = pdfbuf->len;
-    g_string_append_printf(pdfbuf, 
+    xref->data[image->n_obj_smask] = pdfout_tell(out);
+    g_string_append_printf(out->buf, 
       "%d 0 obj\n<< /Length %d /Filter /FlateDecode /Type /Xobject "
       "/Subtype /Image /Width %d /Height %d /ColorSpace /DeviceGray "
       "/BitsPerComponent 8 >> stream\n",
       image->n_obj_smask, zpix->len, width, height);
 
-    g_string_append_len(pdfbuf, zpix->str, zpix->len);
+    pdfout_write(out, zpix->str, zpix->len);
     g_string_free(zpix, TRUE);
-    g_string_append(pdfbuf, "endstream\nendobj\n");
+    g_string_append(out->buf, "endstream\nendobj\n");
   }
 
   return TRUE;
@@ -920,11 +1345,77 @@ struct PdfFont *new_pdffont(struct XrefTable *xref, GList **fonts,
   return font;
 }
 
+/* pango and TrueType objects shared by all the text of an export, instead
+   of a new font map and layout for every text item and a new parse of the
+   font file for every subset. Only used from the main thread. */
+
+static struct {
+  PangoFontMap *fontmap;
+  PangoContext *context;
+  GHashTable *layouts;   // "font name@size" -> PangoLayout
+  GHashTable *ttfonts;   // font file -> TrueTypeFont, NULL if it can't be read
+} pdf_text_cache;
+
+static void pdf_close_ttfont(gpointer ttfnt)
+{
+  if (ttfnt != NULL) CloseTTFont((TrueTypeFont *)ttfnt);
+}
+
+static PangoLayout *pdf_text_layout(const char *font_name, double font_size)
+{
+  PangoLayout *layout;
+  PangoFontDescription *font_desc;
+  gchar *key;
+
+  if (pdf_text_cache.fontmap == NULL) {
+    pdf_text_cache.fontmap = pango_ft2_font_map_new();
+    pango_ft2_font_map_set_resolution(PANGO_FT2_FONT_MAP (pdf_text_cache.fontmap), 72, 72);
+    pdf_text_cache.context = pango_context_new();
+    pango_context_set_font_map(pdf_text_cache.context, pdf_text_cache.fontmap);
+    pdf_text_cache.layouts = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                   g_free, g_object_unref);
+  }
+  // pango keeps the size as an integer, so this is exact
+  key = g_strdup_printf("%s@%d", font_name, (int)(font_size*PANGO_SCALE));
+  layout = (PangoLayout *)g_hash_table_lookup(pdf_text_cache.layouts, key);
+  if (layout != NULL) { g_free(key); return layout; }
+  layout = pango_layout_new(pdf_text_cache.context);
+  font_desc = pango_font_description_from_string(font_name);
+  pango_font_description_set_absolute_size(font_desc, font_size*PANGO_SCALE);
+  pango_layout_set_font_description(layout, font_desc);
+  pango_font_description_free(font_desc);
+  g_hash_table_insert(pdf_text_cache.layouts, key, layout);
+  return layout;
+}
+
+static TrueTypeFont *pdf_truetype_font(const char *filename)
+{
+  gpointer ttfnt;
+
+  if (pdf_text_cache.ttfonts == NULL)
+    pdf_text_cache.ttfonts = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                   g_free, pdf_close_ttfont);
+  if (g_hash_table_lookup_extended(pdf_text_cache.ttfonts, filename, NULL, &ttfnt))
+    return (TrueTypeFont *)ttfnt;
+  if (OpenTTFont(filename, 0, (TrueTypeFont **)&ttfnt) != SF_OK) ttfnt = NULL;
+  g_hash_table_insert(pdf_text_cache.ttfonts, g_strdup(filename), ttfnt);
+  return (TrueTypeFont *)ttfnt;
+}
+
+static void pdf_text_cache_free(void)
+{
+  if (pdf_text_cache.layouts != NULL) g_hash_table_destroy(pdf_text_cache.layouts);
+  if (pdf_text_cache.context != NULL) g_object_unref(pdf_text_cache.context);
+  if (pdf_text_cache.fontmap != NULL) g_object_unref(pdf_text_cache.fontmap);
+  if (pdf_text_cache.ttfonts != NULL) g_hash_table_destroy(pdf_text_cache.ttfonts);
+  memset(&pdf_text_cache, 0, sizeof(pdf_text_cache));
+}
+
 #define pfb_get_length(x) (((x)[3]<<24) + ((x)[2]<<16) + ((x)[1]<<8) + (x)[0])
 #define T1_SEGMENT_1_END "currentfile eexec"
 #define T1_SEGMENT_3_END "cleartomark"
 
-void embed_pdffont(GString *pdfbuf, struct XrefTable *xref, struct PdfFont *font)
+void embed_pdffont(struct PdfOutput *out, struct XrefTable *xref, struct PdfFont *font)
 {
   // this code inspired by libgnomeprint
   gboolean fallback, is_binary;
@@ -953,20 +1444,20 @@ void embed_pdffont(GString *pdfbuf, struct XrefTable *xref, struct PdfFont *font
         num++;
       }
     font->num_glyphs_used = num-1;
-    if (OpenTTFont(font->filename, 0, &ttfnt) == SF_OK) {
+    ttfnt = pdf_truetype_font(font->filename);
+    if (ttfnt != NULL) {
       if (CreateTTFromTTGlyphs_tomemory(ttfnt, (guint8**)&fontdata, &tt_len, glyphs, encoding, num, 
                    0, NULL, TTCF_AutoName | TTCF_IncludeOS2) == SF_OK) {
-        make_xref(xref, xref->last+1, pdfbuf->len);
+        make_xref(xref, xref->last+1, pdfout_tell(out));
         nobj_fontprog = xref->last;
-        g_string_append_printf(pdfbuf, 
+        g_string_append_printf(out->buf, 
           "%d 0 obj\n<< /Length %u /Length1 %u >> stream\n",
           nobj_fontprog, tt_len, tt_len);
-        g_string_append_len(pdfbuf, fontdata, tt_len);
-        g_string_append(pdfbuf, "endstream\nendobj\n");
+        pdfout_write(out, fontdata, tt_len);
+        g_string_append(out->buf, "endstream\nendobj\n");
         g_free(fontdata);
       }
       else fallback = TRUE;
-      CloseTTFont(ttfnt);
     } 
     else fallback = TRUE;
   } else {
@@ -1025,14 +1516,14 @@ void embed_pdffont(GString *pdfbuf, struct XrefTable *xref, struct PdfFont *font
           }
           len2 = j;
         }
-        make_xref(xref, xref->last+1, pdfbuf->len);
+        make_xref(xref, xref->last+1, pdfout_tell(out));
         nobj_fontprog = xref->last;
-        g_string_append_printf(pdfbuf, 
+        g_string_append_printf(out->buf, 
           "%d 0 obj\n<< /Length %u /Length1 %u /Length2 %u /Length3 0 >> stream\n",
           nobj_fontprog, len1+len2, len1, len2);
-        g_string_append_len(pdfbuf, seg1, len1);
-        g_string_append_len(pdfbuf, seg2, len2);
-        g_string_append(pdfbuf, "endstream\nendobj\n");
+        pdfout_write(out, seg1, len1);
+        pdfout_write(out, seg2, len2);
+        g_string_append(out->buf, "endstream\nendobj\n");
         if (!is_binary) g_free(seg2);
       }
       g_free(fontdata);
@@ -1042,9 +1533,9 @@ void embed_pdffont(GString *pdfbuf, struct XrefTable *xref, struct PdfFont *font
   
   // next, the font descriptor
   if (!fallback) {
-    make_xref(xref, xref->last+1, pdfbuf->len);
+    make_xref(xref, xref->last+1, pdfout_tell(out));
     nobj_descr = xref->last;
-    g_string_append_printf(pdfbuf,
+    g_string_append_printf(out->buf,
       "%d 0 obj\n<< /Type /FontDescriptor /FontName /%s /Flags %d "
       "/FontBBox [%d %d %d %d] /ItalicAngle 0 /Ascent %d "
       "/Descent %d /CapHeight %d /StemV 100 /%s %d 0 R >> endobj\n",
@@ -1060,7 +1551,7 @@ void embed_pdffont(GString *pdfbuf, struct XrefTable *xref, struct PdfFont *font
      in TrueType case, encoding lists the used charcodes by index,
                        glyphs   list the used glyph no's by index
                        font->glyphmap maps charcodes to indices        */
-  xref->data[font->n_obj] = pdfbuf->len;
+  xref->data[font->n_obj] = pdfout_tell(out);
   if (font->is_truetype) lastchar = encoding[font->num_glyphs_used];
   else lastchar = font->num_glyphs_used;
   if (fallback) {
@@ -1074,37 +1565,51 @@ void embed_pdffont(GString *pdfbuf, struct XrefTable *xref, struct PdfFont *font
     for (i=0; i<6; i++) { prefix[i] = 'A'+(num%26); num/=26; }
     prefix[6]='+'; prefix[7]=0;
   }
-  g_string_append_printf(pdfbuf,
+  g_string_append_printf(out->buf,
     "%d 0 obj\n<< /Type /Font /Subtype /%s /BaseFont /%s%s /Name /F%d ",
     font->n_obj, font->is_truetype?"TrueType":"Type1",
     prefix, font->fontname, font->n_obj);
   if (!fallback) {
-    g_string_append_printf(pdfbuf,
+    g_string_append_printf(out->buf,
       "/FontDescriptor %d 0 R /FirstChar 0 /LastChar %d /Widths [",
       nobj_descr, lastchar);
     for (i=0; i<=lastchar; i++)
-      g_string_append_printf(pdfbuf, "%d ", font->advance[i]);
-    g_string_append(pdfbuf, "] ");
+      g_string_append_printf(out->buf, "%d ", font->advance[i]);
+    g_string_append(out->buf, "] ");
   }
   if (!font->is_truetype) { /* encoding */
-    g_string_append(pdfbuf, "/Encoding << /Type /Encoding "
+    g_string_append(out->buf, "/Encoding << /Type /Encoding "
       "/BaseEncoding /MacRomanEncoding /Differences [1 ");
     for (i=1; i<=lastchar; i++) {
-      g_string_append_printf(pdfbuf, "/%s ", font->glyphpsnames[i]);
+      g_string_append_printf(out->buf, "/%s ", font->glyphpsnames[i]);
       g_free(font->glyphpsnames[i]);
     }
-    g_string_append(pdfbuf, "] >> ");
+    g_string_append(out->buf, "] >> ");
   }
-  g_string_append(pdfbuf, ">> endobj\n");
+  g_string_append(out->buf, ">> endobj\n");
 }
 
 // Pdf images
 
+/* a copy of an image already in the document (same pixbuf, or same
+   pixels) is shared with it rather than embedded again */
+
 struct PdfImage *new_pdfimage(struct XrefTable *xref, GList **images, GdkPixbuf *pixbuf)
 {
   GList *list;
   struct PdfImage *image;
+  gchar *digest;
   
+  for (list = *images; list!=NULL; list = list->next) {
+    image = (struct PdfImage *)list->data;
+    if (image->pixbuf == pixbuf) return image;
+  }
+  digest = pdf_pixbuf_digest(pixbuf);
+  for (list = *images; list!=NULL; list = list->next) {
+    image = (struct PdfImage *)list->data;
+    if (!strcmp(image->digest, digest)) { g_free(digest); return image; }
+  }
+
   image = g_malloc(sizeof(struct PdfImage));
   *images = g_list_append(*images, image);
   image->n_obj = xref->last+1;
@@ -1115,10 +1620,58 @@ struct PdfImage *new_pdfimage(struct XrefTable *xref, GList **images, GdkPixbuf
     make_xref(xref, xref->last+1, 0); // will give it a value later
   }
   image->pixbuf = pixbuf;
+  image->digest = digest;
 
   return image;
 }
 
+/* numbers in content streams: "%.2f" without the trailing zeros (12.5,
+   3, -0.25), formatted by fixed2_to_ascii() rather than printf, which was
+   most of the cost of exporting handwritten pages */
+
+static int pdf_num_to_ascii(char *buf, double x)
+{
+  int len;
+
+  len = fixed2_to_ascii(buf, x);
+  if (strchr(buf, '.') != NULL && strchr(buf, 'e') == NULL) {
+    while (buf[len-1] == '0') len--;
+    if (buf[len-1] == '.') len--;
+  }
+  if (len == 2 && buf[0] == '-' && buf[1] == '0') { buf[0] = '0'; len = 1; }
+  buf[len++] = ' ';
+  return len;
+}
+
+static void pdf_put_num(GString *str, double x)
+{
+  char buf[FIXED2_MAXLEN+1];
+
+  g_string_append_len(str, buf, pdf_num_to_ascii(buf, x));
+}
+
+// "x y op ", with a single append
+
+static void pdf_put_point(GString *str, float *pt, char op)
+{
+  char buf[2*FIXED2_MAXLEN+4];
+  int len;
+
+  len = pdf_num_to_ascii(buf, pt[0]);
+  len += pdf_num_to_ascii(buf+len, pt[1]);
+  buf[len++] = op;
+  buf[len++] = ' ';
+  g_string_append_len(str, buf, len);
+}
+
+static void pdf_put_rgb(GString *str, guint rgba, const char *op)
+{
+  pdf_put_num(str, RGBA_RED(rgba));
+  pdf_put_num(str, RGBA_GREEN(rgba));
+  pdf_put_num(str, RGBA_BLUE(rgba));
+  g_string_append(str, op);
+}
+
 // draw a page's graphics
 
 void pdf_draw_page(struct Page *pg, GString *str, gboolean *use_hiliter, 
@@ -1128,17 +1681,14 @@ void pdf_draw_page(struct Page *pg, GString *str, gboolean *use_hiliter,
   struct Layer *l;
   struct Item *item;
   guint old_rgba, old_text_rgba;
-  double old_thickness;
-  double *pt;
-  int i, j;
-  PangoFontDescription *font_desc;
-  PangoContext *context;
+  double old_thickness, wmin, wmax;
+  float *pt;
+  int i, j, k;
   PangoLayout *layout;
   PangoLayoutIter *iter;
   PangoRectangle logical_rect;
   PangoLayoutRun *run;
   PangoFcFont *fcfont;
-  PangoFontMap *fontmap;
   FcPattern *pattern;
   int baseline, advance;
   int glyph_no, glyph_page, current_page;
@@ -1167,49 +1717,56 @@ void pdf_draw_page(struct Page *pg, GString *str, gboolean *use_hiliter,
       item = (struct Item *)itemlist->data;
       if (item->type == ITEM_STROKE) {
         if ((item->brush.color_rgba & ~0xff) != old_rgba)
-          g_string_append_printf(str, "%.2f %.2f %.2f RG ",
-            RGBA_RGB(item->brush.color_rgba));
-        if (item->brush.thickness != old_thickness)
-          g_string_append_printf(str, "%.2f w ", item->brush.thickness);
+          pdf_put_rgb(str, item->brush.color_rgba, "RG ");
+        if (!item->brush.variable_width && item->brush.thickness != old_thickness) {
+          pdf_put_num(str, item->brush.thickness);
+          g_string_append(str, "w ");
+          old_thickness = item->brush.thickness;
+        }
         if ((item->brush.color_rgba & 0xf0) != 0xf0) { // transparent
           g_string_append(str, "q /XoHi gs ");
           *use_hiliter = TRUE;
         }
         old_rgba = item->brush.color_rgba & ~0xff;
-        old_thickness = item->brush.thickness;
         pt = item->path->coords;
         if (!item->brush.variable_width) {
-          g_string_append_printf(str, "%.2f %.2f m ", pt[0], pt[1]);
+          pdf_put_point(str, pt, 'm');
           for (i=1, pt+=2; i<item->path->num_points; i++, pt+=2)
-            g_string_append_printf(str, "%.2f %.2f l ", pt[0], pt[1]);
-          g_string_append_printf(str,"S\n");
-          old_thickness = item->brush.thickness;
+            pdf_put_point(str, pt, 'l');
+          g_string_append(str, "S\n");
         } else {
-          for (i=0; i<item->path->num_points-1; i++, pt+=2)
-            g_string_append_printf(str, "%.2f w %.2f %.2f m %.2f %.2f l S\n", 
-               item->widths[i], pt[0], pt[1], pt[2], pt[3]);
-          old_thickness = 0.0;
+          /* each run of segments whose widths are within pdf_width_tolerance
+             of each other is one polyline: with round joins, it looks like
+             the round-capped segments the canvas draws, with far fewer paths */
+          for (i=0; i<item->path->num_points-1; i=j) {
+            wmin = wmax = item->path->widths[i];
+            for (j=i+1; j<item->path->num_points-1; j++) {
+              if (MAX(wmax, item->path->widths[j]) - MIN(wmin, item->path->widths[j]) > ui.pdf_width_tolerance)
+                break;
+              wmin = MIN(wmin, item->path->widths[j]);
+              wmax = MAX(wmax, item->path->widths[j]);
+            }
+            if ((wmin+wmax)/2 != old_thickness) {
+              old_thickness = (wmin+wmax)/2;
+              pdf_put_num(str, old_thickness);
+              g_string_append(str, "w ");
+            }
+            pdf_put_point(str, pt+2*i, 'm');
+            for (k=i+1; k<=j; k++)
+              pdf_put_point(str, pt+2*k, 'l');
+            g_string_append(str, "S\n");
+          }
         }
-        if ((item->brush.color_rgba & 0xf0) != 0xf0) // undo transparent
+        if ((item->brush.color_rgba & 0xf0) != 0xf0) { // undo transparent
           g_string_append(str, "Q ");
+          if (item->brush.variable_width) old_thickness = 0.0; // reset by Q
+        }
       }
       else if (item->type == ITEM_TEXT) {
         if ((item->brush.color_rgba & ~0xff) != old_text_rgba)
-          g_string_append_printf(str, "%.2f %.2f %.2f rg ",
-            RGBA_RGB(item->brush.color_rgba));
+          pdf_put_rgb(str, item->brush.color_rgba, "rg ");
         old_text_rgba = item->brush.color_rgba & ~0xff;
-        fontmap = pango_ft2_font_map_new();
-        pango_ft2_font_map_set_resolution(PANGO_FT2_FONT_MAP (fontmap), 72, 72);
-        context = pango_context_new();
-        pango_context_set_font_map(context, fontmap);
-        layout = pango_layout_new(context);
-        g_object_unref(fontmap);
-        g_object_unref(context);
-        font_desc = pango_font_description_from_string(item->font_name);
-        pango_font_description_set_absolute_size(font_desc,
-          item->font_size*PANGO_SCALE);
-        pango_layout_set_font_description(layout, font_desc);
-        pango_font_description_free(font_desc);
+        layout = pdf_text_layout(item->font_name, item->font_size);
         pango_layout_set_text(layout, item->text, -1);
         // this code inspired by the code in libgnomeprint
         iter = pango_layout_get_iter(layout);
@@ -1277,7 +1834,6 @@ void pdf_draw_page(struct Page *pg, GString *str, gboolean *use_hiliter,
           pango_fc_font_unlock_face(fcfont);
         } while (pango_layout_iter_next_run(iter));
         pango_layout_iter_free(iter);
-        g_object_unref(layout);
       }
       else if  (item->type == ITEM_IMAGE) {
         cur_image = new_pdfimage(xref, pdfimages, item->image);
@@ -1291,6 +1847,200 @@ void pdf_draw_page(struct Page *pg, GString *str, gboolean *use_hiliter,
   }
 }
 
+/* parallel export: worker threads render and deflate the bitmap
+   backgrounds, and generate and deflate the content streams, a batch of
+   pages at a time. Pages with text or images are left to the main thread,
+   since their fonts and images get object numbers as they are met. The
+   main thread then writes everything out in page order, so the output
+   doesn't depend on the number of threads. */
+
+#define PDF_EXPORT_BATCH 32
+
+struct PdfPageJob {
+  struct Page *pg;
+  gboolean prefix;        // drawn over the original PDF page
+  gboolean bitmap_bg;     // the background is a bitmap, to be rendered
+  gboolean bg_shared;     // the same bitmap as an earlier page's background
+  gboolean use_bgpix;     // the page draws a bitmap background
+  gboolean in_order;      // has text or images: done by the main thread
+  GAsyncQueue *documents; // PopplerDocuments for rendering PDF bitmaps
+  GString *zbg;           // the deflated background bitmap
+  gchar *bg_digest;       // its checksum
+  int bg_width, bg_height;
+  GString *zcontent;      // the deflated content stream
+  gboolean use_hiliter;
+};
+
+static gboolean pdf_page_has_text_or_images(struct Page *pg)
+{
+  GList *layerlist, *itemlist;
+  struct Item *item;
+
+  for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next)
+    for (itemlist = ((struct Layer *)layerlist->data)->items; itemlist!=NULL; 
+         itemlist = itemlist->next) {
+      item = (struct Item *)itemlist->data;
+      if (item->type == ITEM_TEXT || item->type == ITEM_IMAGE) return TRUE;
+    }
+  return FALSE;
+}
+
+static GString *pdf_page_stream(struct PdfPageJob *job, struct XrefTable *xref,
+                                GList **pdffonts, GList **pdfimages)
+{
+  struct Page *pg = job->pg;
+  GString *pgstrm;
+
+  pgstrm = g_string_new("");
+  g_string_printf(pgstrm, "q 1 0 0 -1 0 %.2f cm 1 J 1 j ", pg->height);
+  if (pg->bg->type == BG_SOLID)
+    pdf_draw_solid_background(pg, pgstrm);
+  else if (job->prefix)
+    g_string_prepend(pgstrm, "Q Q Q ");
+  else if (job->use_bgpix)
+    g_string_append_printf(pgstrm, "q %.2f 0 0 %.2f 0 %.2f cm /ImBg Do Q ",
+      pg->width, -pg->height, pg->height);
+  job->use_hiliter = FALSE;
+  pdf_draw_page(pg, pgstrm, &job->use_hiliter, xref, pdffonts, pdfimages);
+  g_string_append_printf(pgstrm, "Q\n");
+  return pgstrm;
+}
+
+static void pdf_page_job(gpointer data, gpointer user_data)
+{
+  struct PdfPageJob *job = (struct PdfPageJob *)data;
+  GString *pgstrm;
+  GList *none = NULL;
+
+  if (job->bitmap_bg)
+    job->zbg = pdf_bitmap_background(job->pg, job->documents, &job->bg_width, &job->bg_height);
+  if (job->zbg != NULL && job->bg_digest == NULL)
+    job->bg_digest = g_compute_checksum_for_data(G_CHECKSUM_SHA1, 
+                        (guchar *)job->zbg->str, job->zbg->len);
+  job->use_bgpix = (job->zbg != NULL || job->bg_shared);
+  if (job->in_order || job->zcontent != NULL) return;
+  pgstrm = pdf_page_stream(job, NULL, &none, &none);
+  job->zcontent = do_deflate(pgstrm->str, pgstrm->len);
+  g_string_free(pgstrm, TRUE);
+}
+
+/* incremental export: what the previous export produced for a page is kept
+   in pg->pdf_cache, and reused as long as neither the page (see
+   page_changed()) nor the export settings change. The bitmap backgrounds
+   count against ui.pdf_cache_size, like the PDF backgrounds on screen. */
+
+static gsize pdf_cache_bytes = 0;
+
+void pdf_page_cache_free(struct Page *pg)
+{
+  struct PdfPageCache *c = pg->pdf_cache;
+
+  if (c == NULL) return;
+  if (c->zcontent != NULL) g_string_free(c->zcontent, TRUE);
+  if (c->zbg != NULL) {
+    pdf_cache_bytes -= c->zbg->len;
+    g_string_free(c->zbg, TRUE);
+  }
+  g_free(c->bg_digest);
+  g_free(c);
+  pg->pdf_cache = NULL;
+}
+
+static gboolean pdf_page_cache_valid(struct PdfPageCache *c, gboolean prefix)
+{
+  return (c->prefix == prefix && c->print_ruling == ui.print_ruling &&
+          c->width_tolerance == ui.pdf_width_tolerance &&
+          c->printing_dpi == PDFTOPPM_PRINTING_DPI);
+}
+
+// once a page is written out, its cache takes over the job's output
+
+static void pdf_page_cache_store(struct PdfPageJob *job)
+{
+  struct PdfPageCache *c = job->pg->pdf_cache;
+
+  if (c == NULL) {
+    c = job->pg->pdf_cache = g_new0(struct PdfPageCache, 1);
+    c->prefix = job->prefix;
+    c->print_ruling = ui.print_ruling;
+    c->width_tolerance = ui.pdf_width_tolerance;
+    c->printing_dpi = PDFTOPPM_PRINTING_DPI;
+  }
+  if (job->zbg != NULL && job->zbg != c->zbg) {
+    if (c->zbg == NULL && (ui.pdf_cache_size <= 0 || 
+          pdf_cache_bytes + job->zbg->len <= (gsize)ui.pdf_cache_size*1024*1024)) {
+      c->zbg = job->zbg;
+      c->bg_digest = job->bg_digest;
+      c->bg_width = job->bg_width;
+      c->bg_height = job->bg_height;
+      pdf_cache_bytes += c->zbg->len;
+    }
+    else {
+      g_string_free(job->zbg, TRUE);
+      g_free(job->bg_digest);
+    }
+  }
+  if (job->zcontent != NULL && job->zcontent != c->zcontent) {
+    if (job->in_order) g_string_free(job->zcontent, TRUE);
+    else {
+      if (c->zcontent != NULL) g_string_free(c->zcontent, TRUE);
+      c->zcontent = job->zcontent;
+      c->use_hiliter = job->use_hiliter;
+      c->use_bgpix = job->use_bgpix;
+    }
+  }
+}
+
+/* the structure of the background PDF, kept from one export to the next.
+   It is read-only during an export, except for the copy of the xref
+   (its object caches are shared, and only used from the main thread). */
+
+static struct {
+  char *contents;   // the bgpdf.file_contents it was parsed from
+  gsize length;
+  gboolean annot;   // could be parsed
+  struct PdfInfo info;
+  struct XrefTable xref;
+} pdf_source;
+
+void pdf_forget_source(void)
+{
+  int i;
+
+  if (pdf_source.annot) {
+    free_pdfobj(pdf_source.info.trailerdict);
+    if (pdf_source.info.pages!=NULL) {
+      for (i=0; i<pdf_source.info.npages; i++) {
+        free_pdfobj(pdf_source.info.pages[i].resources);
+        free_pdfobj(pdf_source.info.pages[i].mediabox);
+        free_pdfobj(pdf_source.info.pages[i].contents);
+      }
+      g_free(pdf_source.info.pages);
+    }
+  }
+  g_free(pdf_source.xref.data);
+  g_free(pdf_source.xref.index);
+  if (pdf_source.xref.objects!=NULL) g_hash_table_destroy(pdf_source.xref.objects);
+  if (pdf_source.xref.objstms!=NULL) g_hash_table_destroy(pdf_source.xref.objstms);
+  memset(&pdf_source, 0, sizeof(pdf_source));
+}
+
+static gboolean pdf_source_info(GString *pdfsrc, struct PdfInfo *pdfinfo, struct XrefTable *xref)
+{
+  if (pdf_source.contents != pdfsrc->str || pdf_source.length != pdfsrc->len) {
+    pdf_forget_source();
+    pdf_source.contents = pdfsrc->str;
+    pdf_source.length = pdfsrc->len;
+    pdf_source.annot = pdf_parse_info(pdfsrc, &pdf_source.info, &pdf_source.xref);
+  }
+  if (!pdf_source.annot) return FALSE;
+  *pdfinfo = pdf_source.info;
+  *xref = pdf_source.xref;
+  xref->data = g_memdup(pdf_source.xref.data, xref->n_alloc*sizeof(int));
+  xref->index = g_memdup(pdf_source.xref.index, xref->n_alloc*sizeof(int));
+  return TRUE;
+}
+
 // main printing function
 
 /* we use the following object numbers, starting with n_obj_catalog:
@@ -1302,10 +2052,17 @@ void pdf_draw_page(struct Page *pg, GString *str, gboolean *use_hiliter,
 
 gboolean print_to_pdf(char *filename)
 {
-  FILE *f;
-  GString *pdfbuf, *pgstrm, *zpgstrm, *tmpstr;
+  struct PdfOutput out;
+  GString pdfsrc, *pgstrm, *tmpstr;
   int n_obj_catalog, n_obj_pages_offs, n_page, n_obj_bgpix, n_obj_prefix;
-  int i, startxref;
+  int i, k, n, nthreads, startxref;
+  struct PdfPageJob *jobs, *job;
+  GAsyncQueue *documents;
+  GThreadPool *pool;
+  PopplerDocument *doc;
+  GHashTable *bgpixbufs, *bgdigests;
+  gchar *bgkey;
+  gpointer bgobj;
   struct XrefTable xref;
   GList *pglist;
   struct Page *pg;
@@ -1316,16 +2073,26 @@ gboolean print_to_pdf(char *filename)
   GList *pdffonts, *pdfimages, *list;
   struct PdfFont *font;
   struct PdfImage *image;
+  struct PdfPageCache *cache;
   char *tmpbuf;
   
-  f = fopen(filename, "wb");
-  if (f == NULL) return FALSE;
+  mark_undo_pages(undo); // the last change is complete
+  out.f = fopen(filename, "wb");
+  if (out.f == NULL) return FALSE;
+  out.buf = g_string_sized_new(PDFOUT_CHUNK);
+  out.offset = 0;
+  out.error = FALSE;
   setlocale(LC_NUMERIC, "C");
   annot = FALSE;
-  xref.data = NULL;
+  xref.data = xref.index = NULL;
+  xref.objects = xref.objstms = NULL;
+  xref.depth = 0;
+  xref.broken = FALSE;
   uses_pdf = FALSE;
   pdffonts = NULL;
   pdfimages = NULL;
+  pdfsrc.str = NULL;
+  pdfsrc.len = 0;
   for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next) {
     pg = (struct Page *)pglist->data;
     if (pg->bg->type == BG_PDF) uses_pdf = TRUE;
@@ -1333,221 +2100,295 @@ gboolean print_to_pdf(char *filename)
   
   if (uses_pdf && bgpdf.status != STATUS_NOT_INIT && 
       bgpdf.file_contents!=NULL && !strncmp(bgpdf.file_contents, "%PDF-1.", 7)) {
-    // parse the existing PDF file
-    pdfbuf = g_string_new_len(bgpdf.file_contents, bgpdf.file_length);
-    if (pdfbuf->str[7]<'4') pdfbuf->str[7] = '4'; // upgrade to 1.4
-    annot = pdf_parse_info(pdfbuf, &pdfinfo, &xref);
-    if (!annot) {
-      g_string_free(pdfbuf, TRUE);
-      if (xref.data != NULL) g_free(xref.data);
-    }
+    // parse the existing PDF file, in place (read-only, no copy)
+    pdfsrc.str = bgpdf.file_contents;
+    pdfsrc.len = bgpdf.file_length;
+    pdfsrc.allocated_len = 0;
+    annot = pdf_source_info(&pdfsrc, &pdfinfo, &xref);
   }
 
-  if (!annot) {
-    pdfbuf = g_string_new("%PDF-1.4\n%\370\357\365\362\n");
+  if (annot) { // copy the original file, upgraded to PDF 1.4
+    pdfout_write(&out, pdfsrc.str, 7);
+    g_string_append_c(out.buf, MAX(pdfsrc.str[7], '4'));
+    pdfout_write(&out, pdfsrc.str+8, pdfsrc.len-8);
+  }
+  else {
+    g_string_append(out.buf, "%PDF-1.4\n%\370\357\365\362\n");
     xref.n_alloc = xref.last = 0;
-    xref.data = NULL;
+    xref.data = xref.index = NULL;
+    xref.objects = xref.objstms = NULL;
   }
     
   // catalog and page tree
   n_obj_catalog = xref.last+1;
   n_obj_pages_offs = xref.last+4;
-  make_xref(&xref, n_obj_catalog, pdfbuf->len);
-  g_string_append_printf(pdfbuf, 
+  make_xref(&xref, n_obj_catalog, pdfout_tell(&out));
+  g_string_append_printf(out.buf, 
     "%d 0 obj\n<< /Type /Catalog /Pages %d 0 R >> endobj\n",
      n_obj_catalog, n_obj_catalog+1);
-  make_xref(&xref, n_obj_catalog+1, pdfbuf->len);
-  g_string_append_printf(pdfbuf,
+  make_xref(&xref, n_obj_catalog+1, pdfout_tell(&out));
+  g_string_append_printf(out.buf,
     "%d 0 obj\n<< /Type /Pages /Kids [", n_obj_catalog+1);
   for (i=0;i<journal.npages;i++)
-    g_string_append_printf(pdfbuf, "%d 0 R ", n_obj_pages_offs+i);
-  g_string_append_printf(pdfbuf, "] /Count %d >> endobj\n", journal.npages);
-  make_xref(&xref, n_obj_catalog+2, pdfbuf->len);
-  g_string_append_printf(pdfbuf, 
+    g_string_append_printf(out.buf, "%d 0 R ", n_obj_pages_offs+i);
+  g_string_append_printf(out.buf, "] /Count %d >> endobj\n", journal.npages);
+  make_xref(&xref, n_obj_catalog+2, pdfout_tell(&out));
+  g_string_append_printf(out.buf, 
     "%d 0 obj\n<< /Type /ExtGState /CA %.2f >> endobj\n",
      n_obj_catalog+2, ui.hiliter_opacity);
   xref.last = n_obj_pages_offs + journal.npages-1;
   
-  for (pglist = journal.pages, n_page = 0; pglist!=NULL;
-       pglist = pglist->next, n_page++) {
-    pg = (struct Page *)pglist->data;
-    
-    // draw the background and page into pgstrm
-    pgstrm = g_string_new("");
-    g_string_printf(pgstrm, "q 1 0 0 -1 0 %.2f cm 1 J 1 j ", pg->height);
-    n_obj_bgpix = -1;
-    n_obj_prefix = -1;
-    if (pg->bg->type == BG_SOLID)
-      pdf_draw_solid_background(pg, pgstrm);
-    else if (pg->bg->type == BG_PDF && annot && 
-             pdfinfo.pages[pg->bg->file_page_seq-1].contents!=NULL) {
-      make_xref(&xref, xref.last+1, pdfbuf->len);
-      n_obj_prefix = xref.last;
-      tmpstr = make_pdfprefix(pdfinfo.pages+(pg->bg->file_page_seq-1),
-                              pg->width, pg->height);
-      g_string_append_printf(pdfbuf,
-        "%d 0 obj\n<< /Length %zu >> stream\n%s\nendstream\nendobj\n",
-        n_obj_prefix, tmpstr->len, tmpstr->str);
-      g_string_free(tmpstr, TRUE);
-      g_string_prepend(pgstrm, "Q Q Q ");
+  nthreads = xoj_num_threads();
+  if (!g_thread_supported()) nthreads = 1;
+  documents = g_async_queue_new();
+  // bitmap backgrounds already written: by pixbuf, and by contents
+  bgpixbufs = g_hash_table_new(g_direct_hash, g_direct_equal);
+  bgdigests = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  jobs = g_new(struct PdfPageJob, PDF_EXPORT_BATCH);
+  pglist = journal.pages;
+  n_page = 0;
+  while (pglist!=NULL) {
+    // a batch of pages: backgrounds and content streams
+    for (n = 0; n < PDF_EXPORT_BATCH && pglist!=NULL; n++, pglist = pglist->next) {
+      job = jobs+n;
+      job->pg = pg = (struct Page *)pglist->data;
+      job->prefix = (pg->bg->type == BG_PDF && annot && 
+             pdfinfo.pages[pg->bg->file_page_seq-1].contents!=NULL);
+      job->bitmap_bg = !job->prefix && 
+             (pg->bg->type == BG_PIXMAP || pg->bg->type == BG_PDF);
+      job->bg_shared = FALSE;
+      job->in_order = pdf_page_has_text_or_images(pg);
+      job->documents = documents;
+      job->zbg = job->zcontent = NULL;
+      job->bg_digest = NULL;
+      cache = pg->pdf_cache;
+      if (cache != NULL && !pdf_page_cache_valid(cache, job->prefix)) {
+        pdf_page_cache_free(pg);
+        cache = NULL;
+      }
+      if (pg->bg->type == BG_PIXMAP) { // pages cloned from each other share a pixbuf
+        if (!pdf_pixbuf_is_rgb8(pg->bg->pixbuf)) job->bitmap_bg = FALSE;
+        else if (g_hash_table_lookup_extended(bgpixbufs, pg->bg->pixbuf, NULL, NULL))
+          { job->bitmap_bg = FALSE; job->bg_shared = TRUE; }
+        else g_hash_table_insert(bgpixbufs, pg->bg->pixbuf, GINT_TO_POINTER(-1));
+      }
+      if (cache == NULL) continue;
+      // reuse what didn't change since the last export
+      if (job->bitmap_bg && cache->zbg != NULL) {
+        job->bitmap_bg = FALSE;
+        job->zbg = cache->zbg;
+        job->bg_digest = cache->bg_digest;
+        job->bg_width = cache->bg_width;
+        job->bg_height = cache->bg_height;
+      }
+      if (!job->in_order && !job->bitmap_bg && cache->zcontent != NULL &&
+          cache->use_bgpix == (job->bg_shared || job->zbg != NULL)) {
+        job->zcontent = cache->zcontent;
+        job->use_hiliter = cache->use_hiliter;
+      }
     }
-    else if (pg->bg->type == BG_PIXMAP || pg->bg->type == BG_PDF)
-      n_obj_bgpix = pdf_draw_bitmap_background(pg, pgstrm, &xref, pdfbuf);
-    // draw the page contents
-    use_hiliter = FALSE;
-    pdf_draw_page(pg, pgstrm, &use_hiliter, &xref, &pdffonts, &pdfimages);
-    g_string_append_printf(pgstrm, "Q\n");
-    
-    // deflate pgstrm and write it
-    zpgstrm = do_deflate(pgstrm->str, pgstrm->len);
-    g_string_free(pgstrm, TRUE);
+    pool = NULL;
+    if (nthreads > 1 && n > 1)
+      pool = g_thread_pool_new(pdf_page_job, NULL, MIN(nthreads, n), TRUE, NULL);
+    if (pool != NULL) {
+      for (k = 0; k < n; k++) g_thread_pool_push(pool, jobs+k, NULL);
+      g_thread_pool_free(pool, FALSE, TRUE); // waits for the workers
+    }
+    else for (k = 0; k < n; k++) pdf_page_job(jobs+k, NULL);
+
+    // write the batch out, in order
+    for (k = 0; k < n; k++, n_page++) {
+      job = jobs+k;
+      pg = job->pg;
+      n_obj_bgpix = -1;
+      n_obj_prefix = -1;
+      if (job->prefix) {
+        make_xref(&xref, xref.last+1, pdfout_tell(&out));
+        n_obj_prefix = xref.last;
+        tmpstr = make_pdfprefix(pdfinfo.pages+(pg->bg->file_page_seq-1),
+                                pg->width, pg->height);
+        g_string_append_printf(out.buf,
+          "%d 0 obj\n<< /Length %zu >> stream\n%s\nendstream\nendobj\n",
+          n_obj_prefix, tmpstr->len, tmpstr->str);
+        g_string_free(tmpstr, TRUE);
+      }
+      else if (job->zbg != NULL) {
+        bgkey = g_strdup_printf("%dx%d:%s", job->bg_width, job->bg_height, job->bg_digest);
+        if (g_hash_table_lookup_extended(bgdigests, bgkey, NULL, &bgobj)) {
+          n_obj_bgpix = GPOINTER_TO_INT(bgobj);
+          g_free(bgkey);
+        }
+        else {
+          n_obj_bgpix = pdf_write_bitmap_background(job->zbg, job->bg_width, job->bg_height, 
+                                                    &xref, &out);
+          g_hash_table_insert(bgdigests, bgkey, GINT_TO_POINTER(n_obj_bgpix));
+        }
+        if (pg->bg->type == BG_PIXMAP)
+          g_hash_table_insert(bgpixbufs, pg->bg->pixbuf, GINT_TO_POINTER(n_obj_bgpix));
+      }
+      else if (job->bg_shared)
+        n_obj_bgpix = GPOINTER_TO_INT(g_hash_table_lookup(bgpixbufs, pg->bg->pixbuf));
+      if (job->in_order) { // fonts and images get numbered as they come
+        pgstrm = pdf_page_stream(job, &xref, &pdffonts, &pdfimages);
+        job->zcontent = do_deflate(pgstrm->str, pgstrm->len);
+        g_string_free(pgstrm, TRUE);
+      }
+      else {
+        for (list = pdffonts; list!=NULL; list = list->next)
+          ((struct PdfFont *)list->data)->used_in_this_page = FALSE;
+        for (list = pdfimages; list!=NULL; list = list->next)
+          ((struct PdfImage *)list->data)->used_in_this_page = FALSE;
+      }
+      use_hiliter = job->use_hiliter;
     
-    make_xref(&xref, xref.last+1, pdfbuf->len);
-    g_string_append_printf(pdfbuf, 
-      "%d 0 obj\n<< /Length %zu /Filter /FlateDecode>> stream\n",
-      xref.last, zpgstrm->len);
-    g_string_append_len(pdfbuf, zpgstrm->str, zpgstrm->len);
-    g_string_free(zpgstrm, TRUE);
-    g_string_append(pdfbuf, "endstream\nendobj\n");
+      make_xref(&xref, xref.last+1, pdfout_tell(&out));
+      g_string_append_printf(out.buf, 
+        "%d 0 obj\n<< /Length %zu /Filter /FlateDecode>> stream\n",
+        xref.last, job->zcontent->len);
+      pdfout_write(&out, job->zcontent->str, job->zcontent->len);
+      g_string_append(out.buf, "endstream\nendobj\n");
+      pdf_page_cache_store(job);
     
-    // write the page object
+      // write the page object
     
-    make_xref(&xref, n_obj_pages_offs+n_page, pdfbuf->len);
-    g_string_append_printf(pdfbuf, 
-      "%d 0 obj\n<< /Type /Page /Parent %d 0 R /MediaBox [0 0 %.2f %.2f] ",
-      n_obj_pages_offs+n_page, n_obj_catalog+1, pg->width, pg->height);
-    if (n_obj_prefix>0) {
-      obj = get_pdfobj(pdfbuf, &xref, pdfinfo.pages[pg->bg->file_page_seq-1].contents);
-      if (obj->type != PDFTYPE_ARRAY) {
+      make_xref(&xref, n_obj_pages_offs+n_page, pdfout_tell(&out));
+      g_string_append_printf(out.buf, 
+        "%d 0 obj\n<< /Type /Page /Parent %d 0 R /MediaBox [0 0 %.2f %.2f] ",
+        n_obj_pages_offs+n_page, n_obj_catalog+1, pg->width, pg->height);
+      if (n_obj_prefix>0) {
+        obj = get_pdfobj(&pdfsrc, &xref, pdfinfo.pages[pg->bg->file_page_seq-1].contents);
+        if (obj == NULL || obj->type != PDFTYPE_ARRAY) {
+          free_pdfobj(obj);
+          obj = dup_pdfobj(pdfinfo.pages[pg->bg->file_page_seq-1].contents);
+        }
+        g_string_append_printf(out.buf, "/Contents [%d 0 R ", n_obj_prefix);
+        if (obj->type == PDFTYPE_REF) 
+          g_string_append_printf(out.buf, "%d %d R ", obj->intval, obj->num);
+        if (obj->type == PDFTYPE_ARRAY) {
+          for (i=0; i<obj->num; i++) {
+            show_pdfobj(obj->elts[i], out.buf);
+            g_string_append_c(out.buf, ' ');
+          }
+        }
         free_pdfobj(obj);
-        obj = dup_pdfobj(pdfinfo.pages[pg->bg->file_page_seq-1].contents);
+        g_string_append_printf(out.buf, "%d 0 R] ", xref.last);
       }
-      g_string_append_printf(pdfbuf, "/Contents [%d 0 R ", n_obj_prefix);
-      if (obj->type == PDFTYPE_REF) 
-        g_string_append_printf(pdfbuf, "%d %d R ", obj->intval, obj->num);
-      if (obj->type == PDFTYPE_ARRAY) {
-        for (i=0; i<obj->num; i++) {
-          show_pdfobj(obj->elts[i], pdfbuf);
-          g_string_append_c(pdfbuf, ' ');
-        }
+      else g_string_append_printf(out.buf, "/Contents %d 0 R ", xref.last);
+      g_string_append(out.buf, "/Resources ");
+
+      if (n_obj_prefix>0)
+        obj = dup_pdfobj(pdfinfo.pages[pg->bg->file_page_seq-1].resources);
+      else obj = NULL;
+      if (obj!=NULL && obj->type!=PDFTYPE_DICT)
+        { free_pdfobj(obj); obj=NULL; }
+      if (obj==NULL) {
+        obj = g_malloc(sizeof(struct PdfObj));
+        obj->type = PDFTYPE_DICT;
+        obj->num = 0;
+        obj->elts = NULL;
+        obj->names = NULL;
       }
-      free_pdfobj(obj);
-      g_string_append_printf(pdfbuf, "%d 0 R] ", xref.last);
-    }
-    else g_string_append_printf(pdfbuf, "/Contents %d 0 R ", xref.last);
-    g_string_append(pdfbuf, "/Resources ");
-
-    if (n_obj_prefix>0)
-      obj = dup_pdfobj(pdfinfo.pages[pg->bg->file_page_seq-1].resources);
-    else obj = NULL;
-    if (obj!=NULL && obj->type!=PDFTYPE_DICT)
-      { free_pdfobj(obj); obj=NULL; }
-    if (obj==NULL) {
-      obj = g_malloc(sizeof(struct PdfObj));
-      obj->type = PDFTYPE_DICT;
-      obj->num = 0;
-      obj->elts = NULL;
-      obj->names = NULL;
-    }
-    add_dict_subentry(pdfbuf, &xref,
-        obj, "/ProcSet", PDFTYPE_ARRAY, NULL, mk_pdfname("/PDF"));
-    if (n_obj_bgpix>0 || pdfimages!=NULL)
-      add_dict_subentry(pdfbuf, &xref,
-        obj, "/ProcSet", PDFTYPE_ARRAY, NULL, mk_pdfname("/ImageC"));
-    if (use_hiliter)
-      add_dict_subentry(pdfbuf, &xref,
-        obj, "/ExtGState", PDFTYPE_DICT, "/XoHi", mk_pdfref(n_obj_catalog+2));
-    if (n_obj_bgpix>0)
-      add_dict_subentry(pdfbuf, &xref,
-        obj, "/XObject", PDFTYPE_DICT, "/ImBg", mk_pdfref(n_obj_bgpix));
-    for (list=pdffonts; list!=NULL; list = list->next) {
-      font = (struct PdfFont *)list->data;
-      if (font->used_in_this_page) {
-        add_dict_subentry(pdfbuf, &xref,
-          obj, "/ProcSet", PDFTYPE_ARRAY, NULL, mk_pdfname("/Text"));
-        tmpbuf = g_strdup_printf("/F%d", font->n_obj);
-        add_dict_subentry(pdfbuf, &xref,
-          obj, "/Font", PDFTYPE_DICT, tmpbuf, mk_pdfref(font->n_obj));
-        g_free(tmpbuf);
+      add_dict_subentry(&pdfsrc, &xref,
+          obj, "/ProcSet", PDFTYPE_ARRAY, NULL, mk_pdfname("/PDF"));
+      if (n_obj_bgpix>0 || pdfimages!=NULL)
+        add_dict_subentry(&pdfsrc, &xref,
+          obj, "/ProcSet", PDFTYPE_ARRAY, NULL, mk_pdfname("/ImageC"));
+      if (use_hiliter)
+        add_dict_subentry(&pdfsrc, &xref,
+          obj, "/ExtGState", PDFTYPE_DICT, "/XoHi", mk_pdfref(n_obj_catalog+2));
+      if (n_obj_bgpix>0)
+        add_dict_subentry(&pdfsrc, &xref,
+          obj, "/XObject", PDFTYPE_DICT, "/ImBg", mk_pdfref(n_obj_bgpix));
+      for (list=pdffonts; list!=NULL; list = list->next) {
+        font = (struct PdfFont *)list->data;
+        if (font->used_in_this_page) {
+          add_dict_subentry(&pdfsrc, &xref,
+            obj, "/ProcSet", PDFTYPE_ARRAY, NULL, mk_pdfname("/Text"));
+          tmpbuf = g_strdup_printf("/F%d", font->n_obj);
+          add_dict_subentry(&pdfsrc, &xref,
+            obj, "/Font", PDFTYPE_DICT, tmpbuf, mk_pdfref(font->n_obj));
+          g_free(tmpbuf);
+        }
       }
-    }
-    for (list=pdfimages; list!=NULL; list = list->next) {
-      image = (struct PdfImage *)list->data;
-      if (image->used_in_this_page) {
-        tmpbuf = g_strdup_printf("/Im%d", image->n_obj);
-        add_dict_subentry(pdfbuf, &xref,
-          obj, "/XObject", PDFTYPE_DICT, tmpbuf, mk_pdfref(image->n_obj));
-        g_free(tmpbuf);
+      for (list=pdfimages; list!=NULL; list = list->next) {
+        image = (struct PdfImage *)list->data;
+        if (image->used_in_this_page) {
+          tmpbuf = g_strdup_printf("/Im%d", image->n_obj);
+          add_dict_subentry(&pdfsrc, &xref,
+            obj, "/XObject", PDFTYPE_DICT, tmpbuf, mk_pdfref(image->n_obj));
+          g_free(tmpbuf);
+        }
       }
+      show_pdfobj(obj, out.buf);
+      free_pdfobj(obj);
+      g_string_append(out.buf, " >> endobj\n");
+      if (out.buf->len > PDFOUT_CHUNK) pdfout_flush(&out);
     }
-    show_pdfobj(obj, pdfbuf);
-    free_pdfobj(obj);
-    g_string_append(pdfbuf, " >> endobj\n");
   }
+  g_free(jobs);
+  g_hash_table_destroy(bgpixbufs);
+  g_hash_table_destroy(bgdigests);
+  xoj_poppler_lock(FALSE);
+  while ((doc = (PopplerDocument *)g_async_queue_try_pop(documents)) != NULL)
+    g_object_unref(doc);
+  xoj_poppler_unlock(FALSE);
+  g_async_queue_unref(documents);
   
   // after the pages, we insert fonts and images
   for (list = pdffonts; list!=NULL; list = list->next) {
     font = (struct PdfFont *)list->data;
-    embed_pdffont(pdfbuf, &xref, font);
+    embed_pdffont(&out, &xref, font);
     g_free(font->filename);
     g_free(font->fontname);
     g_free(font);
   }
   g_list_free(pdffonts);
+  pdf_text_cache_free();
   for (list = pdfimages; list!=NULL; list = list->next) {
     image = (struct PdfImage *)list->data;
-    if (!pdf_draw_image(image, &xref, pdfbuf)) {
+    if (!pdf_draw_image(image, &xref, &out)) {
+      fclose(out.f);
+      g_string_free(out.buf, TRUE);
       return FALSE;
     }
+    g_free(image->digest);
     g_free(image);
   }
   g_list_free(pdfimages);
   
   // PDF trailer
-  startxref = pdfbuf->len;
-  if (annot) g_string_append_printf(pdfbuf,
+  startxref = pdfout_tell(&out);
+  if (annot) g_string_append_printf(out.buf,
         "xref\n%d %d\n", n_obj_catalog, xref.last-n_obj_catalog+1);
-  else g_string_append_printf(pdfbuf, 
+  else g_string_append_printf(out.buf, 
         "xref\n0 %d\n0000000000 65535 f \n", xref.last+1);
   for (i=n_obj_catalog; i<=xref.last; i++)
-    g_string_append_printf(pdfbuf, "%010d 00000 n \n", xref.data[i]);
-  g_string_append_printf(pdfbuf, 
+    g_string_append_printf(out.buf, "%010d 00000 n \n", xref.data[i]);
+  g_string_append_printf(out.buf, 
     "trailer\n<< /Size %d /Root %d 0 R ", xref.last+1, n_obj_catalog);
   if (annot) {
-    g_string_append_printf(pdfbuf, "/Prev %d ", pdfinfo.startxref);
+    g_string_append_printf(out.buf, "/Prev %d ", pdfinfo.startxref);
     // keeping encryption info somehow doesn't work.
     // xournal can't annotate encrypted PDFs anyway...
 /*    
     obj = get_dict_entry(pdfinfo.trailerdict, "/Encrypt");
     if (obj!=NULL) {
-      g_string_append_printf(pdfbuf, "/Encrypt ");
-      show_pdfobj(obj, pdfbuf);
+      g_string_append_printf(out.buf, "/Encrypt ");
+      show_pdfobj(obj, out.buf);
     } 
 */
   }
-  g_string_append_printf(pdfbuf, 
+  g_string_append_printf(out.buf, 
     ">>\nstartxref\n%d\n%%%%EOF\n", startxref);
   
   g_free(xref.data);
-  if (annot) {
-    free_pdfobj(pdfinfo.trailerdict);
-    if (pdfinfo.pages!=NULL)
-      for (i=0; i<pdfinfo.npages; i++) {
-        free_pdfobj(pdfinfo.pages[i].resources);
-        free_pdfobj(pdfinfo.pages[i].mediabox);
-        free_pdfobj(pdfinfo.pages[i].contents);
-      }
-  }
+  g_free(xref.index);
   
   setlocale(LC_NUMERIC, "");
-  if (fwrite(pdfbuf->str, 1, pdfbuf->len, f) < pdfbuf->len) {
-    fclose(f);
-    g_string_free(pdfbuf, TRUE);
-    return FALSE;
-  }
-  fclose(f);
-  g_string_free(pdfbuf, TRUE);
-  return TRUE;
+  pdfout_flush(&out);
+  g_string_free(out.buf, TRUE);
+  if (fclose(out.f) != 0) out.error = TRUE;
+  return !out.error;
 }
 
 /*********** Printing via gtk-print **********/
@@ -1602,7 +2443,9 @@ void print_background(cairo_t *cr, struct Page *pg)
     poppler_page_get_size(pdfpage, &pgwidth, &pgheight);
     cairo_save(cr);
     cairo_scale(cr, pg->width/pgwidth, pg->height/pgheight);
+    xoj_poppler_lock(TRUE); // the background renderers may be busy too
     poppler_page_render(pdfpage, cr);
+    xoj_poppler_unlock(TRUE);
     cairo_restore(cr);
     g_object_unref(pdfpage);
   }
@@ -1629,11 +2472,11 @@ void print_job_render_page(GtkPrintOperation *print, GtkPrintContext *context, g
   struct Layer *l;
   struct Item *item;
   int i;
-  double *pt;
+  float *pt;
   PangoFontDescription *font_desc;
   PangoLayout *layout;
         
-  pg = (struct Page *)g_list_nth_data(journal.pages, pageno);
+  pg = journal_page(pageno);
   cr = gtk_print_context_get_cairo_context(context);
   width = gtk_print_context_get_width(context);
   height = gtk_print_context_get_height(context);
@@ -1673,7 +2516,7 @@ void print_job_render_page(GtkPrintOperation *print, GtkPrintContext *context, g
         } else {
           for (i=0; i<item->path->num_points-1; i++, pt+=2) {
             cairo_move_to(cr, pt[0], pt[1]);
-            cairo_set_line_width(cr, item->widths[i]);
+            cairo_set_line_width(cr, item->path->widths[i]);
             cairo_line_to(cr, pt[2], pt[3]);
             cairo_stroke(cr);
           }
@@ -14,11 +14,23 @@
  */
 
 typedef struct XrefTable {
-  int *data;
+  int *data;      // file offsets, or -(object stream number) for compressed objects
+  int *index;     // index of compressed objects within their object stream
   int last;
   int n_alloc;
+  GHashTable *objects;  // parsed objects of the source file, by number
+  GHashTable *objstms;  // decoded object streams, by number
+  int depth;            // nesting of object lookups and xref sections being read
+  gboolean broken;      // a malformed file made them nest too deep
 } XrefTable;
 
+typedef struct PdfOutput {
+  FILE *f;
+  GString *buf;  // pending output, written out in chunks
+  int offset;    // file offset of the start of buf
+  gboolean error;
+} PdfOutput;
+
 typedef struct PdfPageDesc {
   struct PdfObj *resources, *mediabox, *contents;
   int rotate;
@@ -60,11 +72,27 @@ typedef struct PdfFont {
   int flags;
 } PdfFont;
 
+/* what a PDF export produced for a page, kept for the next export until the
+   page changes. The content stream is only kept for pages without text or
+   images, whose streams don't depend on the numbering of other objects. */
+
+typedef struct PdfPageCache {
+  gboolean prefix, print_ruling; // the settings it was made with
+  double width_tolerance;
+  int printing_dpi;
+  GString *zcontent;             // deflated content stream, or NULL
+  gboolean use_hiliter, use_bgpix;
+  GString *zbg;                  // deflated bitmap background, or NULL
+  gchar *bg_digest;
+  int bg_width, bg_height;
+} PdfPageCache;
+
 typedef struct PdfImage {
   int n_obj;
   gboolean has_alpha;
   int n_obj_smask;              /* only if has_alpha */
   GdkPixbuf *pixbuf;
+  gchar *digest;                /* checksum of the pixels, to find copies */
   gboolean used_in_this_page;
 } PdfImage;
 
@@ -89,6 +117,11 @@ gboolean pdf_parse_info(GString *pdfbuf, struct PdfInfo *pdfinfo, struct XrefTab
 
 // main printing functions
 
+void pdf_draw_page(struct Page *pg, GString *str, gboolean *use_hiliter, 
+                   struct XrefTable *xref, GList **pdffonts, GList **pdfimages);
+
+void pdf_page_cache_free(struct Page *pg);
+void pdf_forget_source(void);
 gboolean print_to_pdf(char *filename);
 
 #if GTK_CHECK_VERSION(2, 10, 0)
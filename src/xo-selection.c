@@ -32,6 +32,8 @@
 #include "xo-misc.h"
 #include "xo-paint.h"
 #include "xo-selection.h"
+#include "xo-index.h"
+#include "xo-pages.h"
 
 /************ selection tools ***********/
 
@@ -74,7 +76,7 @@ void start_selectrect(GdkEvent *event)
 void finalize_selectrect(void)
 {
   double x1, x2, y1, y2;
-  GList *itemlist;
+  GList *itemlist, *list;
   struct Item *item;
   
   ui.cur_item_type = ITEM_NONE;
@@ -93,13 +95,16 @@ void finalize_selectrect(void)
     y1 = ui.selection->bbox.top;  y2 = ui.selection->bbox.bottom;
   }
   
-  for (itemlist = ui.selection->layer->items; itemlist!=NULL; itemlist = itemlist->next) {
-    item = (struct Item *)itemlist->data;
+  itemlist = layer_items_in_bbox(ui.selection->layer, &ui.selection->bbox);
+  for (list = itemlist; list!=NULL; list = list->next) {
+    item = (struct Item *)list->data;
     if (item->bbox.left >= x1 && item->bbox.right <= x2 &&
           item->bbox.top >= y1 && item->bbox.bottom <= y2) {
-      ui.selection->items = g_list_append(ui.selection->items, item); 
+      ui.selection->items = g_list_prepend(ui.selection->items, item); 
     }
   }
+  ui.selection->items = g_list_reverse(ui.selection->items);
+  g_list_free(itemlist);
   
   if (ui.selection->items == NULL) {
     // if we clicked inside a text zone or image?  
@@ -172,14 +177,47 @@ gboolean hittest_point(ArtSVP *lassosvp, double x, double y)
   return art_svp_point_wind(lassosvp, x, y)%2;
 }
 
+/* whether the segment p[0..1]-p[2..3] crosses the outline of the lasso.
+   A touch at a vertex of the outline counts as a crossing */
+
+static gboolean hittest_segment_crosses(ArtSVP *lassosvp, float *p)
+{
+  ArtSVPSeg *seg;
+  ArtPoint *q;
+  double d1, d2, d3, d4;
+  int i, j;
+
+  for (i=0; i<lassosvp->n_segs; i++) {
+    seg = lassosvp->segs+i;
+    if (MAX(p[0], p[2]) < seg->bbox.x0 || MIN(p[0], p[2]) > seg->bbox.x1 ||
+        MAX(p[1], p[3]) < seg->bbox.y0 || MIN(p[1], p[3]) > seg->bbox.y1) continue;
+    for (j=0, q=seg->points; j<seg->n_points-1; j++, q++) {
+      // the ends of each segment must be on either side of the other one
+      d1 = (q[1].x-q[0].x)*(p[1]-q[0].y) - (q[1].y-q[0].y)*(p[0]-q[0].x);
+      d2 = (q[1].x-q[0].x)*(p[3]-q[0].y) - (q[1].y-q[0].y)*(p[2]-q[0].x);
+      d3 = (p[2]-p[0])*(q[0].y-p[1]) - (p[3]-p[1])*(q[0].x-p[0]);
+      d4 = (p[2]-p[0])*(q[1].y-p[1]) - (p[3]-p[1])*(q[1].x-p[0]);
+      if (d1*d2 < 0 && d3*d4 <= 0) return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/* a stroke is inside if its vertices are, and none of its segments cuts
+   through a dent of the lasso (strokes are no longer subdivided, so a
+   segment can be long) */
+
 gboolean hittest_item(ArtSVP *lassosvp, struct Item *item)
 {
   int i;
+  float *p;
   
   if (item->type == ITEM_STROKE) {
     for (i=0; i<item->path->num_points; i++)
       if (!hittest_point(lassosvp, item->path->coords[2*i], item->path->coords[2*i+1])) 
         return FALSE;
+    for (i=0, p=item->path->coords; i<item->path->num_points-1; i++, p+=2)
+      if (hittest_segment_crosses(lassosvp, p)) return FALSE;
     return TRUE;
   }
   else 
@@ -191,10 +229,11 @@ gboolean hittest_item(ArtSVP *lassosvp, struct Item *item)
 
 void finalize_selectregion(void)
 {
-  GList *itemlist;
+  GList *itemlist, *list;
   struct Item *item;
   ArtVpath *vpath;
   ArtSVP *lassosvp;
+  struct BBox lassobox;
   int i, n;
   double *pt;
   
@@ -214,9 +253,20 @@ void finalize_selectregion(void)
   lassosvp = art_svp_from_vpath(vpath);
   g_free(vpath);
 
+  // only items within the bbox of the lasso can be selected
+  lassobox.left = lassobox.right = ui.cur_path.coords[0];
+  lassobox.top = lassobox.bottom = ui.cur_path.coords[1];
+  for (i=1, pt=ui.cur_path.coords+2; i<n; i++, pt+=2) {
+    lassobox.left = MIN(lassobox.left, pt[0]);
+    lassobox.right = MAX(lassobox.right, pt[0]);
+    lassobox.top = MIN(lassobox.top, pt[1]);
+    lassobox.bottom = MAX(lassobox.bottom, pt[1]);
+  }
+
   // see which items we selected
-  for (itemlist = ui.selection->layer->items; itemlist!=NULL; itemlist = itemlist->next) {
-    item = (struct Item *)itemlist->data;
+  itemlist = layer_items_in_bbox(ui.selection->layer, &lassobox);
+  for (list = itemlist; list!=NULL; list = list->next) {
+    item = (struct Item *)list->data;
     if (hittest_item(lassosvp, item)) {
       // update the selection bbox
       if (ui.selection->items==NULL || ui.selection->bbox.left>item->bbox.left)
@@ -231,6 +281,7 @@ void finalize_selectregion(void)
       ui.selection->items = g_list_append(ui.selection->items, item); 
     }
   }
+  g_list_free(itemlist);
   art_svp_free(lassosvp);
   
   if (ui.selection->items == NULL) {
@@ -347,8 +398,9 @@ gboolean start_resizesel(GdkEvent *event)
 void start_vertspace(GdkEvent *event)
 {
   double pt[2];
-  GList *itemlist;
+  GList *itemlist, *list;
   struct Item *item;
+  struct BBox box;
 
   reset_selection();
   ui.cur_item_type = ITEM_MOVESEL_VERT;
@@ -359,14 +411,19 @@ void start_vertspace(GdkEvent *event)
 
   get_pointer_coords(event, pt);
   ui.selection->bbox.top = ui.selection->bbox.bottom = pt[1];
-  for (itemlist = ui.cur_layer->items; itemlist!=NULL; itemlist = itemlist->next) {
-    item = (struct Item *)itemlist->data;
+  box.left = -G_MAXDOUBLE; box.right = G_MAXDOUBLE;
+  box.top = pt[1]; box.bottom = G_MAXDOUBLE;
+  itemlist = layer_items_in_bbox(ui.cur_layer, &box);
+  for (list = itemlist; list!=NULL; list = list->next) {
+    item = (struct Item *)list->data;
     if (item->bbox.top >= pt[1]) {
-      ui.selection->items = g_list_append(ui.selection->items, item); 
+      ui.selection->items = g_list_prepend(ui.selection->items, item); 
       if (item->bbox.bottom > ui.selection->bbox.bottom)
         ui.selection->bbox.bottom = item->bbox.bottom;
     }
   }
+  ui.selection->items = g_list_reverse(ui.selection->items);
+  g_list_free(itemlist);
 
   ui.selection->anchor_x = ui.selection->last_x = 0;
   ui.selection->anchor_y = ui.selection->last_y = pt[1];
@@ -399,11 +456,11 @@ void continue_movesel(GdkEvent *event)
     upmargin = ui.selection->bbox.bottom - ui.selection->bbox.top;
   else upmargin = VIEW_CONTINUOUS_SKIP;
   tmppageno = ui.selection->move_pageno;
-  tmppage = g_list_nth_data(journal.pages, tmppageno);
+  tmppage = journal_page(tmppageno);
   while (ui.view_continuous && (pt[1] < - upmargin)) {
     if (tmppageno == 0) break;
     tmppageno--;
-    tmppage = g_list_nth_data(journal.pages, tmppageno);
+    tmppage = journal_page(tmppageno);
     pt[1] += tmppage->height + VIEW_CONTINUOUS_SKIP;
     ui.selection->move_pagedelta += tmppage->height + VIEW_CONTINUOUS_SKIP;
   }
@@ -412,7 +469,7 @@ void continue_movesel(GdkEvent *event)
     pt[1] -= tmppage->height + VIEW_CONTINUOUS_SKIP;
     ui.selection->move_pagedelta -= tmppage->height + VIEW_CONTINUOUS_SKIP;
     tmppageno++;
-    tmppage = g_list_nth_data(journal.pages, tmppageno);
+    tmppage = journal_page(tmppageno);
   }
   
   if (tmppageno != ui.selection->move_pageno) {
@@ -422,7 +479,7 @@ void continue_movesel(GdkEvent *event)
       ui.selection->move_layer = ui.selection->layer;
     else
       ui.selection->move_layer = (struct Layer *)(g_list_last(
-        ((struct Page *)g_list_nth_data(journal.pages, tmppageno))->layers)->data);
+        journal_page(tmppageno)->layers)->data);
     gnome_canvas_item_reparent(ui.selection->canvas_item, ui.selection->move_layer->group);
     for (list = ui.selection->items; list!=NULL; list = list->next) {
       item = (struct Item *)list->data;
@@ -489,7 +546,7 @@ void finalize_movesel(void)
     undo->auxlist = NULL;
     // build auxlist = pointers to Item's just before ours (for depths)
     for (list = ui.selection->items; list!=NULL; list = list->next) {
-      link = g_list_find(ui.selection->layer->items, list->data);
+      link = ((struct Item *)list->data)->link;
       if (link!=NULL) link = link->prev;
       undo->auxlist = g_list_append(undo->auxlist, ((link!=NULL) ? link->data : NULL));
     }
@@ -593,19 +650,20 @@ void selection_delete(void)
       gtk_object_destroy(GTK_OBJECT(item->canvas_item));
     erasure = g_new(struct UndoErasureData, 1);
     erasure->item = item;
-    erasure->npos = g_list_index(ui.selection->layer->items, item);
+    erasure->next = (item->link != NULL && item->link->next != NULL) ?
+                       (struct Item *)item->link->next->data : NULL;
     erasure->nrepl = 0;
     erasure->replacement_items = NULL;
-    ui.selection->layer->items = g_list_remove(ui.selection->layer->items, item);
-    ui.selection->layer->nitems--;
+    layer_remove_item(ui.selection->layer, item);
     undo->erasurelist = g_list_prepend(undo->erasurelist, erasure);
   }
+  undo->erasurelist = g_list_reverse(undo->erasurelist);
   reset_selection();
 
-  /* NOTE: the erasurelist is built backwards; this guarantees that,
-     upon undo, the erasure->npos fields give the correct position
-     where each item should be reinserted as the list is traversed in
-     the forward direction */
+  /* NOTE: the selection and the erasurelist are in depth order; upon
+     undo the erasurelist is traversed backwards, so that each item's
+     erasure->next is back on the layer by the time the item is
+     reinserted under it */
 }
 
 // modify the color or thickness of pen strokes in a selection
@@ -615,7 +673,6 @@ void recolor_selection(int color_no, guint color_rgba)
   GList *itemlist;
   struct Item *item;
   struct Brush *brush;
-  GnomeCanvasGroup *group;
   
   if (ui.selection == NULL) return;
   prepare_new_undo();
@@ -634,16 +691,9 @@ void recolor_selection(int color_no, guint color_rgba)
     // repaint the stroke
     item->brush.color_no = color_no;
     item->brush.color_rgba = color_rgba | 0xff; // no alpha
-    if (item->canvas_item!=NULL) {
-      if (!item->brush.variable_width)
-        gnome_canvas_item_set(item->canvas_item, 
-           "fill-color-rgba", item->brush.color_rgba, NULL);
-      else {
-        group = (GnomeCanvasGroup *) item->canvas_item->parent;
-        gtk_object_destroy(GTK_OBJECT(item->canvas_item));
-        make_canvas_item_one(group, item);
-      }
-    }
+    if (item->canvas_item!=NULL)
+      gnome_canvas_item_set(item->canvas_item, 
+         "fill-color-rgba", item->brush.color_rgba, NULL);
   }
 }
 
@@ -19,6 +19,7 @@ void finalize_selectrect(void);
 void start_selectregion(GdkEvent *event);
 void finalize_selectregion(void);
 void continue_selectregion(GdkEvent *event);
+gboolean hittest_item(ArtSVP *lassosvp, struct Item *item);
 
 gboolean start_movesel(GdkEvent *event);
 void start_vertspace(GdkEvent *event);
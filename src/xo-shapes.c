@@ -25,6 +25,9 @@
 #include "xournal.h"
 #include "xo-shapes.h"
 #include "xo-paint.h"
+#include "xo-misc.h"
+#include "xo-path.h"
+#include "xo-arena.h"
 
 typedef struct Inertia {
   double mass, sx, sy, sxx, sxy, syy;
@@ -291,7 +294,7 @@ void calc_edge_isect(struct RecoSegment *r1, struct RecoSegment *r2, double *pt)
 void remove_recognized_strokes(struct RecoSegment *rs, int num_old_items)
 {
   struct Item *old_item;
-  int i, shift;
+  int i;
   struct UndoErasureData *erasure;
 
   old_item = NULL;
@@ -299,21 +302,20 @@ void remove_recognized_strokes(struct RecoSegment *rs, int num_old_items)
   undo->type = ITEM_RECOGNIZER;
   undo->layer = ui.cur_layer;
   undo->erasurelist = NULL;
-  shift = 0;
   
   for (i=0; i<num_old_items; i++) {
     if (rs[i].item == old_item) continue; // already done
     old_item = rs[i].item;
     erasure = g_new(struct UndoErasureData, 1);
     erasure->item = old_item;
-    erasure->npos = g_list_index(ui.cur_layer->items, old_item) + (shift++);
+    erasure->next = (old_item->link->next != NULL) ?
+                       (struct Item *)old_item->link->next->data : NULL;
     erasure->nrepl = 0;
     erasure->replacement_items = NULL;
     undo->erasurelist = g_list_append(undo->erasurelist, erasure);
     if (old_item->canvas_item != NULL)
       gtk_object_destroy(GTK_OBJECT(old_item->canvas_item));
-    ui.cur_layer->items = g_list_remove(ui.cur_layer->items, old_item);
-    ui.cur_layer->nitems--;
+    layer_remove_item(ui.cur_layer, old_item);
   }
 }
 
@@ -324,21 +326,17 @@ struct Item *insert_recognized_curpath(void)
   struct UndoErasureData *erasure;
 
   erasure = (struct UndoErasureData *)(undo->erasurelist->data);
-  item = g_new(struct Item, 1);
+  item = arena_new_item(journal.arena);
   item->type = ITEM_STROKE;
   g_memmove(&(item->brush), &(erasure->item->brush), sizeof(struct Brush));
   item->brush.variable_width = FALSE;
-  subdivide_cur_path();
-  item->path = gnome_canvas_points_new(ui.cur_path.num_points);
-  g_memmove(item->path->coords, ui.cur_path.coords, 2*ui.cur_path.num_points*sizeof(double));
-  item->widths = NULL;
+  item->path = path_new_from_doubles(journal.arena, ui.cur_path.num_points, ui.cur_path.coords, NULL);
   update_item_bbox(item);
   ui.cur_path.num_points = 0;
   
   erasure->nrepl++;
   erasure->replacement_items = g_list_append(erasure->replacement_items, item);
-  ui.cur_layer->items = g_list_append(ui.cur_layer->items, item);
-  ui.cur_layer->nitems++;
+  layer_append_item(ui.cur_layer, item);
   make_canvas_item_one(ui.cur_layer->group, item);
   return item;
 }
@@ -538,22 +536,19 @@ gboolean try_closed_polygon(int nsides)
   return TRUE;
 }
 
-/* the main pattern recognition function, called after finalize_stroke() */
-void recognize_patterns(void)
+/* the recognizer proper, working on a double copy of the stroke's points */
+static void recognize_stroke(struct Item *it, double *coords)
 {
-  struct Item *it;
   struct Inertia s, ss[4];
   struct RecoSegment *rs;
   int n, i;
   int brk[5];
   double score;
   
-  if (!undo || undo->type!=ITEM_STROKE) return;
   if (undo->next != last_item_checker) reset_recognizer(); // reset queue
   if (last_item_checker!=NULL && ui.cur_layer != last_item_checker->layer) reset_recognizer();
 
-  it = undo->item;
-  calc_inertia(it->path->coords, 0, it->path->num_points-1, &s);
+  calc_inertia(coords, 0, it->path->num_points-1, &s);
 #ifdef RECOGNIZER_DEBUG
   printf("DEBUG: Mass=%.0f, Center=(%.1f,%.1f), I=(%.0f,%.0f, %.0f), "
      "Rad=%.2f, Det=%.4f \n", 
@@ -561,9 +556,9 @@ void recognize_patterns(void)
 #endif
 
   // first see if it's a polygon
-  n = find_polygonal(it->path->coords, 0, it->path->num_points-1, MAX_POLYGON_SIDES, brk, ss);
+  n = find_polygonal(coords, 0, it->path->num_points-1, MAX_POLYGON_SIDES, brk, ss);
   if (n>0) {
-    optimize_polygonal(it->path->coords, n, brk, ss);
+    optimize_polygonal(coords, n, brk, ss);
 #ifdef RECOGNIZER_DEBUG
     printf("DEBUG: Polygon, %d edges: ", n);
     for (i=0; i<n; i++)
@@ -588,7 +583,7 @@ void recognize_patterns(void)
       rs[i].item = it;
       rs[i].startpt = brk[i];
       rs[i].endpt = brk[i+1];
-      get_segment_geometry(it->path->coords, brk[i], brk[i+1], ss+i, rs+i);
+      get_segment_geometry(coords, brk[i], brk[i+1], ss+i, rs+i);
     }  
     if (try_rectangle()) { reset_recognizer(); return; }
     if (try_arrow()) { reset_recognizer(); return; }
@@ -619,7 +614,7 @@ void recognize_patterns(void)
   // not a polygon: maybe a circle ?
   reset_recognizer();
   if (I_det(s)>CIRCLE_MIN_DET) {
-    score = score_circle(it->path->coords, 0, it->path->num_points-1, &s);
+    score = score_circle(coords, 0, it->path->num_points-1, &s);
 #ifdef RECOGNIZER_DEBUG
     printf("DEBUG: Circle score: %.2f\n", score);
 #endif
@@ -632,3 +627,14 @@ void recognize_patterns(void)
   }
 }
 
+/* the main pattern recognition function, called after finalize_stroke() */
+void recognize_patterns(void)
+{
+  double *coords;
+
+  if (!undo || undo->type!=ITEM_STROKE) return;
+  coords = g_new(double, 2*undo->item->path->num_points);
+  path_get_coords(undo->item->path, coords);
+  recognize_stroke(undo->item, coords);
+  g_free(coords);
+}
@@ -73,6 +73,9 @@
 #define MIN_ZOOM 0.2
 #define RESIZE_MARGIN 6.0
 #define MAX_SAFE_RENDER_DPI 720 // max dpi at which PDF bg's get rendered
+#define PDF_PLACEHOLDER_DPI 18 // resolution of the PDF bg's kept for evicted pages
+#define PDF_TILE_THRESHOLD 4000000 // PDF bg's larger than this (in pixels) are tiled
+#define PDF_TILE_SIZE 256 // size of the tiles, in pixels
 
 #define VBOX_MAIN_NITEMS 5 // number of interface items in vboxMain
 
@@ -176,15 +179,32 @@ typedef struct BBox {
 
 struct UndoErasureData;
 
+/* the geometry of a stroke, in a single block: the header, the
+   coordinates, then the widths if the stroke has variable width. Floats
+   are ample for the 1/100 pt precision of the file format; GnomeCanvas
+   and the PDF/print code get doubles through path_get_coords() and
+   friends (xo-path.h). Paths are refcounted and shared (with the pieces
+   left by the eraser), so they are read-only: call path_make_writable()
+   before changing one */
+
+typedef struct Path {
+  int num_points;
+  int ref_count;
+  float *coords;       // 2*num_points coordinates
+  float *widths;       // num_points-1 widths, or NULL if constant width
+  struct Path *parent; // for a piece of another path, the one holding the data
+  struct BBox *chunk_boxes; // see path_get_chunk_boxes(), or NULL until needed
+} Path;
+
 typedef struct Item {
   int type;
   struct Brush brush; // the brush to use, if ITEM_STROKE
   // 'brush' also contains color info for text items
-  GnomeCanvasPoints *path;
-  gdouble *widths;
+  struct Path *path;  // for ITEM_STROKE; NULL while the stroke is being drawn
   GnomeCanvasItem *canvas_item; // the corresponding canvas item, or NULL
   struct BBox bbox;
   struct UndoErasureData *erasure; // for temporary use during erasures
+  GList *link; // its link in its layer's items, or NULL if it's on no layer
   // the following fields for ITEM_TEXT:
   gchar *text;
   gchar *font_name;
@@ -227,8 +247,10 @@ typedef struct Item {
 
 typedef struct Layer {
   GList *items; // the items on the layer, from bottom to top
+  GList *items_tail; // the last link of items
   int nitems;
   GnomeCanvasGroup *group;
+  struct LayerIndex *index; // spatial index, see xo-index.c
 } Layer;
 
 typedef struct Page {
@@ -238,12 +260,15 @@ typedef struct Page {
   double hoffset, voffset; // offsets of canvas group rel. to canvas root
   struct Background *bg;
   GnomeCanvasGroup *group;
+  gboolean items_unmapped; // lazy canvas: contents have no canvas items
+  struct PdfPageCache *pdf_cache; // output of the last PDF export, see page_changed()
 } Page;
 
 typedef struct Journal {
   GList *pages;  // the pages in the journal
   int npages;
   int last_attach_no; // for naming of attached backgrounds
+  struct Arena *arena; // where its items and their paths live (xo-arena.h)
 } Journal;
 
 typedef struct Selection {
@@ -341,6 +366,11 @@ typedef struct UIData {
   GtkPrintSettings *print_settings;
 #endif
   gboolean poppler_force_cairo; // force poppler to use cairo
+  gboolean lazy_canvas; // only create canvas items for pages near the viewport
+  double lazy_canvas_margin; // how near (in points)
+  int pdf_cache_size; // memory budget for rendered PDF pages, in MB (0 = unlimited)
+  double pdf_width_tolerance; // PDF export: pressure width differences merged into one line
+  gboolean headless; // batch export from the command line: no windows, no dialogs
 } UIData;
 
 #define BRUSH_LINKED 0
@@ -349,7 +379,7 @@ typedef struct UIData {
 
 typedef struct UndoErasureData {
   struct Item *item; // the item that got erased
-  int npos; // its position in its layer
+  struct Item *next; // the item just above it in its layer, or NULL if on top
   int nrepl; // the number of replacement items
   GList *replacement_items;
 } UndoErasureData;
@@ -371,6 +401,7 @@ typedef struct UndoItem {
   struct Brush *brush; // for ITEM_TEXT_ATTRIB
   struct UndoItem *next;
   int multiop;
+  gboolean marked; // its pages' exports were dropped (see mark_undo_pages)
 } UndoItem;
 
 #define MULTIOP_CONT_REDO 1 // not the last in a multiop, so keep redoing
@@ -380,14 +411,25 @@ typedef struct UndoItem {
 typedef struct BgPdfRequest {
   int pageno;
   double dpi;
+  int tx, ty; // tile coordinates, or -1 for the whole page
 } BgPdfRequest;
 
 typedef struct BgPdfPage {
   double dpi;
   GdkPixbuf *pixbuf;
   int pixel_height, pixel_width; // pixel size of pixbuf
+  gboolean placeholder; // pixbuf is a low-res copy left by the cache eviction
+  guint last_use; // for LRU eviction
 } BgPdfPage;
 
+typedef struct BgPdfTile {
+  int pageno, tx, ty;
+  double dpi;
+  guint id; // identifies the canvas items showing this tile
+  GdkPixbuf *pixbuf;
+  guint last_use;
+} BgPdfTile;
+
 typedef struct BgPdf {
   int status; // the rest only makes sense if this is not STATUS_NOT_INIT
   guint pid; // the identifier of the idle callback
@@ -398,8 +440,16 @@ typedef struct BgPdf {
   int npages;
   GList *pages; // a list of BgPdfPage structures
   GList *requests; // a list of BgPdfRequest structures
+  GHashTable *tiles; // the rendered BgPdfTile's, for zooms at which pages are tiled
   gboolean has_failed; // has failed in the past...
-  PopplerDocument *document; // the poppler document
+  PopplerDocument *document; // the poppler document (main thread only)
+  GList *jobs; // the requests being rendered by worker threads
+  struct BgPdfRenderer *renderer; // state shared with the worker threads
+  // render cache statistics
+  gsize cache_bytes; // size of the full-resolution pixbufs in pages and tiles
+  gsize placeholder_bytes; // size of the placeholders in pages
+  guint cache_clock;
+  int cache_hits, cache_misses, cache_evictions;
 } BgPdf;
 
 #define STATUS_NOT_INIT 0